@@ -14,6 +14,9 @@ char packet_bytes[] = {0x00, 0x00, 0x01, 0x20, 0x00, 0x01, 0x00, 0x00,
                        0x61, 0x6c, 0x69, 0x75, 0x6d, 0x03, 0x63, 0x6f,
                        0x6d, 0x00, 0x00, 0x01, 0x00, 0x01};
 
+#define TIMEOUT_SEC 2
+#define MAX_TRIES 3
+
 int main(int argc, char** argv) {
   if (argc != 3) {
     Print("Usage: dig.bin <DNS server ip> <hostname>\n");
@@ -26,6 +29,15 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  // The query is sent again if no response comes in time.
+  struct timeval timeout;
+  timeout.tv_sec = TIMEOUT_SEC;
+  timeout.tv_usec = 0;
+  if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout)) < 0) {
+    panic("error: fail to set the timeout\n");
+  }
+
   struct sockaddr_in dst_address;
   dst_address.sin_family = AF_INET; /* IP */
   dst_address.sin_addr.s_addr = MakeIPv4AddrFromString(argv[1]);
@@ -63,25 +75,30 @@ int main(int argc, char** argv) {
   query_buf[query_size++] = 0x00;
   query_buf[query_size++] = 0x01;
 
-  sent_size = sendto(socket_fd, query_buf, query_size, 0,
-                     (struct sockaddr*)&dst_address, sizeof(dst_address));
   for (int i = 0; i < query_size; i++) {
     PrintHex8ZeroFilled(query_buf[i]);
     Print((i & 0xF) == 0xF ? "\n" : " ");
   }
   Print("\n");
-  Print("Sent size: ");
-  PrintNum(sent_size);
-  Print("\n");
 
   struct sockaddr_in client_address;
   socklen_t client_addr_len = sizeof(client_address);
   uint8_t buf[4096];
-  ssize_t recv_size =
-      recvfrom(socket_fd, (char*)buf, sizeof(buf), 0,
-               (struct sockaddr*)&client_address, &client_addr_len);
-  if (recv_size == -1) {
-    panic("error: recvfrom returned -1\n");
+  ssize_t recv_size = -EAGAIN;
+  for (int i = 0; i < MAX_TRIES && recv_size == -EAGAIN; i++) {
+    sent_size = sendto(socket_fd, query_buf, query_size, 0,
+                       (struct sockaddr*)&dst_address, sizeof(dst_address));
+    Print("Sent size: ");
+    PrintNum(sent_size);
+    Print("\n");
+    recv_size = recvfrom(socket_fd, (char*)buf, sizeof(buf), 0,
+                         (struct sockaddr*)&client_address, &client_addr_len);
+  }
+  if (recv_size == -EAGAIN) {
+    panic("error: no response from the server\n");
+  }
+  if (recv_size < 0) {
+    panic("error: recvfrom failed\n");
   }
   Print("Recieved size: ");
   PrintNum(recv_size);
@@ -1,8 +1,11 @@
-// HTTP server with UDP protocol.
+// HTTP server with UDP and TCP protocols.
 
 #include "../liumlib/liumlib.h"
 
+#define MAX_EVENTS 8
+
 uint16_t port;
+bool udp;
 bool tcp;
 
 void StatusLine(char *response, int status) {
@@ -112,14 +115,14 @@ void Route(char *response, char *path) {
   BuildResponse(response, 404, body);
 }
 
-void StartServer() {
-  int socket_fd, accepted_socket;
+// Returns a socket bound to `port`, which is registered to `epoll_fd`.
+int OpenServerSocket(int epoll_fd, bool use_tcp) {
+  int socket_fd;
   struct sockaddr_in address;
-  unsigned int addrlen = sizeof(address);
 
   // In TCP, the second argument of socket() should be `SOCK_STREAM`.
   // In UDP, the second argument of socket() should be `SOCK_DGRAM`.
-  if (tcp) {
+  if (use_tcp) {
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);
   } else {
     socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -133,86 +136,155 @@ void StartServer() {
   address.sin_addr.s_addr = INADDR_ANY;
   address.sin_port = htons(port);
 
-  if (bind(socket_fd, (struct sockaddr *) &address, addrlen) < 0) {
+  if (bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
     Println("Error: Failed to bind a socket");
     exit(EXIT_FAILURE);
   }
 
   // In TCP, listen() should be called.
-  if (tcp) {
+  if (use_tcp) {
     if (listen(socket_fd, 3) < 0) {
       Println("Error: Failed to listen a socket");
       exit(1);
     }
   }
 
-  while (1) {
-    Println("Log: Waiting for a request...\n");
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = socket_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+    Println("Error: Failed to register a socket to epoll");
+    exit(1);
+  }
+  return socket_fd;
+}
 
-    char request[SIZE_REQUEST];
-    int size = -1;
+// `request` should have a room for the terminating null character.
+void HandleRequest(char *request, int size, char *response) {
+  request[size] = '\0';
+  Println("----- request -----");
+  Println(request);
 
-    // In TCP, a request is received by accept() and read().
-    // In UDP, a request is received by recvfrom().
-    if (tcp) {
-      if ((accepted_socket = accept(socket_fd, (struct sockaddr *)&address,
-                                    (socklen_t*)&addrlen)) < 0) {
-        Println("Error: Failed to accept a socket.");
-        exit(1);
-      }
+  char *method = strtok(request, " ");
+  char *path = strtok(NULL, " ");
+
+  response[0] = '\0';
+  if (method && path && strcmp(method, "GET") == 0) {
+    Route(response, path);
+  } else {
+    BuildResponse(response, 500, "Only GET method is supported.");
+  }
+}
+
+// In UDP, a request is received by recvfrom().
+void ServeUDPRequest(int socket_fd) {
+  char request[SIZE_REQUEST + 1];
+  char response[SIZE_RESPONSE];
+  struct sockaddr_in address;
+  socklen_t addrlen = sizeof(address);
 
-      size = read(accepted_socket, request, SIZE_REQUEST);
-    } else {
-      size = recvfrom(socket_fd, request, SIZE_REQUEST, 0,
+  int size = recvfrom(socket_fd, request, SIZE_REQUEST, 0,
                       (struct sockaddr*) &address, &addrlen);
-    }
-    if (size < 0) {
-      Println("Error: Failed to receive a request.");
-      exit(EXIT_FAILURE);
-    }
+  if (size < 0) {
+    Println("Error: Failed to receive a request.");
+    exit(EXIT_FAILURE);
+  }
+  if (size > SIZE_REQUEST)
+    size = SIZE_REQUEST;
+  HandleRequest(request, size, response);
+
+  // In UDP, a response is sent to `socket_fd`.
+  if (sendto(socket_fd, response, strlen(response), 0,
+             (struct sockaddr *) &address, addrlen) < 0) {
+    Println("Error: Failed to send a response.");
+    exit(EXIT_FAILURE);
+  }
+}
 
-    Println("----- request -----");
-    Println(request);
+// In TCP, a request is received by accept() and read(). The accepted socket
+// is served when the request arrives.
+void AcceptConnection(int epoll_fd, int socket_fd) {
+  struct sockaddr_in address;
+  socklen_t addrlen = sizeof(address);
 
-    char *method = strtok(request, " ");
-    char *path = strtok(NULL, " ");
+  int accepted_socket = accept(socket_fd, (struct sockaddr *)&address,
+                               &addrlen);
+  if (accepted_socket < 0) {
+    Println("Error: Failed to accept a socket.");
+    exit(1);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = accepted_socket;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accepted_socket, &event) < 0) {
+    Println("Error: Failed to register a socket to epoll");
+    close(accepted_socket);
+  }
+}
 
-    char* response = (char *) malloc(SIZE_RESPONSE);
+void ServeTCPRequest(int accepted_socket) {
+  char request[SIZE_REQUEST + 1];
+  char response[SIZE_RESPONSE];
 
-    if (strcmp(method, "GET") == 0) {
-      Route(response, path);
-    } else {
-      BuildResponse(response, 500, "Only GET method is supported.");
-    }
+  int size = read(accepted_socket, request, SIZE_REQUEST);
+  if (size <= 0) {
+    Println("Error: Failed to receive a request.");
+    close(accepted_socket);
+    return;
+  }
+  HandleRequest(request, size, response);
 
-    size = -1;
-    // In TCP, a response is sent to `accepted_socket`.
-    // In UDP, a response is sent to `socket_fd`.
-    if (tcp) {
-      size = sendto(accepted_socket, response, strlen(response), 0,
-                    (struct sockaddr *) &address, addrlen);
-    } else {
-      size = sendto(socket_fd, response, strlen(response), 0,
-                    (struct sockaddr *) &address, addrlen);
-    }
-    if (size < 0) {
-      Println("Error: Failed to send a response.");
+  // In TCP, a response is sent to `accepted_socket`.
+  if (sendto(accepted_socket, response, strlen(response), 0, NULL, 0) < 0) {
+    Println("Error: Failed to send a response.");
+  }
+
+  // In TCP, an accepted socket should be closed. It is removed from epoll as
+  // well.
+  close(accepted_socket);
+}
+
+// Serves requests on all sockets with a single epoll instance.
+void StartServer() {
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    Println("Error: Failed to create an epoll instance");
+    exit(1);
+  }
+  int udp_socket = -1;
+  int tcp_socket = -1;
+  if (udp)
+    udp_socket = OpenServerSocket(epoll_fd, false);
+  if (tcp)
+    tcp_socket = OpenServerSocket(epoll_fd, true);
+
+  while (1) {
+    Println("Log: Waiting for a request...\n");
+
+    struct epoll_event events[MAX_EVENTS];
+    int num_of_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (num_of_events < 0) {
+      Println("Error: Failed to wait for requests.");
       exit(EXIT_FAILURE);
     }
-
-    // In TCP, an accepted socket should be closed.
-    if (tcp) {
-      close(accepted_socket);
+    for (int i = 0; i < num_of_events; i++) {
+      int fd = events[i].data.fd;
+      if (fd == udp_socket) {
+        ServeUDPRequest(fd);
+      } else if (fd == tcp_socket) {
+        AcceptConnection(epoll_fd, fd);
+      } else {
+        ServeTCPRequest(fd);
+      }
     }
   }
-
-  close(socket_fd);
 }
 
 // Return true when parse succeeded, otherwise return false.
 bool ParseArgs(int argc, char **argv) {
   // Set default values.
   port = 8888;
+  udp = true;
   tcp = false;
 
   while (argc > 0) {
@@ -224,6 +296,15 @@ bool ParseArgs(int argc, char **argv) {
     }
 
     if (strcmp("--tcp", argv[0]) == 0) {
+      udp = false;
+      tcp = true;
+      argc -= 1;
+      argv += 1;
+      continue;
+    }
+
+    if (strcmp("--both", argv[0]) == 0) {
+      udp = true;
       tcp = true;
       argc -= 1;
       argv += 1;
@@ -240,11 +321,14 @@ int main(int argc, char **argv) {
     Println("Usage: httpserver.bin [ OPTION ]");
     Println("       -p, --port    Port number. Default: 8888");
     Println("           --tcp     Flag to use TCP. Use UDP when it doesn't exist.");
+    Println("           --both    Flag to serve both UDP and TCP.");
     exit(EXIT_FAILURE);
     return EXIT_FAILURE;
   }
 
-  if (tcp)
+  if (udp && tcp)
+    Println("Log: Using protocol: UDP and TCP");
+  else if (tcp)
     Println("Log: Using protocol: TCP");
   else
     Println("Log: Using protocol: UDP");
@@ -0,0 +1,152 @@
+// Prints ICMP packets received through the RX ring of a raw socket, which
+// the kernel fills without a syscall per packet. Optionally sends echo
+// requests through the TX ring at once before that.
+
+#include "../liumlib/liumlib.h"
+
+#define FRAME_SIZE 256
+#define NUM_OF_FRAMES 64
+#define PAGE_SIZE 4096
+
+struct __attribute__((packed)) IPv4Header {
+  uint8_t version_and_ihl;
+  uint8_t dscp_and_ecn;
+  uint16_t length;
+  uint16_t ident;
+  uint16_t flags;
+  uint8_t ttl;
+  uint8_t protocol;
+  uint16_t checksum;
+  in_addr_t src_addr;
+  in_addr_t dst_addr;
+};
+
+struct __attribute__((packed)) ICMPMessage {
+  uint8_t type;
+  uint8_t code;
+  uint16_t checksum;
+  uint16_t identifier;
+  uint16_t sequence;
+};
+
+struct packet_ring_header *rx_ring;
+struct packet_ring_header *tx_ring;
+
+size_t GetRingMapSize() {
+  size_t size = sizeof(struct packet_ring_header) + FRAME_SIZE * NUM_OF_FRAMES;
+  return (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+}
+
+struct packet_ring_frame *GetFrame(struct packet_ring_header *ring,
+                                   uint32_t index) {
+  return (struct packet_ring_frame *)((uint8_t *)(ring + 1) +
+                                      (index % NUM_OF_FRAMES) * FRAME_SIZE);
+}
+
+uint16_t CalcChecksum(void *buf, size_t start, size_t end) {
+  // https://tools.ietf.org/html/rfc1071
+  uint8_t *p = buf;
+  uint32_t sum = 0;
+  for (size_t i = start; i < end; i += 2) {
+    sum += ((uint16_t)p[i + 0]) << 8 | p[i + 1];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  sum = ~sum;
+  return ((sum >> 8) & 0xFF) | ((sum & 0xFF) << 8);
+}
+
+void SetUpRings(int soc) {
+  struct packet_ring_req req;
+  req.frame_size = FRAME_SIZE;
+  req.num_of_frames = NUM_OF_FRAMES;
+  if (setsockopt(soc, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0 ||
+      setsockopt(soc, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    panic("error: failed to request rings\n");
+  uint8_t *p = mmap(NULL, GetRingMapSize() * 2, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, soc, 0);
+  if ((long)p < 0)
+    panic("error: failed to map rings\n");
+  rx_ring = (struct packet_ring_header *)p;
+  tx_ring = (struct packet_ring_header *)(p + GetRingMapSize());
+}
+
+// Puts count echo requests into the TX ring and sends all of them with one
+// syscall.
+void SendEchoRequests(int soc, in_addr_t dst_addr, int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t head = tx_ring->head;
+    if (head - __atomic_load_n(&tx_ring->tail, __ATOMIC_ACQUIRE) ==
+        NUM_OF_FRAMES)
+      break;
+    struct packet_ring_frame *frame = GetFrame(tx_ring, head);
+    struct ICMPMessage *icmp = (struct ICMPMessage *)(frame + 1);
+    memset(icmp, 0, sizeof(*icmp));
+    icmp->type = 8; /* Echo Request */
+    icmp->sequence = htons(i);
+    icmp->checksum = CalcChecksum(icmp, 0, sizeof(*icmp));
+    frame->size = sizeof(*icmp);
+    frame->addr = dst_addr;
+    __atomic_store_n(&tx_ring->head, head + 1, __ATOMIC_RELEASE);
+  }
+  if (sendto(soc, NULL, 0, 0, NULL, 0) < 0)
+    panic("error: failed to send\n");
+}
+
+void PrintFrame(struct packet_ring_frame *frame) {
+  struct IPv4Header *ip = (struct IPv4Header *)(frame + 1);
+  if (frame->size < sizeof(*ip) + sizeof(struct ICMPMessage)) {
+    Print("(too short)\n");
+    return;
+  }
+  struct ICMPMessage *icmp = (struct ICMPMessage *)(ip + 1);
+  PrintIPv4Addr(ip->src_addr);
+  Print(" > ");
+  PrintIPv4Addr(ip->dst_addr);
+  Print(": type ");
+  PrintNum(icmp->type);
+  Print(", code ");
+  PrintNum(icmp->code);
+  Print(", length ");
+  PrintNum(frame->original_size);
+  Print("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc > 3) {
+    Print("Usage: ");
+    Print(argv[0]);
+    Print(" [count] [echo request dst ip addr]\n");
+    exit(EXIT_FAILURE);
+  }
+  int count = argc >= 2 ? StrToNum16(argv[1], NULL) : 0;
+
+  int soc = socket(AF_INET, SOCK_RAW, PROT_ICMP);
+  if (soc < 0)
+    panic("error: failed to create socket\n");
+  SetUpRings(soc);
+  if (argc == 3)
+    SendEchoRequests(soc, MakeIPv4AddrFromString(argv[2]), count);
+
+  // Waits with poll() only when the ring is empty.
+  struct pollfd pfd;
+  pfd.fd = soc;
+  pfd.events = POLLIN;
+  for (int n = 0; !count || n < count;) {
+    uint32_t tail = rx_ring->tail;
+    if (tail == __atomic_load_n(&rx_ring->head, __ATOMIC_ACQUIRE)) {
+      if (poll(&pfd, 1, -1) < 0)
+        panic("error: failed to poll\n");
+      continue;
+    }
+    PrintFrame(GetFrame(rx_ring, tail));
+    __atomic_store_n(&rx_ring->tail, tail + 1, __ATOMIC_RELEASE);
+    n++;
+  }
+  Print("dropped: ");
+  PrintNum((int)rx_ring->num_of_dropped);
+  Print("\n");
+  close(soc);
+  return 0;
+}
@@ -17,10 +17,55 @@
 #define SO_SNDTIMEO 21
 #define SOL_SOCKET  1
 #define PROT_ICMP 1
+#define IPPROTO_TCP 6
 #define IPPROTO_UDP 17
+#define TCP_NODELAY 1
+#define MSG_TRUNC 0x20
+#define MSG_DONTWAIT 0x40
+#define MSG_WAITFORONE 0x10000
+
+#define SOL_PACKET 263
+#define PACKET_RX_RING 5
+#define PACKET_TX_RING 13
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x01
+
+#define F_GETFL 3
+#define F_SETFL 4
+#define O_NONBLOCK 04000
+
+// System calls return these negated on failure.
+#define EAGAIN 11
+#define EWOULDBLOCK EAGAIN
+#define EBUSY 16
+#define EINVAL 22
+#define EMSGSIZE 90
+#define ENOBUFS 105
+#define ETIMEDOUT 110
+#define EINPROGRESS 115
+
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define TIMER_ABSTIME 1
 
 #define INADDR_ANY ((unsigned long int) 0x00000000)
 
+#define POLLIN 0x001
+#define POLLOUT 0x004
+#define POLLERR 0x008
+#define POLLHUP 0x010
+#define POLLNVAL 0x020
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
 #define __bswap_16(x) \
   ((__uint16_t) ((((x) >> 8) & 0xff) | (((x) & 0xff) << 8)))
 
@@ -43,6 +88,7 @@ typedef unsigned long size_t;
 typedef _Bool bool;
 
 typedef uint32_t socklen_t;
+typedef int clockid_t;
 
 int malloc_size;
 char malloc_array[MALLOC_MAX_SIZE];
@@ -60,6 +106,13 @@ struct timeval {
   long tv_usec;
 };
 
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/uapi/linux/time.h#L10
+struct timespec {
+  long tv_sec;
+  long tv_nsec;
+};
+
 // c.f.
 // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/in.h#L232
 struct sockaddr_in {
@@ -78,6 +131,82 @@ struct sockaddr {
   char sa_data[14];    /* 14 bytes of protocol address */
 };
 
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/uapi/asm-generic/poll.h#L36
+struct pollfd {
+  int fd;
+  short events;
+  short revents;
+};
+typedef unsigned long nfds_t;
+
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/uapi/linux/eventpoll.h#L77
+typedef union epoll_data {
+  void *ptr;
+  int fd;
+  uint32_t u32;
+  uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+  uint32_t events;
+  epoll_data_t data;
+} __attribute__((packed));
+
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/uapi/linux/uio.h#L17
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/linux/socket.h#L50
+struct msghdr {
+  void *msg_name;
+  socklen_t msg_namelen;
+  struct iovec *msg_iov;
+  size_t msg_iovlen;
+  void *msg_control;
+  size_t msg_controllen;
+  int msg_flags;
+};
+
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+// Packet rings of raw ICMP sockets. Unlike the ones of Linux, each ring
+// has a header with head and tail indices followed by frames, and each frame
+// has a packet_ring_frame followed by the data. The producer fills the frame
+// at head % num_of_frames and then increments head, and the consumer takes
+// the frame at tail % num_of_frames and then increments tail. The kernel
+// produces the RX ring, from the IP header of received packets, and
+// consumes the TX ring, ICMP messages to addr, when sendto() is called with
+// no buffer. mmap() maps the RX ring followed by the TX ring, each of them
+// rounded up to pages.
+struct packet_ring_req {
+  unsigned int frame_size;  // A multiple of 64.
+  unsigned int num_of_frames;  // A power of two.
+};
+
+struct packet_ring_header {
+  uint32_t frame_size;
+  uint32_t num_of_frames;
+  uint64_t num_of_dropped;
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct packet_ring_frame {
+  uint32_t size;
+  uint32_t original_size;  // Larger than size if truncated.
+  in_addr_t addr;  // Source for RX, destination for TX.
+  uint32_t reserved;
+};
+
 // System call functions.
 ssize_t read(int fd, void *buf, size_t count);
 ssize_t write(int fd, const void *buf, size_t count);
@@ -102,7 +231,26 @@ int bind(int sockfd, struct sockaddr *addr,
          socklen_t addrlen);
 int listen(int sockfd, int backlog);
 int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+             int flags);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+             int flags, struct timespec *timeout);
+int fcntl(int fd, int cmd, ...);
+// Returns a negated errno cast to a pointer on failure.
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           long offset);
 void exit(int);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int clock_gettime(clockid_t clockid, struct timespec *tp);
+int clock_nanosleep(clockid_t clockid, int flags,
+                    const struct timespec *request,
+                    struct timespec *remain);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int epoll_create(int size);
+int epoll_create1(int flags);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
 
 // Standard library functions.
 size_t strlen(const char *s);
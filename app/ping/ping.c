@@ -42,6 +42,15 @@ int main(int argc, char** argv) {
     panic("socket() failed\n");
   }
 
+  // A lost reply should not block forever.
+  struct timeval timeout;
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  if (setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout)) < 0) {
+    panic("setsockopt() failed\n");
+  }
+
   // Create sockaddr_in
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
@@ -63,6 +72,11 @@ int main(int argc, char** argv) {
   socklen_t addr_size;
   int recv_len = recvfrom(soc, &recv_buf, sizeof(recv_buf), 0,
                           (struct sockaddr*)&addr, &addr_size);
+  if (recv_len == -EAGAIN) {
+    Print("Request timed out\n");
+    close(soc);
+    exit(EXIT_FAILURE);
+  }
   if (recv_len < 1) {
     panic("recvfrom() failed\n");
   }
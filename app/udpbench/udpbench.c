@@ -0,0 +1,177 @@
+// UDP echo benchmark. The server echoes datagrams back to their sources and
+// the client measures round trips, one datagram per syscall or in batches
+// with recvmmsg/sendmmsg.
+
+#include "../liumlib/liumlib.h"
+
+#define MAX_BATCH 64
+#define PAYLOAD_SIZE 64
+#define REPORT_INTERVAL_NS 1000000000UL
+
+struct mmsghdr msgs[MAX_BATCH];
+struct iovec iovs[MAX_BATCH];
+struct sockaddr_in addrs[MAX_BATCH];
+uint8_t bufs[MAX_BATCH][PAYLOAD_SIZE];
+// Uses recvmmsg/sendmmsg instead of recvfrom/sendto.
+bool use_mmsg;
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void PrintPacketsPerSec(const char *label, uint64_t packets,
+                        uint64_t elapsed_ns) {
+  Print(label);
+  PrintNum((int)(packets * 1000000000UL / (elapsed_ns ? elapsed_ns : 1)));
+  Print(" packets/sec\n");
+}
+
+// Points each message to its buffer and address.
+void SetUpMessages(int batch) {
+  for (int i = 0; i < batch; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = PAYLOAD_SIZE;
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+// Receives up to max datagrams. Returns the number of them, or a negative
+// error. Only the first one is waited for.
+int Receive(int soc, int max) {
+  if (!use_mmsg) {
+    socklen_t addr_len = sizeof(addrs[0]);
+    ssize_t size = recvfrom(soc, bufs[0], PAYLOAD_SIZE, 0,
+                            (struct sockaddr *)&addrs[0], &addr_len);
+    if (size < 0)
+      return size;
+    iovs[0].iov_len = size;
+    return 1;
+  }
+  SetUpMessages(max);
+  int n = recvmmsg(soc, msgs, max, MSG_WAITFORONE, NULL);
+  for (int i = 0; i < n; i++) {
+    iovs[i].iov_len = msgs[i].msg_len;
+  }
+  return n;
+}
+
+// Sends the first n datagrams in bufs to addrs.
+void Send(int soc, int n) {
+  if (!use_mmsg) {
+    sendto(soc, bufs[0], iovs[0].iov_len, 0, (struct sockaddr *)&addrs[0],
+           sizeof(addrs[0]));
+    return;
+  }
+  sendmmsg(soc, msgs, n, 0);
+}
+
+void Server(uint16_t port, int batch) {
+  int soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc < 0)
+    panic("error: failed to create socket\n");
+  struct sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if (bind(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    panic("error: failed to bind socket\n");
+  // Reports regularly even if datagrams stop coming.
+  struct timeval timeout;
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint64_t packets = 0;
+  uint64_t last_report_ns = NowNs();
+  for (;;) {
+    int n = Receive(soc, batch);
+    if (n > 0) {
+      Send(soc, n);
+      packets += n;
+    } else if (n != -EAGAIN) {
+      panic("error: failed to receive\n");
+    }
+    uint64_t now = NowNs();
+    if (now - last_report_ns >= REPORT_INTERVAL_NS) {
+      if (packets)
+        PrintPacketsPerSec("echoed: ", packets, now - last_report_ns);
+      packets = 0;
+      last_report_ns = now;
+    }
+  }
+}
+
+void Client(in_addr_t server_ip_addr, uint16_t port, int batch,
+            int seconds) {
+  int soc = socket(AF_INET, SOCK_DGRAM, 0);
+  if (soc < 0)
+    panic("error: failed to create socket\n");
+  // Lost datagrams are given up after this.
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 100000;
+  setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t start_ns = NowNs();
+  uint64_t end_ns = start_ns + seconds * REPORT_INTERVAL_NS;
+  while (NowNs() < end_ns) {
+    SetUpMessages(batch);
+    for (int i = 0; i < batch; i++) {
+      addrs[i].sin_family = AF_INET;
+      addrs[i].sin_addr.s_addr = server_ip_addr;
+      addrs[i].sin_port = htons(port);
+      memset(bufs[i], 'a' + i % 26, PAYLOAD_SIZE);
+    }
+    Send(soc, batch);
+    sent += batch;
+    // Waits for the echoes of the whole batch.
+    for (int remaining = batch; remaining > 0;) {
+      int n = Receive(soc, remaining);
+      if (n == -EAGAIN)
+        break;
+      if (n < 0)
+        panic("error: failed to receive\n");
+      remaining -= n;
+      received += n;
+    }
+  }
+  Print("sent: ");
+  PrintNum((int)sent);
+  Print(", received: ");
+  PrintNum((int)received);
+  Print("\n");
+  PrintPacketsPerSec("round trips: ", received, NowNs() - start_ns);
+}
+
+int ParseBatch(const char *s) {
+  int batch = StrToNum16(s, NULL);
+  if (batch < 1 || batch > MAX_BATCH)
+    panic("error: batch should be from 1 to 64\n");
+  use_mmsg = batch > 1;
+  return batch;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[1], "server") == 0) {
+    Server(StrToNum16(argv[2], NULL), argc >= 4 ? ParseBatch(argv[3]) : 1);
+    return 0;
+  }
+  if (argc >= 4 && strcmp(argv[1], "client") == 0) {
+    Client(MakeIPv4AddrFromString(argv[2]), StrToNum16(argv[3], NULL),
+           argc >= 5 ? ParseBatch(argv[4]) : 1,
+           argc >= 6 ? StrToNum16(argv[5], NULL) : 5);
+    return 0;
+  }
+  Print("Usage:\n");
+  Print("  udpbench.bin server <port> [batch]\n");
+  Print("  udpbench.bin client <server ip> <port> [batch] [seconds]\n");
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,30 @@
+#!/usr/bin/env python3
+import sys
+import test_util
+
+NUM_OF_REQUESTS = 100
+
+def test_tcp_http_server(qemu_mon_conn, liumos_serial_conn, liumos_builder_conn):
+    test_util.expect_liumos_command_result(
+        liumos_serial_conn,
+        "httpserver.bin --port 8890 --tcp",
+        "Listening port: 8890", 5);
+    test_util.expect_liumos_command_result(
+        liumos_builder_conn,
+        "/liumos/app/httpclient/httpclient.bin --ip 127.0.0.1 --port 8890 --tcp --path /index.html",
+        "This is a sample paragraph.", 5);
+    # Each request uses a new connection, so this measures the handshakes
+    # and the teardowns as well as the transfers.
+    test_util.expect_liumos_command_result(
+        liumos_builder_conn,
+        "N={0}; S=$(date +%s%N); "
+        "for i in $(seq $N); do "
+        "/liumos/app/httpclient/httpclient.bin --ip 127.0.0.1 --port 8890 --tcp --path /index.html; "
+        "done | grep -c 'HTTP/1.1 200 OK' | tr -d '\\n'; "
+        "E=$(date +%s%N); "
+        "echo \" responses, $((N * 1000000000 / (E - S))) requests/sec\"".format(NUM_OF_REQUESTS),
+        r"{0} responses, \d+ requests/sec".format(NUM_OF_REQUESTS), 60);
+
+if __name__ == "__main__":
+    test_util.launch_test(test_tcp_http_server);
+    sys.exit(0)
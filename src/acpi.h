@@ -246,12 +246,12 @@ packed_struct SRAT {
     }
     return kUnknownProximityDomain;
   }
-  uint32_t GetProximityDomainForLocalAPIC(LocalAPIC & lapic) {
+  uint32_t GetProximityDomainForAPICID(uint32_t apic_id) {
     for (auto& it : *this) {
       if (it.type != SRAT::Entry::kTypeLx2APICAffinity)
         continue;
       SRAT::Lx2APICAffinity* e = reinterpret_cast<SRAT::Lx2APICAffinity*>(&it);
-      if (e->x2apic_id != lapic.GetID())
+      if (e->x2apic_id != apic_id)
         continue;
       return e->proximity_domain;
     }
@@ -259,7 +259,7 @@ packed_struct SRAT {
       if (it.type != SRAT::Entry::kTypeLAPICAffinity)
         continue;
       SRAT::LAPICAffinity* e = reinterpret_cast<SRAT::LAPICAffinity*>(&it);
-      if (e->apic_id != lapic.GetID())
+      if (e->apic_id != apic_id)
         continue;
       return e->proximity_domain_low | (e->proximity_domain_high[0] << 8) |
              (e->proximity_domain_high[1] << 16) |
@@ -267,6 +267,9 @@ packed_struct SRAT {
     }
     return kUnknownProximityDomain;
   }
+  uint32_t GetProximityDomainForLocalAPIC(LocalAPIC & lapic) {
+    return GetProximityDomainForAPICID(lapic.GetID());
+  }
 };
 static_assert(offsetof(SRAT, entry) == 48);
 
@@ -5,6 +5,8 @@
 
 #include <algorithm>
 
+#include "timer.h"
+
 int Adlib::note_on_count_[0x100];
 int Adlib::ch_of_note_[0x100];
 int Adlib::note_of_ch_[9];
@@ -241,8 +243,7 @@ void PlayMIDI(EFIFile& file) {
       has_next_event = true;
     }
     if (min_delta != 0) {
-      HPET::GetInstance().BusyWaitMicroSecond(state.micro_second_per_delta *
-                                              min_delta);
+      SleepMicroSecond(state.micro_second_per_delta * min_delta);
     }
     for (int i = 0; i < num_of_tracks; i++) {
       delta_used[i] += min_delta;
@@ -257,35 +258,35 @@ void TestAdlib() {
   }
 
   Adlib::NoteOn(60);
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
   Adlib::NoteOff(60);
 
   Adlib::NoteOn(64);
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
   Adlib::NoteOff(64);
 
   Adlib::NoteOn(67);
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
   Adlib::NoteOff(67);
 
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
 
   Adlib::NoteOn(60);
   Adlib::NoteOn(64);
   Adlib::NoteOn(67);
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
   Adlib::NoteOff(60);
   Adlib::NoteOff(64);
   Adlib::NoteOff(67);
 
-  HPET::GetInstance().BusyWait(500);
+  SleepMilliSecond(500);
 
   for (int i = 0; i < 10; i++) {
     Adlib::NoteOn(i + 60);
-    HPET::GetInstance().BusyWait(200);
+    SleepMilliSecond(200);
   }
   for (int i = 0; i < 10; i++) {
-    HPET::GetInstance().BusyWait(200);
+    SleepMilliSecond(200);
     Adlib::NoteOff(i + 60);
   }
 
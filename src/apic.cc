@@ -34,7 +34,11 @@ void LocalAPIC::Init(void) {
   ReadCPUID(&cpuid, CPUIDIndex::kXTopology, 0);
   id_ = cpuid.edx;
   PutStringAndHex(" id", id_);
-  liumos->bsp_local_apic = this;
+
+  // Software-enable the local APIC since it is disabled after INIT on
+  // application processors.
+  WriteRegister(kRegSpuriousInterruptVector,
+                ReadRegister(kRegSpuriousInterruptVector) | (1 << 8));
 }
 
 void LocalAPIC::SendEndOfInterrupt(void) {
@@ -43,7 +47,59 @@ void LocalAPIC::SendEndOfInterrupt(void) {
     WriteMSR(MSRIndex::kx2APICEndOfInterrupt, 0);
     return;
   }
-  WriteRegister(0xB0ULL, 0);
+  WriteRegister(kRegEndOfInterrupt, 0);
+}
+
+uint32_t LocalAPIC::ReadIDOfCurrentProcessor(void) {
+  if (is_x2apic_)
+    return ReadRegister(kRegID);
+  return ReadRegister(kRegID) >> 24;
+}
+
+void LocalAPIC::SendIPI(uint32_t dest_apic_id, uint32_t command) {
+  if (is_x2apic_) {
+    WriteMSR(GetMSRIndexForRegister(kRegInterruptCommandLow),
+             (static_cast<uint64_t>(dest_apic_id) << 32) | command);
+    return;
+  }
+  WriteRegister(kRegInterruptCommandHigh, dest_apic_id << 24);
+  WriteRegister(kRegInterruptCommandLow, command);
+  constexpr uint32_t kDeliveryStatusSendPending = 1 << 12;
+  while (ReadRegister(kRegInterruptCommandLow) & kDeliveryStatusSendPending) {
+  }
+}
+
+void LocalAPIC::SendInitIPI(uint32_t dest_apic_id) {
+  // Delivery mode: INIT, Level: Assert, Trigger mode: Level
+  SendIPI(dest_apic_id, (0b101 << 8) | (1 << 14) | (1 << 15));
+}
+
+void LocalAPIC::SendStartupIPI(uint32_t dest_apic_id, uint64_t code_phys_addr) {
+  assert((code_phys_addr & kPageAddrMask) == 0);
+  assert(code_phys_addr < 0x100000);
+  // Delivery mode: Start Up, Level: Assert
+  SendIPI(dest_apic_id, static_cast<uint32_t>(code_phys_addr >> 12) |
+                            (0b110 << 8) | (1 << 14));
+}
+
+void LocalAPIC::SendFixedIPI(uint32_t dest_apic_id, uint8_t vector) {
+  // Delivery mode: Fixed, Level: Assert
+  SendIPI(dest_apic_id, vector | (1 << 14));
+}
+
+void LocalAPIC::StartTimer(uint32_t initial_count,
+                           uint8_t vector,
+                           bool periodic) {
+  constexpr uint32_t kTimerModePeriodic = 1 << 17;
+  WriteRegister(kRegTimerDivideConfig, 0b0011);  // Divide by 16
+  WriteRegister(kRegLVTTimer, vector | (periodic ? kTimerModePeriodic : 0));
+  WriteRegister(kRegTimerInitialCount, initial_count);
+}
+
+void LocalAPIC::StopTimer(void) {
+  constexpr uint32_t kLVTMasked = 1 << 16;
+  WriteRegister(kRegLVTTimer, kLVTMasked);
+  WriteRegister(kRegTimerInitialCount, 0);
 }
 
 static uint32_t ReadIOAPICRegister(uint8_t reg_index) {
@@ -69,10 +125,11 @@ static void WriteIOAPICRedirectTableRegister(uint8_t irq_index,
 
 static void SetInterruptRedirection(uint64_t local_apic_id,
                                     int from_irq_num,
-                                    int to_vector_index) {
+                                    int to_vector_index,
+                                    uint64_t flags = 0) {
   uint64_t redirect_table = ReadIOAPICRedirectTableRegister(from_irq_num);
   redirect_table &= 0x00fffffffffe0000UL;
-  redirect_table |= (local_apic_id << 56) | to_vector_index;
+  redirect_table |= (local_apic_id << 56) | flags | to_vector_index;
   WriteIOAPICRedirectTableRegister(from_irq_num, redirect_table);
 }
 
@@ -81,3 +138,10 @@ void InitIOAPIC(uint64_t local_apic_id) {
   SetInterruptRedirection(local_apic_id, 1, 0x21);   // KBC
   SetInterruptRedirection(local_apic_id, 12, 0x22);  // MOUSE
 }
+
+void SetLevelTriggeredInterruptRedirection(uint64_t local_apic_id,
+                                           int irq,
+                                           int vector) {
+  constexpr uint64_t kTriggerModeLevel = 1 << 15;
+  SetInterruptRedirection(local_apic_id, irq, vector, kTriggerModeLevel);
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include "asm.h"
 #include "generic.h"
 
 class LocalAPIC {
@@ -7,14 +8,50 @@ class LocalAPIC {
   uint32_t GetID() { return id_; }
   bool Isx2APIC() { return is_x2apic_; }
   void SendEndOfInterrupt(void);
+  // Reads the ID of the processor executing this. Each processor accesses
+  // its own local APIC through the same registers, so this can be called on
+  // any processor via any initialized instance.
+  uint32_t ReadIDOfCurrentProcessor(void);
+  void SendInitIPI(uint32_t dest_apic_id);
+  // code_phys_addr should be 4KiB-aligned and below 1MiB.
+  void SendStartupIPI(uint32_t dest_apic_id, uint64_t code_phys_addr);
+  void SendFixedIPI(uint32_t dest_apic_id, uint8_t vector);
+  // Timer counts down from initial_count at the bus clock divided by 16.
+  void StartTimer(uint32_t initial_count, uint8_t vector, bool periodic);
+  void StopTimer(void);
+  uint32_t ReadTimerCurrentCount(void) {
+    return ReadRegister(kRegTimerCurrentCount);
+  }
 
  private:
+  static constexpr uint64_t kRegID = 0x20;
+  static constexpr uint64_t kRegEndOfInterrupt = 0xB0;
+  static constexpr uint64_t kRegSpuriousInterruptVector = 0xF0;
+  static constexpr uint64_t kRegInterruptCommandLow = 0x300;
+  static constexpr uint64_t kRegInterruptCommandHigh = 0x310;
+  static constexpr uint64_t kRegLVTTimer = 0x320;
+  static constexpr uint64_t kRegTimerInitialCount = 0x380;
+  static constexpr uint64_t kRegTimerCurrentCount = 0x390;
+  static constexpr uint64_t kRegTimerDivideConfig = 0x3E0;
+
   uint32_t ReadRegister(uint64_t offset) {
-    return *reinterpret_cast<uint32_t*>(kernel_virt_base_addr_ + offset);
+    if (is_x2apic_)
+      return static_cast<uint32_t>(ReadMSR(GetMSRIndexForRegister(offset)));
+    return *reinterpret_cast<volatile uint32_t*>(kernel_virt_base_addr_ +
+                                                 offset);
   }
   void WriteRegister(uint64_t offset, uint32_t data) {
-    *reinterpret_cast<uint32_t*>(kernel_virt_base_addr_ + offset) = data;
+    if (is_x2apic_) {
+      WriteMSR(GetMSRIndexForRegister(offset), data);
+      return;
+    }
+    *reinterpret_cast<volatile uint32_t*>(kernel_virt_base_addr_ + offset) =
+        data;
+  }
+  static MSRIndex GetMSRIndexForRegister(uint64_t offset) {
+    return static_cast<MSRIndex>(0x800 + (offset >> 4));
   }
+  void SendIPI(uint32_t dest_apic_id, uint32_t command);
   uint32_t* GetRegisterAddr(uint64_t offset) {
     return (uint32_t*)(base_addr_ + offset);
   }
@@ -27,3 +64,9 @@ class LocalAPIC {
 };
 
 void InitIOAPIC(uint64_t local_apic_id);
+// For PCI INTx. The interrupt line register of a device is assumed to be the
+// input pin of the IOAPIC, which is true for ISA IRQs routed with active high
+// polarity as on QEMU.
+void SetLevelTriggeredInterruptRedirection(uint64_t local_apic_id,
+                                           int irq,
+                                           int vector);
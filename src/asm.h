@@ -7,6 +7,7 @@ extern "C" {
 
 namespace CPUIDIndex {
 constexpr uint32_t kXTopology = 0x0B;
+constexpr uint32_t kAdvancedPowerManagement = 0x8000'0007;
 constexpr uint32_t kMaxAddr = 0x8000'0008;
 }  // namespace CPUIDIndex
 
@@ -21,12 +22,21 @@ constexpr uint64_t kLocalAPICBaseBitx2APICEnabled = (1 << 10);
 constexpr uint64_t kRFlagsInterruptEnable = (1ULL << 9);
 
 struct CPUFeatureIndex {
-  enum { kX2APIC, kXSAVE, kOSXSAVE, kAPIC, kFXSR, kSize };
+  enum {
+    kX2APIC,
+    kXSAVE,
+    kOSXSAVE,
+    kAPIC,
+    kFXSR,
+    kInvariantTSC,
+    kSSE2,
+    kSize
+  };
   int dummy;
 };
 
 static const char* CPUFeatureString[] = {
-    "x2APIC", "XSAVE", "OSXSAVE", "APIC", "FXSR",
+    "x2APIC", "XSAVE", "OSXSAVE", "APIC", "FXSR", "InvariantTSC", "SSE2",
 };
 
 packed_struct CPUFeatureSet {
@@ -211,14 +221,18 @@ __attribute__((ms_abi)) void WriteIOPort32(uint16_t addr, uint32_t data);
 __attribute__((ms_abi)) void StoreIntFlag(void);
 __attribute__((ms_abi)) void StoreIntFlagAndHalt(void);
 __attribute__((ms_abi)) void ClearIntFlag(void);
+__attribute__((ms_abi)) uint64_t ReadRFLAGS(void);
+__attribute__((ms_abi)) uint64_t ReadTSC(void);
 [[noreturn]] __attribute__((ms_abi)) void Die(void);
 __attribute__((ms_abi)) uint16_t ReadCSSelector(void);
 __attribute__((ms_abi)) uint16_t ReadSSSelector(void);
 __attribute__((ms_abi)) void WriteCSSelector(uint16_t);
 __attribute__((ms_abi)) void WriteSSSelector(uint16_t);
 __attribute__((ms_abi)) void WriteDataAndExtraSegmentSelectors(uint16_t);
+__attribute__((ms_abi)) uint64_t ReadCR0(void);
 __attribute__((ms_abi)) uint64_t ReadCR2(void);
 __attribute__((ms_abi)) uint64_t ReadCR3(void);
+__attribute__((ms_abi)) uint64_t ReadCR4(void);
 __attribute__((ms_abi)) void WriteCR3(uint64_t);
 __attribute__((ms_abi)) uint64_t CompareAndSwap(uint64_t*, uint64_t);
 __attribute__((ms_abi)) void SwapGS(void);
@@ -260,6 +274,10 @@ __attribute__((ms_abi)) void AsmIntHandler13_SIMDFPException(void);
 __attribute__((ms_abi)) void AsmIntHandler20(void);
 __attribute__((ms_abi)) void AsmIntHandler21(void);
 __attribute__((ms_abi)) void AsmIntHandler22(void);
+__attribute__((ms_abi)) void AsmIntHandler23(void);
+__attribute__((ms_abi)) void AsmIntHandler24(void);
+__attribute__((ms_abi)) void AsmIntHandler30(void);
+__attribute__((ms_abi)) void AsmIntHandler31(void);
 __attribute__((ms_abi)) void AsmIntHandlerNotImplemented(void);
 __attribute__((ms_abi)) void Disable8259PIC(void);
 }
@@ -0,0 +1,119 @@
+#include "clock_source.h"
+
+#include "kernel.h"
+#include "liumos.h"
+#include "util.h"
+
+constexpr uint64_t kCalibrationMs = 50;
+constexpr uint64_t kMaxTSCSkewNs = 50'000;
+
+static bool use_tsc_;
+static uint64_t tsc_base_;
+static uint64_t hpet_base_;
+// Multipliers in 32.32 fixed point.
+static uint64_t ns_per_tsc_;
+static uint64_t fs_per_tsc_;
+static uint64_t ns_per_hpet_count_;
+static uint64_t fs_per_hpet_count_;
+static uint64_t tsc_frequency_;
+
+static uint64_t MulShift32(uint64_t a, uint64_t mult) {
+  return static_cast<uint64_t>((static_cast<__uint128_t>(a) * mult) >> 32);
+}
+
+static uint64_t HPETNowNs() {
+  return MulShift32(HPET::GetInstance().ReadMainCounterValue() - hpet_base_,
+                    ns_per_hpet_count_);
+}
+
+static uint64_t TSCNowNs() {
+  return MulShift32(ReadTSC() - tsc_base_, ns_per_tsc_);
+}
+
+void InitClockSource() {
+  HPET& hpet = HPET::GetInstance();
+  const uint64_t fs_per_hpet_count = hpet.GetFemtosecondPerCount();
+  fs_per_hpet_count_ = fs_per_hpet_count << 32;
+  ns_per_hpet_count_ = (fs_per_hpet_count << 32) / 1'000'000;
+  hpet_base_ = hpet.ReadMainCounterValue();
+  tsc_base_ = ReadTSC();
+  use_tsc_ = false;
+  const uint64_t features = liumos->cpu_features->features;
+  if (!GetBit<CPUFeatureIndex::kInvariantTSC>(features)) {
+    PrintClockSource();
+    return;
+  }
+  // Interrupts are not enabled yet, so spin on HPET.
+  const uint64_t hpet_end =
+      hpet_base_ + 1'000'000'000'000ULL * kCalibrationMs / fs_per_hpet_count;
+  uint64_t hpet_now;
+  while ((hpet_now = hpet.ReadMainCounterValue()) < hpet_end) {
+    asm volatile("pause");
+  }
+  const uint64_t tsc_now = ReadTSC();
+  const uint64_t elapsed_ns =
+      (hpet_now - hpet_base_) * fs_per_hpet_count / 1'000'000;
+  const uint64_t elapsed_tsc = tsc_now - tsc_base_;
+  ns_per_tsc_ = (elapsed_ns << 32) / elapsed_tsc;
+  fs_per_tsc_ = ns_per_tsc_ * 1'000'000;
+  tsc_frequency_ = elapsed_tsc * 1'000'000'000 / elapsed_ns;
+  use_tsc_ = true;
+  PrintClockSource();
+}
+
+void CheckClockSourceOnCurrentCPU() {
+  if (!use_tsc_)
+    return;
+  const uint64_t tsc_ns = TSCNowNs();
+  const uint64_t hpet_ns = HPETNowNs();
+  const uint64_t skew = tsc_ns > hpet_ns ? tsc_ns - hpet_ns : hpet_ns - tsc_ns;
+  if (skew <= kMaxTSCSkewNs)
+    return;
+  __atomic_store_n(&use_tsc_, false, __ATOMIC_RELAXED);
+  PutStringAndHex("TSC is not synchronized. Falling back to HPET. skew(ns)",
+                  skew);
+}
+
+uint64_t NowNs() {
+  if (__atomic_load_n(&use_tsc_, __ATOMIC_RELAXED))
+    return TSCNowNs();
+  return HPETNowNs();
+}
+
+uint64_t NowFs() {
+  if (__atomic_load_n(&use_tsc_, __ATOMIC_RELAXED))
+    return MulShift32(ReadTSC() - tsc_base_, fs_per_tsc_);
+  return MulShift32(HPET::GetInstance().ReadMainCounterValue() - hpet_base_,
+                    fs_per_hpet_count_);
+}
+
+void PrintClockSource() {
+  if (!use_tsc_) {
+    PutString("Clock source: HPET\n");
+    return;
+  }
+  PutStringAndDecimal("Clock source: TSC (Hz)", tsc_frequency_);
+}
+
+template <class TReadClock>
+static void BenchmarkClockSource(const char* name, TReadClock read_clock) {
+  constexpr uint64_t kNumOfReads = 100'000;
+  uint64_t sum = 0;
+  const uint64_t t0 = NowNs();
+  for (uint64_t i = 0; i < kNumOfReads; i++) {
+    sum += read_clock();
+  }
+  const uint64_t t1 = NowNs();
+  kprintf("%s: %lu ns per read (checksum %lx)\n", name,
+          (t1 - t0) / kNumOfReads, sum);
+}
+
+void BenchmarkClockSources() {
+  PrintClockSource();
+  HPET& hpet = HPET::GetInstance();
+  BenchmarkClockSource("HPET main counter",
+                       [&hpet] { return hpet.ReadMainCounterValue(); });
+  BenchmarkClockSource("RDTSC", [] { return ReadTSC(); });
+  BenchmarkClockSource("NowNs()", [] { return NowNs(); });
+  BenchmarkClockSource("NowFs()", [] { return NowFs(); });
+}
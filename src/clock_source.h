@@ -0,0 +1,23 @@
+#pragma once
+
+#include "generic.h"
+
+// Monotonic clock of the kernel.
+// The invariant TSC is used if the processor has it, since reading it is
+// much cheaper than an uncached MMIO read of the HPET main counter. Its
+// frequency is calibrated against HPET at boot. HPET is used if the TSC is
+// not invariant or not synchronized between processors.
+// Time is measured from the calibration.
+
+// @clock_source.cc
+// Should be called on the BSP after HPET is initialized.
+void InitClockSource();
+// Should be called on each AP. Falls back to HPET if the TSC of the
+// processor does not match the clock of the BSP.
+void CheckClockSourceOnCurrentCPU();
+uint64_t NowNs();
+// Wraps around in about 5 hours. Use it only to measure intervals.
+uint64_t NowFs();
+void PrintClockSource();
+// Compares the cost of reading each clock source.
+void BenchmarkClockSources();
@@ -5,17 +5,24 @@
 #include <vector>
 
 #include "adlib.h"
+#include "clock_source.h"
 #include "command_line_args.h"
 #include "kernel.h"
 #include "liumos.h"
 #include "network.h"
+#include "nic.h"
 #include "pci.h"
 #include "pmem.h"
-#include "virtio_net.h"
+#include "tcp.h"
+#include "timer.h"
 #include "xhci.h"
 
 namespace ConsoleCommand {
 
+// Keyboard and serial inputs are polled, so the console process sleeps for
+// this interval between checks instead of halting the processor.
+constexpr uint64_t kInputPollIntervalMs = 10;
+
 static void ShowNFIT_PrintMemoryMappingAttr(uint64_t attr) {
   PutString("  attr: ");
   PutHex64(attr);
@@ -364,6 +371,8 @@ void ShowEFIMemoryMap() {
 }
 
 void Free() {
+  PutString("DRAM Usage per Node (* = local):\n");
+  GetSystemDRAMAllocator().PrintNodeUsage();
   PutString("DRAM Free List:\n");
   GetSystemDRAMAllocator().Print();
 }
@@ -652,13 +661,17 @@ void Run(TextBox& tbox) {
     return;
   }
   if (IsEqualString(args.GetArg(0), "ip")) {
-    Virtio::Net& net = Virtio::Net::GetInstance();
-    auto ip_addr = net.GetSelfIPv4Addr();
-    auto mac_addr = net.GetSelfEtherAddr();
+    auto& network = Network::GetInstance();
+    if (!network.HasNIC()) {
+      PutString("No NIC is available\n");
+      return;
+    }
+    NIC& nic = network.GetNIC();
+    auto ip_addr = nic.GetSelfIPv4Addr();
+    auto mac_addr = nic.GetSelfEtherAddr();
     ip_addr.Print();
     PutString(" eth ");
     mac_addr.Print();
-    auto& network = Network::GetInstance();
     PutString(" mask ");
     auto mask = network.GetIPv4NetMask();
     mask.Print();
@@ -673,14 +686,7 @@ void Run(TextBox& tbox) {
       SendARPRequest(args.GetArg(1));
       return;
     }
-    auto& net = Network::GetInstance();
-    kprintf("%d entries found:\n", net.GetARPTable().size());
-    for (const auto& e : net.GetARPTable()) {
-      e.first.Print();
-      PutString(" -> ");
-      e.second.Print();
-      PutString("\n");
-    }
+    Network::GetInstance().PrintARPTable();
     return;
   }
   if (IsEqualString(args.GetArg(0), "dhcp")) {
@@ -710,6 +716,14 @@ void Run(TextBox& tbox) {
     ShowEFIMemoryMap();
   } else if (IsEqualString(line, "show hpet")) {
     HPET::GetInstance().Print();
+  } else if (IsEqualString(line, "show slab")) {
+    liumos->kernel_slab_allocator->Print();
+    liumos->proc_ctrl->PrintStatistics();
+  } else if (IsEqualString(line, "show net")) {
+    if (Network::GetInstance().HasNIC())
+      Network::GetInstance().GetNIC().PrintStatistics();
+    Network::GetInstance().PrintSockets();
+    TCP::GetInstance().PrintSockets();
   } else if (IsEqualString(line, "show cpu")) {
     PutString("APIC Mode: ");
     PutString(liumos->bsp_local_apic->Isx2APIC() ? "x2APIC" : "xAPIC");
@@ -762,7 +776,8 @@ void Run(TextBox& tbox) {
     Process& proc =
         liumos->proc_ctrl->RestoreFromPersistentProcessInfo(*pp_info);
     liumos->scheduler->RegisterProcess(proc);
-    proc.WaitUntilExit();
+    liumos->scheduler->WaitUntilExit(proc);
+    liumos->scheduler->ReapProcess(proc);
   } else if (IsEqualString(line, "pmem run pi.bin")) {
     assert(liumos->pmem[0]);
     int idx = GetLoaderInfo().FindFile("pi.bin");
@@ -794,6 +809,10 @@ void Run(TextBox& tbox) {
     Free();
   } else if (IsEqualString(line, "time")) {
     Time();
+  } else if (IsEqualString(line, "timer")) {
+    PrintTimerStatistics();
+  } else if (IsEqualString(line, "clock")) {
+    BenchmarkClockSources();
   } else if (strncmp(line, "eval ", 5) == 0) {
     int idx = GetLoaderInfo().FindFile("pi.bin");
     if (idx == -1) {
@@ -803,12 +822,7 @@ void Run(TextBox& tbox) {
     EFIFile& pi_bin = GetLoaderInfo().root_files[idx];
     int us = atoi(&line[5]);
     PutStringAndHex("Eval in time slice", us);
-    ClearIntFlag();
-    HPET::GetInstance().SetTimerNs(
-        0, us,
-        HPET::TimerConfig::kUsePeriodicMode | HPET::TimerConfig::kEnable);
-
-    StoreIntFlag();
+    SetTimeSliceMicroSecond(us);
 
     assert(liumos->pmem[0]);
     constexpr int kNumOfTestRun = 5;
@@ -869,6 +883,9 @@ void Run(TextBox& tbox) {
     PutString("test mem: Test memory access \n");
     PutString("free: show memory free entries\n");
     PutString("time: show HPET main counter value\n");
+    PutString("timer: show timer interrupts per second\n");
+    PutString("clock: show the clock source and compare reading costs\n");
+    PutString("show net: show NIC and socket statistics\n");
   } else if (IsEqualString(line, "testscroll")) {
     uint64_t t0 = HPET::GetInstance().ReadMainCounterValue();
     uint64_t t1 = t0 + 3 * 1000'000'000'000'000 /
@@ -1001,13 +1018,14 @@ void Run(TextBox& tbox) {
       uint16_t keyid = liumos->main_console->GetCharWithoutBlocking();
       if (KeyID::IsWithCtrl(keyid) && KeyID::IsChar(keyid, 'c')) {
         // Ctrl-C
-        proc.Kill();
-        proc.WaitUntilExit();
+        liumos->scheduler->Kill(proc);
+        liumos->scheduler->WaitUntilExit(proc);
         PutString("\nkilled.\n");
         break;
       }
-      Sleep();
+      SleepMilliSecond(kInputPollIntervalMs);
     }
+    liumos->scheduler->ReapProcess(proc);
   }
 }
 
@@ -1019,7 +1037,7 @@ void WaitAndProcess(TextBox& tbox) {
     while ((keyid = liumos->main_console->GetCharWithoutBlocking()) ==
            KeyID::kNoInput) {
       XHCI::Controller::GetInstance().PollEvents();
-      StoreIntFlagAndHalt();
+      SleepMilliSecond(kInputPollIntervalMs);
     }
     if (keyid == '\n') {
       tbox.StopRecording();
@@ -66,6 +66,11 @@ void Console::PutString(const char* s) {
 #ifndef LIUMOS_LOADER
 
 uint16_t Console::GetCharWithoutBlocking() {
+  if (lookahead_keyid_ != KeyID::kNoInput) {
+    const uint16_t keyid = lookahead_keyid_;
+    lookahead_keyid_ = KeyID::kNoInput;
+    return keyid;
+  }
   while (1) {
     uint16_t keyid;
     if ((keyid = liumos->keyboard_ctrl->ReadKeyID()) ||
@@ -94,6 +99,17 @@ uint16_t Console::GetCharWithoutBlocking() {
   return KeyID::kNoInput;
 }
 
+bool Console::HasInput() {
+  while (lookahead_keyid_ == KeyID::kNoInput) {
+    const uint16_t keyid = GetCharWithoutBlocking();
+    if (keyid == KeyID::kNoInput)
+      return false;
+    if (!(keyid & KeyID::kMaskBreak))
+      lookahead_keyid_ = keyid;
+  }
+  return true;
+}
+
 #endif
 
 void PutChar(char c) {
@@ -1,5 +1,6 @@
 #pragma once
 #include "generic.h"
+#include "keyid.h"
 #include "process_lock.h"
 
 class Sheet;
@@ -11,7 +12,11 @@ class Console {
     int x, y;
   };
   Console()
-      : cursor_x_(0), cursor_y_(0), sheet_(nullptr), serial_port_(nullptr) {}
+      : cursor_x_(0),
+        cursor_y_(0),
+        sheet_(nullptr),
+        serial_port_(nullptr),
+        lookahead_keyid_(KeyID::kNoInput) {}
   void SetCursorPosition(int x, int y) {
     cursor_x_ = x;
     cursor_y_ = y;
@@ -27,6 +32,10 @@ class Console {
 
 #ifndef LIUMOS_LOADER
   uint16_t GetCharWithoutBlocking();
+  // Returns true if GetCharWithoutBlocking() has a key to return. Released
+  // keys are discarded. The input devices are polled, so the caller should
+  // check this periodically.
+  bool HasInput();
 #endif
 
  private:
@@ -34,6 +43,8 @@ class Console {
   Sheet* sheet_;
   SerialPort* serial_port_;
   ProcessLock lock_;
+  // Read by HasInput() and returned by the next GetCharWithoutBlocking().
+  uint16_t lookahead_keyid_;
 
   void PutCharWithoutLocking(char c);
 };
@@ -161,16 +161,23 @@ Process& LoadELFAndCreateEphemeralProcess(EFIFile& file) {
   const Elf64_Ehdr* ehdr = ParseProgramHeader(file, map_info, phdr_map_info);
   assert(ehdr);
 
-  map_info.code.SetPhysAddr(GetSystemDRAMAllocator().AllocPages<uint64_t>(
-      ByteSizeToPageSize(map_info.code.GetMapSize())));
-  map_info.data.SetPhysAddr(GetSystemDRAMAllocator().AllocPages<uint64_t>(
-      ByteSizeToPageSize(map_info.data.GetMapSize())));
+  // Place segments on the memory near to the CPU which loads the process.
+  // The scheduler picks the CPU to run it later and may migrate it, so this
+  // is only a guess.
+  auto& dram_allocator = GetSystemDRAMAllocator();
+  const uint32_t prox_domain = dram_allocator.GetLocalProximityDomain();
+  map_info.code.SetPhysAddr(
+      dram_allocator.AllocPagesNearProximityDomain<uint64_t>(
+          ByteSizeToPageSize(map_info.code.GetMapSize()), prox_domain));
+  map_info.data.SetPhysAddr(
+      dram_allocator.AllocPagesNearProximityDomain<uint64_t>(
+          ByteSizeToPageSize(map_info.data.GetMapSize()), prox_domain));
 
   const int kNumOfStackPages = 32;
-  map_info.stack.Set(
-      0xBEEF'0000,
-      GetSystemDRAMAllocator().AllocPages<uint64_t>(kNumOfStackPages),
-      kNumOfStackPages << kPageSizeExponent);
+  map_info.stack.Set(0xBEEF'0000,
+                     dram_allocator.AllocPagesNearProximityDomain<uint64_t>(
+                         kNumOfStackPages, prox_domain),
+                     kNumOfStackPages << kPageSizeExponent);
 
   if (liumos->debug_mode_enabled) {
     map_info.Print();
@@ -197,7 +204,7 @@ Process& LoadELFAndCreateEphemeralProcess(EFIFile& file) {
                    reinterpret_cast<uint64_t>(&user_page_table),
                    kRFlagsInterruptEnable, kernel_stack_pointer);
   Process& proc = liumos->proc_ctrl->Create();
-  proc.InitAsEphemeralProcess(ctx);
+  proc.InitAsEphemeralUserProcess(ctx);
   return proc;
 }
 
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "generic.h"
+
+// File descriptors of a process.
+// Each descriptor is an index of a dense array of entries, so looking up an
+// object from a descriptor takes constant time. Free descriptors are tracked
+// by a bitmap and the lowest one is allocated first, as POSIX requires.
+// Only the owner process and the reaper of it touch the table, so it has no
+// lock.
+class FileDescriptorTable {
+ public:
+  static constexpr int kMaxNumOfFileDescriptors = 256;
+  // 0, 1 and 2 are the console and not in the table.
+  static constexpr int kNumOfReservedFileDescriptors = 3;
+  enum class Type : uint8_t {
+    kNone,
+    kSocket,
+    kTCPSocket,
+    kEventPoll,
+  };
+  // File status flags of fcntl(2). Same value as Linux.
+  static constexpr int kStatusFlagNonBlock = 04000;  // O_NONBLOCK
+  struct Entry {
+    Type type;
+    int status_flags;
+    void* object;
+  };
+
+  constexpr FileDescriptorTable() : entries_{}, used_bitmap_{} {}
+  // Returns -1 if all descriptors are in use.
+  int Alloc(Type type, void* object) {
+    assert(type != Type::kNone);
+    assert(object);
+    const int fd = FindNext(kNumOfReservedFileDescriptors, false);
+    if (fd < 0)
+      return -1;
+    SetUsed(fd, true);
+    entries_[fd] = {type, 0, object};
+    return fd;
+  }
+  // Returns nullptr if fd is not open or does not refer to an object of type.
+  void* Get(int fd, Type type) const {
+    if (fd < 0 || fd >= kMaxNumOfFileDescriptors)
+      return nullptr;
+    const Entry& entry = entries_[fd];
+    return entry.type == type ? entry.object : nullptr;
+  }
+  // Returns -1 if fd is not open. New descriptors have no flags.
+  int GetStatusFlags(int fd) const {
+    if (fd < 0 || fd >= kMaxNumOfFileDescriptors ||
+        entries_[fd].type == Type::kNone)
+      return -1;
+    return entries_[fd].status_flags;
+  }
+  // Returns true if fd is not open.
+  bool SetStatusFlags(int fd, int flags) {
+    if (fd < 0 || fd >= kMaxNumOfFileDescriptors ||
+        entries_[fd].type == Type::kNone)
+      return true;
+    entries_[fd].status_flags = flags;
+    return false;
+  }
+  // Removes fd from the table and returns the entry which it referred to.
+  // The type of the returned entry is kNone if fd was not open.
+  Entry Free(int fd) {
+    if (fd < 0 || fd >= kMaxNumOfFileDescriptors ||
+        entries_[fd].type == Type::kNone)
+      return {Type::kNone, 0, nullptr};
+    const Entry entry = entries_[fd];
+    entries_[fd] = {Type::kNone, 0, nullptr};
+    SetUsed(fd, false);
+    return entry;
+  }
+  // Returns the lowest open descriptor not less than fd, or -1 if none.
+  int FindNextOpen(int fd) const { return FindNext(fd, true); }
+
+ private:
+  static constexpr int kBitsPerWord = 64;
+  static constexpr int kNumOfWords = kMaxNumOfFileDescriptors / kBitsPerWord;
+  static_assert(kMaxNumOfFileDescriptors % kBitsPerWord == 0);
+
+  void SetUsed(int fd, bool is_used) {
+    const uint64_t bit = 1ULL << (fd % kBitsPerWord);
+    if (is_used)
+      used_bitmap_[fd / kBitsPerWord] |= bit;
+    else
+      used_bitmap_[fd / kBitsPerWord] &= ~bit;
+  }
+  int FindNext(int fd, bool is_used) const {
+    if (fd < 0)
+      fd = 0;
+    for (int i = fd / kBitsPerWord; i < kNumOfWords; i++) {
+      uint64_t word = is_used ? used_bitmap_[i] : ~used_bitmap_[i];
+      if (i == fd / kBitsPerWord)
+        word &= ~0ULL << (fd % kBitsPerWord);
+      if (word)
+        return i * kBitsPerWord + __builtin_ctzll(word);
+    }
+    return -1;
+  }
+
+  Entry entries_[kMaxNumOfFileDescriptors];
+  uint64_t used_bitmap_[kNumOfWords];  // Bit n is set if n is open.
+};
@@ -0,0 +1,87 @@
+#include "file_descriptor.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+using Type = FileDescriptorTable::Type;
+
+static void TestAllocLowestFirst() {
+  FileDescriptorTable fdt;
+  int objects[4];
+  assert(fdt.FindNextOpen(0) == -1);
+  const int fd0 = fdt.Alloc(Type::kSocket, &objects[0]);
+  const int fd1 = fdt.Alloc(Type::kSocket, &objects[1]);
+  const int fd2 = fdt.Alloc(Type::kSocket, &objects[2]);
+  assert(fd0 == FileDescriptorTable::kNumOfReservedFileDescriptors);
+  assert(fd1 == fd0 + 1);
+  assert(fd2 == fd0 + 2);
+  assert(fdt.Get(fd1, Type::kSocket) == &objects[1]);
+  assert(!fdt.Get(fd1, Type::kNone));
+  assert(!fdt.Get(0, Type::kSocket));
+  assert(!fdt.Get(-1, Type::kSocket));
+  assert(!fdt.Get(FileDescriptorTable::kMaxNumOfFileDescriptors,
+                  Type::kSocket));
+
+  FileDescriptorTable::Entry entry = fdt.Free(fd1);
+  assert(entry.type == Type::kSocket);
+  assert(entry.object == &objects[1]);
+  assert(!fdt.Get(fd1, Type::kSocket));
+  assert(fdt.Free(fd1).type == Type::kNone);
+  // The lowest free descriptor is reused.
+  assert(fdt.Alloc(Type::kSocket, &objects[3]) == fd1);
+  assert(fdt.Get(fd1, Type::kSocket) == &objects[3]);
+}
+
+static void TestStatusFlags() {
+  FileDescriptorTable fdt;
+  int object;
+  constexpr int kNonBlock = FileDescriptorTable::kStatusFlagNonBlock;
+  const int fd = fdt.Alloc(Type::kSocket, &object);
+  assert(fdt.GetStatusFlags(fd) == 0);
+  assert(!fdt.SetStatusFlags(fd, kNonBlock));
+  assert(fdt.GetStatusFlags(fd) == kNonBlock);
+  // Closed and reserved descriptors have no flags.
+  assert(fdt.GetStatusFlags(fd + 1) == -1);
+  assert(fdt.SetStatusFlags(fd + 1, kNonBlock));
+  assert(fdt.GetStatusFlags(0) == -1);
+  assert(fdt.SetStatusFlags(-1, kNonBlock));
+  // A reused descriptor does not inherit the flags.
+  fdt.Free(fd);
+  assert(fdt.Alloc(Type::kSocket, &object) == fd);
+  assert(fdt.GetStatusFlags(fd) == 0);
+}
+
+static void TestFull() {
+  static FileDescriptorTable fdt;
+  int object;
+  constexpr int kNumOfAllocatable =
+      FileDescriptorTable::kMaxNumOfFileDescriptors -
+      FileDescriptorTable::kNumOfReservedFileDescriptors;
+  for (int i = 0; i < kNumOfAllocatable; i++)
+    assert(fdt.Alloc(Type::kSocket, &object) >= 0);
+  assert(fdt.Alloc(Type::kSocket, &object) == -1);
+  assert(fdt.Free(100).type == Type::kSocket);
+  assert(fdt.Alloc(Type::kSocket, &object) == 100);
+
+  // Iterates over all open descriptors while closing them.
+  int num_of_closed = 0;
+  for (int fd = fdt.FindNextOpen(0); fd >= 0; fd = fdt.FindNextOpen(fd + 1)) {
+    assert(fdt.Free(fd).type == Type::kSocket);
+    num_of_closed++;
+  }
+  assert(num_of_closed == kNumOfAllocatable);
+  assert(fdt.FindNextOpen(0) == -1);
+}
+
+int main() {
+  TestAllocLowestFirst();
+  TestStatusFlags();
+  TestFull();
+  puts("PASS");
+  return 0;
+}
+
+#endif
@@ -69,18 +69,6 @@ uint64_t HPET::ReadMainCounterValue() {
   return GetKernelVirtAddrForPhysAddr(registers_)->main_counter_value;
 }
 
-void HPET::BusyWait(uint64_t ms) {
-  uint64_t count = 1'000'000'000'000ULL * ms / femtosecond_per_count_ +
-                   ReadMainCounterValue();
-  while (ReadMainCounterValue() < count)
-    Sleep();
-}
-void HPET::BusyWaitMicroSecond(uint64_t microsec) {
-  uint64_t count = 1'000'000'000ULL * microsec / femtosecond_per_count_ +
-                   ReadMainCounterValue();
-  while (ReadMainCounterValue() < count)
-    Sleep();
-}
 uint64_t HPET::GetFemtosecondPerCount() {
   return femtosecond_per_count_;
 }
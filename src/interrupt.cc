@@ -40,10 +40,12 @@ void IDT::IntHandler(uint64_t intcode, InterruptInfo* info) {
   }
   auto& pp = PanicPrinter::BeginPanic();
   PrintInterruptInfo(pp, intcode, info);
+#ifndef LIUMOS_LOADER
   if (liumos->is_multi_task_enabled) {
     Process& proc = liumos->scheduler->GetCurrentProcess();
     pp.PrintLineWithHex("Context#", proc.GetID());
   }
+#endif
   if (intcode == 0x08) {
     pp.EndPanicAndDie("Double Fault");
   }
@@ -131,12 +133,15 @@ void IDT::Init() {
   idt_->InitInternal();
 }
 
-void IDT::InitInternal() {
-  uint16_t cs = ReadCSSelector();
-
+void IDT::Load() {
   IDTR idtr;
   idtr.limit = sizeof(descriptors_) - 1;
   idtr.base = descriptors_;
+  WriteIDTR(&idtr);
+}
+
+void IDT::InitInternal() {
+  uint16_t cs = ReadCSSelector();
 
   for (int i = 0; i < 0x100; i++) {
     SetEntry(i, cs, 1, IDTType::kInterruptGate, 0, AsmIntHandlerNotImplemented);
@@ -159,5 +164,9 @@ void IDT::InitInternal() {
   SetEntry(0x20, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler20);
   SetEntry(0x21, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler21);
   SetEntry(0x22, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler22);
-  WriteIDTR(&idtr);
+  SetEntry(0x23, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler23);
+  SetEntry(0x24, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler24);
+  SetEntry(0x30, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler30);
+  SetEntry(0x31, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler31);
+  Load();
 }
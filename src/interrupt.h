@@ -14,6 +14,8 @@ class IDT {
     return *idt_;
   }
   static void Init();
+  // Loads the IDT on the current processor. Init() does this for the BSP.
+  void Load();
 
  private:
   static IDT* idt_;
@@ -5,24 +5,25 @@
 #include <functional>
 #include <vector>
 
+#include "clock_source.h"
 #include "corefunc.h"
 #include "liumos.h"
+#include "network.h"
 #include "panic_printer.h"
 #include "pci.h"
 #include "ps2_mouse.h"
 #include "rtl81xx.h"
+#include "timer.h"
 #include "virtio_net.h"
 #include "xhci.h"
 
 LiumOS* liumos;
 
-GDT gdt_;
 KeyboardController keyboard_ctrl_;
 LiumOS liumos_;
 Sheet virtual_vram_;
 Sheet virtual_screen_;
 Console virtual_console_;
-LocalAPIC bsp_local_apic_;
 CPUFeatureSet cpu_features_;
 SerialPort com1_;
 SerialPort com2_;
@@ -35,6 +36,8 @@ uint64_t GetKernelStraightMappingBase() {
 void kprintf(const char* fmt, ...) {
   constexpr int kSizeOfBuffer = 4096;
   static char buf[kSizeOfBuffer];
+  static SpinLock lock;  // for buf
+  lock.Lock();
   va_list args;
   va_start(args, fmt);
   int len = vsnprintf(buf, sizeof(buf), fmt, args);
@@ -44,6 +47,7 @@ void kprintf(const char* fmt, ...) {
   }
   PutString(buf);
   va_end(args);
+  lock.Unlock();
 }
 
 void kprintbuf(const char* desc,
@@ -119,7 +123,7 @@ void InitializeVRAMForKernel() {
   liumos->screen_sheet = &virtual_screen_;
 }
 
-void CreateAndLaunchKernelTask(void (*entry_point)()) {
+static Process& CreateKernelTask(void (*entry_point)()) {
   const int kNumOfStackPages = 64;
   void* sub_context_stack_base =
       liumos->kernel_heap_allocator->AllocPages<void*>(kNumOfStackPages);
@@ -140,9 +144,23 @@ void CreateAndLaunchKernelTask(void (*entry_point)()) {
 
   Process& proc = liumos->proc_ctrl->Create();
   proc.InitAsEphemeralProcess(sub_context);
+  return proc;
+}
+
+void CreateAndLaunchKernelTask(void (*entry_point)(), int cpu = 0) {
+  // Kernel tasks are pinned to the processor where the interrupts of their
+  // devices are delivered, which is the BSP for most devices.
+  Process& proc = CreateKernelTask(entry_point);
+  proc.SetAffinity(cpu);
   liumos->scheduler->RegisterProcess(proc);
 }
 
+static void IdleTask() {
+  while (1) {
+    StoreIntFlagAndHalt();
+  }
+}
+
 static void EnsureAddrIs16ByteAligned(Process& from,
                                       Process& to,
                                       const char* label,
@@ -158,17 +176,13 @@ static void EnsureAddrIs16ByteAligned(Process& from,
 void SwitchContext(InterruptInfo& int_info,
                    Process& from_proc,
                    Process& to_proc) {
-  static uint64_t proc_last_time_count = 0;
-  const uint64_t now_count = HPET::GetInstance().ReadMainCounterValue();
-  if ((proc_last_time_count - now_count) < liumos->time_slice_count)
-    return;
-
-  from_proc.AddProcTimeFemtoSec(
-      (HPET::GetInstance().ReadMainCounterValue() - proc_last_time_count) *
-      HPET::GetInstance().GetFemtosecondPerCount());
+  CPU& cpu = GetCurrentCPU();
+  const uint64_t now_fs = NowFs();
+  from_proc.AddProcTimeFemtoSec(now_fs - cpu.last_switch_fs);
+  cpu.last_switch_fs = now_fs;
 
   CPUContext& from = from_proc.GetExecutionContext().GetCPUContext();
-  const uint64_t t0 = HPET::GetInstance().ReadMainCounterValue();
+  const uint64_t t0 = NowFs();
 
   EnsureAddrIs16ByteAligned(from_proc, to_proc, "int_info.fpu_context",
                             &int_info.fpu_context);
@@ -177,9 +191,7 @@ void SwitchContext(InterruptInfo& int_info,
   from.greg = int_info.greg;
   from.int_ctx = int_info.int_ctx;
   from_proc.NotifyContextSaving();
-  const uint64_t t1 = HPET::GetInstance().ReadMainCounterValue();
-  from_proc.AddTimeConsumedInContextSavingFemtoSec(
-      (t1 - t0) * HPET::GetInstance().GetFemtosecondPerCount());
+  from_proc.AddTimeConsumedInContextSavingFemtoSec(NowFs() - t0);
 
   CPUContext& to = to_proc.GetExecutionContext().GetCPUContext();
   int_info.greg = to.greg;
@@ -187,24 +199,29 @@ void SwitchContext(InterruptInfo& int_info,
   if (from.cr3 == to.cr3)
     return;
   WriteCR3(to.cr3);
-  // TODO: Investigate why this line causes #GP on pi.bin
-  // maybe ReadMainCounterValue accesses physical addr with
-  // user pagetable?
-  // proc_last_time_count = HPET::GetInstance().ReadMainCounterValue();
 }
 
 __attribute__((ms_abi)) extern "C" void SleepHandler(uint64_t,
                                                      InterruptInfo* info) {
   Process& proc = liumos->scheduler->GetCurrentProcess();
   Process* next_proc = liumos->scheduler->SwitchProcess();
-  if (!next_proc)
-    return;  // no need to switching context.
-  assert(info);
-  SwitchContext(*info, proc, *next_proc);
+  if (next_proc) {
+    assert(info);
+    SwitchContext(*info, proc, *next_proc);
+    liumos->scheduler->FinishSwitch(proc);
+  }
+  ProgramNextTimerInterrupt(next_proc != nullptr);
 }
 
 void TimerHandler(uint64_t, InterruptInfo* info) {
-  liumos->bsp_local_apic->SendEndOfInterrupt();
+  GetCurrentCPU().local_apic.SendEndOfInterrupt();
+  HandleTimerInterrupt();
+  SleepHandler(0, info);
+}
+
+void RescheduleHandler(uint64_t, InterruptInfo* info) {
+  GetCurrentCPU().local_apic.SendEndOfInterrupt();
+  HandleRescheduleInterrupt();
   SleepHandler(0, info);
 }
 
@@ -223,6 +240,14 @@ LoaderInfo& GetLoaderInfo() {
   return *loader_info_;
 }
 
+void* AllocKernelObjectMemory(uint64_t byte_size) {
+  return liumos->kernel_slab_allocator->Alloc(byte_size);
+}
+
+void FreeKernelObjectMemory(void* p) {
+  liumos->kernel_slab_allocator->Free(p);
+}
+
 KernelPhysPageAllocator& GetKernelPhysPageAllocator() {
   return *reinterpret_cast<KernelPhysPageAllocator*>(
       reinterpret_cast<uint64_t>(&GetSystemDRAMAllocator()) +
@@ -242,23 +267,29 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   KernelVirtualHeapAllocator kernel_heap_allocator(GetKernelPML4(),
                                                    kernel_phys_page_allocator);
   liumos->kernel_heap_allocator = &kernel_heap_allocator;
+  KernelSlabAllocator kernel_slab_allocator(kernel_heap_allocator);
+  liumos->kernel_slab_allocator = &kernel_slab_allocator;
 
   Disable8259PIC();
-  bsp_local_apic_.Init();
+  InitBootProcessor();
+  kernel_phys_page_allocator.SetLocalProximityDomainGetter(
+      GetProximityDomainOfCurrentCPU);
 
-  InitIOAPIC(bsp_local_apic_.GetID());
+  InitIOAPIC(liumos->bsp_local_apic->GetID());
 
   HPET& hpet = HPET::GetInstance();
   hpet.Init(static_cast<HPET::RegisterSpace*>(
       liumos->acpi.hpet->base_address.address));
-  hpet.SetTimerNs(
-      0, 1000,
-      HPET::TimerConfig::kUsePeriodicMode | HPET::TimerConfig::kEnable);
-  liumos->time_slice_count = 1e12 * 100 / hpet.GetFemtosecondPerCount();
 
   cpu_features_ = *liumos->cpu_features;
   liumos->cpu_features = &cpu_features_;
 
+  InitClockSource();
+  InitTimer();
+
+  Network::InternetChecksum::UseVectorSum(
+      GetBit<CPUFeatureIndex::kSSE2>(liumos->cpu_features->features));
+
   InitializeVRAMForKernel();
 
   new (&virtual_console_) Console();
@@ -275,7 +306,7 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   PanicPrinter::Init(liumos->kernel_heap_allocator->Alloc<PanicPrinter>(),
                      virtual_vram_, com2_);
 
-  bsp_local_apic_.Init();
+  liumos->bsp_local_apic->Init();
 
   ProcessController proc_ctrl_(kernel_heap_allocator);
   liumos->proc_ctrl = &proc_ctrl_;
@@ -294,6 +325,7 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   liumos->root_process->InitAsEphemeralProcess(root_context);
   Scheduler scheduler_(*liumos->root_process);
   liumos->scheduler = &scheduler_;
+  scheduler_.InitCPU(0, CreateKernelTask(IdleTask));
   liumos->is_multi_task_enabled = true;
 
   int idx = GetLoaderInfo().FindFile("LIUMOS.ELF");
@@ -342,25 +374,33 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   uint64_t ist1_virt_base =
       kernel_heap_allocator.AllocPages<uint64_t>(kNumOfKernelStackPages);
 
-  gdt_.Init(kernel_stack_pointer,
-            ist1_virt_base + (kNumOfKernelStackPages << kPageSizeExponent));
+  GetCPU(0).gdt.Init(
+      kernel_stack_pointer,
+      ist1_virt_base + (kNumOfKernelStackPages << kPageSizeExponent));
   IDT::Init();
   keyboard_ctrl_.Init();
 
   PS2MouseController& mouse_ctrl = PS2MouseController::GetInstance();
   mouse_ctrl.Init();
 
-  IDT::GetInstance().SetIntHandler(0x20, TimerHandler);
+  IDT::GetInstance().SetIntHandler(kTimerVector, TimerHandler);
+  IDT::GetInstance().SetIntHandler(kRescheduleVector, RescheduleHandler);
+  IDT::GetInstance().SetIntHandler(kTLBShootdownVector, TLBShootdownHandler);
 
   PCI& pci = PCI::GetInstance();
   pci.DetectDevices();
 
   // CreateAndLaunchKernelTask(SubTask);
-  CreateAndLaunchKernelTask(NetworkManager);
   CreateAndLaunchKernelTask(MouseManager);
 
   EnableSyscall();
 
+  StartApplicationProcessors();
+
+  // Each processor serves its own RX queue of virtio-net.
+  for (int i = 0; i < GetNumOfCPUs(); i++)
+    CreateAndLaunchKernelTask(NetworkManager, i);
+
   StoreIntFlag();
 
   // XHCI::Controller::GetInstance().Init();
@@ -26,6 +26,13 @@ T AllocKernelMemory(uint64_t byte_size) {
       ByteSizeToPageSize(byte_size));
 }
 
+template <typename T>
+T* AllocKernelObject() {
+  // Returns a memory region for an object of T from the kernel slab
+  // allocator. Construct the object with placement new.
+  return reinterpret_cast<T*>(AllocKernelObjectMemory(sizeof(T)));
+}
+
 template <typename T>
 T AllocMemoryForMappedIO(uint64_t byte_size) {
   uint64_t num_of_pages = ByteSizeToPageSize(byte_size);
@@ -34,8 +41,25 @@ T AllocMemoryForMappedIO(uint64_t byte_size) {
       num_of_pages, kPageAttrMemMappedIO);
 }
 
+template <typename T>
+void FreeMemoryForMappedIO(T addr, uint64_t byte_size) {
+  // addr and byte_size should be the same as the ones for
+  // AllocMemoryForMappedIO.
+  uint64_t num_of_pages = ByteSizeToPageSize(byte_size);
+  uint64_t paddr = v2p(addr);
+  liumos->kernel_heap_allocator->UnmapPages(addr, num_of_pages);
+  GetKernelPhysPageAllocator().FreePages(paddr, num_of_pages);
+}
+
 template <typename T>
 T MapMemoryForIO(uint64_t phys_addr, uint64_t byte_size) {
   return liumos->kernel_heap_allocator->MapPages<T>(
       phys_addr, ByteSizeToPageSize(byte_size), kPageAttrMemMappedIO);
 }
+
+template <typename T>
+void UnmapMemoryForIO(T addr, uint64_t byte_size) {
+  // addr and byte_size should be the same as the ones for MapMemoryForIO.
+  liumos->kernel_heap_allocator->UnmapPages(addr,
+                                            ByteSizeToPageSize(byte_size));
+}
@@ -1,14 +1,19 @@
 #pragma once
 
+#include "asm.h"
 #include "generic.h"
 #include "paging.h"
 #include "phys_page_allocator.h"
+#include "slab_allocator.h"
+#include "smp.h"
+#include "spin_lock.h"
+#include "virtual_range_allocator.h"
 
 class KernelVirtualHeapAllocator {
  public:
   KernelVirtualHeapAllocator(IA_PML4& pml4,
                              KernelPhysPageAllocator& dram_allocator)
-      : next_base_(kKernelHeapBaseAddr),
+      : virtual_ranges_(kKernelHeapBaseAddr, kKernelHeapSize),
         pml4_(pml4),
         dram_allocator_(dram_allocator){};
   template <typename T>
@@ -20,17 +25,44 @@ class KernelVirtualHeapAllocator {
         GetKernelStraightMappingBase());
   }
   template <typename T>
+  void FreePages(T addr, uint64_t num_of_pages) {
+    // addr should be a value returned from AllocPages.
+    dram_allocator_.FreePages(
+        reinterpret_cast<uint64_t>(addr) - GetKernelStraightMappingBase(),
+        num_of_pages);
+  }
+  template <typename T>
   T MapPages(uint64_t paddr, uint64_t num_of_pages, uint64_t page_attr) {
     uint64_t byte_size = (num_of_pages << kPageSizeExponent);
-    if (byte_size > kKernelHeapSize ||
-        next_base_ + byte_size > kKernelHeapBaseAddr + kKernelHeapSize)
+    if (byte_size > kKernelHeapSize)
+      Panic("Cannot allocate kernel virtual heap");
+    lock_.Lock();
+    // One more page is reserved as a guard page.
+    uint64_t vaddr = virtual_ranges_.Alloc(byte_size + kPageSize);
+    if (!vaddr)
       Panic("Cannot allocate kernel virtual heap");
-    uint64_t vaddr = next_base_;
-    next_base_ += byte_size + (1 << kPageSizeExponent);
     CreatePageMapping(dram_allocator_, pml4_, vaddr, paddr, byte_size,
                       page_attr);
+    lock_.Unlock();
     return reinterpret_cast<T>(vaddr);
   }
+  template <typename T>
+  void UnmapPages(T addr, uint64_t num_of_pages) {
+    // addr and num_of_pages should be the same as the ones for MapPages.
+    // Physical pages are not freed. Should be called with interrupts
+    // enabled, since it waits for other processors to flush their TLBs.
+    uint64_t vaddr = reinterpret_cast<uint64_t>(addr);
+    uint64_t byte_size = (num_of_pages << kPageSizeExponent);
+    lock_.Lock();
+    RemovePageMapping(pml4_, vaddr, byte_size);
+    lock_.Unlock();
+    // The range is reused only after no processor can access it through
+    // stale TLB entries.
+    FlushTLBOfAllCPUs();
+    lock_.Lock();
+    virtual_ranges_.Free(vaddr, byte_size + kPageSize);
+    lock_.Unlock();
+  }
 
   template <typename T>
   T* Alloc() {
@@ -38,11 +70,18 @@ class KernelVirtualHeapAllocator {
     // mapping). This function is safe to be called under a user mappings.
     return AllocPages<T*>(ByteSizeToPageSize(sizeof(T)));
   }
+  template <typename T>
+  void Free(T* p) {
+    // p should be a value returned from Alloc<T>.
+    FreePages(p, ByteSizeToPageSize(sizeof(T)));
+  }
 
  private:
   static constexpr uint64_t kKernelHeapBaseAddr = 0xFFFF'FFFF'9000'0000;
   static constexpr uint64_t kKernelHeapSize = 0x0000'0000'4000'0000;
-  uint64_t next_base_;
+  VirtualRangeAllocator virtual_ranges_;
   IA_PML4& pml4_;
   KernelPhysPageAllocator& dram_allocator_;
+  SpinLock lock_;  // Protects the virtual ranges and pml4_.
 };
+using KernelSlabAllocator = SlabAllocator<KernelVirtualHeapAllocator>;
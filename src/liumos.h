@@ -23,6 +23,7 @@
 #include "serial.h"
 #include "sheet.h"
 #include "sheet_painter.h"
+#include "smp.h"
 #include "sys_constant.h"
 #include "text_box.h"
 
@@ -77,15 +78,18 @@ packed_struct LiumOS {
   LocalAPIC* bsp_local_apic;
   CPUFeatureSet* cpu_features;
   KernelVirtualHeapAllocator* kernel_heap_allocator;
+  KernelSlabAllocator* kernel_slab_allocator;
   EFI::MemoryMap* efi_memory_map;
   IA_PML4* kernel_pml4;
   Scheduler* scheduler;
   ProcessController* proc_ctrl;
   Process* root_process;
-  uint64_t time_slice_count;
+  uint64_t time_slice_ns;
   bool is_multi_task_enabled;
   bool debug_mode_enabled;
   uint64_t direct_mapping_end_phys;
+  // A page below 1MiB for the boot code of application processors.
+  uint64_t ap_boot_code_phys_addr;
 };
 extern LiumOS* liumos;
 
@@ -100,3 +104,6 @@ void MainForBootProcessor(void* image_handle, EFI::SystemTable* system_table);
 
 // @syscall.cc
 void EnableSyscall();
+void CloseFileDescriptor(Process& proc, int fd);
+// Called when proc is reaped.
+void CloseAllFileDescriptors(Process& proc);
@@ -53,6 +53,10 @@ void InitDRAMManagement(EFI::MemoryMap& map) {
     available_pages += desc->number_of_pages;
     FreePages(dram_allocator, desc->physical_start, desc->number_of_pages);
   }
+  if (liumos->acpi.slit) {
+    ACPI::SLIT& slit = *liumos->acpi.slit;
+    dram_allocator->SetDistanceTable(slit.entry, slit.num_of_system_localities);
+  }
   PutStringAndHex("Available DRAM (KiB)", available_pages * 4);
   GetLoaderInfo().dram_allocator = dram_allocator;
 }
@@ -79,6 +83,7 @@ void IdentifyCPU() {
   f.features |= ((cpuid.ecx >> 27) & 1) << CPUFeatureIndex::kOSXSAVE;
   f.features |= ((cpuid.edx >> 9) & 1) << CPUFeatureIndex::kAPIC;
   f.features |= ((cpuid.edx >> 24) & 1) << CPUFeatureIndex::kFXSR;
+  f.features |= ((cpuid.edx >> 26) & 1) << CPUFeatureIndex::kSSE2;
   if (!(cpuid.edx & kCPUID01H_EDXBitAPIC))
     Panic("APIC not supported");
   if (!(cpuid.edx & kCPUID01H_EDXBitMSR))
@@ -105,6 +110,11 @@ void IdentifyCPU() {
     }
   }
 
+  if (CPUIDIndex::kAdvancedPowerManagement <= f.max_extended_cpuid) {
+    ReadCPUID(&cpuid, CPUIDIndex::kAdvancedPowerManagement, 0);
+    f.features |= ((cpuid.edx >> 8) & 1) << CPUFeatureIndex::kInvariantTSC;
+  }
+
   if (CPUIDIndex::kMaxAddr <= f.max_extended_cpuid) {
     ReadCPUID(&cpuid, CPUIDIndex::kMaxAddr, 0);
     IA32_MaxPhyAddr maxaddr;
@@ -148,6 +158,11 @@ void MainForBootProcessor(EFI::Handle image_handle,
   loader_info.root_files_used =
       efi_.LoadRootFiles(loader_info.root_files, kNumOfRootFiles);
 
+  // Boot code for APs should be placed below 1MiB since they start in real
+  // mode.
+  liumos->ap_boot_code_phys_addr = reinterpret_cast<uint64_t>(
+      efi_.AllocatePagesBelow(1, 0x100000 - 1));
+
   efi_.GetMemoryMapAndExitBootServices(image_handle, efi_memory_map);
   liumos->efi_memory_map = &efi_memory_map;
 
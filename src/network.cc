@@ -1,7 +1,11 @@
 #include "network.h"
+#include "clock_source.h"
 #include "kernel.h"
 #include "liumos.h"
-#include "virtio_net.h"
+#include "nic.h"
+#include "smp.h"
+#include "tcp.h"
+#include "timer.h"
 
 void Network::IPv4Addr::Print() const {
   for (int i = 0; i < 4; i++) {
@@ -39,29 +43,749 @@ Network& Network::GetInstance() {
   return *network_;
 }
 
+bool Network::AttachNIC(NIC& nic) {
+  lock_.Lock();
+  const bool is_used = nic_;
+  if (!is_used)
+    nic_ = &nic;
+  lock_.Unlock();
+  if (is_used)
+    return true;
+  // NetworkManager may be waiting for a NIC.
+  nic_wait_queue_.WakeAll();
+  SendDHCPRequest();
+  return false;
+}
+
+NIC& Network::WaitForNIC() {
+  nic_wait_queue_.WaitUntil([this] { return HasNIC(); });
+  return *nic_;
+}
+
+Network::Socket* Network::CreateSocket(uint64_t pid, Socket::Type type) {
+  Socket* socket = new (AllocKernelObject<Socket>()) Socket(pid, type);
+  bool failed = false;
+  lock_.Lock();
+  if (type == Socket::Type::kUDP) {
+    // Unbound sockets are given a port to receive replies.
+    socket->listen_port = AllocEphemeralPortLocked(IPv4Packet::Protocol::kUDP);
+    failed = !socket->listen_port;
+    if (!failed)
+      socket_by_port_[PortKey(IPv4Packet::Protocol::kUDP,
+                              socket->listen_port)] = socket;
+  }
+  if (!failed)
+    sockets_.push_back(socket);
+  lock_.Unlock();
+  if (failed) {
+    DestroySocket(*socket);
+    return nullptr;
+  }
+  return socket;
+}
+
+bool Network::BindToPort(Socket& socket, uint16_t port) {
+  lock_.Lock();
+  if (socket.type == Socket::Type::kUDP) {
+    if (!port) {
+      // Keeps the ephemeral port.
+      lock_.Unlock();
+      return false;
+    }
+    const uint32_t key = PortKey(IPv4Packet::Protocol::kUDP, port);
+    auto it = socket_by_port_.find(key);
+    if (it != socket_by_port_.end() && it->second != &socket) {
+      lock_.Unlock();
+      return true;
+    }
+    socket_by_port_.erase(
+        PortKey(IPv4Packet::Protocol::kUDP, socket.listen_port));
+    socket_by_port_[key] = &socket;
+  }
+  socket.listen_port = port;
+  lock_.Unlock();
+  return false;
+}
+
+void Network::CloseSocket(Socket& socket) {
+  lock_.Lock();
+  RemoveSocketLocked(socket);
+  lock_.Unlock();
+  DestroySocket(socket);
+}
+
+void Network::PrintSockets() {
+  static const char* kTypeNames[] = {"icmp-raw", "icmp-dgram", "udp"};
+  lock_.Lock();
+  for (auto it : sockets_) {
+    kprintf("pid %lu %s port %u: rx %lu, dropped %lu\n", it->pid,
+            kTypeNames[static_cast<int>(it->type)], it->listen_port,
+            it->num_of_rx_packets, it->num_of_rx_dropped);
+  }
+  kprintf("rx packets with no receiver: %lu\n", num_of_rx_unclaimed_);
+  lock_.Unlock();
+}
+
+uint16_t Network::AllocEphemeralPortLocked(IPv4Packet::Protocol protocol) {
+  constexpr int kNumOfPorts = kEphemeralPortLast - kEphemeralPortFirst + 1;
+  for (int i = 0; i < kNumOfPorts; i++) {
+    const uint16_t port = next_ephemeral_port_;
+    next_ephemeral_port_ =
+        port == kEphemeralPortLast ? kEphemeralPortFirst : port + 1;
+    if (!socket_by_port_.count(PortKey(protocol, port)))
+      return port;
+  }
+  return 0;
+}
+
+void Network::RemoveSocketLocked(Socket& socket) {
+  for (auto it = sockets_.begin(); it != sockets_.end(); it++) {
+    if (*it == &socket) {
+      sockets_.erase(it);
+      break;
+    }
+  }
+  if (socket.type == Socket::Type::kUDP) {
+    auto it = socket_by_port_.find(
+        PortKey(IPv4Packet::Protocol::kUDP, socket.listen_port));
+    if (it != socket_by_port_.end() && it->second == &socket)
+      socket_by_port_.erase(it);
+  }
+}
+
+void Network::DestroySocket(Socket& socket) {
+  // Releases the buffers of unread packets.
+  while (PacketBuffer* pbuf = socket.PopPacket())
+    pbuf->Unref();
+  if (socket.ring_memory) {
+    liumos->kernel_heap_allocator->FreePages(
+        socket.ring_memory, ByteSizeToPageSize(socket.ring_byte_size));
+  }
+  socket.~Socket();
+  FreeKernelObjectMemory(&socket);
+}
+
+using InternetChecksum = Network::InternetChecksum;
+using EtherFrame = Network::EtherFrame;
+using ARPPacket = Network::ARPPacket;
+using IPv4Packet = Network::IPv4Packet;
+using ICMPPacket = Network::ICMPPacket;
+using IPv4UDPPacket = Network::IPv4UDPPacket;
+using DHCPPacket = Network::DHCPPacket;
+
+void PrintARPPacket(ARPPacket& arp) {
+  switch (arp.GetOperation()) {
+    case ARPPacket::Operation::kRequest:
+      PutString("Who has ");
+      arp.target_proto_addr.Print();
+      PutString("? Tell ");
+      arp.sender_proto_addr.Print();
+      PutString(" at ");
+      arp.sender_eth_addr.Print();
+      PutChar('\n');
+      return;
+    case ARPPacket::Operation::kReply:
+      arp.sender_proto_addr.Print();
+      PutString(" is at ");
+      arp.sender_eth_addr.Print();
+      PutChar('\n');
+      return;
+    default:
+      break;
+  }
+  PutString("Recieved ARP with invalid Operation\n");
+}
+
+static bool ARPPacketHandler(uint8_t* frame_data, size_t frame_size) {
+  if (frame_size < sizeof(ARPPacket)) {
+    return false;
+  }
+  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
+  if (!eth.HasEthType(EtherFrame::kTypeARP)) {
+    return false;
+  }
+  ARPPacket& arp = *reinterpret_cast<ARPPacket*>(frame_data);
+  NIC& nic = Network::GetInstance().GetNIC();
+  if (arp.GetOperation() == ARPPacket::Operation::kReply) {
+    Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
+                                                 arp.sender_eth_addr);
+    return true;
+  }
+  if (arp.GetOperation() != ARPPacket::Operation::kRequest) {
+    return false;
+  }
+  if (!arp.target_proto_addr.IsEqualTo(nic.GetSelfIPv4Addr())) {
+    // This is ARP Request, but not a request to me
+    return true;
+  }
+  // The sender will talk to us soon (RFC 826 "Packet Reception").
+  Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
+                                               arp.sender_eth_addr);
+  // Reply to ARP
+  ARPPacket& reply = *nic.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
+  reply.SetupReply(arp.sender_proto_addr, nic.GetSelfIPv4Addr(),
+                   arp.sender_eth_addr, nic.GetSelfEtherAddr());
+  nic.SendPacket();
+  return true;
+}
+
+static void SendICMPEchoReply(const ICMPPacket& req, size_t req_frame_size) {
+  if (req_frame_size < sizeof(ICMPPacket)) {
+    return;
+  }
+  PutStringAndHex("req_frame_size", req_frame_size);
+  NIC& nic = Network::GetInstance().GetNIC();
+  // Reply to ARP
+  ICMPPacket& reply = *nic.GetNextTXPacketBuf<ICMPPacket*>(req_frame_size);
+  memcpy(&reply, &req, req_frame_size);
+  // Setup ICMP
+  reply.type = ICMPPacket::Type::kEchoReply;
+  reply.csum.Clear();
+  reply.csum = Network::InternetChecksum::Calc(
+      &reply, offsetof(ICMPPacket, type), req_frame_size);
+  // Setup IP
+  reply.ip.dst_ip = req.ip.src_ip;
+  reply.ip.src_ip = req.ip.dst_ip;
+  reply.ip.csum.Clear();
+  reply.ip.csum = Network::InternetChecksum::Calc(
+      &reply, offsetof(IPv4Packet, version_and_ihl), req_frame_size);
+  // Setup Eth
+  reply.ip.eth.dst = req.ip.eth.src;
+  reply.ip.eth.src = nic.GetSelfEtherAddr();
+  // Send
+  nic.SendPacket();
+  PutString("Reply sent!: ");
+
+  // UDP
+  const char* s = "Hello! This is liumOS. Are you there?\n";
+  uint16_t dst_port = 11111;
+  uint16_t packet_size =
+      static_cast<uint16_t>((sizeof(IPv4UDPPacket) + strlen(s) + 1) & ~1);
+  IPv4UDPPacket& p = *nic.GetNextTXPacketBuf<IPv4UDPPacket*>(packet_size);
+  char* data = reinterpret_cast<char*>(reinterpret_cast<uint8_t*>(&p) +
+                                       sizeof(IPv4UDPPacket));
+  memcpy(&p, &req, packet_size);
+  memcpy(data, s, strlen(s));
+  // Setup UDP
+  p.SetDestinationPort(dst_port);
+  p.SetSourcePort(12345);
+  p.SetDataSize(strlen(s));
+  p.csum.Clear();
+  p.csum = Network::CalcUDPChecksum(&p, offsetof(IPv4UDPPacket, src_port),
+                                    packet_size, req.ip.dst_ip, req.ip.src_ip,
+                                    p.length);
+  // Setup IP
+  p.ip.protocol = IPv4Packet::Protocol::kUDP;
+  p.ip.SetDataLength(packet_size - sizeof(IPv4Packet));
+  p.ip.dst_ip = req.ip.src_ip;
+  p.ip.src_ip = req.ip.dst_ip;
+  p.ip.csum.Clear();
+  p.ip.csum = Network::InternetChecksum::Calc(
+      &p, offsetof(IPv4Packet, version_and_ihl), sizeof(IPv4Packet));
+  // Setup Eth
+  p.ip.eth.dst = req.ip.eth.src;
+  p.ip.eth.src = nic.GetSelfEtherAddr();
+  // Send
+  nic.SendPacket();
+}
+
+static bool ICMPPacketHandler(IPv4Packet& p, size_t frame_size) {
+  if (p.protocol != IPv4Packet::Protocol::kICMP) {
+    return false;
+  }
+  if (frame_size < sizeof(ICMPPacket)) {
+    return false;
+  }
+  ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(&p);
+  if (icmp.type == ICMPPacket::Type::kEchoRequest) {
+    SendICMPEchoReply(icmp, frame_size);
+  }
+  return true;
+}
+
+static bool UDPPacketHandler(IPv4Packet& p, size_t frame_size) {
+  using IPv4Addr = Network::IPv4Addr;
+  using IPv4NetMask = Network::IPv4NetMask;
+  if (p.protocol != IPv4Packet::Protocol::kUDP) {
+    return false;
+  }
+  if (frame_size < sizeof(IPv4UDPPacket)) {
+    return false;
+  }
+  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(&p);
+  if (udp.GetDestinationPort() != 68) {
+    // Not a DHCP packet
+    return false;
+  }
+  DHCPPacket& dhcp = *reinterpret_cast<DHCPPacket*>(&p);
+  NIC& nic = Network::GetInstance().GetNIC();
+  Network& network = Network::GetInstance();
+  if (dhcp.op != 2 || !dhcp.chaddr.IsEqualTo(nic.GetSelfEtherAddr())) {
+    return false;
+  }
+  dhcp.yiaddr.Print();
+  kprintf(" is assigned by DHCP\n");
+  nic.SetSelfIPv4Addr(dhcp.yiaddr);
+  // https://tools.ietf.org/html/rfc2131
+  // 3. The Client-Server Protocol
+  if (dhcp.cookie[0] != 99 || dhcp.cookie[1] != 130 || dhcp.cookie[2] != 83 ||
+      dhcp.cookie[3] != 99) {
+    kprintf("Unexpected DHCP Option cookie\n");
+    return true;
+  }
+  uint8_t* buf = reinterpret_cast<uint8_t*>(&dhcp);
+  size_t i = sizeof(DHCPPacket);
+  while (i < frame_size) {
+    uint8_t option = buf[i];
+    uint8_t option_data_len = buf[i + 1];
+    if (option_data_len == 0) {
+      break;
+    }
+    if (option == 3) {
+      // Router
+      assert(option_data_len == 4);
+      IPv4Addr router_ip = *reinterpret_cast<IPv4Addr*>(&buf[i + 2]);
+      router_ip.Print();
+      kprintf(" is router\n");
+      network.SetIPv4DefaultGateway(router_ip);
+    }
+    if (option == 1) {
+      // Subnet Mask
+      assert(option_data_len == 4);
+      IPv4NetMask netmask = *reinterpret_cast<IPv4NetMask*>(&buf[i + 2]);
+      netmask.Print();
+      kprintf(" is netmask\n");
+      network.SetIPv4NetMask(netmask);
+    }
+    i += 2 + option_data_len;
+  }
+  return true;
+}
+
+static bool IPv4PacketHandler(uint8_t* frame_data, size_t frame_size) {
+  if (frame_size < sizeof(IPv4Packet)) {
+    return false;
+  }
+  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
+  if (!eth.HasEthType(EtherFrame::kTypeIPv4)) {
+    return false;
+  }
+  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame_data);
+  if (ICMPPacketHandler(p, frame_size)) {
+    return true;
+  }
+  if (UDPPacketHandler(p, frame_size)) {
+    return true;
+  }
+  return true;
+}
+
+void Network::HandleReceivedFrame(PacketBuffer& pbuf) {
+  uint8_t* frame_data = pbuf.GetData();
+  const size_t frame_size = pbuf.GetSize();
+  ARPPacketHandler(frame_data, frame_size) ||
+      IPv4PacketHandler(frame_data, frame_size);
+  DeliverPacket(pbuf);
+}
+
+static void ReleaseCopiedPacketBuffer(PacketBuffer& pbuf) {
+  pbuf.~PacketBuffer();
+  FreeKernelObjectMemory(&pbuf);
+}
+
+// Returns a reference to pbuf which a socket can keep until it is read. A
+// frame whose buffer should go back to the driver soon is copied into the
+// kernel heap, so that slow readers do not stop receiving for everyone.
+static PacketBuffer* KeepPacketBuffer(PacketBuffer& pbuf) {
+  if (pbuf.CanBeKept()) {
+    pbuf.Ref();
+    return &pbuf;
+  }
+  PacketBuffer* copy = new (AllocKernelObjectMemory(
+      sizeof(PacketBuffer) + pbuf.GetSize())) PacketBuffer();
+  uint8_t* data = reinterpret_cast<uint8_t*>(copy + 1);
+  memcpy(data, pbuf.GetData(), pbuf.GetSize());
+  copy->Init(data, pbuf.GetSize(), ReleaseCopiedPacketBuffer);
+  copy->SetChecksumValid(pbuf.IsChecksumValid());
+  copy->SetCanBeKept(true);
+  return copy;
+}
+
+void Network::DeliverPacketToSocketLocked(Socket& socket, PacketBuffer& pbuf) {
+  socket.lock.Lock();
+  if (socket.rx_ring.IsEnabled()) {
+    // Copied from the IP header as recvfrom(2) of raw sockets does, so pbuf
+    // goes back to the driver right after this.
+    const IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(pbuf.GetData());
+    uint32_t src_addr;
+    memcpy(&src_addr, ip.src_ip.addr, sizeof(src_addr));
+    if (socket.rx_ring.Push(pbuf.GetData() + sizeof(EtherFrame),
+                            pbuf.GetSize() - sizeof(EtherFrame), src_addr)) {
+      socket.num_of_rx_dropped++;
+    } else {
+      socket.num_of_rx_packets++;
+      socket.has_new_packets = true;
+    }
+  } else if (socket.rx_queue.IsFull()) {
+    socket.num_of_rx_dropped++;
+  } else {
+    socket.rx_queue.Push(KeepPacketBuffer(pbuf));
+    socket.num_of_rx_packets++;
+    socket.has_new_packets = true;
+  }
+  socket.lock.Unlock();
+}
+
+void Network::DeliverPacket(PacketBuffer& pbuf) {
+  const size_t frame_size = pbuf.GetSize();
+  if (frame_size < sizeof(IPv4Packet))
+    return;
+  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(pbuf.GetData());
+  if (!eth.HasEthType(EtherFrame::kTypeIPv4))
+    return;
+  IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(pbuf.GetData());
+  if (ip.protocol == IPv4Packet::Protocol::kTCP) {
+    // TCP copies the payload into the buffers of the connection.
+    TCP::GetInstance().HandleSegment(pbuf);
+    return;
+  }
+  bool is_claimed = false;
+  lock_.Lock();
+  if (ip.protocol == IPv4Packet::Protocol::kICMP) {
+    // Every ICMP socket receives a copy, as raw sockets do on Linux.
+    for (auto it : sockets_) {
+      if (it->type != Socket::Type::kICMPRaw &&
+          it->type != Socket::Type::kICMPDatagram)
+        continue;
+      DeliverPacketToSocketLocked(*it, pbuf);
+      is_claimed = true;
+    }
+  } else if (ip.protocol == IPv4Packet::Protocol::kUDP &&
+             frame_size >= sizeof(IPv4UDPPacket)) {
+    IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(pbuf.GetData());
+    auto it = socket_by_port_.find(
+        PortKey(IPv4Packet::Protocol::kUDP, udp.GetDestinationPort()));
+    if (it != socket_by_port_.end()) {
+      DeliverPacketToSocketLocked(*it->second, pbuf);
+      is_claimed = true;
+    }
+  }
+  if (!is_claimed)
+    num_of_rx_unclaimed_++;
+  lock_.Unlock();
+}
+
+void Network::NotifyRXPackets() {
+  lock_.Lock();
+  for (auto it : sockets_) {
+    if (!it->has_new_packets)
+      continue;
+    it->has_new_packets = false;
+    // Readers take only the lock of the socket in the wait condition.
+    it->rx_wait_queue.WakeAll();
+    it->poll_notifier.Notify();
+  }
+  lock_.Unlock();
+}
+
+Network::ARPEntry& Network::GetARPEntryLocked(IPv4Addr ip_addr, bool& is_new) {
+  auto result = arp_table_.try_emplace(ip_addr);
+  ARPEntry& entry = result.first->second;
+  is_new = result.second;
+  if (is_new) {
+    entry.state = ARPState::kIncomplete;
+    entry.num_of_requests = 1;
+    entry.deadline_ns = NowNs() + kARPRequestIntervalNs;
+    num_of_arp_requests_++;
+    ArmARPRequestTimerLocked();
+  }
+  return entry;
+}
+
+std::optional<Network::EtherAddr> Network::LookUpARPEntryLocked(
+    ARPEntry& entry) {
+  if (entry.state == ARPState::kIncomplete)
+    return std::nullopt;
+  entry.is_used = true;
+  return entry.eth_addr;
+}
+
+void Network::ArmARPRequestTimerLocked() {
+  if (is_arp_request_timer_armed_)
+    return;
+  is_arp_request_timer_armed_ = true;
+  AddTimer(arp_request_timer_, NowNs() + kARPRequestIntervalNs);
+}
+
+void Network::ArmARPExpiryTimerLocked(uint64_t deadline_ns) {
+  // An armed timer fires before deadline_ns since entries expire in the
+  // order of their resolution, and re-arms itself for the rest.
+  if (is_arp_expiry_timer_armed_)
+    return;
+  is_arp_expiry_timer_armed_ = true;
+  AddTimer(arp_expiry_timer_, deadline_ns);
+}
+
+void Network::HandleARPRequestTimer(Timer& timer) {
+  Network& network = *reinterpret_cast<Network*>(timer.GetData());
+  PendingFrame* dropped = nullptr;
+  bool has_unresolved = false;
+  network.lock_.Lock();
+  network.is_arp_request_timer_armed_ = false;
+  const uint64_t now_ns = NowNs();
+  for (auto it = network.arp_table_.begin(); it != network.arp_table_.end();) {
+    ARPEntry& entry = it->second;
+    if (entry.state != ARPState::kIncomplete &&
+        entry.state != ARPState::kProbe) {
+      ++it;
+      continue;
+    }
+    if (now_ns < entry.deadline_ns) {
+      has_unresolved = true;
+      ++it;
+      continue;
+    }
+    if (entry.num_of_requests >= kARPMaxRequests) {
+      // Nobody replied. Frames waiting for it are dropped.
+      if (entry.pending_tail) {
+        entry.pending_tail->next = dropped;
+        dropped = entry.pending_head;
+        network.num_of_arp_frames_dropped_ += entry.num_of_pending;
+      }
+      it = network.arp_table_.erase(it);
+      continue;
+    }
+    entry.num_of_requests++;
+    entry.deadline_ns = now_ns + kARPRequestIntervalNs;
+    network.num_of_arp_requests_++;
+    SendARPRequest(it->first);
+    has_unresolved = true;
+    ++it;
+  }
+  if (has_unresolved)
+    network.ArmARPRequestTimerLocked();
+  network.lock_.Unlock();
+  FreePendingFrames(dropped);
+}
+
+void Network::HandleARPExpiryTimer(Timer& timer) {
+  Network& network = *reinterpret_cast<Network*>(timer.GetData());
+  uint64_t next_deadline_ns = 0;
+  network.lock_.Lock();
+  network.is_arp_expiry_timer_armed_ = false;
+  const uint64_t now_ns = NowNs();
+  for (auto it = network.arp_table_.begin(); it != network.arp_table_.end();) {
+    ARPEntry& entry = it->second;
+    if (entry.state != ARPState::kReachable) {
+      ++it;
+      continue;
+    }
+    if (now_ns < entry.deadline_ns) {
+      if (!next_deadline_ns || entry.deadline_ns < next_deadline_ns)
+        next_deadline_ns = entry.deadline_ns;
+      ++it;
+      continue;
+    }
+    if (!entry.is_used) {
+      it = network.arp_table_.erase(it);
+      continue;
+    }
+    // The address is still used while it is confirmed.
+    entry.state = ARPState::kProbe;
+    entry.num_of_requests = 1;
+    entry.deadline_ns = now_ns + kARPRequestIntervalNs;
+    network.num_of_arp_requests_++;
+    SendARPRequest(it->first);
+    network.ArmARPRequestTimerLocked();
+    ++it;
+  }
+  if (next_deadline_ns)
+    network.ArmARPExpiryTimerLocked(next_deadline_ns);
+  network.lock_.Unlock();
+}
+
+void Network::WakeARPWaiters(Timer& timer) {
+  reinterpret_cast<Network*>(timer.GetData())->arp_wait_queue_.WakeAll();
+}
+
+void Network::RegisterARPResolution(IPv4Addr ip_addr,
+                                    EtherAddr eth_addr,
+                                    bool is_permanent) {
+  PendingFrame* pending = nullptr;
+  lock_.Lock();
+  ARPEntry& entry = arp_table_.try_emplace(ip_addr).first->second;
+  if (entry.state == ARPState::kPermanent && !is_permanent) {
+    // Our own address is never overwritten by others.
+    lock_.Unlock();
+    return;
+  }
+  entry.eth_addr = eth_addr;
+  entry.num_of_requests = 0;
+  entry.is_used = false;
+  if (is_permanent) {
+    entry.state = ARPState::kPermanent;
+  } else {
+    entry.state = ARPState::kReachable;
+    entry.deadline_ns = NowNs() + kARPReachableNs;
+    ArmARPExpiryTimerLocked(entry.deadline_ns);
+  }
+  pending = entry.pending_head;
+  entry.pending_head = nullptr;
+  entry.pending_tail = nullptr;
+  entry.num_of_pending = 0;
+  lock_.Unlock();
+  for (PendingFrame* frame = pending; frame; frame = frame->next)
+    SendPendingFrame(*frame, eth_addr);
+  FreePendingFrames(pending);
+  arp_wait_queue_.WakeAll();
+}
+
+std::optional<Network::EtherAddr> Network::ResolveIPv4(IPv4Addr ip_addr) {
+  bool is_new;
+  lock_.Lock();
+  std::optional<EtherAddr> eth_addr =
+      LookUpARPEntryLocked(GetARPEntryLocked(ip_addr, is_new));
+  lock_.Unlock();
+  if (is_new)
+    SendARPRequest(ip_addr);
+  return eth_addr;
+}
+
+std::optional<Network::EtherAddr> Network::WaitForARPResolution(
+    IPv4Addr ip_addr,
+    uint64_t timeout_ns) {
+  std::optional<EtherAddr> eth_addr = ResolveIPv4(ip_addr);
+  if (eth_addr.has_value())
+    return eth_addr;
+  const uint64_t deadline_ns = NowNs() + timeout_ns;
+  Timer timer;
+  timer.Init(WakeARPWaiters, this);
+  AddTimer(timer, deadline_ns);
+  arp_wait_queue_.WaitUntil([&] {
+    lock_.Lock();
+    auto it = arp_table_.find(ip_addr);
+    if (it != arp_table_.end())
+      eth_addr = LookUpARPEntryLocked(it->second);
+    lock_.Unlock();
+    return eth_addr.has_value() || NowNs() >= deadline_ns;
+  });
+  CancelTimer(timer);
+  return eth_addr;
+}
+
+Network::PendingFrame* Network::AllocPendingFrame(size_t size) {
+  PendingFrame* frame = reinterpret_cast<PendingFrame*>(
+      AllocKernelObjectMemory(sizeof(PendingFrame) + size));
+  if (!frame)
+    return nullptr;
+  frame->next = nullptr;
+  frame->offload = {};
+  frame->size = size;
+  return frame;
+}
+
+void Network::FreePendingFrames(PendingFrame* head) {
+  while (head) {
+    PendingFrame* next = head->next;
+    FreeKernelObjectMemory(head);
+    head = next;
+  }
+}
+
+void Network::SendPendingFrame(PendingFrame& frame, EtherAddr eth_addr) {
+  NIC& nic = GetInstance().GetNIC();
+  uint8_t* data = nic.GetNextTXPacketBuf(frame.size);
+  memcpy(data, frame.GetData(), frame.size);
+  reinterpret_cast<EtherFrame*>(data)->dst = eth_addr;
+  nic.SetTXOffload(frame.offload);
+  nic.SendPacket();
+}
+
+void Network::SendFrameAfterARPResolution(IPv4Addr next_hop,
+                                          PendingFrame& frame) {
+  PendingFrame* dropped = nullptr;
+  bool is_new;
+  frame.next = nullptr;
+  lock_.Lock();
+  ARPEntry& entry = GetARPEntryLocked(next_hop, is_new);
+  const std::optional<EtherAddr> eth_addr = LookUpARPEntryLocked(entry);
+  if (!eth_addr.has_value()) {
+    if (entry.pending_tail)
+      entry.pending_tail->next = &frame;
+    else
+      entry.pending_head = &frame;
+    entry.pending_tail = &frame;
+    if (++entry.num_of_pending > kARPMaxPendingFrames) {
+      dropped = entry.pending_head;
+      entry.pending_head = dropped->next;
+      dropped->next = nullptr;
+      entry.num_of_pending--;
+      num_of_arp_frames_dropped_++;
+    }
+  }
+  lock_.Unlock();
+  if (is_new)
+    SendARPRequest(next_hop);
+  if (eth_addr.has_value()) {
+    // Resolved after the caller looked it up.
+    SendPendingFrame(frame, *eth_addr);
+    FreePendingFrames(&frame);
+  }
+  FreePendingFrames(dropped);
+}
+
+void Network::PrintARPTable() {
+  static const char* kStateNames[] = {"INCOMPLETE", "REACHABLE", "PROBE",
+                                      "PERMANENT"};
+  lock_.Lock();
+  kprintf("%lu entries found:\n", arp_table_.size());
+  for (const auto& it : arp_table_) {
+    const IPv4Addr& addr = it.first;
+    const ARPEntry& entry = it.second;
+    kprintf("%u.%u.%u.%u -> ", addr.addr[0], addr.addr[1], addr.addr[2],
+            addr.addr[3]);
+    if (entry.state == ARPState::kIncomplete)
+      PutString("?");
+    else
+      entry.eth_addr.Print();
+    kprintf(" %s, %d frames pending\n",
+            kStateNames[static_cast<int>(entry.state)], entry.num_of_pending);
+  }
+  kprintf("arp requests sent: %lu, frames dropped: %lu\n",
+          num_of_arp_requests_, num_of_arp_frames_dropped_);
+  lock_.Unlock();
+}
+
 void NetworkManager() {
-  auto& virtio_net = Virtio::Net::GetInstance();
+  // Bottom half of the RX interrupt of the NIC. Each processor has one,
+  // pinned to it, for the RX queue of the processor.
+  NIC& nic = Network::GetInstance().WaitForNIC();
+  const int queue = GetCurrentCPUIndex();
+  if (queue >= nic.GetNumOfRXQueues()) {
+    // Nothing to do on this processor.
+    WaitQueue wait_queue;
+    wait_queue.WaitUntil([] { return false; });
+  }
   while (true) {
-    ClearIntFlag();
-    virtio_net.PollRXQueue();
-    StoreIntFlag();
-    Sleep();
+    nic.WaitForRXQueue(queue);
+    while (nic.PollRXQueue(queue)) {
+    }
   }
 }
 
 void SendARPRequest(Network::IPv4Addr ip_addr) {
-  using Net = Virtio::Net;
-  using ARPPacket = Virtio::Net::ARPPacket;
-  Net& virtio_net = Net::GetInstance();
-  ARPPacket& arp =
-      *virtio_net.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
-  arp.SetupRequest(ip_addr, virtio_net.GetSelfIPv4Addr(),
-                   virtio_net.GetSelfEtherAddr());
+  NIC& nic = Network::GetInstance().GetNIC();
+  ARPPacket& arp = *nic.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
+  arp.SetupRequest(ip_addr, nic.GetSelfIPv4Addr(), nic.GetSelfEtherAddr());
   // send
-  virtio_net.SendPacket();
+  nic.SendPacket();
 }
 
 void SendARPRequest(const char* ip_addr_str) {
+  if (!Network::GetInstance().HasNIC()) {
+    PutString("No NIC is available\n");
+    return;
+  }
   auto ip_addr = Network::IPv4Addr::CreateFromString(ip_addr_str);
   if (!ip_addr.has_value()) {
     PutString("Invalid IP Addr format: ");
@@ -73,11 +797,14 @@ void SendARPRequest(const char* ip_addr_str) {
 }
 
 void SendDHCPRequest() {
-  using DHCPPacket = Network::DHCPPacket;
-  auto& virtio_net = Virtio::Net::GetInstance();
+  if (!Network::GetInstance().HasNIC()) {
+    PutString("No NIC is available\n");
+    return;
+  }
+  NIC& nic = Network::GetInstance().GetNIC();
   // Send DHCP
   DHCPPacket& request =
-      *virtio_net.GetNextTXPacketBuf<DHCPPacket*>(sizeof(DHCPPacket));
-  request.SetupRequest(virtio_net.GetSelfEtherAddr());
-  virtio_net.SendPacket();
+      *nic.GetNextTXPacketBuf<DHCPPacket*>(sizeof(DHCPPacket));
+  request.SetupRequest(nic.GetSelfEtherAddr());
+  nic.SendPacket();
 }
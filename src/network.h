@@ -5,7 +5,17 @@
 #include <vector>
 
 #include "generic.h"
+#include "packet_buffer.h"
+#include "packet_ring.h"
+#include "poll.h"
 #include "ring_buffer.h"
+#include "slab_allocator.h"
+#include "spin_lock.h"
+#include "timer.h"
+#include "timer_wheel.h"
+#include "wait_queue.h"
+
+class NIC;
 
 class Network {
  public:
@@ -40,6 +50,8 @@ class Network {
     bool HasEthType(const uint8_t(&etype)[2]) {
       return eth_type[0] == etype[0] && eth_type[1] == etype[1];
     }
+    // The largest payload of a frame.
+    static constexpr size_t kMTU = 1500;
   };
 
   //
@@ -58,12 +70,10 @@ class Network {
              *reinterpret_cast<const uint16_t*>(to.csum);
     }
     static InternetChecksum Calc(void* buf, size_t start, size_t end) {
-      // https://tools.ietf.org/html/rfc1071
-      uint8_t* p = reinterpret_cast<uint8_t*>(buf);
-      uint32_t sum = 0;
-      for (size_t i = start; i < end; i += 2) {
-        sum += (static_cast<uint16_t>(p[i + 0])) << 8 | p[i + 1];
-      }
+      return FromSum(Sum(buf, start, end));
+    }
+    // Returns the complement of sum folded to 16 bits.
+    static InternetChecksum FromSum(uint32_t sum) {
       while (sum >> 16) {
         sum = (sum & 0xffff) + (sum >> 16);
       }
@@ -71,6 +81,75 @@ class Network {
       return {static_cast<uint8_t>((sum >> 8) & 0xFF),
               static_cast<uint8_t>(sum & 0xFF)};
     }
+    // Returns the one's complement sum of [start, end) of buf as 16-bit
+    // words in the network byte order. An odd byte at the end is padded
+    // with zero.
+    static uint16_t Sum(const void* buf, size_t start, size_t end) {
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(buf) + start;
+      return FoldSum(use_vector_sum_ ? SumVector(p, end - start)
+                                     : SumScalar(p, end - start));
+    }
+    // The sum is independent of the byte order of the words (RFC 1071 2.B),
+    // so the following add words as they are in memory, and FoldSum()
+    // swaps the bytes at the end.
+    // Sums 4 bytes at a time into a 64-bit accumulator, which does not
+    // overflow for any buffer which fits in memory.
+    static uint64_t SumScalar(const uint8_t* p, size_t size) {
+      uint64_t sum = 0;
+      uint32_t w[4];
+      for (; size >= sizeof(w); p += sizeof(w), size -= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        sum += static_cast<uint64_t>(w[0]) + w[1] + w[2] + w[3];
+      }
+      for (; size >= sizeof(w[0]); p += sizeof(w[0]), size -= sizeof(w[0])) {
+        memcpy(w, p, sizeof(w[0]));
+        sum += w[0];
+      }
+      if (size >= 2) {
+        sum += static_cast<uint64_t>(p[1]) << 8 | p[0];
+        p += 2;
+        size -= 2;
+      }
+      if (size)
+        sum += p[0];
+      return sum;
+    }
+    // Sums 64 bytes at a time with SSE2: each 64-bit lane adds the two
+    // 32-bit halves of quadwords, so lanes do not overflow either.
+    static uint64_t SumVector(const uint8_t* p, size_t size) {
+      using Quadwords = uint64_t __attribute__((vector_size(16)));
+      Quadwords q[4];
+      Quadwords sum = {0, 0};
+      for (; size >= sizeof(q); p += sizeof(q), size -= sizeof(q)) {
+        memcpy(q, p, sizeof(q));
+        sum += (q[0] & 0xFFFF'FFFF) + (q[0] >> 32) + (q[1] & 0xFFFF'FFFF) +
+               (q[1] >> 32) + (q[2] & 0xFFFF'FFFF) + (q[2] >> 32) +
+               (q[3] & 0xFFFF'FFFF) + (q[3] >> 32);
+      }
+      return FoldTo32(sum[0]) + FoldTo32(sum[1]) + SumScalar(p, size);
+    }
+    // Folds a sum from SumScalar() or SumVector() into 16 bits in the
+    // network byte order.
+    static uint16_t FoldSum(uint64_t sum) {
+      sum = FoldTo32(sum);
+      while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+      }
+      return static_cast<uint16_t>((sum >> 8 & 0xFF) | (sum & 0xFF) << 8);
+    }
+    static uint64_t FoldTo32(uint64_t sum) {
+      sum = (sum & 0xFFFF'FFFF) + (sum >> 32);
+      return (sum & 0xFFFF'FFFF) + (sum >> 32);
+    }
+    // Selected by the kernel from the CPU features. The scalar version is
+    // the default so that checksums are correct before that.
+    static void UseVectorSum(bool use_vector_sum) {
+      use_vector_sum_ = use_vector_sum;
+    }
+    static bool IsVectorSumUsed() { return use_vector_sum_; }
+
+   private:
+    static inline bool use_vector_sum_ = false;
   };
 
   //
@@ -141,6 +220,14 @@ class Network {
       length[0] = size >> 8;
       length[1] = size & 0xFF;
     }
+    // Unlike SetDataLength(), these do not round the size up.
+    uint16_t GetTotalLength() const {
+      return static_cast<uint16_t>(length[0]) << 8 | length[1];
+    }
+    void SetTotalLength(uint16_t size) {
+      length[0] = size >> 8;
+      length[1] = size & 0xFF;
+    }
     void CalcAndSetChecksum() {
       csum.Clear();
       csum = InternetChecksum::Calc(this, offsetof(IPv4Packet, version_and_ihl),
@@ -293,22 +380,121 @@ class Network {
                                           Network::IPv4Addr dst_addr,
                                           uint8_t (&udp_length)[2]) {
     // https://tools.ietf.org/html/rfc1071
-    uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+    const InternetChecksum pseudo = CalcPseudoHeaderChecksum(
+        src_addr, dst_addr, IPv4Packet::Protocol::kUDP,
+        static_cast<uint16_t>((udp_length[0] << 8) | udp_length[1]));
+    return InternetChecksum::FromSum(
+        static_cast<uint32_t>((pseudo.csum[0] << 8) | pseudo.csum[1]) +
+        InternetChecksum::Sum(buf, start, end));
+  }
+
+  //
+  // TCP
+  //
+  packed_struct IPv4TCPPacket {
+    // https://tools.ietf.org/html/rfc793#section-3.1
+    static constexpr uint8_t kFlagFIN = 0x01;
+    static constexpr uint8_t kFlagSYN = 0x02;
+    static constexpr uint8_t kFlagRST = 0x04;
+    static constexpr uint8_t kFlagPSH = 0x08;
+    static constexpr uint8_t kFlagACK = 0x10;
+    static constexpr uint8_t kOptionEnd = 0;
+    static constexpr uint8_t kOptionNop = 1;
+    static constexpr uint8_t kOptionMSS = 2;
+
+    IPv4Packet ip;
+    uint8_t src_port[2];
+    uint8_t dst_port[2];
+    uint8_t seq[4];
+    uint8_t ack[4];
+    uint8_t data_offset;  // Upper 4 bits: header size in uint32_t
+    uint8_t flags;
+    uint8_t window[2];
+    InternetChecksum csum;
+    uint8_t urgent_pointer[2];
+    // Options follow
+
+    uint16_t GetSourcePort() const {
+      return static_cast<uint16_t>(src_port[0]) << 8 | src_port[1];
+    }
+    void SetSourcePort(uint16_t port) {
+      src_port[0] = port >> 8;
+      src_port[1] = port & 0xFF;
+    }
+    uint16_t GetDestinationPort() const {
+      return static_cast<uint16_t>(dst_port[0]) << 8 | dst_port[1];
+    }
+    void SetDestinationPort(uint16_t port) {
+      dst_port[0] = port >> 8;
+      dst_port[1] = port & 0xFF;
+    }
+    uint32_t GetSeq() const { return ReadBE32(seq); }
+    void SetSeq(uint32_t v) { WriteBE32(seq, v); }
+    uint32_t GetAck() const { return ReadBE32(ack); }
+    void SetAck(uint32_t v) { WriteBE32(ack, v); }
+    uint16_t GetWindow() const {
+      return static_cast<uint16_t>(window[0]) << 8 | window[1];
+    }
+    void SetWindow(uint16_t v) {
+      window[0] = v >> 8;
+      window[1] = v & 0xFF;
+    }
+    size_t GetHeaderSize() const { return (data_offset >> 4) * 4; }
+    void SetHeaderSize(size_t size) {
+      data_offset = static_cast<uint8_t>((size / 4) << 4);
+    }
+    uint8_t* GetOptions() {
+      return reinterpret_cast<uint8_t*>(this) + sizeof(IPv4TCPPacket);
+    }
+
+   private:
+    static uint32_t ReadBE32(const uint8_t (&v)[4]) {
+      return static_cast<uint32_t>(v[0]) << 24 |
+             static_cast<uint32_t>(v[1]) << 16 |
+             static_cast<uint32_t>(v[2]) << 8 | v[3];
+    }
+    static void WriteBE32(uint8_t (&v)[4], uint32_t value) {
+      v[0] = value >> 24;
+      v[1] = (value >> 16) & 0xFF;
+      v[2] = (value >> 8) & 0xFF;
+      v[3] = value & 0xFF;
+    }
+  };
+  static_assert(sizeof(IPv4TCPPacket) == sizeof(IPv4Packet) + 20);
+  // Returns the checksum of buf[start, end) with the TCP pseudo-header.
+  // The size of the range can be odd. Verifying a segment including its
+  // checksum field gives zero if it is correct.
+  static InternetChecksum CalcTCPChecksum(void* buf,
+                                          size_t start,
+                                          size_t end,
+                                          Network::IPv4Addr src_addr,
+                                          Network::IPv4Addr dst_addr) {
+    // https://tools.ietf.org/html/rfc793#section-3.1
+    const InternetChecksum pseudo = CalcPseudoHeaderChecksum(
+        src_addr, dst_addr, IPv4Packet::Protocol::kTCP,
+        static_cast<uint16_t>(end - start));
+    return InternetChecksum::FromSum(
+        static_cast<uint32_t>((pseudo.csum[0] << 8) | pseudo.csum[1]) +
+        InternetChecksum::Sum(buf, start, end));
+  }
+  // Returns the sum of the pseudo-header of TCP or UDP without taking its
+  // complement. A device offloading the checksum expects this in the
+  // checksum field and adds the rest of the segment to it.
+  static InternetChecksum CalcPseudoHeaderChecksum(
+      Network::IPv4Addr src_addr,
+      Network::IPv4Addr dst_addr,
+      IPv4Packet::Protocol protocol,
+      uint16_t length) {
     uint32_t sum = 0;
-    // Pseudo-header
     sum += (static_cast<uint16_t>(src_addr.addr[0]) << 8) | src_addr.addr[1];
     sum += (static_cast<uint16_t>(src_addr.addr[2]) << 8) | src_addr.addr[3];
     sum += (static_cast<uint16_t>(dst_addr.addr[0]) << 8) | dst_addr.addr[1];
     sum += (static_cast<uint16_t>(dst_addr.addr[2]) << 8) | dst_addr.addr[3];
-    sum += (static_cast<uint16_t>(udp_length[0]) << 8) | udp_length[1];
-    sum += 17;  // Protocol: UDP
-    for (size_t i = start; i < end; i += 2) {
-      sum += (static_cast<uint16_t>(p[i + 0])) << 8 | p[i + 1];
-    }
+    sum += length;
+    sum += static_cast<uint8_t>(protocol);
     while (sum >> 16) {
       sum = (sum & 0xffff) + (sum >> 16);
     }
-    sum = ~sum;
     return {static_cast<uint8_t>((sum >> 8) & 0xFF),
             static_cast<uint8_t>(sum & 0xFF)};
   }
@@ -394,93 +580,290 @@ class Network {
   static_assert(offsetof(DHCPPacket, cookie) == 278);
 
   //
-  // ARP Table
+  // TX
   //
-  using ARPTable = std::unordered_map<IPv4Addr, EtherAddr, IPv4AddrHash>;
-  const ARPTable& GetARPTable() { return arp_table_; }
-  void RegisterARPResolution(IPv4Addr ip_addr, EtherAddr eth_addr) {
-    arp_table_[ip_addr] = eth_addr;
-  }
-  std::optional<EtherAddr> ResolveIPv4(IPv4Addr ip_addr) {
-    if (arp_table_.find(ip_addr) == arp_table_.end())
-      return std::nullopt;
-    return arp_table_[ip_addr];
-  }
+  // Offloads requested to the driver for a frame (NIC::SetTXOffload).
+  struct TXOffload {
+    uint16_t csum_start;
+    uint16_t csum_offset;  // The device computes the checksum if not 0.
+    uint8_t gso_type;      // NIC::kGSOType*
+    uint16_t header_size;
+    uint16_t segment_size;
+  };
+  // A frame waiting for the resolution of its next hop. The destination of
+  // the Ethernet header is filled when it is sent.
+  struct PendingFrame {
+    PendingFrame* next;
+    TXOffload offload;
+    size_t size;
+    uint8_t* GetData() { return reinterpret_cast<uint8_t*>(this + 1); }
+  };
 
   //
-  // RX buffer
+  // ARP (RFC 826)
   //
-  static constexpr int kPacketContainerSize = 2048;
-  static constexpr int kRXBufferSize = 32;
-  packed_struct PacketContainer {
-    size_t size;
-    uint8_t data[kPacketContainerSize];
+  // Resolved addresses are used without asking for kARPReachableNs. After
+  // that, they are still used while ARP requests confirm them, and dropped
+  // if nobody replies or nobody has used them. Requests for an address are
+  // sent at most once per kARPRequestIntervalNs, up to kARPMaxRequests
+  // times. Frames to an unresolved address are queued, up to
+  // kARPMaxPendingFrames with the oldest dropped first.
+  static constexpr uint64_t kARPReachableNs = 60'000'000'000;
+  static constexpr uint64_t kARPRequestIntervalNs = 1'000'000'000;
+  static constexpr int kARPMaxRequests = 3;
+  static constexpr int kARPMaxPendingFrames = 16;
+  enum class ARPState {
+    kIncomplete,  // Waiting for a reply.
+    kReachable,
+    kProbe,  // Waiting for a reply to confirm an expired address.
+    kPermanent,
+  };
+  struct ARPEntry {
+    ARPState state;
+    EtherAddr eth_addr;  // Invalid in kIncomplete.
+    // Next request in kIncomplete and kProbe. Expiry in kReachable.
+    uint64_t deadline_ns;
+    int num_of_requests;
+    bool is_used;  // Looked up since it got kReachable.
+    PendingFrame* pending_head;
+    PendingFrame* pending_tail;
+    int num_of_pending;
   };
-  void PushToRXBuffer(const void* data, size_t begin, size_t end) {
-    assert(begin < end);
-    PacketContainer buf;
-    buf.size = end - begin;
-    assert(buf.size <= kPacketContainerSize);
-    memcpy(buf.data, reinterpret_cast<const uint8_t*>(data) + begin, buf.size);
-    rx_buffer_.Push(buf);
+
+  // @network.cc
+  // Frames waiting for ip_addr are sent. A permanent entry never expires.
+  void RegisterARPResolution(IPv4Addr ip_addr,
+                             EtherAddr eth_addr,
+                             bool is_permanent = false);
+  // Never blocks. If the address is not known, sends an ARP request unless
+  // one was sent recently, and returns nullopt.
+  std::optional<EtherAddr> ResolveIPv4(IPv4Addr ip_addr);
+  // Blocks the current process until ip_addr is resolved or timeout_ns
+  // passes. Returns nullopt on timeout.
+  std::optional<EtherAddr> WaitForARPResolution(IPv4Addr ip_addr,
+                                                uint64_t timeout_ns);
+  // The address to resolve to send a packet to dst_addr.
+  IPv4Addr GetNextHop(IPv4Addr dst_addr) {
+    if (dst_addr.IsInSameSubnet(gateway_, netmask_))
+      return dst_addr;
+    return gateway_;
   }
-  PacketContainer PopFromRXBuffer() { return rx_buffer_.Pop(); }
-  bool HasPacketInRXBuffer() { return !rx_buffer_.IsEmpty(); }
+  // Returns a frame of size bytes with nothing filled, or nullptr on failure.
+  static PendingFrame* AllocPendingFrame(size_t size);
+  // Sends frame when the address of next_hop is resolved. Takes the
+  // ownership of frame.
+  void SendFrameAfterARPResolution(IPv4Addr next_hop, PendingFrame& frame);
+  void PrintARPTable();
 
   static Network& GetInstance();
 
+  //
+  // NIC (@nic.h)
+  //
+  // @network.cc
+  // Called by drivers when their device gets ready. The first NIC attached
+  // carries all the traffic. Returns true if another one is already used.
+  bool AttachNIC(NIC& nic);
+  bool HasNIC() const { return nic_; }
+  NIC& GetNIC() {
+    if (!nic_)
+      Panic("No NIC is attached");
+    return *nic_;
+  }
+  // Blocks the current process until a NIC is attached.
+  NIC& WaitForNIC();
+
   //
   // sockets
   //
+  static constexpr int kSocketRXQueueSize = 64;
+  // https://tools.ietf.org/html/rfc6335#section-6
+  static constexpr uint16_t kEphemeralPortFirst = 49152;
+  static constexpr uint16_t kEphemeralPortLast = 65535;
   struct Socket {
-    uint64_t pid;
-    int fd;
-    uint16_t listen_port;
     enum class Type {
       kICMPRaw,
       kICMPDatagram,
       kUDP,
-    } type;
-  };
-
-  bool RegisterSocket(uint64_t pid, int fd, Socket::Type type) {
-    // returns true on failure
-    if (FindSocket(pid, fd).has_value()) {
-      return true;
+    };
+    Socket(uint64_t owner_pid, Type socket_type)
+        : pid(owner_pid),
+          listen_port(0),
+          type(socket_type),
+          num_of_rx_packets(0),
+          num_of_rx_dropped(0),
+          has_new_packets(false),
+          rx_timeout_ns(0),
+          rx_ring_layout{},
+          tx_ring_layout{},
+          ring_memory(nullptr),
+          ring_vaddr(0),
+          ring_byte_size(0) {}
+    // Returns nullptr if empty. The caller should Unref() the returned
+    // packet after using it.
+    PacketBuffer* PopPacket() {
+      lock.Lock();
+      PacketBuffer* pbuf = rx_queue.Pop();
+      lock.Unlock();
+      return pbuf;
     }
-    sockets_.push_back({pid, fd, 12345 /* TODO: use random port */, type});
-    return false;
-  }
-  bool BindToPort(uint64_t pid, int fd, uint16_t port) {
-    // returns true on failure
-    for (auto& it : sockets_) {
-      if (it.pid == pid && it.fd == fd) {
-        it.listen_port = port;
-        return false;
-      }
+    // Pops up to max_packets packets at once. Returns the number of them.
+    int PopPackets(PacketBuffer** pbufs, int max_packets) {
+      int n = 0;
+      lock.Lock();
+      while (n < max_packets && !rx_queue.IsEmpty())
+        pbufs[n++] = rx_queue.Pop();
+      lock.Unlock();
+      return n;
     }
-    return true;
-  }
-  std::optional<Socket> FindSocket(uint64_t pid, int fd) {
-    for (auto& it : sockets_) {
-      if (it.pid == pid && it.fd == fd) {
-        return it;
+    bool HasPacket() {
+      lock.Lock();
+      const bool has_packet =
+          !rx_queue.IsEmpty() ||
+          (rx_ring.IsEnabled() && rx_ring.HasUnconsumedFrames());
+      lock.Unlock();
+      return has_packet;
+    }
+    // Returns nullptr if no packet arrives until deadline_ns.
+    PacketBuffer* WaitAndPopPacket(uint64_t deadline_ns) {
+      for (;;) {
+        if (PacketBuffer* pbuf = PopPacket())
+          return pbuf;
+        if (!WaitUntilOrDeadline(rx_wait_queue, deadline_ns,
+                                 [this] { return HasPacket(); }))
+          return PopPacket();
       }
     }
-    return std::nullopt;
-  }
+
+    uint64_t pid;  // Only for debugging.
+    uint16_t listen_port;
+    Type type;
+    // Packets demultiplexed to this socket. Protected by lock.
+    RingBuffer<PacketBuffer*, kSocketRXQueueSize> rx_queue;
+    uint64_t num_of_rx_packets;
+    uint64_t num_of_rx_dropped;
+    SpinLock lock;
+    // Protected by the lock of Network.
+    bool has_new_packets;
+    WaitQueue rx_wait_queue;
+    // Tells poll(2) and epoll(7) waiters about new packets.
+    PollNotifier poll_notifier;
+    // SO_RCVTIMEO. 0 waits forever. Only the owner process touches it.
+    // Datagrams are sent without blocking, so SO_SNDTIMEO is not needed.
+    uint64_t rx_timeout_ns;
+    // PACKET_RX_RING and PACKET_TX_RING. The layouts are given by
+    // setsockopt(2), and mmap(2) creates the rings on ring_memory and maps
+    // it into the owner process at ring_vaddr (@syscall.cc). Packets go to
+    // rx_ring instead of rx_queue once it is enabled.
+    struct RingLayout {
+      uint32_t frame_size;
+      uint32_t num_of_frames;  // 0 if the ring is not requested.
+    };
+    RingLayout rx_ring_layout;
+    RingLayout tx_ring_layout;
+    PacketRing rx_ring;  // Protected by lock.
+    PacketRing tx_ring;  // Only the owner process touches it.
+    void* ring_memory;   // Freed when this is closed.
+    uint64_t ring_vaddr;
+    size_t ring_byte_size;
+  };
+
+  // @network.cc
+  // Returns nullptr on failure. Sockets are referred to by file descriptors
+  // of processes (@file_descriptor.h).
+  Socket* CreateSocket(uint64_t pid, Socket::Type type);
+  // Returns true on failure, including when the port is used by another
+  // socket.
+  bool BindToPort(Socket& socket, uint16_t port);
+  // Packets left in the queue are dropped. The rings should be unmapped
+  // from the owner process before this.
+  void CloseSocket(Socket& socket);
+  void PrintSockets();
+
+  //
+  // RX
+  //
+  // @network.cc
+  // Called by drivers for each received frame. Each socket which the frame
+  // is destined for takes a reference to pbuf. Frames with no receiver are
+  // dropped.
+  void HandleReceivedFrame(PacketBuffer& pbuf);
+  // Drivers call this after delivering a batch of packets. Wakes up readers
+  // of the sockets which got packets.
+  void NotifyRXPackets();
+  uint64_t GetNumOfRXUnclaimed() const { return num_of_rx_unclaimed_; }
 
  private:
   static Network* network_;
 
+  // Demultiplexing key of a socket which has a port.
+  static constexpr uint32_t PortKey(IPv4Packet::Protocol protocol,
+                                    uint16_t port) {
+    return static_cast<uint32_t>(protocol) << 16 | port;
+  }
+  // Returns 0 if all ports are in use.
+  uint16_t AllocEphemeralPortLocked(IPv4Packet::Protocol protocol);
+  void RemoveSocketLocked(Socket& socket);
+  void DestroySocket(Socket& socket);
+  // Passes pbuf to TCP and sockets.
+  void DeliverPacket(PacketBuffer& pbuf);
+  void DeliverPacketToSocketLocked(Socket& socket, PacketBuffer& pbuf);
+  // Returns the entry of ip_addr. A new one is created in kIncomplete and
+  // the caller should send a request for it if is_new is set to true.
+  ARPEntry& GetARPEntryLocked(IPv4Addr ip_addr, bool& is_new);
+  static std::optional<EtherAddr> LookUpARPEntryLocked(ARPEntry& entry);
+  void ArmARPRequestTimerLocked();
+  void ArmARPExpiryTimerLocked(uint64_t deadline_ns);
+  // Sends requests again for kIncomplete and kProbe entries.
+  static void HandleARPRequestTimer(Timer& timer);
+  // Moves kReachable entries which have expired to kProbe.
+  static void HandleARPExpiryTimer(Timer& timer);
+  static void WakeARPWaiters(Timer& timer);
+  static void SendPendingFrame(PendingFrame& frame, EtherAddr eth_addr);
+  static void FreePendingFrames(PendingFrame* head);
+
+  using ARPTable = std::unordered_map<IPv4Addr, ARPEntry, IPv4AddrHash>;
+  using SocketByPortMap = std::unordered_map<
+      uint32_t,
+      Socket*,
+      std::hash<uint32_t>,
+      std::equal_to<uint32_t>,
+      KernelObjectSTLAllocator<std::pair<const uint32_t, Socket*>>>;
+
+  NIC* nic_;
+  // Processes waiting for a NIC to be attached.
+  WaitQueue nic_wait_queue_;
   ARPTable arp_table_;
-  // +1ACD0
-  RingBuffer<PacketContainer, kRXBufferSize> rx_buffer_;  // (2048 + 8) * 32
-  std::vector<Socket> sockets_;
+  std::vector<Socket*, KernelObjectSTLAllocator<Socket*>> sockets_;
+  SocketByPortMap socket_by_port_;
+  uint16_t next_ephemeral_port_;
+  uint64_t num_of_rx_unclaimed_;
   IPv4Addr gateway_;
   IPv4NetMask netmask_;
+  // ARP timers fire lazily: they are not cancelled, and each of them
+  // handles all the entries which have passed their deadlines.
+  Timer arp_request_timer_;
+  bool is_arp_request_timer_armed_;
+  Timer arp_expiry_timer_;
+  bool is_arp_expiry_timer_armed_;
+  uint64_t num_of_arp_requests_;
+  uint64_t num_of_arp_frames_dropped_;
+  // Processes waiting for ARP resolution.
+  WaitQueue arp_wait_queue_;
+  // Protects arp_table_, the ARP timers and statistics, sockets_,
+  // socket_by_port_, next_ephemeral_port_ and num_of_rx_unclaimed_.
+  SpinLock lock_;
 
-  Network(){};
+  Network()
+      : nic_(nullptr),
+        next_ephemeral_port_(kEphemeralPortFirst),
+        is_arp_request_timer_armed_(false),
+        is_arp_expiry_timer_armed_(false),
+        num_of_arp_requests_(0),
+        num_of_arp_frames_dropped_(0) {
+    arp_request_timer_.Init(HandleARPRequestTimer, this);
+    arp_expiry_timer_.Init(HandleARPExpiryTimer, this);
+  };
 };
 
 void NetworkManager();
@@ -5,6 +5,88 @@
 #include <stdio.h>
 
 #include <cassert>
+#include <chrono>
+#include <random>
+#include <vector>
+
+using InternetChecksum = Network::InternetChecksum;
+
+// RFC 1071 as written: adds big-endian 16-bit words one by one.
+static uint16_t SumReference(const uint8_t* p, size_t size) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < size; i += 2) {
+    sum += static_cast<uint32_t>(p[i]) << 8;
+    if (i + 1 < size)
+      sum += p[i + 1];
+    while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint16_t>(sum);
+}
+
+void TestChecksumImplementations() {
+  std::mt19937 mt(1);
+  std::vector<uint8_t> buf(64 * 1024 + 64);
+  for (auto& b : buf)
+    b = static_cast<uint8_t>(mt());
+  // All lengths around the strides and random ones, from every alignment.
+  std::vector<size_t> sizes;
+  for (size_t size = 0; size <= 130; size++)
+    sizes.push_back(size);
+  for (int i = 0; i < 200; i++)
+    sizes.push_back(mt() % (64 * 1024));
+  sizes.push_back(64 * 1024);
+  for (size_t size : sizes) {
+    for (size_t offset = 0; offset < 16; offset++) {
+      const uint8_t* p = buf.data() + offset;
+      const uint16_t expected = SumReference(p, size);
+      assert(InternetChecksum::FoldSum(InternetChecksum::SumScalar(p, size)) ==
+             expected);
+      assert(InternetChecksum::FoldSum(InternetChecksum::SumVector(p, size)) ==
+             expected);
+    }
+  }
+  // Words of 0xFFFF make the accumulators carry most.
+  std::vector<uint8_t> ones(64 * 1024, 0xFF);
+  for (size_t size : {2, 62, 64, 4096, 64 * 1024}) {
+    const uint16_t expected = SumReference(ones.data(), size);
+    assert(InternetChecksum::FoldSum(InternetChecksum::SumScalar(
+               ones.data(), size)) == expected);
+    assert(InternetChecksum::FoldSum(InternetChecksum::SumVector(
+               ones.data(), size)) == expected);
+  }
+}
+
+void BenchmarkChecksum() {
+  std::vector<uint8_t> buf(64 * 1024);
+  for (size_t i = 0; i < buf.size(); i++)
+    buf[i] = static_cast<uint8_t>(i * 7);
+  for (size_t size = 64; size <= buf.size(); size *= 4) {
+    const int num_of_iterations = static_cast<int>(16 * 1024 * 1024 / size);
+    double mb_per_s[3];
+    for (int k = 0; k < 3; k++) {
+      volatile uint16_t sink = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < num_of_iterations; i++) {
+        if (k == 0)
+          sink = sink + SumReference(buf.data(), size);
+        else if (k == 1)
+          sink = sink + InternetChecksum::FoldSum(
+                            InternetChecksum::SumScalar(buf.data(), size));
+        else
+          sink = sink + InternetChecksum::FoldSum(
+                            InternetChecksum::SumVector(buf.data(), size));
+      }
+      auto end = std::chrono::steady_clock::now();
+      mb_per_s[k] = static_cast<double>(size) * num_of_iterations /
+                    std::chrono::duration<double, std::micro>(end - start)
+                        .count();
+    }
+    printf("checksum %6zu B: 16-bit %7.1f MB/s, 64-bit %7.1f MB/s, "
+           "SSE2 %7.1f MB/s\n",
+           size, mb_per_s[0], mb_per_s[1], mb_per_s[2]);
+  }
+}
 
 int main() {
   auto ip_addr_actual = Network::IPv4Addr::CreateFromString("12.34.56.78");
@@ -18,6 +100,45 @@ int main() {
   assert(!Network::IPv4Addr::CreateFromString("").has_value());
   assert(!Network::IPv4Addr::CreateFromString("123.56.78").has_value());
 
+  // A TCP segment with a checksum verifies to zero, including odd lengths.
+  using IPv4TCPPacket = Network::IPv4TCPPacket;
+  constexpr size_t kHeaderOffset = offsetof(IPv4TCPPacket, src_port);
+  for (size_t payload_size = 0; payload_size < 4; payload_size++) {
+    uint8_t buf[sizeof(IPv4TCPPacket) + 4] = {};
+    IPv4TCPPacket& tcp = *reinterpret_cast<IPv4TCPPacket*>(buf);
+    tcp.ip.src_ip = {10, 0, 2, 15};
+    tcp.ip.dst_ip = {10, 0, 2, 2};
+    tcp.SetSourcePort(8890);
+    tcp.SetDestinationPort(49152);
+    tcp.SetSeq(0x12345678);
+    tcp.SetAck(0x9ABCDEF0);
+    tcp.SetHeaderSize(sizeof(IPv4TCPPacket) - kHeaderOffset);
+    tcp.flags = IPv4TCPPacket::kFlagACK | IPv4TCPPacket::kFlagPSH;
+    tcp.SetWindow(0xFFFF);
+    for (size_t i = 0; i < payload_size; i++)
+      buf[sizeof(IPv4TCPPacket) + i] = static_cast<uint8_t>(0xA5 + i);
+    const size_t end = sizeof(IPv4TCPPacket) + payload_size;
+    assert(tcp.GetSeq() == 0x12345678);
+    assert(tcp.GetAck() == 0x9ABCDEF0);
+    assert(tcp.GetHeaderSize() == 20);
+    tcp.csum = Network::CalcTCPChecksum(buf, kHeaderOffset, end,
+                                        tcp.ip.src_ip, tcp.ip.dst_ip);
+    Network::InternetChecksum verified = Network::CalcTCPChecksum(
+        buf, kHeaderOffset, end, tcp.ip.src_ip, tcp.ip.dst_ip);
+    assert(verified.IsEqualTo({0, 0}));
+    // A device offloading the checksum sums the segment from the TCP header
+    // with the pseudo header checksum in the checksum field.
+    const Network::InternetChecksum expected = tcp.csum;
+    tcp.csum = Network::CalcPseudoHeaderChecksum(
+        tcp.ip.src_ip, tcp.ip.dst_ip, Network::IPv4Packet::Protocol::kTCP,
+        static_cast<uint16_t>(end - kHeaderOffset));
+    assert(Network::InternetChecksum::Calc(buf, kHeaderOffset, end)
+               .IsEqualTo(expected));
+  }
+
+  TestChecksumImplementations();
+  BenchmarkChecksum();
+
   puts("PASS");
   return 0;
 }
@@ -52,4 +52,32 @@ void fstat(int) {
 void isatty(int) {
   Panic("isatty");
 }
+
+// newlib calls these around malloc and free. The lock can be taken
+// recursively, so the processor holding it is recorded. Interrupts are
+// disabled while it is held, so no other process runs on that processor.
+static SpinLock malloc_lock_;
+static int malloc_lock_owner_ = -1;
+static int malloc_lock_depth_;
+
+void __malloc_lock(struct _reent*) {
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  if (malloc_lock_owner_ == GetCurrentCPUIndex()) {
+    malloc_lock_depth_++;
+    return;
+  }
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+  malloc_lock_.Lock();
+  malloc_lock_owner_ = GetCurrentCPUIndex();
+  malloc_lock_depth_ = 1;
+}
+
+void __malloc_unlock(struct _reent*) {
+  if (--malloc_lock_depth_)
+    return;
+  malloc_lock_owner_ = -1;
+  malloc_lock_.Unlock();
+}
 }
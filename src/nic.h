@@ -0,0 +1,89 @@
+#pragma once
+
+#include "generic.h"
+#include "network.h"
+
+// Network interface controller seen from the network stack. Drivers
+// (Virtio::Net and RTL81) implement this and attach themselves with
+// Network::AttachNIC() when their device gets ready, so the stack does not
+// name any driver.
+// TX: a frame is written into the buffer taken by GetNextTXPacketBuf() and
+// handed to the device by SendPacket(). The driver is locked in between,
+// so the caller should not block.
+// RX: each RX queue is drained by the bottom half pinned to its processor
+// (NetworkManager @network.cc) with WaitForRXQueue() and PollRXQueue().
+// Drivers pass each received frame to Network::HandleReceivedFrame() and
+// call Network::NotifyRXPackets() once per poll.
+class NIC {
+ public:
+  // Types of segmentation offload. Same as virtio-net.
+  static constexpr uint8_t kGSOTypeNone = 0;
+  static constexpr uint8_t kGSOTypeTCPv4 = 1;
+  static constexpr uint8_t kGSOTypeUDP = 3;
+
+  template <typename T = uint8_t*>
+  T GetNextTXPacketBuf(size_t size) {
+    return reinterpret_cast<T>(ReserveTXPacketBuf(size));
+  }
+  // Called between GetNextTXPacketBuf() and SendPacket() to let the device
+  // compute the checksum over the frame from csum_start and store it at
+  // csum_start + csum_offset. The checksum field should hold the sum of the
+  // pseudo-header (Network::CalcPseudoHeaderChecksum()).
+  virtual void SetTXChecksumOffload(size_t csum_start, size_t csum_offset) = 0;
+  // Lets the device split the frame into packets of header_size bytes of
+  // headers followed by up to segment_size bytes of the payload. The
+  // checksum should be offloaded as well.
+  virtual void SetTXSegmentationOffload(uint8_t gso_type,
+                                        size_t header_size,
+                                        size_t segment_size) = 0;
+  // Applies offloads requested with Network::TXOffload.
+  void SetTXOffload(const Network::TXOffload& offload) {
+    if (offload.csum_offset)
+      SetTXChecksumOffload(offload.csum_start, offload.csum_offset);
+    if (offload.gso_type != kGSOTypeNone) {
+      SetTXSegmentationOffload(offload.gso_type, offload.header_size,
+                               offload.segment_size);
+    }
+  }
+  virtual void SendPacket() = 0;
+  // Packets sent between BeginTXBatch() and EndTXBatch() may be notified to
+  // the device at once. Batches can be nested. BeginTXBatch() returns the
+  // batch to be passed to EndTXBatch(), which ends it on the TX queue where
+  // it began even if the caller has moved to another processor in between.
+  virtual int BeginTXBatch() = 0;
+  virtual void EndTXBatch(int batch) = 0;
+  // Offloads negotiated with the device.
+  virtual bool CanOffloadTXChecksum() const = 0;
+  virtual bool CanOffloadTCPSegmentation() const = 0;
+  virtual bool CanOffloadUDPFragmentation() const = 0;
+  // The largest frame which GetNextTXPacketBuf() accepts. Frames larger than
+  // the MTU should be sent with SetTXSegmentationOffload().
+  virtual size_t GetMaxTXPacketSize() const = 0;
+
+  // RX queue i is drained on the processor i.
+  virtual int GetNumOfRXQueues() const = 0;
+  // Interrupts are suppressed until the queue gets empty again, so the caller
+  // should call PollRXQueue() until it returns 0 after this returns.
+  virtual void WaitForRXQueue(int queue) = 0;
+  // Processes all received packets and returns the number of them.
+  // Should be called on the processor of queue.
+  virtual int PollRXQueue(int queue) = 0;
+  virtual void PrintStatistics() = 0;
+
+  Network::EtherAddr GetSelfEtherAddr() const { return mac_addr_; }
+  Network::IPv4Addr GetSelfIPv4Addr() const { return self_ip_; }
+  void SetSelfIPv4Addr(Network::IPv4Addr addr) {
+    self_ip_ = addr;
+    if (self_ip_.IsEqualTo(Network::kWildcardIPv4Addr))
+      return;
+    Network::GetInstance().RegisterARPResolution(self_ip_, mac_addr_, true);
+  }
+
+ protected:
+  // Takes a TX buffer for a frame of size bytes, waiting for the device to
+  // complete sent packets if there is none.
+  virtual uint8_t* ReserveTXPacketBuf(size_t size) = 0;
+
+  Network::EtherAddr mac_addr_;
+  Network::IPv4Addr self_ip_;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "generic.h"
+
+// Reference-counted buffer holding a received frame in memory owned by a
+// driver. The frame is passed around by reference instead of being copied,
+// and the driver gets the memory back by the release callback when the last
+// reference is dropped. Holders which may keep the frame for long, such as
+// socket queues, should copy it unless CanBeKept(), so that the device does
+// not run out of buffers.
+class PacketBuffer {
+ public:
+  using ReleaseCallback = void (*)(PacketBuffer& pbuf);
+  constexpr PacketBuffer()
+      : data_(nullptr),
+        size_(0),
+        ref_count_(0),
+        is_checksum_valid_(false),
+        can_be_kept_(false),
+        release_(nullptr) {}
+  // Called by the owner. The caller holds the first reference.
+  void Init(uint8_t* data, size_t size, ReleaseCallback release) {
+    assert(!ref_count_);
+    data_ = data;
+    size_ = size;
+    release_ = release;
+    ref_count_ = 1;
+    is_checksum_valid_ = false;
+    can_be_kept_ = false;
+  }
+  uint8_t* GetData() const { return data_; }
+  size_t GetSize() const { return size_; }
+  // Set by the driver if the device has validated the checksum of the
+  // transport layer, so that the upper layer can skip verifying it.
+  void SetChecksumValid(bool is_valid) { is_checksum_valid_ = is_valid; }
+  bool IsChecksumValid() const { return is_checksum_valid_; }
+  // Set by the owner if the memory may stay referenced after the owner
+  // drops its reference.
+  void SetCanBeKept(bool can_be_kept) { can_be_kept_ = can_be_kept; }
+  bool CanBeKept() const { return can_be_kept_; }
+  void Ref() {
+    assert(ref_count_);
+    __atomic_add_fetch(&ref_count_, 1, __ATOMIC_RELAXED);
+  }
+  void Unref() {
+    assert(ref_count_);
+    if (__atomic_sub_fetch(&ref_count_, 1, __ATOMIC_ACQ_REL) == 0)
+      release_(*this);
+  }
+
+ private:
+  uint8_t* data_;
+  size_t size_;
+  uint32_t ref_count_;
+  bool is_checksum_valid_;
+  bool can_be_kept_;
+  ReleaseCallback release_;
+};
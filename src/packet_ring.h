@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// A ring of fixed-size frames on memory shared with a user process, for
+// PACKET_RX_RING and PACKET_TX_RING of sockets. The memory starts with
+// Header and the frames follow it. The producer fills the frame at head and
+// then advances head, and the consumer takes the frame at tail and then
+// advances tail. Both indices run freely and are wrapped by the number of
+// frames, so head == tail means empty and head - tail == num_of_frames
+// means full.
+// The kernel is the producer of RX rings and the consumer of TX rings. It
+// keeps its own copy of the index which it advances, so a user process
+// breaking the shared header can only spoil its own frames: a broken ring
+// looks full to the producer and empty to the consumer.
+class PacketRing {
+ public:
+  static constexpr uint32_t kCacheLineSize = 64;
+  // head and tail are on separate cache lines since they are written by
+  // different processors.
+  struct Header {
+    uint32_t frame_size;
+    uint32_t num_of_frames;
+    uint64_t num_of_dropped;  // Frames dropped since the ring was full.
+    alignas(kCacheLineSize) uint32_t head;
+    alignas(kCacheLineSize) uint32_t tail;
+  };
+  static_assert(sizeof(Header) == kCacheLineSize * 3);
+  // Each frame starts with this, followed by the data.
+  struct FrameHeader {
+    uint32_t size;           // Size of the data in this frame.
+    uint32_t original_size;  // Larger than size if the data is truncated.
+    uint32_t addr;  // IPv4 address of the peer in the network byte order.
+    uint32_t reserved;
+  };
+  static_assert(sizeof(FrameHeader) == 16);
+  static constexpr uint32_t kMaxFrameSize = 1 << 16;
+  static constexpr uint32_t kMaxNumOfFrames = 1 << 16;
+
+  // Returns true if the layout is not supported. frame_size should be a
+  // multiple of kCacheLineSize up to kMaxFrameSize, and num_of_frames a
+  // power of two up to kMaxNumOfFrames.
+  static bool IsInvalidLayout(uint32_t frame_size, uint32_t num_of_frames) {
+    return !frame_size || frame_size % kCacheLineSize ||
+           frame_size > kMaxFrameSize || !num_of_frames ||
+           (num_of_frames & (num_of_frames - 1)) ||
+           num_of_frames > kMaxNumOfFrames;
+  }
+  static size_t GetByteSize(uint32_t frame_size, uint32_t num_of_frames) {
+    return sizeof(Header) + static_cast<size_t>(frame_size) * num_of_frames;
+  }
+
+  constexpr PacketRing()
+      : header_(nullptr), frame_size_(0), num_of_frames_(0), index_(0) {}
+  // Puts an empty ring on GetByteSize() bytes of memory. The layout should
+  // be valid.
+  void Init(void* memory, uint32_t frame_size, uint32_t num_of_frames) {
+    memset(memory, 0, GetByteSize(frame_size, num_of_frames));
+    header_ = reinterpret_cast<Header*>(memory);
+    header_->frame_size = frame_size;
+    header_->num_of_frames = num_of_frames;
+    frame_size_ = frame_size;
+    num_of_frames_ = num_of_frames;
+    index_ = 0;
+  }
+  bool IsEnabled() const { return header_; }
+  uint32_t GetMaxDataSize() const {
+    return frame_size_ - static_cast<uint32_t>(sizeof(FrameHeader));
+  }
+
+  //
+  // Producer
+  //
+  // Copies size bytes of data into a new frame, truncating it to
+  // GetMaxDataSize(). Returns true if the ring is full and the data is
+  // dropped.
+  bool Push(const void* data, size_t size, uint32_t addr) {
+    const uint32_t tail = __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE);
+    if (index_ - tail >= num_of_frames_) {
+      header_->num_of_dropped++;
+      return true;
+    }
+    FrameHeader& frame = GetFrame(index_);
+    const uint32_t copied_size =
+        size < GetMaxDataSize() ? static_cast<uint32_t>(size)
+                                : GetMaxDataSize();
+    frame.size = copied_size;
+    frame.original_size = static_cast<uint32_t>(size);
+    frame.addr = addr;
+    memcpy(&frame + 1, data, copied_size);
+    index_++;
+    __atomic_store_n(&header_->head, index_, __ATOMIC_RELEASE);
+    return false;
+  }
+  // True while the consumer has frames to take.
+  bool HasUnconsumedFrames() const {
+    return __atomic_load_n(&header_->tail, __ATOMIC_ACQUIRE) != index_;
+  }
+
+  //
+  // Consumer
+  //
+  // Returns the data of the oldest frame and sets size and addr of it, or
+  // returns nullptr if empty. The frame is kept until Pop() is called.
+  const uint8_t* Front(uint32_t& size, uint32_t& addr) {
+    const uint32_t head = __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE);
+    if (head - index_ - 1 >= num_of_frames_)
+      return nullptr;
+    const FrameHeader& frame = GetFrame(index_);
+    // The producer may write anything here at any time, so each field is
+    // read only once before it is checked.
+    const uint32_t frame_data_size =
+        __atomic_load_n(&frame.size, __ATOMIC_RELAXED);
+    size = frame_data_size < GetMaxDataSize() ? frame_data_size
+                                              : GetMaxDataSize();
+    addr = __atomic_load_n(&frame.addr, __ATOMIC_RELAXED);
+    return reinterpret_cast<const uint8_t*>(&frame + 1);
+  }
+  void Pop() {
+    index_++;
+    __atomic_store_n(&header_->tail, index_, __ATOMIC_RELEASE);
+  }
+
+ private:
+  FrameHeader& GetFrame(uint32_t index) {
+    return *reinterpret_cast<FrameHeader*>(
+        reinterpret_cast<uint8_t*>(header_ + 1) +
+        static_cast<size_t>(index & (num_of_frames_ - 1)) * frame_size_);
+  }
+
+  Header* header_;
+  uint32_t frame_size_;
+  uint32_t num_of_frames_;
+  // head for the producer and tail for the consumer.
+  uint32_t index_;
+};
@@ -0,0 +1,143 @@
+#include "packet_ring.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+constexpr uint32_t kFrameSize = 64;
+constexpr uint32_t kNumOfFrames = 4;
+constexpr uint32_t kMaxDataSize = kFrameSize - sizeof(PacketRing::FrameHeader);
+
+alignas(PacketRing::kCacheLineSize) static uint8_t
+    memory[sizeof(PacketRing::Header) + kFrameSize * kNumOfFrames];
+
+static PacketRing::Header& GetHeader() {
+  return *reinterpret_cast<PacketRing::Header*>(memory);
+}
+
+static PacketRing::FrameHeader& GetFrame(uint32_t index) {
+  return *reinterpret_cast<PacketRing::FrameHeader*>(
+      memory + sizeof(PacketRing::Header) +
+      (index % kNumOfFrames) * kFrameSize);
+}
+
+static void TestLayout() {
+  assert(!PacketRing::IsInvalidLayout(kFrameSize, kNumOfFrames));
+  assert(!PacketRing::IsInvalidLayout(2048, 1));
+  assert(PacketRing::IsInvalidLayout(0, kNumOfFrames));
+  assert(PacketRing::IsInvalidLayout(100, kNumOfFrames));
+  assert(PacketRing::IsInvalidLayout(PacketRing::kMaxFrameSize * 2, 1));
+  assert(PacketRing::IsInvalidLayout(kFrameSize, 0));
+  assert(PacketRing::IsInvalidLayout(kFrameSize, 3));
+  assert(PacketRing::IsInvalidLayout(kFrameSize,
+                                     PacketRing::kMaxNumOfFrames * 2));
+  assert(PacketRing::GetByteSize(kFrameSize, kNumOfFrames) == sizeof(memory));
+}
+
+// The kernel produces frames and the test consumes them as a user would.
+static void TestProducer() {
+  PacketRing ring;
+  assert(!ring.IsEnabled());
+  memset(memory, 0xCC, sizeof(memory));
+  ring.Init(memory, kFrameSize, kNumOfFrames);
+  assert(ring.IsEnabled());
+  assert(ring.GetMaxDataSize() == kMaxDataSize);
+  assert(GetHeader().frame_size == kFrameSize);
+  assert(GetHeader().num_of_frames == kNumOfFrames);
+  assert(GetHeader().head == 0 && GetHeader().tail == 0);
+  assert(!ring.HasUnconsumedFrames());
+
+  uint8_t data[kMaxDataSize + 8];
+  for (uint32_t i = 0; i < sizeof(data); i++)
+    data[i] = static_cast<uint8_t>(i);
+  assert(!ring.Push(data, 5, 0x0100000A));
+  assert(ring.HasUnconsumedFrames());
+  assert(GetHeader().head == 1);
+  assert(GetFrame(0).size == 5 && GetFrame(0).original_size == 5);
+  assert(GetFrame(0).addr == 0x0100000A);
+  assert(memcmp(&GetFrame(0) + 1, data, 5) == 0);
+
+  // Truncated to the frame.
+  assert(!ring.Push(data, sizeof(data), 0));
+  assert(GetFrame(1).size == kMaxDataSize);
+  assert(GetFrame(1).original_size == sizeof(data));
+  assert(memcmp(&GetFrame(1) + 1, data, kMaxDataSize) == 0);
+
+  assert(!ring.Push(data, 1, 0));
+  assert(!ring.Push(data, 1, 0));
+  assert(ring.Push(data, 1, 0));
+  assert(GetHeader().num_of_dropped == 1);
+  assert(GetHeader().head == kNumOfFrames);
+
+  // Consuming one frame makes room for another.
+  GetHeader().tail = 1;
+  assert(!ring.Push(data + 3, 1, 0));
+  assert(GetHeader().head == kNumOfFrames + 1);
+  assert(*reinterpret_cast<uint8_t*>(&GetFrame(0) + 1) == 3);
+  GetHeader().tail = kNumOfFrames + 1;
+  assert(!ring.HasUnconsumedFrames());
+
+  // A broken tail makes the ring look full.
+  GetHeader().tail = GetHeader().head + 1;
+  assert(ring.Push(data, 1, 0));
+  assert(GetHeader().num_of_dropped == 2);
+}
+
+// The test produces frames as a user would and the kernel consumes them.
+static void TestConsumer() {
+  PacketRing ring;
+  ring.Init(memory, kFrameSize, kNumOfFrames);
+  uint32_t size;
+  uint32_t addr;
+  assert(!ring.Front(size, addr));
+
+  GetFrame(0).size = 3;
+  GetFrame(0).addr = 0x0200000A;
+  memcpy(&GetFrame(0) + 1, "abc", 3);
+  GetFrame(1).size = 0xFFFF'FFFF;
+  GetHeader().head = 2;
+  const uint8_t* data = ring.Front(size, addr);
+  assert(data && size == 3 && addr == 0x0200000A);
+  assert(memcmp(data, "abc", 3) == 0);
+  // Not consumed until Pop().
+  assert(ring.Front(size, addr) == data);
+  assert(GetHeader().tail == 0);
+  ring.Pop();
+  assert(GetHeader().tail == 1);
+  // A broken size is limited to the frame.
+  assert(ring.Front(size, addr));
+  assert(size == kMaxDataSize);
+  ring.Pop();
+  assert(!ring.Front(size, addr));
+
+  // Indices wrap around.
+  for (uint32_t i = 2; i < kNumOfFrames * 3; i++) {
+    GetFrame(i).size = 1;
+    GetFrame(i).addr = i;
+    GetHeader().head = i + 1;
+    assert(ring.Front(size, addr) && addr == i);
+    ring.Pop();
+  }
+  assert(GetHeader().tail == kNumOfFrames * 3);
+
+  // A broken head makes the ring look empty.
+  GetHeader().head = GetHeader().tail + kNumOfFrames + 1;
+  assert(!ring.Front(size, addr));
+  GetHeader().head = GetHeader().tail - 1;
+  assert(!ring.Front(size, addr));
+  GetHeader().head = GetHeader().tail + kNumOfFrames;
+  assert(ring.Front(size, addr));
+}
+
+int main() {
+  TestLayout();
+  TestProducer();
+  TestConsumer();
+
+  puts("PASS");
+  return 0;
+}
+
+#endif
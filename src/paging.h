@@ -358,6 +358,65 @@ void inline CreatePageMapping(TAllocator& allocator,
   }
 }
 
+// Clears the mappings created by CreatePageMapping(). Page tables are kept for
+// later use. Caller should flush TLB after calling this.
+inline void RemovePageMapping(IA_PML4& pml4,
+                              uint64_t vaddr,
+                              uint64_t byte_size) {
+  assert((vaddr & kPageAddrMask) == 0);
+  uint64_t num_of_4k_pages = ByteSizeToPageSize(byte_size);
+  while (num_of_4k_pages) {
+    auto& pml4e = pml4.GetEntryForAddr(vaddr);
+    if (!pml4e.IsPresent())
+      Panic("RemovePageMapping: pml4e not present");
+    auto& pdpte = pml4e.GetTableAddr()->GetEntryForAddr(vaddr);
+    if (!pdpte.IsPresent() || pdpte.IsPage())
+      Panic("RemovePageMapping: unexpected pdpte");
+    auto& pdte = pdpte.GetTableAddr()->GetEntryForAddr(vaddr);
+    if (!pdte.IsPresent())
+      Panic("RemovePageMapping: pdte not present");
+    if (pdte.IsPage()) {
+      if ((vaddr & IA_PDE::kOffsetMask) != 0 ||
+          num_of_4k_pages < IA_PT::kNumOfEntries)
+        Panic("RemovePageMapping: partial unmapping of 2MB page");
+      pdte.data = 0;
+      vaddr += (1 << 21);
+      num_of_4k_pages -= IA_PT::kNumOfEntries;
+      continue;
+    }
+    pdte.GetTableAddr()->GetEntryForAddr(vaddr).data = 0;
+    vaddr += (1 << 12);
+    num_of_4k_pages--;
+  }
+}
+
+// Frees page tables for the lower half (user space) of pml4 and pml4 itself.
+// Pages mapped by the tables are not freed.
+template <class TAllocator>
+void DestroyUserPageTable(TAllocator& allocator, IA_PML4& pml4) {
+  for (int pml4_idx = 0; pml4_idx < IA_PML4::kNumOfEntries / 2; pml4_idx++) {
+    auto& pml4e = pml4.entries[pml4_idx];
+    if (!pml4e.IsPresent())
+      continue;
+    IA_PDPT* pdpt = pml4e.GetTableAddr();
+    for (int pdpt_idx = 0; pdpt_idx < IA_PDPT::kNumOfEntries; pdpt_idx++) {
+      auto& pdpte = pdpt->entries[pdpt_idx];
+      if (!pdpte.IsPresent() || pdpte.IsPage())
+        continue;
+      IA_PDT* pdt = pdpte.GetTableAddr();
+      for (int pdt_idx = 0; pdt_idx < IA_PDT::kNumOfEntries; pdt_idx++) {
+        auto& pdte = pdt->entries[pdt_idx];
+        if (!pdte.IsPresent() || pdte.IsPage())
+          continue;
+        allocator.FreePages(reinterpret_cast<uint64_t>(pdte.GetTableAddr()), 1);
+      }
+      allocator.FreePages(reinterpret_cast<uint64_t>(pdt), 1);
+    }
+    allocator.FreePages(reinterpret_cast<uint64_t>(pdpt), 1);
+  }
+  allocator.FreePages(reinterpret_cast<uint64_t>(&pml4), 1);
+}
+
 static inline void AssertAddressIsInLowerHalf(uint64_t addr) {
   assert(static_cast<int64_t>(addr) >= 0);
 }
@@ -92,6 +92,39 @@ void TestRangeMapping(IA_PML4& pml4,
   assert(v2p(pml4, vaddr + size) == kAddrCannotTranslate);
 }
 
+void TestRemoveMappingAndDestroyUserPageTable() {
+  constexpr int kPageTableBufferSize = 64;
+  PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy> allocator;
+  uint64_t malloc_addr = reinterpret_cast<uint64_t>(
+      malloc(kPageSize * (kPageTableBufferSize + 1)));
+  if (!malloc_addr) {
+    perror("malloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  allocator.FreePagesWithProximityDomain(
+      (malloc_addr + kPageSize - 1) & ~kPageAddrMask, kPageTableBufferSize, 0);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+
+  IA_PML4& user_pml4 = AllocPageTable(allocator);
+  // 2MB mapping followed by 4KB mappings
+  const uint64_t vaddr = 0x0000'0000'4000'0000ULL;
+  const uint64_t paddr = 0x0000'0000'8000'0000ULL;
+  const uint64_t size = (1 << 21) + 3 * kPageSize;
+  CreatePageMapping(allocator, user_pml4, vaddr, paddr, size,
+                    kPageAttrPresent);
+  CreatePageMapping(allocator, user_pml4, 0x0000'7FFF'0000'0000ULL, paddr,
+                    kPageSize, kPageAttrPresent);
+  assert(v2p(user_pml4, vaddr + size - 1) == paddr + size - 1);
+
+  RemovePageMapping(user_pml4, vaddr, size);
+  assert(v2p(user_pml4, vaddr) == kAddrCannotTranslate);
+  assert(v2p(user_pml4, vaddr + size - 1) == kAddrCannotTranslate);
+  assert(v2p(user_pml4, 0x0000'7FFF'0000'0000ULL) == paddr);
+
+  DestroyUserPageTable(allocator, user_pml4);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+}
+
 int main() {
   Test1GBPageMapping(0, 1ULL << 30);
   Test1GBPageMapping(1ULL << 30, 1ULL << 31);
@@ -101,6 +134,7 @@ int main() {
                    4ULL * 1024 * 1024 * 1024);
   TestRangeMapping(pml4, 0xFFFF'FFFF'FFE0'0000ULL, 0x0000'0000'FFE0'0000ULL,
                    0x0000'0000'0020'0000ULL);
+  TestRemoveMappingAndDestroyUserPageTable();
   puts("PASS");
   return 0;
 }
@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <string>
 
+#include "kernel.h"
 #include "liumos.h"
 
 constexpr uint16_t kIOAddrPCIConfigAddr = 0x0CF8;
@@ -20,6 +21,7 @@ static const std::
             {{0x1234, 0x1111}, "QEMU Virtual Video Controller"},
             {{0x10ec, 0x8168},
              "RTL8111/8168/8411 PCI Express Gigabit Ethernet Controller"},
+            {{0x10ec, 0x8169}, "RTL8169 PCI Gigabit Ethernet Controller"},
             {{0x10ec, 0x8139}, "RTL-8100/8101L/8139 PCI Fast Ethernet Adapter"},
             {{0x1af4, 0x1000}, "Virtio Network Card"},
 };
@@ -41,7 +43,7 @@ uint8_t PCI::ReadConfigRegister8(uint32_t bus,
                                  uint32_t func,
                                  uint32_t reg) {
   SelectRegister(bus, device, func, reg & 0b1111'1100);
-  return (ReadIOPort32(kIOAddrPCIConfigData) >> (reg & 3)) & 0xFF;
+  return (ReadIOPort32(kIOAddrPCIConfigData) >> ((reg & 3) * 8)) & 0xFF;
 }
 
 uint32_t PCI::ReadConfigRegister32(uint32_t bus,
@@ -120,6 +122,77 @@ void PCI::PrintDevices() {
   }
 }
 
+std::optional<uint8_t> PCI::FindCapability(const DeviceLocation& dev,
+                                            uint8_t cap_id) {
+  // PCI: 6.7. Capabilities List
+  constexpr uint32_t kPCIRegOffsetStatus = 0x06;
+  constexpr uint32_t kPCIRegOffsetCapabilitiesPointer = 0x34;
+  constexpr uint8_t kPCIStatusBitCapabilitiesList = 1 << 4;
+  if (!(ReadConfigRegister8(dev, kPCIRegOffsetStatus) &
+        kPCIStatusBitCapabilitiesList))
+    return std::nullopt;
+  uint8_t cap_ofs = ReadConfigRegister8(dev, kPCIRegOffsetCapabilitiesPointer);
+  // Each capability takes at least 4 bytes, so this bounds broken lists.
+  for (int i = 0; cap_ofs && i < 64; i++) {
+    cap_ofs &= ~0b11;
+    if (ReadConfigRegister8(dev, cap_ofs) == cap_id)
+      return cap_ofs;
+    cap_ofs = ReadConfigRegister8(dev, cap_ofs + 1);
+  }
+  return std::nullopt;
+}
+
+bool PCI::EnableMSIX(const DeviceLocation& dev,
+                     int entry,
+                     uint32_t apic_id,
+                     uint8_t vector) {
+  // PCI: 6.8.2. MSI-X Capability and Table Structure
+  constexpr uint8_t kCapIDMSIX = 0x11;
+  constexpr uint32_t kMessageControlBitEnable = 1 << 31;
+  constexpr uint32_t kMessageControlBitFunctionMask = 1 << 30;
+  constexpr uint64_t kMSIAddressBase = 0xFEE0'0000;
+  packed_struct TableEntry {
+    uint32_t message_addr_low;
+    uint32_t message_addr_high;
+    uint32_t message_data;
+    uint32_t vector_control;  // bit 0: Mask
+  };
+  std::optional<uint8_t> cap_ofs = FindCapability(dev, kCapIDMSIX);
+  if (!cap_ofs)
+    return false;
+  // Message Control is in the upper half of the first dword.
+  uint32_t cap_header = ReadConfigRegister32(dev, *cap_ofs);
+  const int table_size = ((cap_header >> 16) & 0x7FF) + 1;
+  if (entry < 0 || table_size <= entry)
+    return false;
+  const uint32_t table_ofs_and_bir = ReadConfigRegister32(dev, *cap_ofs + 4);
+  std::optional<uint64_t> bar_paddr =
+      GetMemoryBARPhysAddr(dev, table_ofs_and_bir & 0b111);
+  if (!bar_paddr || !*bar_paddr)
+    return false;
+  const uint64_t table_paddr = *bar_paddr + (table_ofs_and_bir & ~0b111U);
+  const uint64_t map_base = table_paddr & ~kPageAddrMask;
+  // The table is mapped only while the entry is written.
+  const uint64_t map_size =
+      table_paddr - map_base + sizeof(TableEntry) * table_size;
+  uint8_t* mapped = MapMemoryForIO<uint8_t*>(map_base, map_size);
+  volatile TableEntry& te = reinterpret_cast<volatile TableEntry*>(
+      mapped + (table_paddr - map_base))[entry];
+  // Intel SDM Vol.3 10.11 Message Signalled Interrupts: fixed delivery,
+  // edge triggered.
+  te.vector_control = 1;
+  te.message_addr_low =
+      static_cast<uint32_t>(kMSIAddressBase | (apic_id << 12));
+  te.message_addr_high = 0;
+  te.message_data = vector;
+  te.vector_control = 0;
+  UnmapMemoryForIO(mapped, map_size);
+  cap_header |= kMessageControlBitEnable;
+  cap_header &= ~kMessageControlBitFunctionMask;
+  WriteConfigRegister32(dev, *cap_ofs, cap_header);
+  return true;
+}
+
 const char* PCI::GetDeviceName(DeviceIdent key) {
   const auto& it = device_infos.find(key);
   return it != device_infos.end() ? it->second : "(Unknown)";
@@ -1,4 +1,5 @@
 #pragma once
+#include <optional>
 #include <unordered_map>
 
 class PCI {
@@ -66,6 +67,24 @@ class PCI {
     WriteConfigRegister32(dev, reg + 4, static_cast<uint32_t>(value >> 32));
   }
   static const char* GetDeviceName(DeviceIdent key);
+  // Returns the config space offset of the capability with cap_id.
+  static std::optional<uint8_t> FindCapability(const DeviceLocation& dev,
+                                               uint8_t cap_id);
+  // Routes the MSI-X table entry of dev to vector of the processor with
+  // apic_id, and enables MSI-X. Other entries stay masked.
+  // Returns false if dev does not support MSI-X.
+  static bool EnableMSIX(const DeviceLocation& dev,
+                         int entry,
+                         uint32_t apic_id,
+                         uint8_t vector);
+  // Clears the Interrupt Disable bit set by EnsureBusMasterEnabled().
+  static void EnableINTx(const DeviceLocation& dev) {
+    constexpr uint32_t kPCIRegOffsetCommandAndStatus = 0x04;
+    uint32_t cmd_and_status =
+        ReadConfigRegister32(dev, kPCIRegOffsetCommandAndStatus);
+    cmd_and_status &= ~(1 << 10);  // Interrupt Disable
+    WriteConfigRegister32(dev, kPCIRegOffsetCommandAndStatus, cmd_and_status);
+  }
   static void EnsureBusMasterEnabled(DeviceLocation& dev) {
     constexpr uint32_t kPCIRegOffsetCommandAndStatus = 0x04;
     constexpr uint64_t kPCIRegCommandAndStatusMaskBusMasterEnable = 1 << 2;
@@ -92,6 +111,25 @@ class PCI {
     assert((bar_raw_val & kPCIBARMaskType) == kPCIBARBitsTypeIOSpace);
     return {static_cast<uint16_t>(bar_raw_val & ~kPCIBARMaskType)};
   }
+  // Returns the physical address of the memory space BAR at index, or
+  // nullopt if it is an I/O space BAR.
+  static std::optional<uint64_t> GetMemoryBARPhysAddr(
+      const DeviceLocation& dev,
+      int index) {
+    constexpr uint32_t kPCIRegOffsetBAR = 0x10;
+    constexpr uint64_t kPCIBARMaskAddr = ~0b1111ULL;
+    constexpr uint64_t kPCIBARBitIOSpace = 0b1;
+    constexpr uint64_t kPCIBARMaskMemoryType = 0b110;
+    constexpr uint64_t kPCIBARBitsType64bit = 0b100;
+    assert(0 <= index && index < 6);
+    const uint32_t reg = kPCIRegOffsetBAR + index * 4;
+    uint64_t bar_raw_val = ReadConfigRegister32(dev, reg);
+    if (bar_raw_val & kPCIBARBitIOSpace)
+      return std::nullopt;
+    if ((bar_raw_val & kPCIBARMaskMemoryType) == kPCIBARBitsType64bit)
+      bar_raw_val = ReadConfigRegister64(dev, reg);
+    return bar_raw_val & kPCIBARMaskAddr;
+  }
   static BAR64 GetBAR64(const DeviceLocation& dev) {
     constexpr uint32_t kPCIRegOffsetBAR = 0x10;
     constexpr uint64_t kPCIBARMaskType = 0b111;
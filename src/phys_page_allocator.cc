@@ -2,32 +2,71 @@
 #include "liumos.h"
 
 template <class TStrategy>
-void PhysicalPageAllocator<TStrategy>::FreeInfo::Print() {
-  uint64_t physical_start = TStrategy::GetPhysAddrFromFreeInfo(this);
+void PhysicalPageAllocator<TStrategy>::Zone::Print() {
   PutString("[ 0x");
-  PutHex64ZeroFilled(physical_start);
+  PutHex64ZeroFilled(base_phys_addr_);
   PutString(" - 0x");
-  PutHex64ZeroFilled(physical_start + (num_of_pages_ << 12));
+  PutHex64ZeroFilled(base_phys_addr_ + (num_of_pages_ << kPageSizeExponent));
   PutString(" )@ProxDomain:0x");
   PutHex64(proximity_domain_);
   PutString(" = 0x");
+  PutHex64(num_of_free_pages_);
+  PutString(" / 0x");
   PutHex64(num_of_pages_);
-  PutString(" pages\n");
+  PutString(" pages free\n");
+  for (int order = 0; order < kNumOfOrders; order++) {
+    if (!free_list_head_[order])
+      continue;
+    int num_of_blocks = 0;
+    for (FreeBlock* block = GetFreeBlockFromPhysAddr(free_list_head_[order]);
+         block; block = GetFreeBlockFromPhysAddr(block->next_phys_addr))
+      num_of_blocks++;
+    PutString("  order ");
+    PutHex64(order);
+    PutString(": ");
+    PutHex64(num_of_blocks);
+    PutString(" blocks\n");
+  }
 }
 template void
-PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>::FreeInfo::Print();
+PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>::Zone::Print();
 
 template <class TStrategy>
 void PhysicalPageAllocator<TStrategy>::Print() {
-  FreeInfo* info = TStrategy::GetFreeInfoFromPhysAddr(head_phys_addr_);
-  while (info) {
-    info->Print();
-    info = info->GetNext();
+  for (int i = 0; i < num_of_nodes_; i++) {
+    for (Zone* zone = GetHeadZone(nodes_[i]); zone; zone = zone->GetNext())
+      zone->Print();
   }
 }
 template void
 PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>::Print();
 
+template <class TStrategy>
+void PhysicalPageAllocator<TStrategy>::PrintNodeUsage() {
+  const uint32_t local_domain = GetLocalProximityDomain();
+  for (int i = 0; i < num_of_nodes_; i++) {
+    const Node& node = nodes_[i];
+    const uint64_t num_of_free_pages = GetNumOfFreePages(node);
+    PutString(node.proximity_domain == local_domain ? "* " : "  ");
+    PutString("ProxDomain:0x");
+    PutHex64(node.proximity_domain);
+    PutString(" used 0x");
+    PutHex64((node.num_of_pages - num_of_free_pages) << 2);
+    PutString(" KiB, free 0x");
+    PutHex64(num_of_free_pages << 2);
+    PutString(" KiB, total 0x");
+    PutHex64(node.num_of_pages << 2);
+    PutString(" KiB, fallback:");
+    for (int k = 0; k < num_of_nodes_; k++) {
+      PutString(" 0x");
+      PutHex64(nodes_[fallback_order_[i][k]].proximity_domain);
+    }
+    PutString("\n");
+  }
+}
+template void
+PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>::PrintNodeUsage();
+
 PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>&
 GetSystemDRAMAllocator() {
   assert(GetLoaderInfo().dram_allocator);
@@ -1,118 +1,419 @@
 #pragma once
 #include "generic.h"
+#include "spin_lock.h"
 
 struct UsePhysicalAddressInternallyStrategy;
 struct UseKernelStraightMappingInternallyStrategy;
 
+// Binary buddy allocator for physical pages.
+// Each range given by FreePagesWithProximityDomain() becomes a Zone. A Zone
+// keeps its own header and a bitmap (1 bit per page, set if the page is the
+// head of a free block) at the beginning of the range, and manages the rest
+// of the range with per-order doubly linked free lists. All links are stored
+// as physical addresses so that the same object can be used from both the
+// loader (identity mapped) and the kernel (straight mapped).
+// Zones are grouped into a Node for each proximity domain. Allocations prefer
+// the local node and fall back to other nodes in the order of distance given
+// by SetDistanceTable() (usually taken from ACPI SLIT). The local node is the
+// one of the processor which allocates, given by the getter set with
+// SetLocalProximityDomainGetter(), or the first node if it is not set.
+// Allocations and frees are serialized by a SpinLock so that they can be
+// called from any processor.
 template <class TStrategy>
 class PhysicalPageAllocator {
  public:
-  PhysicalPageAllocator() : head_phys_addr_(0) {}
+  static constexpr int kNumOfOrders = 32;
+  static constexpr int kMaxNumOfNodes = 8;
+  // Defined in ACPI spec for SLIT
+  static constexpr uint8_t kLocalDistance = 10;
+  static constexpr uint8_t kRemoteDistance = 20;
+  static constexpr uint8_t kUnreachableDistance = 0xff;
+
+  PhysicalPageAllocator()
+      : num_of_nodes_(0), get_local_proximity_domain_(nullptr) {}
+  // Adds a new range of pages to this allocator.
   void FreePagesWithProximityDomain(uint64_t phys_addr,
                                     uint64_t num_of_pages,
                                     uint32_t prox_domain) {
-    // TODO: Impl merge
     assert(num_of_pages > 0);
     assert((phys_addr & 0xfff) == 0);
-    FreeInfo* info = TStrategy::GetFreeInfoFromPhysAddr(phys_addr);
-    head_phys_addr_ = TStrategy::GetPhysAddrFromFreeInfo(new (info) FreeInfo(
-        num_of_pages, TStrategy::GetFreeInfoFromPhysAddr(head_phys_addr_),
-        prox_domain));
+    if (phys_addr == 0) {
+      // Physical address 0 is used as a null link.
+      phys_addr += kPageSize;
+      num_of_pages--;
+    }
+    const uint64_t num_of_meta_pages = Zone::GetNumOfMetaPages(num_of_pages);
+    if (num_of_pages <= num_of_meta_pages)
+      return;
+    lock_.Lock();
+    Node& node = GetOrCreateNode(prox_domain);
+    Zone* zone = new (TStrategy::template GetVirtAddrFromPhysAddr<Zone>(
+        phys_addr)) Zone(phys_addr + (num_of_meta_pages << kPageSizeExponent),
+                         num_of_pages - num_of_meta_pages, prox_domain,
+                         node.head_zone_phys_addr);
+    node.head_zone_phys_addr = phys_addr;
+    node.num_of_pages += zone->GetNumOfPages();
+    zone->FreeRange(0, zone->GetNumOfPages());
+    lock_.Unlock();
+  }
+  // Returns pages which were allocated by AllocPages*() to this allocator.
+  // A part of the allocated range can be freed.
+  void FreePages(uint64_t phys_addr, uint64_t num_of_pages) {
+    assert((phys_addr & 0xfff) == 0);
+    if (!num_of_pages)
+      return;
+    lock_.Lock();
+    for (int i = 0; i < num_of_nodes_; i++) {
+      for (Zone* zone = GetHeadZone(nodes_[i]); zone; zone = zone->GetNext()) {
+        if (!zone->Contains(phys_addr))
+          continue;
+        zone->FreeRange(
+            (phys_addr - zone->GetBasePhysAddr()) >> kPageSizeExponent,
+            num_of_pages);
+        lock_.Unlock();
+        return;
+      }
+    }
+    Panic("FreePages: Out of range");
+  }
+  // distance_table is a num_of_localities x num_of_localities matrix indexed
+  // by proximity domains, in the same format as ACPI SLIT.
+  void SetDistanceTable(const uint8_t* distance_table,
+                        uint64_t num_of_localities) {
+    for (int from = 0; from < num_of_nodes_; from++) {
+      for (int to = 0; to < num_of_nodes_; to++) {
+        const uint64_t from_domain = nodes_[from].proximity_domain;
+        const uint64_t to_domain = nodes_[to].proximity_domain;
+        if (from_domain >= num_of_localities || to_domain >= num_of_localities)
+          continue;
+        distance_[from][to] =
+            distance_table[from_domain * num_of_localities + to_domain];
+      }
+    }
+    UpdateFallbackOrder();
+  }
+  // getter is called on each allocation, so it should return the proximity
+  // domain of the processor which calls it.
+  void SetLocalProximityDomainGetter(uint32_t (*getter)()) {
+    get_local_proximity_domain_ = getter;
+  }
+  uint32_t GetLocalProximityDomain() const {
+    if (get_local_proximity_domain_)
+      return get_local_proximity_domain_();
+    return num_of_nodes_ ? nodes_[0].proximity_domain : 0;
   }
 
   template <typename T>
   T AllocPages(uint64_t num_of_pages) {
-    FreeInfo* info = TStrategy::GetFreeInfoFromPhysAddr(head_phys_addr_);
-    void* addr = nullptr;
-    while (info) {
-      addr = info->ProvidePages(num_of_pages);
-      if (addr)
-        return reinterpret_cast<T>(addr);
-      info = info->GetNext();
+    return AllocPagesNearProximityDomain<T>(num_of_pages,
+                                            GetLocalProximityDomain());
+  }
+  // Tries the node of proximity_domain first, then other nodes from the
+  // nearest one.
+  template <typename T>
+  T AllocPagesNearProximityDomain(uint64_t num_of_pages,
+                                  uint32_t proximity_domain) {
+    int node_index = FindNode(proximity_domain);
+    if (node_index < 0)
+      node_index = 0;
+    lock_.Lock();
+    for (int i = 0; i < num_of_nodes_; i++) {
+      uint64_t paddr = ProvidePagesFromNode(
+          nodes_[fallback_order_[node_index][i]], num_of_pages);
+      if (paddr) {
+        lock_.Unlock();
+        return reinterpret_cast<T>(paddr);
+      }
     }
     Panic("Cannot allocate pages");
   }
   template <typename T>
   T AllocPagesInProximityDomain(uint64_t num_of_pages,
                                 uint32_t proximity_domain) {
-    FreeInfo* info = TStrategy::GetFreeInfoFromPhysAddr(head_phys_addr_);
-    void* addr = nullptr;
-    while (info) {
-      if (info->GetProximityDomain() == proximity_domain) {
-        addr = info->ProvidePages(num_of_pages);
-        if (addr)
-          return reinterpret_cast<T>(addr);
-      }
-      info = info->GetNext();
+    int node_index = FindNode(proximity_domain);
+    if (node_index >= 0) {
+      lock_.Lock();
+      uint64_t paddr = ProvidePagesFromNode(nodes_[node_index], num_of_pages);
+      lock_.Unlock();
+      if (paddr)
+        return reinterpret_cast<T>(paddr);
     }
     Panic("Cannot allocate pages");
   }
+  uint64_t GetNumOfFreePages() const {
+    uint64_t num_of_free_pages = 0;
+    for (int i = 0; i < num_of_nodes_; i++)
+      num_of_free_pages += GetNumOfFreePages(nodes_[i]);
+    return num_of_free_pages;
+  }
+  uint64_t GetNumOfFreePagesInProximityDomain(uint32_t proximity_domain) const {
+    int node_index = FindNode(proximity_domain);
+    return node_index < 0 ? 0 : GetNumOfFreePages(nodes_[node_index]);
+  }
   void Print();
+  void PrintNodeUsage();
 
  private:
-  friend struct UsePhysicalAddressInternallyStrategy;
-  friend struct UseKernelStraightMappingInternallyStrategy;
+  static constexpr int GetOrderToFit(uint64_t num_of_pages) {
+    int order = 0;
+    while (order < kNumOfOrders && (1ULL << order) < num_of_pages)
+      order++;
+    return order;
+  }
 
-  class FreeInfo {
+  struct FreeBlock {
+    uint64_t next_phys_addr;
+    uint64_t prev_phys_addr;
+    uint64_t order;
+  };
+  static_assert(sizeof(FreeBlock) <= kPageSize);
+
+  class Zone {
    public:
-    FreeInfo(uint64_t num_of_pages, FreeInfo* next, uint32_t proximity_domain)
-        : num_of_pages_(num_of_pages),
-          next_phys_addr_(TStrategy::GetPhysAddrFromFreeInfo(next)),
-          proximity_domain_(proximity_domain) {}
-    FreeInfo* GetNext() const {
-      return TStrategy::GetFreeInfoFromPhysAddr(next_phys_addr_);
-    }
-    void* ProvidePages(uint64_t num_of_req_pages) {
-      if (!CanProvidePages(num_of_req_pages))
-        return nullptr;
-      num_of_pages_ -= num_of_req_pages;
-      return reinterpret_cast<void*>(TStrategy::GetPhysAddrFromFreeInfo(this) +
-                                     (num_of_pages_ << 12));
+    static uint64_t GetNumOfMetaPages(uint64_t num_of_pages) {
+      return ByteSizeToPageSize(sizeof(Zone) +
+                                (num_of_pages + 63) / 64 * sizeof(uint64_t));
+    }
+    Zone(uint64_t base_phys_addr,
+         uint64_t num_of_pages,
+         uint32_t proximity_domain,
+         uint64_t next_zone_phys_addr)
+        : base_phys_addr_(base_phys_addr),
+          num_of_pages_(num_of_pages),
+          next_zone_phys_addr_(next_zone_phys_addr),
+          num_of_free_pages_(0),
+          proximity_domain_(proximity_domain),
+          free_order_mask_(0) {
+      for (int i = 0; i < kNumOfOrders; i++)
+        free_list_head_[i] = 0;
+      for (uint64_t i = 0; i < (num_of_pages + 63) / 64; i++)
+        GetBitmap()[i] = 0;
+    }
+    Zone* GetNext() const {
+      return TStrategy::template GetVirtAddrFromPhysAddr<Zone>(
+          next_zone_phys_addr_);
+    }
+    uint64_t GetBasePhysAddr() const { return base_phys_addr_; }
+    uint64_t GetNumOfPages() const { return num_of_pages_; }
+    uint64_t GetNumOfFreePages() const { return num_of_free_pages_; }
+    uint32_t GetProximityDomain() const { return proximity_domain_; }
+    bool Contains(uint64_t phys_addr) const {
+      return base_phys_addr_ <= phys_addr &&
+             phys_addr < base_phys_addr_ + (num_of_pages_ << kPageSizeExponent);
+    }
+    // Returns physical address of allocated pages, or 0 if this zone does not
+    // have enough contiguous pages.
+    uint64_t ProvidePages(uint64_t num_of_req_pages) {
+      assert(num_of_req_pages > 0);
+      const int req_order = GetOrderToFit(num_of_req_pages);
+      if (req_order >= kNumOfOrders)
+        return 0;
+      const uint32_t candidates = free_order_mask_ >> req_order << req_order;
+      if (!candidates)
+        return 0;
+      int order = __builtin_ctz(candidates);
+      const uint64_t index = PopFreeBlock(order);
+      // Split until the block fits to the request.
+      while (order > req_order) {
+        order--;
+        PushFreeBlock(index + (1ULL << order), order);
+      }
+      num_of_free_pages_ -= 1ULL << order;
+      // Give back the tail pages which are not requested.
+      FreeRange(index + num_of_req_pages,
+                (1ULL << order) - num_of_req_pages);
+      return GetPhysAddrOfPage(index);
+    }
+    void FreeRange(uint64_t index, uint64_t num_of_pages) {
+      assert(index + num_of_pages <= num_of_pages_);
+      while (num_of_pages) {
+        int order = index ? __builtin_ctzll(index) : kNumOfOrders - 1;
+        if (order > kNumOfOrders - 1)
+          order = kNumOfOrders - 1;
+        while ((1ULL << order) > num_of_pages)
+          order--;
+        FreeBlockAndMerge(index, order);
+        index += 1ULL << order;
+        num_of_pages -= 1ULL << order;
+      }
     }
-
     void Print();
-    uint32_t GetProximityDomain() { return proximity_domain_; };
 
    private:
-    bool CanProvidePages(uint64_t num_of_req_pages) const {
-      return num_of_req_pages < num_of_pages_;
+    uint64_t GetPhysAddrOfPage(uint64_t index) const {
+      return base_phys_addr_ + (index << kPageSizeExponent);
+    }
+    FreeBlock* GetFreeBlock(uint64_t index) const {
+      return TStrategy::template GetVirtAddrFromPhysAddr<FreeBlock>(
+          GetPhysAddrOfPage(index));
+    }
+    FreeBlock* GetFreeBlockFromPhysAddr(uint64_t phys_addr) const {
+      return TStrategy::template GetVirtAddrFromPhysAddr<FreeBlock>(phys_addr);
+    }
+    uint64_t* GetBitmap() { return reinterpret_cast<uint64_t*>(this + 1); }
+    const uint64_t* GetBitmap() const {
+      return reinterpret_cast<const uint64_t*>(this + 1);
+    }
+    bool IsFreeBlockHead(uint64_t index) const {
+      return (GetBitmap()[index >> 6] >> (index & 63)) & 1;
+    }
+    void SetFreeBlockHead(uint64_t index, bool is_head) {
+      if (is_head)
+        GetBitmap()[index >> 6] |= 1ULL << (index & 63);
+      else
+        GetBitmap()[index >> 6] &= ~(1ULL << (index & 63));
+    }
+    void PushFreeBlock(uint64_t index, int order) {
+      assert(!IsFreeBlockHead(index));
+      FreeBlock* block = GetFreeBlock(index);
+      block->order = order;
+      block->prev_phys_addr = 0;
+      block->next_phys_addr = free_list_head_[order];
+      if (block->next_phys_addr)
+        GetFreeBlockFromPhysAddr(block->next_phys_addr)->prev_phys_addr =
+            GetPhysAddrOfPage(index);
+      free_list_head_[order] = GetPhysAddrOfPage(index);
+      free_order_mask_ |= 1U << order;
+      SetFreeBlockHead(index, true);
+    }
+    void RemoveFreeBlock(uint64_t index, int order) {
+      FreeBlock* block = GetFreeBlock(index);
+      if (block->prev_phys_addr)
+        GetFreeBlockFromPhysAddr(block->prev_phys_addr)->next_phys_addr =
+            block->next_phys_addr;
+      else
+        free_list_head_[order] = block->next_phys_addr;
+      if (block->next_phys_addr)
+        GetFreeBlockFromPhysAddr(block->next_phys_addr)->prev_phys_addr =
+            block->prev_phys_addr;
+      if (!free_list_head_[order])
+        free_order_mask_ &= ~(1U << order);
+      SetFreeBlockHead(index, false);
+    }
+    uint64_t PopFreeBlock(int order) {
+      const uint64_t index =
+          (free_list_head_[order] - base_phys_addr_) >> kPageSizeExponent;
+      RemoveFreeBlock(index, order);
+      return index;
+    }
+    void FreeBlockAndMerge(uint64_t index, int order) {
+      num_of_free_pages_ += 1ULL << order;
+      while (order < kNumOfOrders - 1) {
+        const uint64_t buddy = index ^ (1ULL << order);
+        if (buddy + (1ULL << order) > num_of_pages_ ||
+            !IsFreeBlockHead(buddy) ||
+            GetFreeBlock(buddy)->order != static_cast<uint64_t>(order))
+          break;
+        RemoveFreeBlock(buddy, order);
+        index &= ~(1ULL << order);
+        order++;
+      }
+      PushFreeBlock(index, order);
     }
 
+    uint64_t base_phys_addr_;
     uint64_t num_of_pages_;
-    uint64_t next_phys_addr_;
+    uint64_t next_zone_phys_addr_;
+    uint64_t num_of_free_pages_;
     uint32_t proximity_domain_;
+    uint32_t free_order_mask_;
+    uint64_t free_list_head_[kNumOfOrders];
+    // The bitmap follows immediately after this header.
   };
-  static_assert(sizeof(FreeInfo) <= kPageSize);
 
-  uint64_t head_phys_addr_;
+  struct Node {
+    uint32_t proximity_domain;
+    uint64_t head_zone_phys_addr;
+    uint64_t num_of_pages;
+  };
+
+  Zone* GetHeadZone(const Node& node) const {
+    return TStrategy::template GetVirtAddrFromPhysAddr<Zone>(
+        node.head_zone_phys_addr);
+  }
+  uint64_t GetNumOfFreePages(const Node& node) const {
+    uint64_t num_of_free_pages = 0;
+    for (Zone* zone = GetHeadZone(node); zone; zone = zone->GetNext())
+      num_of_free_pages += zone->GetNumOfFreePages();
+    return num_of_free_pages;
+  }
+  uint64_t ProvidePagesFromNode(const Node& node, uint64_t num_of_pages) {
+    for (Zone* zone = GetHeadZone(node); zone; zone = zone->GetNext()) {
+      uint64_t paddr = zone->ProvidePages(num_of_pages);
+      if (paddr)
+        return paddr;
+    }
+    return 0;
+  }
+  int FindNode(uint32_t proximity_domain) const {
+    for (int i = 0; i < num_of_nodes_; i++) {
+      if (nodes_[i].proximity_domain == proximity_domain)
+        return i;
+    }
+    return -1;
+  }
+  Node& GetOrCreateNode(uint32_t proximity_domain) {
+    const int found_index = FindNode(proximity_domain);
+    if (found_index >= 0)
+      return nodes_[found_index];
+    // Both bounds are checked on a local copy, so that compilers can also
+    // see the writes to distance_ below are in range.
+    const int node_index = num_of_nodes_;
+    if (node_index < 0 || node_index >= kMaxNumOfNodes)
+      Panic("Too many proximity domains");
+    num_of_nodes_ = node_index + 1;
+    Node& node = nodes_[node_index];
+    node.proximity_domain = proximity_domain;
+    node.head_zone_phys_addr = 0;
+    node.num_of_pages = 0;
+    for (int i = 0; i < num_of_nodes_; i++) {
+      distance_[node_index][i] = kRemoteDistance;
+      distance_[i][node_index] = kRemoteDistance;
+    }
+    distance_[node_index][node_index] = kLocalDistance;
+    UpdateFallbackOrder();
+    return node;
+  }
+  void UpdateFallbackOrder() {
+    for (int from = 0; from < num_of_nodes_; from++) {
+      // Insertion sort by distance. Stable, so ties keep the node order.
+      int8_t* order = fallback_order_[from];
+      for (int i = 0; i < num_of_nodes_; i++) {
+        int k = i;
+        while (k > 0 && distance_[from][order[k - 1]] > distance_[from][i]) {
+          order[k] = order[k - 1];
+          k--;
+        }
+        order[k] = static_cast<int8_t>(i);
+      }
+    }
+  }
+
+  Node nodes_[kMaxNumOfNodes];
+  uint8_t distance_[kMaxNumOfNodes][kMaxNumOfNodes];
+  int8_t fallback_order_[kMaxNumOfNodes][kMaxNumOfNodes];
+  int num_of_nodes_;
+  uint32_t (*get_local_proximity_domain_)();
+  SpinLock lock_;
 };
 
 PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>&
 GetSystemDRAMAllocator();
 
 struct UsePhysicalAddressInternallyStrategy {
-  using FreeInfo =
-      PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>::FreeInfo;
-  static inline FreeInfo* GetFreeInfoFromPhysAddr(uint64_t paddr) {
-    return reinterpret_cast<FreeInfo*>(paddr);
-  }
-  static inline uint64_t GetPhysAddrFromFreeInfo(FreeInfo* free_info) {
-    return reinterpret_cast<uint64_t>(free_info);
+  template <typename T>
+  static inline T* GetVirtAddrFromPhysAddr(uint64_t paddr) {
+    return reinterpret_cast<T*>(paddr);
   }
 };
 
 uint64_t GetKernelStraightMappingBase();
 struct UseKernelStraightMappingInternallyStrategy {
-  using FreeInfo = PhysicalPageAllocator<
-      UseKernelStraightMappingInternallyStrategy>::FreeInfo;
-  static inline FreeInfo* GetFreeInfoFromPhysAddr(uint64_t paddr) {
-    return reinterpret_cast<FreeInfo*>(paddr + GetKernelStraightMappingBase());
-  }
-  static inline uint64_t GetPhysAddrFromFreeInfo(FreeInfo* free_info) {
-    if (!free_info)
-      return 0;
-    return reinterpret_cast<uint64_t>(free_info) -
-           GetKernelStraightMappingBase();
+  template <typename T>
+  static inline T* GetVirtAddrFromPhysAddr(uint64_t paddr) {
+    if (!paddr)
+      return nullptr;
+    return reinterpret_cast<T*>(paddr + GetKernelStraightMappingBase());
   }
 };
 using KernelPhysPageAllocator =
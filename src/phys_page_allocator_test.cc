@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cassert>
+#include <chrono>
+#include <random>
+#include <vector>
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+#include "phys_page_allocator.h"
+
+using TestAllocator =
+    PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>;
+
+uint64_t AllocArena(uint64_t num_of_pages) {
+  uint64_t malloc_addr =
+      reinterpret_cast<uint64_t>(malloc(kPageSize * (num_of_pages + 1)));
+  if (!malloc_addr) {
+    perror("malloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  return (malloc_addr + kPageSize - 1) & ~kPageAddrMask;
+}
+
+void TestSplitAndMerge() {
+  constexpr uint64_t kArenaPages = 1024;
+  TestAllocator allocator;
+  allocator.FreePagesWithProximityDomain(AllocArena(kArenaPages), kArenaPages,
+                                         0);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+  assert(0 < initial_free_pages && initial_free_pages < kArenaPages);
+
+  uint64_t a = allocator.AllocPages<uint64_t>(1);
+  uint64_t b = allocator.AllocPages<uint64_t>(3);
+  uint64_t c = allocator.AllocPages<uint64_t>(17);
+  assert((a & kPageAddrMask) == 0);
+  assert((b & kPageAddrMask) == 0);
+  assert((c & kPageAddrMask) == 0);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages - 1 - 3 - 17);
+  // Write to allocated pages to make sure they do not overlap with metadata.
+  memset(reinterpret_cast<void*>(a), 0xaa, kPageSize * 1);
+  memset(reinterpret_cast<void*>(b), 0xbb, kPageSize * 3);
+  memset(reinterpret_cast<void*>(c), 0xcc, kPageSize * 17);
+
+  allocator.FreePages(b, 3);
+  allocator.FreePages(a, 1);
+  // Free a part of the allocated range.
+  allocator.FreePages(c + kPageSize * 16, 1);
+  allocator.FreePages(c, 16);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+
+  // All blocks should be merged again, so the largest block can be allocated.
+  uint64_t largest = 1;
+  while (largest * 2 <= initial_free_pages)
+    largest *= 2;
+  uint64_t d = allocator.AllocPages<uint64_t>(largest);
+  allocator.FreePages(d, largest);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+}
+
+void TestProximityDomain() {
+  constexpr uint64_t kArenaPages = 64;
+  TestAllocator allocator;
+  uint64_t arena0 = AllocArena(kArenaPages);
+  uint64_t arena1 = AllocArena(kArenaPages);
+  allocator.FreePagesWithProximityDomain(arena0, kArenaPages, 0);
+  allocator.FreePagesWithProximityDomain(arena1, kArenaPages, 1);
+  for (int i = 0; i < 8; i++) {
+    uint64_t p0 = allocator.AllocPagesInProximityDomain<uint64_t>(2, 0);
+    uint64_t p1 = allocator.AllocPagesInProximityDomain<uint64_t>(2, 1);
+    assert(arena0 <= p0 && p0 < arena0 + kArenaPages * kPageSize);
+    assert(arena1 <= p1 && p1 < arena1 + kArenaPages * kPageSize);
+  }
+}
+
+static uint32_t local_proximity_domain;
+static uint32_t GetLocalProximityDomainForTest() {
+  return local_proximity_domain;
+}
+
+void TestNearestNodeFallback() {
+  constexpr uint64_t kArenaPages = 16;
+  TestAllocator allocator;
+  uint64_t arena[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    arena[i] = AllocArena(kArenaPages);
+    allocator.FreePagesWithProximityDomain(arena[i], kArenaPages, i);
+  }
+  // Domain 2 is nearer to domain 0 than domain 1 is.
+  const uint8_t distance_table[3 * 3] = {
+      10, 30, 20,  //
+      30, 10, 20,  //
+      20, 20, 10,  //
+  };
+  allocator.SetDistanceTable(distance_table, 3);
+  // Without a getter, the first node is the local one.
+  assert(allocator.GetLocalProximityDomain() == 0);
+  allocator.SetLocalProximityDomainGetter(GetLocalProximityDomainForTest);
+  local_proximity_domain = 0;
+
+  auto is_in_arena = [&](uint64_t addr, int i) {
+    return arena[i] <= addr && addr < arena[i] + kArenaPages * kPageSize;
+  };
+  // Exhaust the local node, then the nearest one.
+  const uint64_t free_pages_in_node = allocator.GetNumOfFreePages() / 3;
+  for (uint64_t i = 0; i < free_pages_in_node; i++)
+    assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 0));
+  assert(allocator.GetNumOfFreePagesInProximityDomain(0) == 0);
+  for (uint64_t i = 0; i < free_pages_in_node; i++)
+    assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 2));
+  assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 1));
+  assert(is_in_arena(
+      allocator.AllocPagesNearProximityDomain<uint64_t>(1, 1), 1));
+}
+
+void TestLocalNodeOfEachAllocation() {
+  constexpr uint64_t kArenaPages = 16;
+  TestAllocator allocator;
+  uint64_t arena[2];
+  for (uint32_t i = 0; i < 2; i++) {
+    arena[i] = AllocArena(kArenaPages);
+    allocator.FreePagesWithProximityDomain(arena[i], kArenaPages, i);
+  }
+  allocator.SetLocalProximityDomainGetter(GetLocalProximityDomainForTest);
+  auto is_in_arena = [&](uint64_t addr, int i) {
+    return arena[i] <= addr && addr < arena[i] + kArenaPages * kPageSize;
+  };
+  // The local node is looked up each time, as the allocating processor
+  // changes.
+  local_proximity_domain = 1;
+  assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 1));
+  local_proximity_domain = 0;
+  assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 0));
+  // Unknown domains fall back to the first node.
+  local_proximity_domain = 7;
+  assert(is_in_arena(allocator.AllocPages<uint64_t>(1), 0));
+}
+
+void TestRandomAllocAndFree() {
+  constexpr uint64_t kArenaPages = 4096;
+  TestAllocator allocator;
+  const uint64_t arena = AllocArena(kArenaPages);
+  allocator.FreePagesWithProximityDomain(arena, kArenaPages, 0);
+  const uint64_t initial_free_pages = allocator.GetNumOfFreePages();
+
+  std::mt19937 mt(1);
+  std::vector<uint8_t> owner(kArenaPages);
+  std::vector<std::pair<uint64_t, uint64_t>> allocated;
+  for (int i = 0; i < 10000; i++) {
+    if (allocated.empty() ||
+        (mt() % 2 && allocator.GetNumOfFreePages() > kArenaPages * 3 / 4)) {
+      uint64_t num_of_pages = mt() % 9 + 1;
+      uint64_t addr = allocator.AllocPages<uint64_t>(num_of_pages);
+      for (uint64_t p = 0; p < num_of_pages; p++) {
+        uint64_t index = (addr - arena) / kPageSize + p;
+        assert(index < kArenaPages);
+        assert(!owner[index]);
+        owner[index] = 1;
+      }
+      allocated.emplace_back(addr, num_of_pages);
+      continue;
+    }
+    uint64_t k = mt() % allocated.size();
+    auto [addr, num_of_pages] = allocated[k];
+    allocated[k] = allocated.back();
+    allocated.pop_back();
+    for (uint64_t p = 0; p < num_of_pages; p++)
+      owner[(addr - arena) / kPageSize + p] = 0;
+    allocator.FreePages(addr, num_of_pages);
+  }
+  for (auto [addr, num_of_pages] : allocated)
+    allocator.FreePages(addr, num_of_pages);
+  assert(allocator.GetNumOfFreePages() == initial_free_pages);
+}
+
+void BenchmarkAllocAndFree() {
+  constexpr uint64_t kArenaPages = 1 << 16;
+  constexpr int kNumOfIterations = 1000000;
+  TestAllocator allocator;
+  allocator.FreePagesWithProximityDomain(AllocArena(kArenaPages), kArenaPages,
+                                         0);
+  std::vector<uint64_t> pages;
+  pages.reserve(kArenaPages);
+  // Fragment the free lists so that alloc and free have to split and merge.
+  for (uint64_t i = 0; i < kArenaPages / 2; i++)
+    pages.push_back(allocator.AllocPages<uint64_t>(1));
+  for (uint64_t i = 0; i < pages.size(); i += 2)
+    allocator.FreePages(pages[i], 1);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfIterations; i++) {
+    uint64_t addr = allocator.AllocPages<uint64_t>(i % 4 + 1);
+    allocator.FreePages(addr, i % 4 + 1);
+  }
+  auto end = std::chrono::steady_clock::now();
+  printf("alloc+free: %.1f ns/op\n",
+         std::chrono::duration<double, std::nano>(end - start).count() /
+             kNumOfIterations);
+}
+
+int main() {
+  TestSplitAndMerge();
+  TestProximityDomain();
+  TestNearestNodeFallback();
+  TestLocalNodeOfEachAllocation();
+  TestRandomAllocAndFree();
+  BenchmarkAllocAndFree();
+  puts("PASS");
+  return 0;
+}
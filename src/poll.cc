@@ -0,0 +1,258 @@
+#include "poll.h"
+
+#include "clock_source.h"
+#include "kernel.h"
+#include "tcp.h"
+#include "timer.h"
+
+uint16_t GetPollEvents(Process& proc, int fd) {
+  // Descriptors of the console are not in the table.
+  if (fd == 0)
+    return liumos->main_console->HasInput() ? kPollIn : 0;
+  if (fd == 1 || fd == 2)
+    return kPollOut;
+  FileDescriptorTable& fd_table = proc.GetFileDescriptorTable();
+  if (void* object = fd_table.Get(fd, FileDescriptorTable::Type::kSocket)) {
+    // Datagrams are sent without blocking.
+    Network::Socket& socket = *reinterpret_cast<Network::Socket*>(object);
+    return socket.HasPacket() ? kPollIn | kPollOut : kPollOut;
+  }
+  if (void* object = fd_table.Get(fd, FileDescriptorTable::Type::kTCPSocket)) {
+    return TCP::GetInstance().GetPollEvents(
+        *reinterpret_cast<TCP::Socket*>(object));
+  }
+  // Event polls can not be waited for by another one.
+  if (fd_table.Get(fd, FileDescriptorTable::Type::kEventPoll))
+    return 0;
+  return kPollNVal;
+}
+
+PollNotifier* GetPollNotifier(Process& proc, int fd) {
+  FileDescriptorTable& fd_table = proc.GetFileDescriptorTable();
+  if (void* object = fd_table.Get(fd, FileDescriptorTable::Type::kSocket))
+    return &reinterpret_cast<Network::Socket*>(object)->poll_notifier;
+  if (void* object = fd_table.Get(fd, FileDescriptorTable::Type::kTCPSocket))
+    return &reinterpret_cast<TCP::Socket*>(object)->GetPollNotifier();
+  return nullptr;
+}
+
+void PollWaiter::Wait(uint64_t deadline_ns, bool should_recheck) {
+  if (should_recheck)
+    deadline_ns = std::min(deadline_ns, NowNs() + kRecheckIntervalNs);
+  WaitUntilOrDeadline(wait_queue_, deadline_ns, [this] {
+    return __atomic_load_n(&is_woken_, __ATOMIC_ACQUIRE);
+  });
+  // The caller checks the readiness after this, so wakeups before this are
+  // not needed anymore.
+  __atomic_store_n(&is_woken_, false, __ATOMIC_RELAXED);
+}
+
+void PollWaiter::Wake() {
+  __atomic_store_n(&is_woken_, true, __ATOMIC_RELEASE);
+  wait_queue_.WakeAll();
+}
+
+static void WakePollWaiter(PollListener& listener) {
+  reinterpret_cast<PollWaiter*>(listener.GetData())->Wake();
+}
+
+int Poll(Process& proc, PollFD* fds, int nfds, uint64_t deadline_ns) {
+  PollWaiter waiter;
+  PollListener* listeners = nullptr;
+  bool should_recheck = false;
+  int num_of_ready;
+  for (;;) {
+    num_of_ready = 0;
+    for (int i = 0; i < nfds; i++) {
+      PollFD& pfd = fds[i];
+      pfd.revents = 0;
+      if (pfd.fd < 0)
+        continue;
+      const uint16_t events =
+          GetPollEvents(proc, pfd.fd) &
+          (static_cast<uint16_t>(pfd.events) | kPollAlwaysReported);
+      pfd.revents = static_cast<int16_t>(events);
+      if (events)
+        num_of_ready++;
+    }
+    if (num_of_ready || NowNs() >= deadline_ns)
+      break;
+    if (listeners || !nfds) {
+      waiter.Wait(deadline_ns, should_recheck);
+      continue;
+    }
+    // Starts listening only when nothing is ready, and checks again since
+    // the descriptors may have become ready before that.
+    listeners = reinterpret_cast<PollListener*>(
+        AllocKernelObjectMemory(sizeof(PollListener) * nfds));
+    for (int i = 0; i < nfds; i++) {
+      PollListener& listener = *new (&listeners[i]) PollListener();
+      listener.Init(WakePollWaiter, &waiter);
+      if (fds[i].fd < 0)
+        continue;
+      if (PollNotifier* notifier = GetPollNotifier(proc, fds[i].fd))
+        notifier->Add(listener);
+      else
+        should_recheck = true;
+    }
+  }
+  if (listeners) {
+    for (int i = 0; i < nfds; i++) {
+      if (PollNotifier* notifier = listeners[i].GetNotifier())
+        notifier->Remove(listeners[i]);
+    }
+    FreeKernelObjectMemory(listeners);
+  }
+  return num_of_ready;
+}
+
+EventPoll* EventPoll::Create() {
+  return new (AllocKernelObject<EventPoll>()) EventPoll();
+}
+
+void EventPoll::Destroy() {
+  while (!items_.empty())
+    RemoveFD(items_.begin()->first);
+  this->~EventPoll();
+  FreeKernelObjectMemory(this);
+}
+
+void EventPoll::PushReadyLocked(Item& item) {
+  assert(!item.is_ready_listed);
+  item.is_ready_listed = true;
+  item.prev_ready = ready_tail_;
+  item.next_ready = nullptr;
+  if (ready_tail_)
+    ready_tail_->next_ready = &item;
+  else
+    ready_head_ = &item;
+  ready_tail_ = &item;
+  num_of_ready_items_++;
+}
+
+void EventPoll::RemoveReadyLocked(Item& item) {
+  assert(item.is_ready_listed);
+  if (item.prev_ready)
+    item.prev_ready->next_ready = item.next_ready;
+  else
+    ready_head_ = item.next_ready;
+  if (item.next_ready)
+    item.next_ready->prev_ready = item.prev_ready;
+  else
+    ready_tail_ = item.prev_ready;
+  item.is_ready_listed = false;
+  num_of_ready_items_--;
+}
+
+void EventPoll::HandleNotification(PollListener& listener) {
+  Item& item = *reinterpret_cast<Item*>(listener.GetData());
+  EventPoll& epoll = *item.owner;
+  epoll.lock_.Lock();
+  if (!item.is_ready_listed)
+    epoll.PushReadyLocked(item);
+  epoll.lock_.Unlock();
+  epoll.waiter_.Wake();
+}
+
+bool EventPoll::AddFD(Process& proc, int fd, const Event& event) {
+  if (items_.count(fd) || (GetPollEvents(proc, fd) & kPollNVal))
+    return true;
+  Item* item = new (AllocKernelObject<Item>()) Item();
+  item->owner = this;
+  item->fd = fd;
+  item->event = event;
+  item->listener.Init(HandleNotification, item);
+  items_[fd] = item;
+  PollNotifier* notifier = GetPollNotifier(proc, fd);
+  if (!notifier) {
+    polled_items_[fd] = item;
+    return false;
+  }
+  notifier->Add(item->listener);
+  // Checked on the next Wait() since it may be ready already.
+  lock_.Lock();
+  if (!item->is_ready_listed)
+    PushReadyLocked(*item);
+  lock_.Unlock();
+  return false;
+}
+
+bool EventPoll::ModifyFD(int fd, const Event& event) {
+  auto it = items_.find(fd);
+  if (it == items_.end())
+    return true;
+  Item& item = *it->second;
+  lock_.Lock();
+  item.event = event;
+  if (item.listener.GetNotifier() && !item.is_ready_listed)
+    PushReadyLocked(item);
+  lock_.Unlock();
+  return false;
+}
+
+bool EventPoll::RemoveFD(int fd) {
+  auto it = items_.find(fd);
+  if (it == items_.end())
+    return true;
+  Item* item = it->second;
+  items_.erase(it);
+  if (PollNotifier* notifier = item->listener.GetNotifier())
+    notifier->Remove(item->listener);
+  else
+    polled_items_.erase(fd);
+  lock_.Lock();
+  if (item->is_ready_listed)
+    RemoveReadyLocked(*item);
+  lock_.Unlock();
+  item->~Item();
+  FreeKernelObjectMemory(item);
+  return false;
+}
+
+int EventPoll::Wait(Process& proc,
+                    Event* events,
+                    int max_events,
+                    uint64_t deadline_ns) {
+  for (;;) {
+    int num_of_events = 0;
+    for (auto it : polled_items_) {
+      if (num_of_events == max_events)
+        break;
+      Item& item = *it.second;
+      const uint16_t revents =
+          GetPollEvents(proc, item.fd) &
+          static_cast<uint16_t>(item.event.events | kPollAlwaysReported);
+      if (!revents)
+        continue;
+      events[num_of_events].events = revents;
+      events[num_of_events].data = item.event.data;
+      num_of_events++;
+    }
+    lock_.Lock();
+    // Items put back on the list below are at the tail, so each item is
+    // checked at most once.
+    for (int n = num_of_ready_items_; n > 0 && num_of_events < max_events;
+         n--) {
+      Item& item = *ready_head_;
+      RemoveReadyLocked(item);
+      const uint16_t requested =
+          static_cast<uint16_t>(item.event.events | kPollAlwaysReported);
+      // Notifications from now on put the item back on the list.
+      lock_.Unlock();
+      const uint16_t revents = GetPollEvents(proc, item.fd) & requested;
+      lock_.Lock();
+      if (!revents)
+        continue;
+      events[num_of_events].events = revents;
+      events[num_of_events].data = item.event.data;
+      num_of_events++;
+      // Level-triggered: reported again while it is ready.
+      if (!item.is_ready_listed)
+        PushReadyLocked(item);
+    }
+    lock_.Unlock();
+    if (num_of_events || NowNs() >= deadline_ns)
+      return num_of_events;
+    waiter_.Wait(deadline_ns, !polled_items_.empty());
+  }
+}
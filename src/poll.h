@@ -0,0 +1,213 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "generic.h"
+#include "slab_allocator.h"
+#include "spin_lock.h"
+#include "timer.h"
+#include "wait_queue.h"
+
+class Process;
+
+// Readiness of file descriptors, for poll(2) and epoll(7).
+// Objects which can become ready (sockets) have a PollNotifier, and tell it
+// when their readiness may have changed. Waiters register a PollListener to
+// the notifier of each object they are interested in, and check the actual
+// readiness with GetPollEvents() when notified.
+
+// Events. Same values as Linux.
+constexpr uint16_t kPollIn = 0x0001;
+constexpr uint16_t kPollOut = 0x0004;
+constexpr uint16_t kPollErr = 0x0008;
+constexpr uint16_t kPollHup = 0x0010;
+constexpr uint16_t kPollNVal = 0x0020;
+// Reported even if not requested.
+constexpr uint16_t kPollAlwaysReported = kPollErr | kPollHup | kPollNVal;
+
+class PollNotifier;
+
+class PollListener {
+ public:
+  // Called with the lock of the notifier held, possibly in an interrupt
+  // handler. It should not block nor take locks other than the ones of the
+  // waiter.
+  using Callback = void (*)(PollListener& listener);
+  constexpr PollListener()
+      : callback_(nullptr),
+        data_(nullptr),
+        notifier_(nullptr),
+        prev_(nullptr),
+        next_(nullptr) {}
+  void Init(Callback callback, void* data) {
+    assert(!notifier_);
+    callback_ = callback;
+    data_ = data;
+  }
+  void* GetData() const { return data_; }
+  // The notifier which this listener is added to, or nullptr.
+  PollNotifier* GetNotifier() const { return notifier_; }
+  friend class PollNotifier;
+
+ private:
+  Callback callback_;
+  void* data_;
+  PollNotifier* notifier_;
+  PollListener* prev_;
+  PollListener* next_;
+};
+
+class PollNotifier {
+ public:
+  constexpr PollNotifier() : head_(nullptr) {}
+  void Add(PollListener& listener) {
+    lock_.Lock();
+    assert(!listener.notifier_);
+    assert(listener.callback_);
+    listener.notifier_ = this;
+    listener.prev_ = nullptr;
+    listener.next_ = head_;
+    if (head_)
+      head_->prev_ = &listener;
+    head_ = &listener;
+    lock_.Unlock();
+  }
+  // The callback of listener is not running after this returns.
+  void Remove(PollListener& listener) {
+    lock_.Lock();
+    assert(listener.notifier_ == this);
+    if (listener.prev_)
+      listener.prev_->next_ = listener.next_;
+    else
+      head_ = listener.next_;
+    if (listener.next_)
+      listener.next_->prev_ = listener.prev_;
+    listener.notifier_ = nullptr;
+    listener.prev_ = nullptr;
+    listener.next_ = nullptr;
+    lock_.Unlock();
+  }
+  bool HasListeners() const {
+    return __atomic_load_n(&head_, __ATOMIC_RELAXED);
+  }
+  // Calls the callbacks of all listeners.
+  void Notify() {
+    if (!HasListeners())
+      return;
+    lock_.Lock();
+    for (PollListener* listener = head_; listener; listener = listener->next_)
+      listener->callback_(*listener);
+    lock_.Unlock();
+  }
+
+ private:
+  PollListener* head_;
+  SpinLock lock_;
+};
+
+#ifndef LIUMOS_TEST
+
+// @poll.cc
+// Deadlines are in NowNs(). kNoDeadline (@timer.h) blocks until something is
+// ready.
+// Returns the events of fd of proc which are ready, or kPollNVal if fd is
+// not open.
+uint16_t GetPollEvents(Process& proc, int fd);
+// Returns the notifier of fd, or nullptr if fd should be checked
+// periodically since the object does not tell its changes (the console).
+PollNotifier* GetPollNotifier(Process& proc, int fd);
+
+// Blocks the current process until Wake() is called or a deadline passes.
+// A Wake() between two Wait() is not lost.
+class PollWaiter {
+ public:
+  // Objects without a notifier are checked at least this often.
+  static constexpr uint64_t kRecheckIntervalNs = 10'000'000;
+  constexpr PollWaiter() : is_woken_(false) {}
+  // Returns at deadline_ns or kRecheckIntervalNs later if should_recheck.
+  void Wait(uint64_t deadline_ns, bool should_recheck);
+  void Wake();
+
+ private:
+  WaitQueue wait_queue_;
+  bool is_woken_;
+};
+
+// struct pollfd of Linux.
+struct PollFD {
+  int fd;
+  int16_t events;
+  int16_t revents;
+};
+static_assert(sizeof(PollFD) == 8);
+
+// Sets revents of each of fds and returns the number of fds which have any
+// event, after waiting for one of them until deadline_ns if none. Negative
+// fds are ignored.
+int Poll(Process& proc, PollFD* fds, int nfds, uint64_t deadline_ns);
+
+// epoll(7), level-triggered only. Each registered descriptor has a listener
+// which puts it on the ready list when notified. Wait() checks only the
+// descriptors on the list and keeps the ones still ready there, so it does
+// not scan all registered descriptors. Registered descriptors are referred
+// to by their numbers in the process which owns this, so closing one of
+// them should remove it by RemoveFD().
+class EventPoll {
+ public:
+  // struct epoll_event of Linux, which is packed on x86-64.
+  packed_struct Event {
+    uint32_t events;
+    uint64_t data;
+  };
+  static_assert(sizeof(Event) == 12);
+
+  // Returns nullptr on failure.
+  static EventPoll* Create();
+  // Removes all descriptors and frees this.
+  void Destroy();
+  // Returns true on failure: fd is not open, or already registered.
+  bool AddFD(Process& proc, int fd, const Event& event);
+  // Returns true if fd is not registered.
+  bool ModifyFD(int fd, const Event& event);
+  bool RemoveFD(int fd);
+  // Returns the number of events stored in events, after waiting for one
+  // until deadline_ns if none.
+  int Wait(Process& proc, Event* events, int max_events, uint64_t deadline_ns);
+
+ private:
+  struct Item {
+    EventPoll* owner;
+    int fd;
+    Event event;
+    PollListener listener;  // Not added if the fd has no notifier.
+    // The ready list. Protected by lock_.
+    Item* prev_ready;
+    Item* next_ready;
+    bool is_ready_listed;
+  };
+
+  EventPoll()
+      : ready_head_(nullptr), ready_tail_(nullptr), num_of_ready_items_(0) {}
+  static void HandleNotification(PollListener& listener);
+  void PushReadyLocked(Item& item);
+  void RemoveReadyLocked(Item& item);
+
+  using ItemMap = std::unordered_map<
+      int,
+      Item*,
+      std::hash<int>,
+      std::equal_to<int>,
+      KernelObjectSTLAllocator<std::pair<const int, Item*>>>;
+  // Only the owner process touches items_, so it has no lock.
+  ItemMap items_;
+  // Items without a notifier. They are checked on every Wait().
+  ItemMap polled_items_;
+  // Items which may be ready. Protected by lock_.
+  Item* ready_head_;
+  Item* ready_tail_;
+  int num_of_ready_items_;
+  SpinLock lock_;
+  PollWaiter waiter_;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "poll.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+static void CountNotification(PollListener& listener) {
+  (*reinterpret_cast<int*>(listener.GetData()))++;
+}
+
+static void TestPollNotifier() {
+  PollNotifier notifier;
+  PollListener listeners[3];
+  int counts[3] = {};
+  for (int i = 0; i < 3; i++)
+    listeners[i].Init(CountNotification, &counts[i]);
+
+  assert(!notifier.HasListeners());
+  notifier.Notify();
+  for (int i = 0; i < 3; i++) {
+    notifier.Add(listeners[i]);
+    assert(listeners[i].GetNotifier() == &notifier);
+  }
+  notifier.Notify();
+  assert(counts[0] == 1 && counts[1] == 1 && counts[2] == 1);
+
+  // Removes the one in the middle, the head and then the last one.
+  notifier.Remove(listeners[1]);
+  assert(!listeners[1].GetNotifier());
+  notifier.Notify();
+  assert(counts[0] == 2 && counts[1] == 1 && counts[2] == 2);
+  notifier.Remove(listeners[2]);
+  notifier.Notify();
+  assert(counts[0] == 3 && counts[1] == 1 && counts[2] == 2);
+  notifier.Remove(listeners[0]);
+  assert(!notifier.HasListeners());
+  notifier.Notify();
+  assert(counts[0] == 3);
+
+  // Can be added again after removed.
+  notifier.Add(listeners[1]);
+  notifier.Notify();
+  assert(counts[1] == 2);
+  notifier.Remove(listeners[1]);
+}
+
+int main() {
+  TestPollNotifier();
+
+  puts("PASS");
+  return 0;
+}
+
+#endif
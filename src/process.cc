@@ -1,28 +1,38 @@
+#include "kernel.h"
 #include "liumos.h"
 
-void Process::Kill() {
-  switch (status_) {
-    case Status::kNotInitialized:
-    case Status::kNotScheduled:
-      PutString("Tried to stop the process not running");
-      return;
-    case Status::kSleeping:
-      SetStatus(Status::kStopped);
-      return;
-    case Status::kRunning:
-      SetStatus(Status::kStopping);
-      return;
-    case Status::kStopping:
-    case Status::kStopped:
-      return;
-  }
-  assert(false);
+void ProcessQueue::Push(Process& proc) {
+  assert(!proc.queue_);
+  proc.queue_ = this;
+  proc.queue_prev_ = tail_;
+  proc.queue_next_ = nullptr;
+  if (tail_)
+    tail_->queue_next_ = &proc;
+  else
+    head_ = &proc;
+  tail_ = &proc;
 }
 
-void Process::WaitUntilExit() {
-  while (status_ != Status::kStopped) {
-    Sleep();
-  }
+Process* ProcessQueue::Pop() {
+  Process* proc = head_;
+  if (proc)
+    Remove(*proc);
+  return proc;
+}
+
+void ProcessQueue::Remove(Process& proc) {
+  assert(proc.queue_ == this);
+  if (proc.queue_prev_)
+    proc.queue_prev_->queue_next_ = proc.queue_next_;
+  else
+    head_ = proc.queue_next_;
+  if (proc.queue_next_)
+    proc.queue_next_->queue_prev_ = proc.queue_prev_;
+  else
+    tail_ = proc.queue_prev_;
+  proc.queue_ = nullptr;
+  proc.queue_prev_ = nullptr;
+  proc.queue_next_ = nullptr;
 }
 
 void Process::NotifyContextSaving() {
@@ -33,11 +43,45 @@ void Process::NotifyContextSaving() {
                           num_of_clflush_issued_in_ctx_sw_);
 }
 
+// Page tables refer to the lower tables by their physical addresses, which
+// are straight-mapped only in the page table of the kernel. Interrupts are
+// disabled so that the process is not switched out while it is used.
+template <typename TFunc>
+static void WithKernelPageTable(TFunc func) {
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  const uint64_t cr3 = ReadCR3();
+  WriteCR3(v2p(liumos->kernel_pml4));
+  func();
+  // Also flushes the TLB for removed mappings.
+  WriteCR3(cr3);
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+}
+
+uint64_t Process::MapUserPages(uint64_t paddr, uint64_t byte_size) {
+  assert(CanMapUserPages());
+  const uint64_t vaddr = next_user_map_vaddr_;
+  next_user_map_vaddr_ += ByteSizeToPageSize(byte_size) << kPageSizeExponent;
+  IA_PML4& pml4 = ctx_->GetCR3();
+  WithKernelPageTable([&] {
+    CreatePageMapping(GetSystemDRAMAllocator(), pml4, vaddr, paddr, byte_size,
+                      kPageAttrPresent | kPageAttrUser | kPageAttrWritable);
+  });
+  return vaddr;
+}
+
+void Process::UnmapUserPages(uint64_t vaddr, uint64_t byte_size) {
+  assert(CanMapUserPages());
+  IA_PML4& pml4 = ctx_->GetCR3();
+  WithKernelPageTable([&] { RemovePageMapping(pml4, vaddr, byte_size); });
+}
+
 void Process::PrintStatistics() {
   PutStringAndDecimal("Process id", id_);
   PutString(
       "num of ctx sw, proc time[s], sys time [s], time for ctx save [s], copy "
-      "in ctx save [MB], clflush in ctx sw [M]\n");
+      "in ctx save [MB], clflush in ctx sw [M], migrations\n");
   PutDecimal64(number_of_ctx_switch_);
   PutString(", ");
   PutDecimal64WithPointPos(proc_time_femto_sec_, 15);
@@ -49,16 +93,59 @@ void Process::PrintStatistics() {
   PutDecimal64WithPointPos(copied_bytes_in_ctx_sw_, 6);
   PutString(", ");
   PutDecimal64WithPointPos(num_of_clflush_issued_in_ctx_sw_, 6);
+  PutString(", ");
+  PutDecimal64(number_of_migrations_);
   PutString("\n");
 }
 
 Process& ProcessController::Create() {
-  Process* proc = kernel_heap_allocator_.AllocPages<Process*>(
-      ByteSizeToPageSize(sizeof(Process)));
-  new (proc) Process(++last_id_);
+  Process* proc = process_cache_.Alloc();
+  new (proc) Process(__atomic_add_fetch(&last_id_, 1, __ATOMIC_RELAXED));
   return *proc;
 }
 
+void ProcessController::FreeKernelStack(ExecutionContext& ctx) {
+  if (!ctx.GetKernelRSP())
+    return;
+  kernel_heap_allocator_.FreePages(
+      ctx.GetKernelRSP() -
+          (kKernelStackPagesForEachProcess << kPageSizeExponent),
+      kKernelStackPagesForEachProcess);
+  ctx.SetKernelRSP(0);
+}
+
+void ProcessController::FreeUserMemory(ExecutionContext& ctx) {
+  auto& dram_allocator = GetSystemDRAMAllocator();
+  ProcessMappingInfo& map_info = ctx.GetProcessMappingInfo();
+  SegmentMapping* segments[] = {&map_info.code, &map_info.data,
+                                &map_info.stack};
+  for (SegmentMapping* seg : segments) {
+    if (!seg->GetPhysAddr())
+      continue;
+    dram_allocator.FreePages(seg->GetPhysAddr(),
+                             ByteSizeToPageSize(seg->GetMapSize()));
+    seg->SetPhysAddr(0);
+  }
+  DestroyUserPageTable(dram_allocator, ctx.GetCR3());
+}
+
+void ProcessController::Destroy(Process& proc) {
+  assert(proc.GetStatus() == Process::Status::kStopped);
+  assert(!proc.queue_);
+  if (proc.IsPersistent()) {
+    // Contents of the process are kept in the persistent memory.
+    FreeKernelStack(proc.pp_info_->GetValidContext());
+    FreeKernelStack(proc.pp_info_->GetWorkingContext());
+  } else {
+    ExecutionContext& ctx = *proc.ctx_;
+    if (proc.owns_user_memory_)
+      FreeUserMemory(ctx);
+    FreeKernelStack(ctx);
+    kernel_heap_allocator_.Free(&ctx);
+  }
+  process_cache_.Free(&proc);
+}
+
 static void PrepareContextForRestoringPersistentProcess(ExecutionContext& ctx) {
   SetKernelPageEntries(ctx.GetCR3());
   ctx.SetKernelRSP(liumos->kernel_heap_allocator->AllocPages<uint64_t>(
@@ -1,19 +1,24 @@
 #pragma once
 
 #include "execution_context.h"
+#include "file_descriptor.h"
 #include "generic.h"
 #include "kernel_virtual_heap_allocator.h"
+#include "timer_wheel.h"
+#include "wait_queue.h"
 
 class Process {
  public:
   enum class Status {
     kNotInitialized,
     kNotScheduled,
-    kSleeping,
+    kSleeping,  // Ready to run, waiting in a ready queue of the scheduler.
+    kBlocked,   // Waiting in a WaitQueue.
     kRunning,
     kStopping,
     kStopped,
   };
+  static constexpr int kAnyCPU = -1;
   bool IsPersistent() {
     if (ctx_) {
       assert(!pp_info_);
@@ -23,14 +28,40 @@ class Process {
     return true;
   }
   uint64_t GetID() { return id_; }
-  int GetSchedulerIndex() const { return scheduler_index_; }
-  void SetSchedulerIndex(int scheduler_index) {
-    scheduler_index_ = scheduler_index;
-  };
+  int GetPriority() const { return priority_; }
+  // Index of the processor which this process is scheduled on.
+  int GetCPU() const { return cpu_; }
+  void SetPriority(int priority) {
+    // Should be called before the process is registered to the scheduler.
+    assert(status_ == Status::kNotInitialized ||
+           status_ == Status::kNotScheduled);
+    priority_ = priority;
+  }
+  // kAnyCPU allows the scheduler to migrate this process between processors.
+  // Otherwise, this process is pinned to the processor.
+  int GetAffinity() const { return affinity_; }
+  void SetAffinity(int cpu) {
+    // Should be called before the process is registered to the scheduler.
+    assert(status_ == Status::kNotInitialized ||
+           status_ == Status::kNotScheduled);
+    affinity_ = cpu;
+  }
   Status GetStatus() const { return status_; };
   void SetStatus(Status status) { status_ = status; }
-  void Kill();
-  void WaitUntilExit();
+  WaitQueue& GetExitWaitQueue() { return exit_wait_queue_; }
+  // Used by SleepUntilNs (@timer.cc) to wake up this process.
+  Timer& GetSleepTimer() { return sleep_timer_; }
+  WaitQueue& GetSleepWaitQueue() { return sleep_wait_queue_; }
+  FileDescriptorTable& GetFileDescriptorTable() { return fd_table_; }
+  // Pages shared with the kernel, such as the packet rings of sockets.
+  // Only ephemeral user processes have a page table to map them.
+  bool CanMapUserPages() const { return owns_user_memory_; }
+  // @process.cc
+  // Maps byte_size bytes from paddr to a new range of the user space and
+  // returns the address of it. Ranges are not reused.
+  uint64_t MapUserPages(uint64_t paddr, uint64_t byte_size);
+  // Removes a mapping created by MapUserPages(). The pages are not freed.
+  void UnmapUserPages(uint64_t vaddr, uint64_t byte_size);
   void InitAsEphemeralProcess(ExecutionContext& ctx) {
     assert(status_ == Status::kNotInitialized);
     assert(!ctx_);
@@ -38,6 +69,12 @@ class Process {
     ctx_ = &ctx;
     status_ = Status::kNotScheduled;
   }
+  void InitAsEphemeralUserProcess(ExecutionContext& ctx) {
+    // User page tables and segments in ctx are owned by this process and
+    // will be freed by ProcessController::Destroy.
+    InitAsEphemeralProcess(ctx);
+    owns_user_memory_ = true;
+  }
   void InitAsPersistentProcess(PersistentProcessInfo& pp_info) {
     assert(status_ == Status::kNotInitialized);
     assert(!ctx_);
@@ -50,6 +87,7 @@ class Process {
   }
   void NotifyContextSaving();
   uint64_t GetNumberOfContextSwitch() { return number_of_ctx_switch_; }
+  uint64_t GetNumberOfMigrations() { return number_of_migrations_; }
   uint64_t GetProcTimeFemtoSec() { return proc_time_femto_sec_; }
   void ResetProcTimeFemtoSec() { proc_time_femto_sec_ = 0; }
   void AddProcTimeFemtoSec(uint64_t fs) { proc_time_femto_sec_ += fs; }
@@ -61,14 +99,28 @@ class Process {
   }
   void PrintStatistics();
   friend class ProcessController;
+  friend class ProcessQueue;
+  friend class Scheduler;
+  static constexpr int kDefaultPriority = 16;
 
  private:
   Process(uint64_t id)
       : id_(id),
         status_(Status::kNotInitialized),
+        priority_(kDefaultPriority),
+        cpu_(0),
+        affinity_(kAnyCPU),
+        on_cpu_(false),
+        queue_(nullptr),
+        queue_prev_(nullptr),
+        queue_next_(nullptr),
+        wait_queue_(nullptr),
         ctx_(nullptr),
         pp_info_(nullptr),
+        owns_user_memory_(false),
+        next_user_map_vaddr_(kUserMapBaseAddr),
         number_of_ctx_switch_(0),
+        number_of_migrations_(0),
         proc_time_femto_sec_(0),
         sys_time_femto_sec_(0),
         copied_bytes_in_ctx_sw_(0),
@@ -76,10 +128,29 @@ class Process {
         time_consumed_in_ctx_save_femto_sec_(0){};
   uint64_t id_;
   volatile Status status_;
-  int scheduler_index_;
+  int priority_;  // Smaller value means higher priority.
+  int cpu_;
+  int affinity_;
+  // True until the context of this process is saved after switching to
+  // another process.
+  bool on_cpu_;
+  ProcessQueue* queue_;
+  Process* queue_prev_;
+  Process* queue_next_;
+  WaitQueue* wait_queue_;  // Not null while blocked.
+  WaitQueue exit_wait_queue_;
+  Timer sleep_timer_;
+  WaitQueue sleep_wait_queue_;
+  FileDescriptorTable fd_table_;
   ExecutionContext* ctx_;
   PersistentProcessInfo* pp_info_;
+  bool owns_user_memory_;
+  // Above the user stack (@elf.cc), far from anything else in the user
+  // space.
+  static constexpr uint64_t kUserMapBaseAddr = 0x10'0000'0000;
+  uint64_t next_user_map_vaddr_;
   uint64_t number_of_ctx_switch_;
+  uint64_t number_of_migrations_;
   uint64_t proc_time_femto_sec_;
   uint64_t sys_time_femto_sec_;
   uint64_t copied_bytes_in_ctx_sw_;
@@ -90,11 +161,21 @@ class Process {
 class ProcessController {
  public:
   ProcessController(KernelVirtualHeapAllocator& kernel_heap_allocator)
-      : last_id_(0), kernel_heap_allocator_(kernel_heap_allocator){};
+      : last_id_(0),
+        kernel_heap_allocator_(kernel_heap_allocator),
+        process_cache_(kernel_heap_allocator, "Process"){};
   Process& Create();
   Process& RestoreFromPersistentProcessInfo(PersistentProcessInfo& pp_info);
+  // Frees all resources owned by a stopped process, including proc itself.
+  // proc should be unregistered from the scheduler before calling this.
+  void Destroy(Process& proc);
+  void PrintStatistics() { process_cache_.Print(); }
 
  private:
+  void FreeKernelStack(ExecutionContext& ctx);
+  void FreeUserMemory(ExecutionContext& ctx);
+
   uint64_t last_id_;
   KernelVirtualHeapAllocator& kernel_heap_allocator_;
+  ObjectCache<Process, KernelVirtualHeapAllocator> process_cache_;
 };
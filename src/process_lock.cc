@@ -8,9 +8,10 @@ void ProcessLock::Lock() {
 #ifndef LIUMOS_LOADER
   Process& proc = liumos->scheduler->GetCurrentProcess();
   uint64_t pid = proc.GetID();
-  for (int cnt = 0; cnt < 3; cnt++) {
-    if (!CompareAndExchange64(&locked_by_pid_, 0, pid))
-      return;
+  if (__atomic_load_n(&locked_by_pid_, __ATOMIC_RELAXED) != pid) {
+    lock_.Lock();
+    locked_by_pid_ = pid;
+    return;
   }
   auto& pp = PanicPrinter::BeginPanic();
   StringBuffer<128> buf;
@@ -21,17 +22,19 @@ void ProcessLock::Lock() {
   pp.PrintLine(buf.GetString());
   buf.Clear();
 
-  buf.WriteString("which is locked by pid 0x");
-  buf.WriteHex64(pid);
+  buf.WriteString("which is already locked by itself");
   pp.PrintLine(buf.GetString());
   buf.Clear();
 
-  pp.EndPanicAndDie("ProcessLock::Lock() taking too long (deadlock?)");
+  pp.EndPanicAndDie("ProcessLock::Lock() deadlock");
 #endif
 }
 
 void ProcessLock::Unlock() {
   if (!liumos->is_multi_task_enabled)
     return;
+#ifndef LIUMOS_LOADER
   locked_by_pid_ = 0;
+  lock_.Unlock();
+#endif
 }
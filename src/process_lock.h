@@ -1,7 +1,10 @@
 #pragma once
 
 #include "generic.h"
+#include "spin_lock.h"
 
+// SpinLock which also records the process holding it, to detect recursive
+// locking in a process.
 class ProcessLock {
  public:
   ProcessLock() : locked_by_pid_(0) {}
@@ -9,5 +12,6 @@ class ProcessLock {
   void Unlock();
 
  private:
+  SpinLock lock_;
   uint64_t locked_by_pid_;
 };
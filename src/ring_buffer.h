@@ -1,4 +1,8 @@
 #pragma once
+
+#include <stdint.h>
+#include <string.h>
+
 template <typename T, unsigned int n>
 class RingBuffer {
  public:
@@ -18,6 +22,8 @@ class RingBuffer {
     writep_ = nextp;
   }
   bool IsEmpty() { return readp_ == writep_; }
+  // Push() drops the value when this is true.
+  bool IsFull() { return (writep_ + 1) % n == static_cast<unsigned>(readp_); }
   int GetReaderIndex() { return readp_; }
   int GetWriterIndex() { return writep_; }
 
@@ -26,3 +32,60 @@ class RingBuffer {
   int readp_;
   int writep_;
 };
+
+// Ring buffer of bytes on memory provided by the owner.
+class ByteRingBuffer {
+ public:
+  constexpr ByteRingBuffer()
+      : buf_(nullptr), capacity_(0), head_(0), size_(0) {}
+  void Init(uint8_t* buf, uint32_t capacity) {
+    buf_ = buf;
+    capacity_ = capacity;
+    head_ = 0;
+    size_ = 0;
+  }
+  uint8_t* GetBuffer() const { return buf_; }
+  uint32_t GetSize() const { return size_; }
+  uint32_t GetFreeSize() const { return capacity_ - size_; }
+  uint32_t GetCapacity() const { return capacity_; }
+  // Appends up to size bytes and returns the number of appended bytes.
+  uint32_t Write(const void* src, uint32_t size) {
+    if (size > GetFreeSize())
+      size = GetFreeSize();
+    const uint32_t tail = (head_ + size_) % capacity_;
+    const uint32_t first = size < capacity_ - tail ? size : capacity_ - tail;
+    memcpy(buf_ + tail, src, first);
+    memcpy(buf_, reinterpret_cast<const uint8_t*>(src) + first, size - first);
+    size_ += size;
+    return size;
+  }
+  // Copies size bytes from offset without consuming them.
+  // offset + size should not exceed GetSize().
+  void Peek(uint32_t offset, void* dst, uint32_t size) const {
+    const uint32_t start = (head_ + offset) % capacity_;
+    const uint32_t first =
+        size < capacity_ - start ? size : capacity_ - start;
+    memcpy(dst, buf_ + start, first);
+    memcpy(reinterpret_cast<uint8_t*>(dst) + first, buf_, size - first);
+  }
+  // Consumes up to size bytes and returns the number of consumed bytes.
+  uint32_t Read(void* dst, uint32_t size) {
+    if (size > size_)
+      size = size_;
+    Peek(0, dst, size);
+    Discard(size);
+    return size;
+  }
+  void Discard(uint32_t size) {
+    if (size > size_)
+      size = size_;
+    head_ = (head_ + size) % capacity_;
+    size_ -= size;
+  }
+
+ private:
+  uint8_t* buf_;
+  uint32_t capacity_;
+  uint32_t head_;
+  uint32_t size_;
+};
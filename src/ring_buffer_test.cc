@@ -6,7 +6,7 @@
 
 #include <cassert>
 
-int main() {
+static void TestRingBuffer() {
   RingBuffer<int, 4> rbuf;
 
   assert(rbuf.IsEmpty());
@@ -15,15 +15,45 @@ int main() {
   rbuf.Push(5);
   rbuf.Push(7);
   rbuf.Push(11);
+  assert(rbuf.IsFull());
   rbuf.Push(13);
   assert(rbuf.Pop() == 3);
   rbuf.Push(17);
   assert(rbuf.Pop() == 5);
+  assert(!rbuf.IsFull());
   assert(rbuf.Pop() == 7);
   assert(!rbuf.IsEmpty());
   assert(rbuf.Pop() == 17);
   assert(rbuf.IsEmpty());
   assert(rbuf.Pop() == 0);
+}
+
+static void TestByteRingBuffer() {
+  uint8_t storage[8];
+  uint8_t out[8];
+  ByteRingBuffer rbuf;
+  rbuf.Init(storage, sizeof(storage));
+  assert(rbuf.GetSize() == 0);
+  assert(rbuf.Write("abcde", 5) == 5);
+  assert(rbuf.GetFreeSize() == 3);
+  rbuf.Peek(1, out, 3);
+  assert(memcmp(out, "bcd", 3) == 0);
+  assert(rbuf.Read(out, 3) == 3);
+  assert(memcmp(out, "abc", 3) == 0);
+  // Wraps around the end of the storage.
+  assert(rbuf.Write("fghijklmn", 9) == 6);
+  assert(rbuf.GetFreeSize() == 0);
+  rbuf.Peek(2, out, 5);
+  assert(memcmp(out, "fghij", 5) == 0);
+  rbuf.Discard(4);
+  assert(rbuf.Read(out, sizeof(out)) == 4);
+  assert(memcmp(out, "hijk", 4) == 0);
+  assert(rbuf.GetSize() == 0);
+}
+
+int main() {
+  TestRingBuffer();
+  TestByteRingBuffer();
 
   puts("PASS");
   return 0;
@@ -1,9 +1,54 @@
 #include "rtl81xx.h"
 #include "kernel.h"
 #include "network.h"
+#include "timer.h"
 
 RTL81* RTL81::rtl_;
 
+// Registers. https://wiki.osdev.org/RTL8139 https://wiki.osdev.org/RTL8169
+constexpr static uint16_t kRegIDR0 = 0x00;
+constexpr static uint16_t kRegMAR0 = 0x08;
+constexpr static uint16_t kRegTNPDS = 0x20;
+constexpr static uint16_t kRegCommand = 0x37;
+constexpr static uint16_t kRegTPPoll8169 = 0x38;
+constexpr static uint16_t kRegTPPoll8139 = 0xD9;
+constexpr static uint16_t kRegIMR = 0x3C;
+constexpr static uint16_t kRegISR = 0x3E;
+constexpr static uint16_t kRegTCR = 0x40;
+constexpr static uint16_t kRegRCR = 0x44;
+constexpr static uint16_t kReg9346CR = 0x50;
+constexpr static uint16_t kRegConfig1 = 0x52;
+constexpr static uint16_t kRegBMSR8139 = 0x64;
+constexpr static uint16_t kRegPHYStatus8169 = 0x6C;
+constexpr static uint16_t kRegRMS8169 = 0xDA;
+constexpr static uint16_t kRegCPlusCmd = 0xE0;
+constexpr static uint16_t kRegRDSAR = 0xE4;
+constexpr static uint16_t kRegMTPS8169 = 0xEC;
+
+constexpr static uint8_t kCommandReset = 0x10;
+constexpr static uint8_t kCommandRXEnable = 0x08;
+constexpr static uint8_t kCommandTXEnable = 0x04;
+constexpr static uint8_t kTPPollNormalPriorityQueue = 0x40;
+constexpr static uint16_t kCPlusCmdRXEnable8139 = 0x02;
+constexpr static uint16_t kCPlusCmdTXEnable8139 = 0x01;
+constexpr static uint8_t k9346CRUnlock = 0xC0;
+constexpr static uint8_t k9346CRLock = 0x00;
+// IMR and ISR
+constexpr static uint16_t kIntRXOK = 0x01;
+constexpr static uint16_t kIntRXError = 0x02;
+constexpr static uint16_t kIntRXDescUnavailable = 0x10;
+constexpr static uint16_t kIntRXFIFOOverflow = 0x40;
+constexpr static uint16_t kIntRX =
+    kIntRXOK | kIntRXError | kIntRXDescUnavailable | kIntRXFIFOOverflow;
+// Max DMA burst unlimited, standard interframe gap.
+constexpr static uint32_t kTCRValue = 0x03000700;
+// No RX FIFO threshold, max DMA burst unlimited, and accepts frames to the
+// physical address, multicast and broadcast.
+constexpr static uint32_t kRCRValue = 0xE70E;
+// The frame check sequence is left at the end of received frames.
+constexpr static uint32_t kSizeOfFCS = 4;
+constexpr static uint32_t kMinFrameSizeWithoutFCS = 60;
+
 RTL81& RTL81::GetInstance() {
   if (!rtl_) {
     rtl_ = liumos->kernel_heap_allocator->Alloc<RTL81>();
@@ -14,9 +59,11 @@ RTL81& RTL81::GetInstance() {
   return *rtl_;
 }
 
-static std::optional<PCI::DeviceLocation> FindRTL81XX() {
+static std::optional<PCI::DeviceLocation> FindRTL81XX(bool& is_rtl8139) {
   for (auto& it : PCI::GetInstance().GetDeviceList()) {
-    if (!it.first.HasID(0x10EC, 0x8168)) {
+    is_rtl8139 = it.first.HasID(0x10EC, 0x8139);
+    if (!is_rtl8139 && !it.first.HasID(0x10EC, 0x8168) &&
+        !it.first.HasID(0x10EC, 0x8169)) {
       continue;
     }
     PutString("Device Found: ");
@@ -28,19 +75,257 @@ static std::optional<PCI::DeviceLocation> FindRTL81XX() {
   return {};
 }
 
-uint16_t RTL81::ReadPHYReg(uint8_t addr) {
-  WriteIOPort32(io_addr_base_ + 0x60, addr << 16);
+void RTL81::ReleaseRXBuffer(PacketBuffer& pbuf) {
+  RTL81& rtl = RTL81::GetInstance();
+  rtl.PostRXBuffer(static_cast<int>(&pbuf - &rtl.rx_pbufs_[0]));
+}
+
+void RTL81::PostRXBuffer(int idx) {
+  rx_lock_.Lock();
+  uint32_t flags = kDescOwn | kSizeOfEachRXBuffer;
+  if (idx == kNumOfRXDescriptors - 1)
+    flags |= kDescEndOfRing;
+  rx_descriptors_[idx].vlan_info = 0;
+  rx_descriptors_[idx].flags_and_size = flags;
+  is_rx_buf_held_[idx] = false;
+  rx_lock_.Unlock();
+}
+
+void RTL81::IntHandler(uint64_t, InterruptInfo*) {
+  RTL81& rtl = RTL81::GetInstance();
+  const uint16_t isr = ReadIOPort16(rtl.io_addr_base_ + kRegISR);
+  // The line may be shared with other devices.
+  if (!isr) {
+    GetCurrentCPU().local_apic.SendEndOfInterrupt();
+    return;
+  }
+  // Bits are cleared by writing 1 to them, which deasserts the line.
+  WriteIOPort16(rtl.io_addr_base_ + kRegISR, isr);
+  if (isr & kIntRX) {
+    rtl.num_of_interrupts_++;
+    if (isr & kIntRXDescUnavailable)
+      rtl.num_of_rx_ring_full_++;
+    // Frames arriving until the bottom half drains the ring are handled
+    // without further interrupts.
+    WriteIOPort16(rtl.io_addr_base_ + kRegIMR, 0);
+  }
+  GetCurrentCPU().local_apic.SendEndOfInterrupt();
+  if (isr & kIntRX)
+    rtl.rx_wait_queue_.WakeAll();
+}
+
+void RTL81::WaitForRXQueue(int queue) {
+  assert(queue == 0);
+  if (!uses_interrupt_) {
+    SleepMilliSecond(kRXPollIntervalMs);
+    return;
+  }
+  rx_wait_queue_.WaitUntil([this] {
+    rx_lock_.Lock();
+    bool has_frame = HasReceivedFrameLocked();
+    rx_lock_.Unlock();
+    if (has_frame)
+      return true;
+    WriteIOPort16(io_addr_base_ + kRegIMR, kIntRX);
+    // Frames received while masked raise an interrupt as soon as the mask
+    // is cleared, but check again to avoid waiting for it.
+    rx_lock_.Lock();
+    has_frame = HasReceivedFrameLocked();
+    rx_lock_.Unlock();
+    if (!has_frame)
+      return false;
+    WriteIOPort16(io_addr_base_ + kRegIMR, 0);
+    return true;
+  });
+}
+
+int RTL81::PollRXQueue(int queue) {
+  assert(queue == 0);
+  int num_of_packets = 0;
+  // Replies to the received packets are notified to the device at once.
+  const int tx_batch = BeginTXBatch();
+  while (true) {
+    rx_lock_.Lock();
+    if (!HasReceivedFrameLocked()) {
+      rx_lock_.Unlock();
+      break;
+    }
+    const int idx = rx_cursor_;
+    const uint32_t flags = rx_descriptors_[idx].flags_and_size;
+    is_rx_buf_held_[idx] = true;
+    rx_cursor_ = (rx_cursor_ + 1) % kNumOfRXDescriptors;
+    rx_lock_.Unlock();
+    const uint32_t size = flags & kRXDescSizeMask;
+    PacketBuffer& pbuf = rx_pbufs_[idx];
+    pbuf.Init(rx_buffers_[idx], size > kSizeOfFCS ? size - kSizeOfFCS : 0,
+              ReleaseRXBuffer);
+    // Sockets copy the frame, so the descriptor is posted again right below.
+    pbuf.SetCanBeKept(false);
+    // Frames larger than a buffer span descriptors. They never come since
+    // the buffers are larger than the MTU, so just drop them.
+    const uint32_t kFirstAndLast = kDescFirstSegment | kDescLastSegment;
+    if ((flags & kRXDescErrorSummary) ||
+        (flags & kFirstAndLast) != kFirstAndLast) {
+      num_of_rx_errors_++;
+    } else if (pbuf.GetSize()) {
+      Network::GetInstance().HandleReceivedFrame(pbuf);
+    }
+    // Nobody else holds the frame, so this gives the descriptor back.
+    pbuf.Unref();
+    num_of_packets++;
+  }
+  EndTXBatch(tx_batch);
+  num_of_rx_polls_++;
+  num_of_rx_packets_ += num_of_packets;
+  // Socket readers are woken up once per batch.
+  Network::GetInstance().NotifyRXPackets();
+  return num_of_packets;
+}
+
+void RTL81::PrintStatistics() {
+  if (!initialized_) {
+    PutString("RTL81 is not initialized\n");
+    return;
+  }
+  const bool is_link_up =
+      is_rtl8139_ ? ReadIOPort16(io_addr_base_ + kRegBMSR8139) & 0x04
+                  : ReadIOPort8(io_addr_base_ + kRegPHYStatus8169) & 0x02;
+  kprintf("chip: %s, link: %s\n", is_rtl8139_ ? "RTL8139C+" : "RTL8168/8169",
+          is_link_up ? "up" : "down");
+  kprintf("interrupt mode: %s\n", uses_interrupt_ ? "INTx" : "polling");
+  kprintf("rx interrupts: %lu\n", num_of_interrupts_);
+  kprintf("rx polls: %lu\n", num_of_rx_polls_);
+  kprintf("rx packets: %lu, errors: %lu, ring full: %lu\n",
+          num_of_rx_packets_, num_of_rx_errors_, num_of_rx_ring_full_);
+  kprintf("tx packets: %lu, kicks: %lu, ring full: %lu\n", num_of_tx_packets_,
+          num_of_tx_kicks_, num_of_tx_ring_full_);
+}
+
+void RTL81::KickTXLocked() {
+  assert(tx_lock_.IsLocked());
+  if (!num_of_unkicked_)
+    return;
+  WriteIOPort8(io_addr_base_ + (is_rtl8139_ ? kRegTPPoll8139 : kRegTPPoll8169),
+               kTPPollNormalPriorityQueue);
+  num_of_unkicked_ = 0;
+  num_of_tx_kicks_++;
+}
+
+uint8_t* RTL81::ReserveTXPacketBuf(size_t size) {
+  if (!initialized_) {
+    Panic("RTL81 not initialized yet");
+  }
+  assert(size <= GetMaxTXPacketSize());
   while (true) {
-    uint32_t v = ReadIOPort32(io_addr_base_ + 0x60);
-    if (v >> 31)
-      return v;
+    tx_lock_.Lock();
+    if (!(tx_descriptors_[tx_cursor_].flags_and_size & kDescOwn))
+      break;
+    // The ring is full. Makes sure the device knows all packets in it and
+    // waits for some of them to be sent.
+    num_of_tx_ring_full_++;
+    KickTXLocked();
+    tx_lock_.Unlock();
+    asm volatile("pause");
   }
+  tx_reserved_size_ = static_cast<uint32_t>(size);
+  return tx_buffers_[tx_cursor_];
+}
+
+void RTL81::SendPacket() {
+  assert(tx_lock_.IsLocked());
+  const int idx = tx_cursor_;
+  uint32_t size = tx_reserved_size_;
+  // The device does not pad short frames.
+  if (size < kMinFrameSizeWithoutFCS) {
+    bzero(tx_buffers_[idx] + size, kMinFrameSizeWithoutFCS - size);
+    size = kMinFrameSizeWithoutFCS;
+  }
+  uint32_t flags = kDescOwn | kDescFirstSegment | kDescLastSegment | size;
+  if (idx == kNumOfTXDescriptors - 1)
+    flags |= kDescEndOfRing;
+  // The frame should be visible to the device before it owns the descriptor.
+  asm volatile("" ::: "memory");
+  tx_descriptors_[idx].vlan_info = 0;
+  tx_descriptors_[idx].flags_and_size = flags;
+  tx_cursor_ = (tx_cursor_ + 1) % kNumOfTXDescriptors;
+  num_of_tx_packets_++;
+  num_of_unkicked_++;
+  if (!tx_batch_depth_ || num_of_unkicked_ >= kTXKickBatchSize)
+    KickTXLocked();
+  tx_lock_.Unlock();
+}
+
+int RTL81::BeginTXBatch() {
+  tx_lock_.Lock();
+  tx_batch_depth_++;
+  tx_lock_.Unlock();
+  // There is only one TX queue.
+  return 0;
+}
+
+void RTL81::EndTXBatch(int) {
+  tx_lock_.Lock();
+  assert(tx_batch_depth_ > 0);
+  if (--tx_batch_depth_ == 0)
+    KickTXLocked();
+  tx_lock_.Unlock();
+}
+
+void RTL81::SetupRXRing() {
+  rx_descriptors_ = AllocMemoryForMappedIO<Descriptor*>(
+      kNumOfRXDescriptors * sizeof(Descriptor));
+  for (int i = 0; i < kNumOfRXDescriptors; i++) {
+    rx_buffers_[i] = AllocMemoryForMappedIO<uint8_t*>(kSizeOfEachRXBuffer);
+    rx_descriptors_[i].buf_phys_addr = v2p(rx_buffers_[i]);
+    PostRXBuffer(i);
+  }
+  rx_cursor_ = 0;
+  const uint64_t phys_addr = v2p(rx_descriptors_);
+  WriteIOPort32(io_addr_base_ + kRegRDSAR, static_cast<uint32_t>(phys_addr));
+  WriteIOPort32(io_addr_base_ + kRegRDSAR + 4,
+                static_cast<uint32_t>(phys_addr >> 32));
+}
+
+void RTL81::SetupTXRing() {
+  tx_descriptors_ = AllocMemoryForMappedIO<Descriptor*>(
+      kNumOfTXDescriptors * sizeof(Descriptor));
+  for (int i = 0; i < kNumOfTXDescriptors; i++) {
+    tx_buffers_[i] = AllocMemoryForMappedIO<uint8_t*>(kSizeOfEachTXBuffer);
+    tx_descriptors_[i].flags_and_size = 0;
+    tx_descriptors_[i].vlan_info = 0;
+    tx_descriptors_[i].buf_phys_addr = v2p(tx_buffers_[i]);
+  }
+  tx_cursor_ = 0;
+  const uint64_t phys_addr = v2p(tx_descriptors_);
+  WriteIOPort32(io_addr_base_ + kRegTNPDS, static_cast<uint32_t>(phys_addr));
+  WriteIOPort32(io_addr_base_ + kRegTNPDS + 4,
+                static_cast<uint32_t>(phys_addr >> 32));
+}
+
+void RTL81::SetupInterrupt() {
+  uses_interrupt_ = false;
+  constexpr uint32_t kPCIRegOffsetInterruptLine = 0x3C;
+  constexpr uint32_t kPCIRegOffsetInterruptPin = 0x3D;
+  const uint8_t irq =
+      PCI::ReadConfigRegister8(dev_, kPCIRegOffsetInterruptLine);
+  const uint8_t pin =
+      PCI::ReadConfigRegister8(dev_, kPCIRegOffsetInterruptPin);
+  if (!pin || irq >= 24) {
+    PutString("RTL81: no interrupt available. Polling RX ring.\n");
+    return;
+  }
+  // The RX ring is drained by the bottom half on the BSP.
+  IDT::GetInstance().SetIntHandler(kInterruptVector, IntHandler);
+  SetLevelTriggeredInterruptRedirection(liumos->bsp_local_apic->GetID(), irq,
+                                        kInterruptVector);
+  PCI::EnableINTx(dev_);
+  uses_interrupt_ = true;
+  PutStringAndHex("RTL81: using INTx. IRQ", irq);
 }
 
 void RTL81::Init() {
-  // https://wiki.osdev.org/RTL8139
-  kprintf("RTL8::Init()\n");
-  if (auto dev = FindRTL81XX()) {
+  kprintf("RTL81::Init()\n");
+  if (auto dev = FindRTL81XX(is_rtl8139_)) {
     dev_ = *dev;
   } else {
     return;
@@ -50,107 +335,54 @@ void RTL81::Init() {
   io_addr_base_ = bar.base;
   PutStringAndHex("bar.base", bar.base);
 
-  Network::EtherAddr eth_addr;
+  if (is_rtl8139_) {
+    // Power on.
+    WriteIOPort8(io_addr_base_ + kRegConfig1, 0);
+  }
+  WriteIOPort8(io_addr_base_ + kRegCommand, kCommandReset);
+  while (ReadIOPort8(io_addr_base_ + kRegCommand) & kCommandReset) {
+    asm volatile("pause");
+  }
   for (int i = 0; i < 6; i++) {
-    eth_addr.mac[i] = ReadIOPort8(io_addr_base_ + i);
+    mac_addr_.mac[i] = ReadIOPort8(io_addr_base_ + kRegIDR0 + i);
   }
   kprintf("MAC Addr: ");
-  eth_addr.Print();
+  mac_addr_.Print();
   kprintf("\n");
 
-  kprintf("Resetting the controller...");
-  // https://wiki.osdev.org/RTL8169
-  WriteIOPort8(io_addr_base_ + 0x37, 0x10);
-  /*set the Reset bit (0x10) to the Command Register (0x37)*/
-  while (ReadIOPort8(io_addr_base_ + 0x37) & 0x10) {
-    kprintf(".");
-    asm volatile("pause");
+  if (is_rtl8139_) {
+    // Switches to C+ mode, which uses descriptor rings.
+    WriteIOPort16(io_addr_base_ + kRegCPlusCmd,
+                  kCPlusCmdRXEnable8139 | kCPlusCmdTXEnable8139);
+  } else {
+    WriteIOPort8(io_addr_base_ + kReg9346CR, k9346CRUnlock);
+    // TCR is writable only while TX is enabled.
+    WriteIOPort8(io_addr_base_ + kRegCommand, kCommandTXEnable);
+    WriteIOPort16(io_addr_base_ + kRegRMS8169, kSizeOfEachRXBuffer - 1);
+    // In units of 128 bytes.
+    WriteIOPort8(io_addr_base_ + kRegMTPS8169, 0x3B);
   }
-  kprintf(" done.\n");
-
-  uint32_t transmit_config = ReadIOPort32(io_addr_base_ + 0x40);
-  kprintf("Transmit Config: 0x%08X\n", transmit_config);
-  uint32_t receive_config = ReadIOPort32(io_addr_base_ + 0x44);
-  kprintf("Receive Config: 0x%08X\n", receive_config);
-
-  // Setup recv buffer
-  rx_descriptors_ = AllocMemoryForMappedIO<RXCommandDescriptor*>(
-      kNumOfRXDescriptors * sizeof(RXCommandDescriptor));
-  for (int i = 0; i < kNumOfRXDescriptors; i++) {
-    rx_buffers_[i] = AllocMemoryForMappedIO<void*>(kSizeOfEachRXBuffer);
-    rx_descriptors_[i].buf_size_and_flag =
-        kSizeOfEachRXBuffer | kRXFlagsOwnedByController;
-    rx_descriptors_[i].vlan_info = 0;
-    rx_descriptors_[i].buf_phys_addr = v2p(rx_buffers_[i]);
+  SetupRXRing();
+  SetupTXRing();
+  WriteIOPort32(io_addr_base_ + kRegTCR, kTCRValue);
+  WriteIOPort32(io_addr_base_ + kRegRCR, kRCRValue);
+  // Accepts all multicast frames.
+  for (int i = 0; i < 8; i++) {
+    WriteIOPort8(io_addr_base_ + kRegMAR0 + i, 0xFF);
   }
-  // Mark EOR
-  rx_descriptors_[kNumOfRXDescriptors - 1].buf_size_and_flag |=
-      kRXFlagsEndOfRing;
-  uint64_t rx_desc_phys_addr = v2p(rx_descriptors_);
-  kprintf("rx_descriptors_: %p\n", rx_descriptors_);
-  kprintf("rx_desc_phys_addr: 0x%016llX\n", rx_desc_phys_addr);
-  // Set RDSAR
-  WriteIOPort32(io_addr_base_ + 0xE4, static_cast<uint32_t>(rx_desc_phys_addr));
-  WriteIOPort32(io_addr_base_ + 0xE8,
-                static_cast<uint32_t>(rx_desc_phys_addr >> 32));
-  kprintf("RDSAR: %016llX\n",
-          (static_cast<uint64_t>(ReadIOPort32(io_addr_base_ + 0xE8)) << 32) |
-              ReadIOPort32(io_addr_base_ + 0xE4));
-  // Set Receive Packet Maximum Size (RMS)
-  WriteIOPort16(io_addr_base_ + 0xDA, kSizeOfEachRXBuffer);
-  // Set Receive Config to receive all packets
-  WriteIOPort32(io_addr_base_ + 0x44, 0b1000'1111'0001'1111);
-  // Start receiver
-  WriteIOPort8(io_addr_base_ + 0x37, 1 << 3);
-
-  bool last_is_link_up = false;
-  uint32_t last_rx_desc_flags = 0;
-  uint16_t last_isr = 0;
-  uint16_t last_rxconf = 0;
-  uint8_t last_cmd = 0;
-  int idx = 0;
-  while (true) {
-    uint8_t phy_status = ReadIOPort8(io_addr_base_ + 0x6C);
-    bool is_link_up = phy_status & 2;
-    uint32_t rx_desc_flags = rx_descriptors_[idx].buf_size_and_flag;
-    uint16_t isr = ReadIOPort16(io_addr_base_ + 0x3E);
-    uint16_t rxconf = ReadIOPort16(io_addr_base_ + 0x44);
-    uint8_t cmd = ReadIOPort8(io_addr_base_ + 0x37);
-    if (last_is_link_up != is_link_up || last_rx_desc_flags != rx_desc_flags ||
-        last_isr != isr || last_rxconf != rxconf || last_cmd != cmd) {
-      kprintf("Link: %s, 0x%08X, isr: 0x%04X, rxconf: 0x%08X, Cmd: 0x%02X\n",
-              is_link_up ? "UP" : "DOWN", rx_desc_flags, isr, rxconf, cmd);
-      last_is_link_up = is_link_up;
-      last_rx_desc_flags = rx_desc_flags;
-      last_isr = isr;
-      last_rxconf = rxconf;
-      last_cmd = cmd;
-    }
-    if ((rx_desc_flags & kRXFlagsOwnedByController) == 0) {
-      size_t size = rx_descriptors_[idx].buf_size_and_flag & 0x1FFF;
-      kprintf("update on rx_descriptors_[%d]: recieved size = %d\n", idx, size);
-      // volatile void *data = rx_buffers_[idx];
-      // kprintbuf("received", data, 0, size);
-
-      if (rx_descriptors_[idx].buf_size_and_flag & kRXFlagsEndOfRing) {
-        rx_descriptors_[idx].vlan_info = 0;
-        rx_descriptors_[idx].buf_size_and_flag =
-            kSizeOfEachRXBuffer | kRXFlagsEndOfRing | kRXFlagsOwnedByController;
-        idx = 0;
-        last_rx_desc_flags = 0;
-      } else {
-        rx_descriptors_[idx].vlan_info = 0;
-        rx_descriptors_[idx].buf_size_and_flag =
-            kSizeOfEachRXBuffer | kRXFlagsOwnedByController;
-        idx++;
-        last_rx_desc_flags = 0;
-      }
-    }
-    if ((cmd & 0x08) == 0) {
-      // Receiver has been stopped
-      break;
-    }
-    if (liumos->main_console->GetCharWithoutBlocking() != KeyID::kNoInput)
-      break;
+  SetupInterrupt();
+  WriteIOPort16(io_addr_base_ + kRegISR, 0xFFFF);
+  WriteIOPort16(io_addr_base_ + kRegIMR, uses_interrupt_ ? kIntRX : 0);
+  WriteIOPort8(io_addr_base_ + kRegCommand,
+               kCommandRXEnable | kCommandTXEnable);
+  if (!is_rtl8139_)
+    WriteIOPort8(io_addr_base_ + kReg9346CR, k9346CRLock);
+
+  initialized_ = true;
+  PutString("RTL81: initialized\n");
+  if (Network::GetInstance().AttachNIC(*this)) {
+    PutString("RTL81: another NIC is used\n");
+    WriteIOPort16(io_addr_base_ + kRegIMR, 0);
+    WriteIOPort8(io_addr_base_ + kRegCommand, 0);
   }
 }
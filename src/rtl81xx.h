@@ -3,31 +3,124 @@
 #include <optional>
 
 #include "generic.h"
+#include "interrupt.h"
 #include "network.h"
+#include "nic.h"
+#include "packet_buffer.h"
 #include "pci.h"
+#include "spin_lock.h"
+#include "wait_queue.h"
 
-class RTL81 {
+// Realtek RTL8139C+ and RTL8168/8169 in C+ mode, which move frames through
+// rings of descriptors. The device has one RX ring and one TX ring, so RX is
+// processed only on the BSP and the TX ring is shared by all processors.
+// Checksums and segmentation are not offloaded.
+class RTL81 : public NIC {
  public:
-  void Init();
-  static RTL81& GetInstance();
-
-  packed_struct RXCommandDescriptor {
-    volatile uint32_t buf_size_and_flag;
+  // Used for both RX and TX.
+  packed_struct Descriptor {
+    volatile uint32_t flags_and_size;
     volatile uint32_t vlan_info;
     volatile uint64_t buf_phys_addr;
   };
-  static_assert(sizeof(RXCommandDescriptor) == 16);
+  static_assert(sizeof(Descriptor) == 16);
+
+  // Attaches the device to Network if found.
+  void Init();
+  static RTL81& GetInstance();
+
+  // NIC
+  void WaitForRXQueue(int queue) override;
+  int PollRXQueue(int queue) override;
+  int GetNumOfRXQueues() const override { return 1; }
+  void PrintStatistics() override;
+  bool CanOffloadTXChecksum() const override { return false; }
+  bool CanOffloadTCPSegmentation() const override { return false; }
+  bool CanOffloadUDPFragmentation() const override { return false; }
+  size_t GetMaxTXPacketSize() const override {
+    return sizeof(Network::EtherFrame) + Network::EtherFrame::kMTU;
+  }
+  void SetTXChecksumOffload(size_t, size_t) override {
+    Panic("RTL81: checksum offload is not supported");
+  }
+  void SetTXSegmentationOffload(uint8_t, size_t, size_t) override {
+    Panic("RTL81: segmentation offload is not supported");
+  }
+  void SendPacket() override;
+  // Packets in a batch are notified to the device at once, or every
+  // kTXKickBatchSize packets.
+  int BeginTXBatch() override;
+  void EndTXBatch(int batch) override;
 
  private:
-  uint16_t ReadPHYReg(uint8_t addr);
+  static constexpr uint8_t kInterruptVector = 0x24;
+  static constexpr uint64_t kRXPollIntervalMs = 10;
+  static constexpr int kTXKickBatchSize = 32;
+  static constexpr uint32_t kSizeOfEachRXBuffer = 4096;
+  static constexpr uint32_t kSizeOfEachTXBuffer = 4096;
+  static constexpr int kNumOfRXDescriptors = 64;
+  static constexpr int kNumOfTXDescriptors = 64;
 
   static RTL81* rtl_;
+  bool initialized_;
   PCI::DeviceLocation dev_;
+  bool is_rtl8139_;  // Otherwise RTL8168/8169.
   uint16_t io_addr_base_;
-  static constexpr uint32_t kSizeOfEachRXBuffer = 4096;
-  static constexpr uint32_t kRXFlagsOwnedByController = (1 << 31);
-  static constexpr uint32_t kRXFlagsEndOfRing = (1 << 30);
-  static constexpr int kNumOfRXDescriptors = 32;
-  RXCommandDescriptor* rx_descriptors_;
-  volatile void* rx_buffers_[kNumOfRXDescriptors];
+  bool uses_interrupt_;  // The RX ring is polled periodically if false.
+
+  // Received frames are passed to the upper layer without copying. The
+  // descriptor of a frame is given back to the device when it is released.
+  // Sockets copy the frames instead of keeping them, since the device fills
+  // the ring in order and stops at a descriptor which is still held.
+  Descriptor* rx_descriptors_;
+  uint8_t* rx_buffers_[kNumOfRXDescriptors];
+  PacketBuffer rx_pbufs_[kNumOfRXDescriptors];
+  // Protects the RX descriptors, rx_cursor_ and is_rx_buf_held_.
+  SpinLock rx_lock_;
+  int rx_cursor_;  // The next descriptor which the device fills.
+  // Set while the frame of the descriptor is handled by the upper layer, when
+  // the descriptor is not owned by the device but has nothing new.
+  bool is_rx_buf_held_[kNumOfRXDescriptors];
+  WaitQueue rx_wait_queue_;
+
+  Descriptor* tx_descriptors_;
+  uint8_t* tx_buffers_[kNumOfTXDescriptors];
+  // Taken by GetNextTXPacketBuf() and released by SendPacket(). Protects the
+  // TX descriptors and the members below.
+  SpinLock tx_lock_;
+  int tx_cursor_;  // The next descriptor to send.
+  uint32_t tx_reserved_size_;
+  int tx_batch_depth_;
+  int num_of_unkicked_;
+
+  // Statistics
+  uint64_t num_of_interrupts_;
+  uint64_t num_of_rx_polls_;
+  uint64_t num_of_rx_packets_;
+  uint64_t num_of_rx_errors_;
+  uint64_t num_of_rx_ring_full_;
+  uint64_t num_of_tx_packets_;
+  uint64_t num_of_tx_kicks_;
+  uint64_t num_of_tx_ring_full_;
+
+  static void IntHandler(uint64_t intcode, InterruptInfo* info);
+  void SetupInterrupt();
+  void SetupRXRing();
+  void SetupTXRing();
+  bool HasReceivedFrameLocked() {
+    return !(rx_descriptors_[rx_cursor_].flags_and_size & kDescOwn) &&
+           !is_rx_buf_held_[rx_cursor_];
+  }
+  static void ReleaseRXBuffer(PacketBuffer& pbuf);
+  // Gives the descriptor back to the device.
+  void PostRXBuffer(int idx);
+  uint8_t* ReserveTXPacketBuf(size_t size) override;
+  void KickTXLocked();
+
+  static constexpr uint32_t kDescOwn = 1U << 31;  // Owned by the device.
+  static constexpr uint32_t kDescEndOfRing = 1 << 30;
+  static constexpr uint32_t kDescFirstSegment = 1 << 29;
+  static constexpr uint32_t kDescLastSegment = 1 << 28;
+  static constexpr uint32_t kRXDescErrorSummary = 1 << 21;
+  static constexpr uint32_t kRXDescSizeMask = 0x1FFF;
 };
@@ -1,45 +1,368 @@
 #include "scheduler.h"
 
 #include "liumos.h"
+#include "timer.h"
+
+Scheduler::Scheduler(Process& root_process) {
+  assert(root_process.GetStatus() == Process::Status::kNotScheduled);
+  for (int i = 0; i < kMaxNumOfCPUs; i++) {
+    RunQueue& rq = run_queues_[i];
+    rq.ready_bitmap = 0;
+    rq.current = nullptr;
+    rq.idle = nullptr;
+    rq.num_of_processes = 0;
+    rq.is_online = false;
+  }
+  // The root process is running on the BSP.
+  RunQueue& rq = run_queues_[0];
+  root_process.cpu_ = 0;
+  root_process.on_cpu_ = true;
+  root_process.SetStatus(Process::Status::kRunning);
+  rq.current = &root_process;
+  rq.num_of_processes = 1;
+  rq.is_online = true;
+}
+
+void Scheduler::InitCPU(int cpu, Process& idle_process) {
+  assert(0 <= cpu && cpu < kMaxNumOfCPUs);
+  assert(idle_process.GetStatus() == Process::Status::kNotScheduled);
+  RunQueue& rq = run_queues_[cpu];
+  rq.lock.Lock();
+  idle_process.cpu_ = cpu;
+  if (rq.current) {
+    idle_process.SetStatus(Process::Status::kSleeping);
+  } else {
+    // Nothing is running on cpu yet, so the caller becomes the idle process.
+    idle_process.SetStatus(Process::Status::kRunning);
+    idle_process.on_cpu_ = true;
+    rq.current = &idle_process;
+  }
+  rq.idle = &idle_process;
+  rq.is_online = true;
+  rq.lock.Unlock();
+}
 
 void Scheduler::RegisterProcess(Process& proc) {
-  using Status = Process::Status;
-  assert(number_of_process_ < kNumberOfProcess);
   assert(proc.GetStatus() == Process::Status::kNotScheduled);
-  process_[number_of_process_] = &proc;
-  proc.SetSchedulerIndex(number_of_process_);
-  number_of_process_++;
+  assert(0 <= proc.GetPriority() && proc.GetPriority() < kNumOfPriorities);
+  int cpu = proc.GetAffinity();
+  if (cpu == Process::kAnyCPU) {
+    // Racy but good enough to spread processes.
+    cpu = 0;
+    for (int i = 1; i < kMaxNumOfCPUs; i++) {
+      if (run_queues_[i].is_online &&
+          run_queues_[i].num_of_processes < run_queues_[cpu].num_of_processes)
+        cpu = i;
+    }
+  }
+  assert(0 <= cpu && cpu < kMaxNumOfCPUs && run_queues_[cpu].is_online);
+  RunQueue& rq = run_queues_[cpu];
+  rq.lock.Lock();
+  proc.cpu_ = cpu;
+  rq.num_of_processes++;
+  const bool needs_reschedule = NeedsReschedule(rq, proc);
+  const bool is_migratable = proc.affinity_ == Process::kAnyCPU;
+  PushToReadyQueue(rq, proc);
+  rq.lock.Unlock();
+  NotifyReadyProcess(cpu, needs_reschedule, is_migratable);
+}
 
-  proc.SetStatus(Status::kSleeping);
+void Scheduler::ReapProcess(Process& proc) {
+  assert(proc.GetStatus() == Process::Status::kStopped);
+  assert(!proc.on_cpu_);
+  // A killed process may leave its sleep timer pending.
+  CancelTimer(proc.GetSleepTimer());
+  CloseAllFileDescriptors(proc);
+  liumos->proc_ctrl->Destroy(proc);
 }
 
 uint64_t Scheduler::LaunchAndWaitUntilExit(Process& proc) {
   RegisterProcess(proc);
-  proc.WaitUntilExit();
+  WaitUntilExit(proc);
   proc.PrintStatistics();
+  ReapProcess(proc);
   return 0;
 }
 
+void Scheduler::WaitUntilExit(Process& proc) {
+  assert(&proc != &GetCurrentProcess());
+  proc.GetExitWaitQueue().WaitUntil(
+      [&proc] { return proc.GetStatus() == Process::Status::kStopped; });
+}
+
 Process* Scheduler::SwitchProcess() {
   using Status = Process::Status;
-  const int base_index = current_->GetSchedulerIndex();
-  for (int i = 1; i < number_of_process_; i++) {
-    Process* proc = process_[(base_index + i) % number_of_process_];
-    if (!proc)
+  const int cpu = GetCurrentCPUIndex();
+  RunQueue& rq = run_queues_[cpu];
+  rq.lock.Lock();
+  Process* current = rq.current;
+  const bool can_continue = current->GetStatus() == Status::kRunning;
+  Process* next = nullptr;
+  bool has_requeued_migratable = false;
+  if (rq.ready_bitmap) {
+    const int priority = __builtin_ctz(rq.ready_bitmap);
+    if (!can_continue || current == rq.idle ||
+        priority <= current->GetPriority())
+      next = PopFromReadyQueue(rq, priority);
+  } else if (!can_continue || current == rq.idle) {
+    next = StealProcess(cpu);
+    if (!next && !can_continue)
+      next = rq.idle;
+  }
+  if (next == current) {
+    // current was woken up before it switched to another process.
+    current->SetStatus(Status::kRunning);
+    next = nullptr;
+  }
+  if (next) {
+    if (current == rq.idle)
+      current->SetStatus(Status::kSleeping);
+    else if (can_continue) {
+      PushToReadyQueue(rq, *current);
+      has_requeued_migratable = current->affinity_ == Process::kAnyCPU;
+    }
+    // Blocked process is already in a WaitQueue, and stopping process will
+    // be stopped in FinishSwitch().
+    next->SetStatus(Status::kRunning);
+    next->on_cpu_ = true;
+    rq.current = next;
+  }
+  rq.lock.Unlock();
+  if (has_requeued_migratable)
+    KickIdleCPU(cpu);
+  return next;
+}
+
+void Scheduler::FinishSwitch(Process& prev) {
+  // Processes waiting for prev may free it as soon as they see kStopped, so
+  // the status is changed with the lock of the exit wait queue held.
+  WaitQueue& exit_wait_queue = prev.GetExitWaitQueue();
+  exit_wait_queue.lock_.Lock();
+  RunQueue& rq = LockRunQueueOf(prev);
+  prev.on_cpu_ = false;
+  const bool is_stopped = prev.GetStatus() == Process::Status::kStopping;
+  if (is_stopped) {
+    prev.SetStatus(Process::Status::kStopped);
+    rq.num_of_processes--;
+  }
+  rq.lock.Unlock();
+  if (is_stopped)
+    WakeAllLocked(exit_wait_queue);
+  exit_wait_queue.lock_.Unlock();
+}
+
+Process& Scheduler::GetCurrentProcess() {
+  // Interrupts are disabled to read the run queue of the processor which
+  // this is running on.
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  Process* proc = run_queues_[GetCurrentCPUIndex()].current;
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+  assert(proc);
+  return *proc;
+}
+
+void Scheduler::Kill(Process& proc) {
+  using Status = Process::Status;
+  // Take proc out of the WaitQueue first to keep the lock order.
+  while (WaitQueue* wait_queue =
+             __atomic_load_n(&proc.wait_queue_, __ATOMIC_ACQUIRE)) {
+    wait_queue->lock_.Lock();
+    if (proc.wait_queue_ == wait_queue) {
+      wait_queue->queue_.Remove(proc);
+      proc.wait_queue_ = nullptr;
+    }
+    wait_queue->lock_.Unlock();
+  }
+  WaitQueue& exit_wait_queue = proc.GetExitWaitQueue();
+  exit_wait_queue.lock_.Lock();
+  RunQueue& rq = LockRunQueueOf(proc);
+  bool is_stopped = false;
+  switch (proc.GetStatus()) {
+    case Status::kNotInitialized:
+    case Status::kNotScheduled:
+      PutString("Tried to stop the process not running");
+      break;
+    case Status::kSleeping:
+      if (proc.queue_)
+        RemoveFromReadyQueue(rq, proc);
+      [[fallthrough]];
+    case Status::kBlocked:
+    case Status::kRunning:
+      if (proc.on_cpu_) {
+        // Will be stopped when the processor switches to another process.
+        proc.SetStatus(Status::kStopping);
+        break;
+      }
+      proc.SetStatus(Status::kStopped);
+      rq.num_of_processes--;
+      is_stopped = true;
+      break;
+    case Status::kStopping:
+    case Status::kStopped:
+      break;
+  }
+  rq.lock.Unlock();
+  if (is_stopped)
+    WakeAllLocked(exit_wait_queue);
+  exit_wait_queue.lock_.Unlock();
+}
+
+void Scheduler::KillCurrentProcess() {
+  Kill(GetCurrentProcess());
+}
+
+void Scheduler::Wake(Process& proc) {
+  RunQueue& rq = LockRunQueueOf(proc);
+  assert(proc.GetStatus() == Process::Status::kBlocked);
+  assert(!proc.queue_);
+  proc.wait_queue_ = nullptr;
+  const int cpu = proc.cpu_;
+  const bool needs_reschedule = NeedsReschedule(rq, proc);
+  const bool is_migratable = proc.affinity_ == Process::kAnyCPU;
+  PushToReadyQueue(rq, proc);
+  rq.lock.Unlock();
+  NotifyReadyProcess(cpu, needs_reschedule, is_migratable);
+}
+
+void Scheduler::Block(Process& proc, WaitQueue& wait_queue) {
+  RunQueue& rq = LockRunQueueOf(proc);
+  // proc may be killed or woken up already.
+  if (proc.GetStatus() == Process::Status::kRunning) {
+    proc.SetStatus(Process::Status::kBlocked);
+    wait_queue.queue_.Push(proc);
+    proc.wait_queue_ = &wait_queue;
+  }
+  rq.lock.Unlock();
+}
+
+Scheduler::RunQueue& Scheduler::LockRunQueueOf(Process& proc) {
+  // proc.cpu_ is changed with the lock of the run queue held when proc is
+  // stolen by another processor, so it is checked again after locking.
+  while (true) {
+    const int cpu = __atomic_load_n(&proc.cpu_, __ATOMIC_RELAXED);
+    RunQueue& rq = run_queues_[cpu];
+    rq.lock.Lock();
+    if (proc.cpu_ == cpu)
+      return rq;
+    rq.lock.Unlock();
+  }
+}
+
+Process* Scheduler::StealProcess(int cpu) {
+  RunQueue& rq = run_queues_[cpu];
+  // Starts from the next processor so that idle processors do not contend
+  // for the same victim.
+  for (int i = 1; i < kMaxNumOfCPUs; i++) {
+    RunQueue& victim = run_queues_[(cpu + i) % kMaxNumOfCPUs];
+    if (!victim.is_online ||
+        !__atomic_load_n(&victim.ready_bitmap, __ATOMIC_RELAXED))
       continue;
-    if (proc->GetStatus() == Status::kSleeping) {
-      if (current_->GetStatus() == Status::kRunning)
-        current_->SetStatus(Status::kSleeping);
-      else if (current_->GetStatus() == Status::kStopping)
-        current_->SetStatus(Status::kStopped);
-      proc->SetStatus(Status::kRunning);
-      current_ = proc;
-      return proc;
+    // The victim may be stealing from this processor at the same time, so
+    // waiting for the lock can deadlock.
+    if (!victim.lock.TryLock())
+      continue;
+    Process* proc = nullptr;
+    for (uint32_t bitmap = victim.ready_bitmap; bitmap && !proc;
+         bitmap &= bitmap - 1) {
+      // The tail is the process which waits for the victim most.
+      for (Process* p = victim.ready_queues[__builtin_ctz(bitmap)].GetTail();
+           p; p = p->queue_prev_) {
+        // A process which is on_cpu_ has not been saved by the victim yet.
+        if (p->affinity_ == Process::kAnyCPU && !p->on_cpu_) {
+          proc = p;
+          break;
+        }
+      }
+    }
+    if (proc) {
+      RemoveFromReadyQueue(victim, *proc);
+      victim.num_of_processes--;
+      proc->cpu_ = cpu;
+      proc->number_of_migrations_++;
+      rq.num_of_processes++;
     }
+    victim.lock.Unlock();
+    if (proc)
+      return proc;
   }
   return nullptr;
 }
 
-void Scheduler::KillCurrentProcess() {
-  current_->Kill();
+void Scheduler::PushToReadyQueue(RunQueue& rq, Process& proc) {
+  const int priority = proc.GetPriority();
+  proc.SetStatus(Process::Status::kSleeping);
+  rq.ready_queues[priority].Push(proc);
+  rq.ready_bitmap |= 1U << priority;
+}
+
+bool Scheduler::NeedsReschedule(RunQueue& rq, Process& proc) {
+  // The timer for the time slice is armed only if some processes are
+  // waiting for the processor.
+  return rq.current == rq.idle || !rq.ready_bitmap ||
+         proc.GetPriority() < rq.current->GetPriority();
+}
+
+void Scheduler::NotifyReadyProcess(int cpu,
+                                   bool needs_reschedule,
+                                   bool is_migratable) {
+  if (needs_reschedule)
+    SendRescheduleIPI(cpu);
+  else if (is_migratable)
+    KickIdleCPU(cpu);
+}
+
+void Scheduler::KickIdleCPU(int cpu) {
+  for (int i = 1; i < kMaxNumOfCPUs; i++) {
+    const int target = (cpu + i) % kMaxNumOfCPUs;
+    RunQueue& rq = run_queues_[target];
+    // Racy, but the processor just finds nothing to steal if it is not idle.
+    if (rq.is_online && rq.current == rq.idle) {
+      SendRescheduleIPI(target);
+      return;
+    }
+  }
+}
+
+Process* Scheduler::PopFromReadyQueue(RunQueue& rq, int priority) {
+  Process* proc = rq.ready_queues[priority].Pop();
+  assert(proc);
+  if (rq.ready_queues[priority].IsEmpty())
+    rq.ready_bitmap &= ~(1U << priority);
+  return proc;
+}
+
+void Scheduler::RemoveFromReadyQueue(RunQueue& rq, Process& proc) {
+  const int priority = proc.GetPriority();
+  rq.ready_queues[priority].Remove(proc);
+  if (rq.ready_queues[priority].IsEmpty())
+    rq.ready_bitmap &= ~(1U << priority);
+}
+
+void Scheduler::WakeAllLocked(WaitQueue& wait_queue) {
+  while (Process* proc = wait_queue.queue_.Pop())
+    Wake(*proc);
+}
+
+void WaitQueue::BlockCurrentProcessAndUnlock() {
+  Scheduler& scheduler = *liumos->scheduler;
+  scheduler.Block(scheduler.GetCurrentProcess(), *this);
+  lock_.Unlock();
+  // If this process is woken up before switching, the scheduler just
+  // continues it.
+  Sleep();
+}
+
+void WaitQueue::WakeOne() {
+  lock_.Lock();
+  if (Process* proc = queue_.Pop())
+    liumos->scheduler->Wake(*proc);
+  lock_.Unlock();
+}
+
+void WaitQueue::WakeAll() {
+  lock_.Lock();
+  liumos->scheduler->WakeAllLocked(*this);
+  lock_.Unlock();
 }
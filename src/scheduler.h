@@ -1,25 +1,80 @@
 #pragma once
 #include "process.h"
+#include "smp.h"
+#include "spin_lock.h"
 
+// Priority scheduler with O(1) selection of the next process.
+// Each processor has its own run queue. Runnable processes are kept in a
+// FIFO per priority, and a bitmap tracks which priorities have runnable
+// processes. Processes with the same priority are scheduled in round-robin.
+// Blocked processes are kept in WaitQueues and never visited by the
+// scheduler until they are woken up.
+// A processor which runs out of runnable processes steals one from the tail
+// of a ready queue of another processor, unless it is pinned by its affinity.
+// Lock order: WaitQueue::lock_, then RunQueue::lock. Locks of other run
+// queues are only tried while the lock of a run queue is held.
 class Scheduler {
  public:
-  Scheduler(Process& root_process)
-      : number_of_process_(0), current_(&root_process) {
-    RegisterProcess(root_process);
-    root_process.SetStatus(Process::Status::kRunning);
-  }
+  static constexpr int kNumOfPriorities = 32;
+  Scheduler(Process& root_process);
+  // Makes cpu available for scheduling. The caller becomes idle_process,
+  // which runs only when there is no other process to run on cpu.
+  // Should be called on cpu.
+  void InitCPU(int cpu, Process& idle_process);
+  // Registers proc to the processor of its affinity, or the least loaded
+  // processor if it is not pinned.
   void RegisterProcess(Process& proc);
+  // Unregisters a stopped process and frees it. proc cannot be used after this.
+  void ReapProcess(Process& proc);
   uint64_t LaunchAndWaitUntilExit(Process& proc);
+  void WaitUntilExit(Process& proc);
+  // Returns the next process to run on the current processor, or nullptr if
+  // current one should continue. Should be called with interrupts disabled,
+  // and FinishSwitch() should be called after the context is switched.
   Process* SwitchProcess();
-  Process& GetCurrentProcess() {
-    assert(current_);
-    return *current_;
-  }
+  // Called after the context of prev is saved.
+  void FinishSwitch(Process& prev);
+  Process& GetCurrentProcess();
+  void Kill(Process& proc);
   void KillCurrentProcess();
+  // Makes a blocked process runnable. Should be called with the lock of the
+  // WaitQueue which proc was in held.
+  void Wake(Process& proc);
+  int GetNumOfProcesses(int cpu) { return run_queues_[cpu].num_of_processes; }
+  bool HasReadyProcess(int cpu) {
+    return __atomic_load_n(&run_queues_[cpu].ready_bitmap, __ATOMIC_RELAXED);
+  }
 
  private:
-  const static int kNumberOfProcess = 256;
-  Process* process_[kNumberOfProcess];
-  int number_of_process_;
-  Process* current_;
+  friend class WaitQueue;
+  struct RunQueue {
+    SpinLock lock;
+    ProcessQueue ready_queues[kNumOfPriorities];
+    uint32_t ready_bitmap;  // bit i is set if ready_queues[i] is not empty.
+    Process* current;
+    Process* idle;
+    int num_of_processes;  // Includes current, excludes idle.
+    bool is_online;
+  };
+  // Returns the run queue which proc belongs to with its lock held.
+  RunQueue& LockRunQueueOf(Process& proc);
+  // Takes a migratable process from another processor and moves it to cpu.
+  // Should be called with the lock of the run queue of cpu held.
+  Process* StealProcess(int cpu);
+  void Block(Process& proc, WaitQueue& wait_queue);
+  void PushToReadyQueue(RunQueue& rq, Process& proc);
+  // Returns true if the processor of rq should run the scheduler to handle
+  // proc which is about to be pushed. Otherwise, proc waits for the end of
+  // the time slice of the current process.
+  bool NeedsReschedule(RunQueue& rq, Process& proc);
+  // Called without locks after proc is made ready on cpu.
+  void NotifyReadyProcess(int cpu, bool needs_reschedule, bool is_migratable);
+  // Sends a reschedule IPI to an idle processor other than cpu, which will
+  // steal a process.
+  void KickIdleCPU(int cpu);
+  Process* PopFromReadyQueue(RunQueue& rq, int priority);
+  void RemoveFromReadyQueue(RunQueue& rq, Process& proc);
+  void WakeAllLocked(WaitQueue& wait_queue);
+
+  RunQueue run_queues_[kMaxNumOfCPUs];
 };
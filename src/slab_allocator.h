@@ -0,0 +1,333 @@
+#pragma once
+
+#include "console.h"
+#include "generic.h"
+#include "spin_lock.h"
+
+// Object cache for small objects of a fixed size.
+// Objects are carved from slabs (runs of pages provided by TPageAllocator).
+// Each object slot has a small header pointing to its slab, so slabs do not
+// need to be aligned to their size. Recently freed objects are kept in a
+// magazine (a small LIFO stack) and returned without touching slab lists.
+// TPageAllocator should provide AllocPages<T>(num_of_pages) and
+// FreePages(addr, num_of_pages). Each cache is protected by its own lock and
+// hooks are called without holding it.
+template <class TPageAllocator>
+class SlabCache {
+ public:
+  using Hook = void (*)(void*);
+  struct Slab {
+    Slab* next;
+    Slab* prev;
+    void* free_list;
+    SlabCache* cache;
+    uint64_t num_of_objects_in_use;
+  };
+  // Placed just before each object.
+  struct SlotHeader {
+    Slab* slab;  // nullptr if the object is not allocated from a slab.
+    uint64_t num_of_pages;  // valid only if slab is nullptr.
+  };
+  struct Statistics {
+    uint64_t num_of_allocs;
+    uint64_t num_of_frees;
+    uint64_t num_of_magazine_hits;
+    uint64_t num_of_slabs;
+    uint64_t num_of_objects_in_use;
+  };
+
+  SlabCache(TPageAllocator& page_allocator,
+            const char* name,
+            uint64_t object_size,
+            Hook ctor = nullptr,
+            Hook dtor = nullptr)
+      : page_allocator_(page_allocator),
+        name_(name),
+        object_size_(object_size),
+        slot_size_(CeilToSlotAlignment(sizeof(SlotHeader) + object_size)),
+        num_of_pages_per_slab_(ByteSizeToPageSize(
+            kSlabHeaderSize + slot_size_ * kMinNumOfObjectsPerSlab)),
+        num_of_objects_per_slab_(
+            ((num_of_pages_per_slab_ << kPageSizeExponent) - kSlabHeaderSize) /
+            slot_size_),
+        ctor_(ctor),
+        dtor_(dtor),
+        partial_slabs_(nullptr),
+        full_slabs_(nullptr),
+        num_of_empty_slabs_(0),
+        magazine_size_(0),
+        stat_() {}
+  void* Alloc() {
+    lock_.Lock();
+    stat_.num_of_allocs++;
+    stat_.num_of_objects_in_use++;
+    void* obj;
+    if (magazine_size_) {
+      stat_.num_of_magazine_hits++;
+      obj = magazine_[--magazine_size_];
+    } else {
+      obj = AllocFromSlab();
+    }
+    lock_.Unlock();
+    if (ctor_)
+      ctor_(obj);
+    return obj;
+  }
+  void Free(void* obj) {
+    if (!obj)
+      return;
+    assert(GetSlot(obj)->slab->cache == this);
+    if (dtor_)
+      dtor_(obj);
+    lock_.Lock();
+    stat_.num_of_frees++;
+    stat_.num_of_objects_in_use--;
+    if (magazine_size_ < kMagazineSize)
+      magazine_[magazine_size_++] = obj;
+    else
+      FreeToSlab(obj);
+    lock_.Unlock();
+  }
+  // Returns objects in the magazine to slabs so that empty slabs can be
+  // released.
+  void Drain() {
+    lock_.Lock();
+    while (magazine_size_)
+      FreeToSlab(magazine_[--magazine_size_]);
+    lock_.Unlock();
+  }
+  static SlotHeader* GetSlot(void* obj) {
+    return reinterpret_cast<SlotHeader*>(reinterpret_cast<uint64_t>(obj) -
+                                         sizeof(SlotHeader));
+  }
+  // Returns the cache which obj was allocated from.
+  static SlabCache* GetCacheOf(void* obj) {
+    Slab* slab = GetSlot(obj)->slab;
+    return slab ? slab->cache : nullptr;
+  }
+  uint64_t GetObjectSize() const { return object_size_; }
+  const Statistics& GetStatistics() const { return stat_; }
+  void Print() {
+    PutString(name_);
+    PutString(": size=");
+    PutDecimal64(object_size_);
+    PutString(" in use=");
+    PutDecimal64(stat_.num_of_objects_in_use);
+    PutString(" slabs=");
+    PutDecimal64(stat_.num_of_slabs);
+    PutString(" allocs=");
+    PutDecimal64(stat_.num_of_allocs);
+    PutString(" frees=");
+    PutDecimal64(stat_.num_of_frees);
+    PutString(" magazine hits=");
+    PutDecimal64(stat_.num_of_magazine_hits);
+    PutString("\n");
+  }
+
+ private:
+  static constexpr int kMagazineSize = 16;
+  static constexpr uint64_t kMinNumOfObjectsPerSlab = 8;
+  static constexpr uint64_t kSlotAlignment = 16;
+  static constexpr uint64_t CeilToSlotAlignment(uint64_t v) {
+    return (v + kSlotAlignment - 1) & ~(kSlotAlignment - 1);
+  }
+
+  static_assert(sizeof(SlotHeader) == kSlotAlignment);
+  static constexpr uint64_t kSlabHeaderSize = CeilToSlotAlignment(sizeof(Slab));
+
+  static void PushSlab(Slab*& list, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = list;
+    if (list)
+      list->prev = slab;
+    list = slab;
+  }
+  static void RemoveSlab(Slab*& list, Slab* slab) {
+    if (slab->prev)
+      slab->prev->next = slab->next;
+    else
+      list = slab->next;
+    if (slab->next)
+      slab->next->prev = slab->prev;
+  }
+  Slab* CreateSlab() {
+    Slab* slab = page_allocator_.template AllocPages<Slab*>(
+        num_of_pages_per_slab_);
+    slab->cache = this;
+    slab->num_of_objects_in_use = 0;
+    slab->free_list = nullptr;
+    uint64_t slot_base = reinterpret_cast<uint64_t>(slab) + kSlabHeaderSize;
+    for (uint64_t i = num_of_objects_per_slab_; i > 0; i--) {
+      SlotHeader* slot =
+          reinterpret_cast<SlotHeader*>(slot_base + slot_size_ * (i - 1));
+      slot->slab = slab;
+      void** obj = reinterpret_cast<void**>(slot + 1);
+      *obj = slab->free_list;
+      slab->free_list = obj;
+    }
+    stat_.num_of_slabs++;
+    num_of_empty_slabs_++;
+    return slab;
+  }
+  void* AllocFromSlab() {
+    if (!partial_slabs_)
+      PushSlab(partial_slabs_, CreateSlab());
+    Slab* slab = partial_slabs_;
+    void** obj = reinterpret_cast<void**>(slab->free_list);
+    slab->free_list = *obj;
+    if (slab->num_of_objects_in_use++ == 0)
+      num_of_empty_slabs_--;
+    if (!slab->free_list) {
+      RemoveSlab(partial_slabs_, slab);
+      PushSlab(full_slabs_, slab);
+    }
+    return obj;
+  }
+  void FreeToSlab(void* obj) {
+    Slab* slab = GetSlot(obj)->slab;
+    if (!slab->free_list) {
+      RemoveSlab(full_slabs_, slab);
+      PushSlab(partial_slabs_, slab);
+    }
+    *reinterpret_cast<void**>(obj) = slab->free_list;
+    slab->free_list = obj;
+    if (--slab->num_of_objects_in_use)
+      return;
+    // Keep one empty slab to avoid allocating pages again soon.
+    if (num_of_empty_slabs_++ == 0)
+      return;
+    RemoveSlab(partial_slabs_, slab);
+    num_of_empty_slabs_--;
+    stat_.num_of_slabs--;
+    page_allocator_.FreePages(reinterpret_cast<uint64_t>(slab),
+                              num_of_pages_per_slab_);
+  }
+
+  TPageAllocator& page_allocator_;
+  const char* name_;
+  const uint64_t object_size_;
+  const uint64_t slot_size_;
+  const uint64_t num_of_pages_per_slab_;
+  const uint64_t num_of_objects_per_slab_;
+  Hook ctor_;
+  Hook dtor_;
+  Slab* partial_slabs_;
+  Slab* full_slabs_;
+  int num_of_empty_slabs_;
+  int magazine_size_;
+  void* magazine_[kMagazineSize];
+  Statistics stat_;
+  SpinLock lock_;
+};
+
+// Typed wrapper of SlabCache. Objects are not constructed by this class
+// unless ctor hook is given; use placement new on the returned memory.
+template <typename T, class TPageAllocator>
+class ObjectCache {
+ public:
+  using Hook = typename SlabCache<TPageAllocator>::Hook;
+  ObjectCache(TPageAllocator& page_allocator,
+              const char* name,
+              Hook ctor = nullptr,
+              Hook dtor = nullptr)
+      : cache_(page_allocator, name, sizeof(T), ctor, dtor) {}
+  T* Alloc() { return reinterpret_cast<T*>(cache_.Alloc()); }
+  void Free(T* obj) { cache_.Free(obj); }
+  void Drain() { cache_.Drain(); }
+  const typename SlabCache<TPageAllocator>::Statistics& GetStatistics() const {
+    return cache_.GetStatistics();
+  }
+  void Print() { cache_.Print(); }
+
+ private:
+  SlabCache<TPageAllocator> cache_;
+};
+
+// General purpose allocator backed by power-of-two size classes. Objects
+// larger than kMaxObjectSize are allocated directly from TPageAllocator.
+template <class TPageAllocator>
+class SlabAllocator {
+ public:
+  static constexpr int kNumOfSizeClasses = 8;
+  static constexpr uint64_t kMinObjectSize = 16;
+  static constexpr uint64_t kMaxObjectSize = kMinObjectSize
+                                             << (kNumOfSizeClasses - 1);
+
+  SlabAllocator(TPageAllocator& page_allocator)
+      : page_allocator_(page_allocator),
+        caches_{{page_allocator, "slab-16", 16},
+                {page_allocator, "slab-32", 32},
+                {page_allocator, "slab-64", 64},
+                {page_allocator, "slab-128", 128},
+                {page_allocator, "slab-256", 256},
+                {page_allocator, "slab-512", 512},
+                {page_allocator, "slab-1024", 1024},
+                {page_allocator, "slab-2048", 2048}} {
+    static_assert(kMaxObjectSize == 2048);
+  }
+  void* Alloc(uint64_t byte_size) {
+    int i = 0;
+    while (i < kNumOfSizeClasses && caches_[i].GetObjectSize() < byte_size)
+      i++;
+    if (i < kNumOfSizeClasses)
+      return caches_[i].Alloc();
+    const uint64_t num_of_pages =
+        ByteSizeToPageSize(sizeof(SlotHeader) + byte_size);
+    SlotHeader* slot =
+        page_allocator_.template AllocPages<SlotHeader*>(num_of_pages);
+    slot->slab = nullptr;
+    slot->num_of_pages = num_of_pages;
+    return slot + 1;
+  }
+  void Free(void* obj) {
+    if (!obj)
+      return;
+    if (SlabCache<TPageAllocator>* cache =
+            SlabCache<TPageAllocator>::GetCacheOf(obj)) {
+      cache->Free(obj);
+      return;
+    }
+    SlotHeader* slot = SlabCache<TPageAllocator>::GetSlot(obj);
+    page_allocator_.FreePages(reinterpret_cast<uint64_t>(slot),
+                              slot->num_of_pages);
+  }
+  void Drain() {
+    for (int i = 0; i < kNumOfSizeClasses; i++)
+      caches_[i].Drain();
+  }
+  void Print() {
+    for (int i = 0; i < kNumOfSizeClasses; i++)
+      caches_[i].Print();
+  }
+
+ private:
+  using SlotHeader = typename SlabCache<TPageAllocator>::SlotHeader;
+  TPageAllocator& page_allocator_;
+  SlabCache<TPageAllocator> caches_[kNumOfSizeClasses];
+};
+
+// @kernel.cc
+void* AllocKernelObjectMemory(uint64_t byte_size);
+void FreeKernelObjectMemory(void* p);
+
+// Allocator for STL containers in the kernel, backed by the kernel
+// SlabAllocator.
+template <typename T>
+struct KernelObjectSTLAllocator {
+  using value_type = T;
+  KernelObjectSTLAllocator() = default;
+  template <typename U>
+  KernelObjectSTLAllocator(const KernelObjectSTLAllocator<U>&) {}
+  T* allocate(size_t n) {
+    return reinterpret_cast<T*>(AllocKernelObjectMemory(sizeof(T) * n));
+  }
+  void deallocate(T* p, size_t) { FreeKernelObjectMemory(p); }
+  template <typename U>
+  bool operator==(const KernelObjectSTLAllocator<U>&) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const KernelObjectSTLAllocator<U>&) const {
+    return false;
+  }
+};
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cassert>
+#include <chrono>
+#include <random>
+#include <vector>
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+#include "phys_page_allocator.h"
+#include "slab_allocator.h"
+
+using TestPageAllocator =
+    PhysicalPageAllocator<UsePhysicalAddressInternallyStrategy>;
+
+constexpr uint64_t kArenaPages = 1 << 14;
+
+void InitPageAllocator(TestPageAllocator& allocator) {
+  uint64_t malloc_addr =
+      reinterpret_cast<uint64_t>(malloc(kPageSize * (kArenaPages + 1)));
+  if (!malloc_addr) {
+    perror("malloc failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  allocator.FreePagesWithProximityDomain(
+      (malloc_addr + kPageSize - 1) & ~kPageAddrMask, kArenaPages, 0);
+}
+
+struct TestObject {
+  uint64_t id;
+  uint8_t payload[200];
+};
+
+int num_of_ctor_called;
+int num_of_dtor_called;
+
+void TestObjectCache() {
+  TestPageAllocator page_allocator;
+  InitPageAllocator(page_allocator);
+  const uint64_t initial_free_pages = page_allocator.GetNumOfFreePages();
+  ObjectCache<TestObject, TestPageAllocator> cache(
+      page_allocator, "test",
+      [](void*) { num_of_ctor_called++; },
+      [](void*) { num_of_dtor_called++; });
+
+  std::vector<TestObject*> objs;
+  for (int i = 0; i < 1000; i++) {
+    TestObject* obj = cache.Alloc();
+    assert((reinterpret_cast<uint64_t>(obj) & 0xF) == 0);
+    obj->id = i;
+    memset(obj->payload, i & 0xFF, sizeof(obj->payload));
+    objs.push_back(obj);
+  }
+  for (int i = 0; i < 1000; i++) {
+    assert(objs[i]->id == static_cast<uint64_t>(i));
+    assert(objs[i]->payload[sizeof(objs[i]->payload) - 1] == (i & 0xFF));
+  }
+  assert(num_of_ctor_called == 1000);
+  assert(cache.GetStatistics().num_of_objects_in_use == 1000);
+  assert(page_allocator.GetNumOfFreePages() < initial_free_pages);
+
+  for (auto obj : objs)
+    cache.Free(obj);
+  assert(num_of_dtor_called == 1000);
+  assert(cache.GetStatistics().num_of_objects_in_use == 0);
+
+  // Recently freed objects are reused from the magazine.
+  TestObject* obj = cache.Alloc();
+  assert(cache.GetStatistics().num_of_magazine_hits == 1);
+  cache.Free(obj);
+  // At most one empty slab is kept after draining the magazine.
+  cache.Drain();
+  assert(cache.GetStatistics().num_of_slabs <= 1);
+}
+
+void TestSlabAllocator() {
+  TestPageAllocator page_allocator;
+  InitPageAllocator(page_allocator);
+  const uint64_t initial_free_pages = page_allocator.GetNumOfFreePages();
+  SlabAllocator<TestPageAllocator> allocator(page_allocator);
+
+  std::mt19937 mt(1);
+  std::vector<std::pair<uint8_t*, uint64_t>> allocated;
+  for (int i = 0; i < 100000; i++) {
+    if (allocated.empty() || mt() % 2) {
+      // Includes objects larger than kMaxObjectSize.
+      uint64_t size =
+          mt() % (SlabAllocator<TestPageAllocator>::kMaxObjectSize * 2) + 1;
+      uint8_t* p = reinterpret_cast<uint8_t*>(allocator.Alloc(size));
+      uint8_t v = static_cast<uint8_t>(i);
+      memset(p, v, size);
+      allocated.emplace_back(p, size);
+      continue;
+    }
+    uint64_t k = mt() % allocated.size();
+    auto [p, size] = allocated[k];
+    // Check the object was not overwritten by others.
+    for (uint64_t j = 1; j < size; j++)
+      assert(p[j] == p[0]);
+    allocated[k] = allocated.back();
+    allocated.pop_back();
+    allocator.Free(p);
+  }
+  for (auto [p, size] : allocated)
+    allocator.Free(p);
+  // Only one empty slab for each size class can be kept after draining.
+  allocator.Drain();
+  assert(initial_free_pages - page_allocator.GetNumOfFreePages() <=
+         SlabAllocator<TestPageAllocator>::kNumOfSizeClasses * 8);
+}
+
+void BenchmarkAllocAndFree() {
+  constexpr int kNumOfObjects = 256;
+  constexpr int kNumOfIterations = 10000;
+  TestPageAllocator page_allocator;
+  InitPageAllocator(page_allocator);
+  ObjectCache<TestObject, TestPageAllocator> cache(page_allocator, "bench");
+  TestObject* objs[kNumOfObjects];
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfIterations; i++) {
+    for (int k = 0; k < kNumOfObjects; k++)
+      objs[k] = cache.Alloc();
+    for (int k = 0; k < kNumOfObjects; k++)
+      cache.Free(objs[k]);
+  }
+  auto end = std::chrono::steady_clock::now();
+  const double ns_slab =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      (kNumOfIterations * kNumOfObjects);
+
+  // Page granular allocation, which was used for Alloc<T>() before.
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfIterations; i++) {
+    for (int k = 0; k < kNumOfObjects; k++)
+      objs[k] = page_allocator.AllocPages<TestObject*>(
+          ByteSizeToPageSize(sizeof(TestObject)));
+    for (int k = 0; k < kNumOfObjects; k++)
+      page_allocator.FreePages(reinterpret_cast<uint64_t>(objs[k]),
+                               ByteSizeToPageSize(sizeof(TestObject)));
+  }
+  end = std::chrono::steady_clock::now();
+  const double ns_page =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      (kNumOfIterations * kNumOfObjects);
+  printf("alloc+free: slab %.1f ns/op, page %.1f ns/op\n", ns_slab, ns_page);
+}
+
+int main() {
+  TestObjectCache();
+  TestSlabAllocator();
+  BenchmarkAllocAndFree();
+  puts("PASS");
+  return 0;
+}
@@ -0,0 +1,280 @@
+#include "smp.h"
+
+#include "clock_source.h"
+#include "liumos.h"
+
+// @ap_boot.S
+extern "C" uint8_t APBootCodeStart[];
+extern "C" uint8_t APBootCodeEnd[];
+
+constexpr uint64_t kNumOfAPStackPages = 64;
+constexpr uint64_t kAPBootParamsOffset = 8;
+
+static CPU cpus_[kMaxNumOfCPUs];
+static int num_of_cpus_ = 1;
+static uint8_t cpu_index_of_apic_id_[256];
+
+// Passed to the AP which is starting. APs are started one by one.
+static struct {
+  int cpu_index;
+  uint64_t kernel_stack_pointer;
+  uint64_t ist1_pointer;
+  Process* idle_process;
+} ap_start_info_;
+
+CPU& GetCPU(int index) {
+  assert(0 <= index && index < num_of_cpus_);
+  return cpus_[index];
+}
+
+int GetCurrentCPUIndex() {
+  if (__atomic_load_n(&num_of_cpus_, __ATOMIC_ACQUIRE) == 1)
+    return 0;
+  // Each processor reads its own APIC ID through the same registers.
+  const uint32_t apic_id = cpus_[0].local_apic.ReadIDOfCurrentProcessor();
+  return cpu_index_of_apic_id_[apic_id];
+}
+
+CPU& GetCurrentCPU() {
+  return cpus_[GetCurrentCPUIndex()];
+}
+
+int GetNumOfCPUs() {
+  return num_of_cpus_;
+}
+
+uint32_t GetProximityDomainOfCurrentCPU() {
+  return GetCurrentCPU().proximity_domain;
+}
+
+static uint32_t GetProximityDomainForAPICID(uint32_t apic_id) {
+  if (!liumos->acpi.srat)
+    return ACPI::SRAT::kUnknownProximityDomain;
+  return liumos->acpi.srat->GetProximityDomainForAPICID(apic_id);
+}
+
+void InitBootProcessor() {
+  CPU& cpu = cpus_[0];
+  cpu.local_apic.Init();
+  cpu.index = 0;
+  cpu.apic_id = cpu.local_apic.GetID();
+  if (cpu.apic_id >= sizeof(cpu_index_of_apic_id_))
+    Panic("APIC ID of BSP is too large");
+  cpu_index_of_apic_id_[cpu.apic_id] = 0;
+  cpu.proximity_domain = GetProximityDomainForAPICID(cpu.apic_id);
+  cpu.is_online = true;
+  liumos->bsp_local_apic = &cpu.local_apic;
+}
+
+void SendRescheduleIPI(int cpu) {
+  // Writes to the interrupt command register should not be interleaved.
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  GetCurrentCPU().local_apic.SendFixedIPI(GetCPU(cpu).apic_id,
+                                          kRescheduleVector);
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+}
+
+void FlushTLBOfAllCPUs() {
+  uint64_t num_of_shootdowns[kMaxNumOfCPUs];
+  const int num_of_cpus = __atomic_load_n(&num_of_cpus_, __ATOMIC_ACQUIRE);
+  // The processor is not switched while sending, so the current one is
+  // flushed directly and any other one is sent an IPI. Kernel mappings are
+  // not global, so reloading CR3 flushes them.
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  WriteCR3(ReadCR3());
+  const int self = GetCurrentCPUIndex();
+  for (int i = 0; i < num_of_cpus; i++) {
+    num_of_shootdowns[i] =
+        __atomic_load_n(&cpus_[i].num_of_tlb_shootdowns, __ATOMIC_ACQUIRE);
+    if (i == self || !__atomic_load_n(&cpus_[i].is_online, __ATOMIC_ACQUIRE))
+      continue;
+    GetCurrentCPU().local_apic.SendFixedIPI(cpus_[i].apic_id,
+                                            kTLBShootdownVector);
+  }
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+  for (int i = 0; i < num_of_cpus; i++) {
+    if (i == self || !__atomic_load_n(&cpus_[i].is_online, __ATOMIC_ACQUIRE))
+      continue;
+    while (__atomic_load_n(&cpus_[i].num_of_tlb_shootdowns,
+                           __ATOMIC_ACQUIRE) == num_of_shootdowns[i])
+      asm volatile("pause");
+  }
+}
+
+void TLBShootdownHandler(uint64_t, InterruptInfo*) {
+  WriteCR3(ReadCR3());
+  CPU& cpu = GetCurrentCPU();
+  __atomic_add_fetch(&cpu.num_of_tlb_shootdowns, 1, __ATOMIC_RELEASE);
+  cpu.local_apic.SendEndOfInterrupt();
+}
+
+static void WaitMicroSecond(uint64_t microsec) {
+  // Interrupts may be disabled here, so SleepMicroSecond (which blocks the
+  // process until a timer interrupt) is not used.
+  const uint64_t end = NowNs() + microsec * 1000;
+  while (NowNs() < end) {
+    asm volatile("pause");
+  }
+}
+
+static uint64_t AllocAPStack() {
+  return liumos->kernel_heap_allocator->AllocPages<uint64_t>(
+             kNumOfAPStackPages) +
+         (kNumOfAPStackPages << kPageSizeExponent);
+}
+
+static Process& CreateIdleProcess() {
+  // Same as the root process, the context is filled when switching to
+  // another process.
+  ExecutionContext& ctx =
+      *liumos->kernel_heap_allocator->Alloc<ExecutionContext>();
+  ctx.SetRegisters(nullptr, 0, nullptr, 0, ReadCR3(), 0, 0);
+  Process& proc = liumos->proc_ctrl->Create();
+  proc.InitAsEphemeralProcess(ctx);
+  return proc;
+}
+
+extern "C" void APEntry() {
+  CPU& cpu = cpus_[ap_start_info_.cpu_index];
+  cpu.gdt.Init(ap_start_info_.kernel_stack_pointer,
+               ap_start_info_.ist1_pointer);
+  IDT::GetInstance().Load();
+  liumos->scheduler->InitCPU(cpu.index, *ap_start_info_.idle_process);
+  cpu.local_apic.Init();
+  CheckClockSourceOnCurrentCPU();
+  EnableSyscall();
+  // The timer is programmed when this processor is given a process to run.
+  cpu.last_switch_fs = NowFs();
+  __atomic_store_n(&cpu.is_online, true, __ATOMIC_RELEASE);
+  while (1) {
+    StoreIntFlagAndHalt();
+  }
+}
+
+static bool WaitUntilOnline(CPU& cpu, uint64_t timeout_microsec) {
+  constexpr uint64_t kPollIntervalMicroSec = 100;
+  for (uint64_t t = 0; t < timeout_microsec; t += kPollIntervalMicroSec) {
+    if (__atomic_load_n(&cpu.is_online, __ATOMIC_ACQUIRE))
+      return true;
+    WaitMicroSecond(kPollIntervalMicroSec);
+  }
+  return __atomic_load_n(&cpu.is_online, __ATOMIC_ACQUIRE);
+}
+
+static bool IsCPURegistered(uint32_t apic_id) {
+  for (int i = 0; i < num_of_cpus_; i++) {
+    if (cpus_[i].apic_id == apic_id)
+      return true;
+  }
+  return false;
+}
+
+static void StartApplicationProcessor(uint32_t apic_id,
+                                      uint64_t boot_code_paddr) {
+  if (num_of_cpus_ >= kMaxNumOfCPUs) {
+    PutStringAndHex("Too many processors. Ignored APIC ID", apic_id);
+    return;
+  }
+  if (apic_id >= sizeof(cpu_index_of_apic_id_)) {
+    PutStringAndHex("APIC ID is too large. Ignored APIC ID", apic_id);
+    return;
+  }
+  const int index = num_of_cpus_;
+  CPU& cpu = cpus_[index];
+  cpu.index = index;
+  cpu.apic_id = apic_id;
+  cpu.proximity_domain = GetProximityDomainForAPICID(apic_id);
+  cpu.is_online = false;
+  cpu_index_of_apic_id_[apic_id] = static_cast<uint8_t>(index);
+
+  ap_start_info_.cpu_index = index;
+  ap_start_info_.kernel_stack_pointer = AllocAPStack();
+  ap_start_info_.ist1_pointer = AllocAPStack();
+  ap_start_info_.idle_process = &CreateIdleProcess();
+  APBootParams& params = *GetKernelVirtAddrForPhysAddr(
+      reinterpret_cast<APBootParams*>(boot_code_paddr + kAPBootParamsOffset));
+  params.stack_pointer = AllocAPStack();
+
+  __atomic_store_n(&num_of_cpus_, index + 1, __ATOMIC_RELEASE);
+
+  // INIT-SIPI-SIPI sequence. The second SIPI is ignored if the first one
+  // has started the processor.
+  LocalAPIC& lapic = cpus_[0].local_apic;
+  lapic.SendInitIPI(apic_id);
+  WaitMicroSecond(10'000);
+  lapic.SendStartupIPI(apic_id, boot_code_paddr);
+  if (WaitUntilOnline(cpu, 200))
+    return;
+  lapic.SendStartupIPI(apic_id, boot_code_paddr);
+  if (WaitUntilOnline(cpu, 1'000'000))
+    return;
+  PutStringAndHex("Failed to start a processor. APIC ID", apic_id);
+}
+
+void StartApplicationProcessors() {
+  using namespace ACPI;
+  const uint64_t boot_code_paddr = liumos->ap_boot_code_phys_addr;
+  if (!liumos->acpi.madt || !boot_code_paddr) {
+    PutString("Application processors are not started\n");
+    return;
+  }
+
+  // The boot code page is identity mapped in the kernel page table, which is
+  // used by APs to enter long mode.
+  const uint64_t cr3 = ReadCR3();
+  if (cr3 >= (1ULL << 32))
+    Panic("Kernel CR3 should be below 4GiB to start APs");
+  const uint64_t boot_code_size = APBootCodeEnd - APBootCodeStart;
+  assert(sizeof(APBootParams) + kAPBootParamsOffset <= boot_code_size);
+  assert(boot_code_size <= kPageSize);
+  memcpy(
+      GetKernelVirtAddrForPhysAddr(reinterpret_cast<void*>(boot_code_paddr)),
+      APBootCodeStart, boot_code_size);
+  APBootParams& params = *GetKernelVirtAddrForPhysAddr(
+      reinterpret_cast<APBootParams*>(boot_code_paddr + kAPBootParamsOffset));
+  params.gdt[0] = 0;
+  params.gdt[1] = 0x00CF'9A00'0000'FFFFULL;  // 32-bit code, flat
+  params.gdt[2] = 0x00CF'9200'0000'FFFFULL;  // data, flat
+  params.gdt[3] = 0x00AF'9A00'0000'FFFFULL;  // 64-bit code
+  params.gdtr_limit = sizeof(params.gdt) - 1;
+  params.gdtr_base = static_cast<uint32_t>(
+      boot_code_paddr + kAPBootParamsOffset + offsetof(APBootParams, gdt));
+  params.cr3 = cr3;
+  params.cr4 = ReadCR4();
+  params.cr0 = ReadCR0();
+  IA32_EFER efer;
+  efer.data = ReadMSR(MSRIndex::kEFER);
+  efer.bits.LMA = 0;  // Set by the processor.
+  params.efer = efer.data;
+  params.entry_point = reinterpret_cast<uint64_t>(APEntry);
+
+  MADT& madt = *liumos->acpi.madt;
+  for (int i = 0; i < (int)(madt.length - offsetof(MADT, entries));
+       i += madt.entries[i + 1]) {
+    const uint8_t type = madt.entries[i];
+    uint32_t apic_id;
+    bool is_enabled;
+    if (type == kProcessorLocalAPICInfo) {
+      apic_id = madt.entries[i + 3];
+      is_enabled = madt.entries[i + 4] & 1;
+    } else if (type == kProcessorLocalx2APICStruct) {
+      apic_id = *reinterpret_cast<uint32_t*>(&madt.entries[i + 4]);
+      is_enabled = madt.entries[i + 8] & 1;
+    } else {
+      continue;
+    }
+    if (!is_enabled || IsCPURegistered(apic_id))
+      continue;
+    StartApplicationProcessor(apic_id, boot_code_paddr);
+  }
+  int num_of_online_cpus = 0;
+  for (int i = 0; i < num_of_cpus_; i++) {
+    if (cpus_[i].is_online)
+      num_of_online_cpus++;
+  }
+  PutStringAndHex("Number of online processors", num_of_online_cpus);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "apic.h"
+#include "gdt.h"
+#include "generic.h"
+
+constexpr int kMaxNumOfCPUs = 16;
+// Sent to make a processor run the scheduler.
+constexpr uint8_t kRescheduleVector = 0x30;
+// Sent to make a processor flush its TLB.
+constexpr uint8_t kTLBShootdownVector = 0x31;
+
+struct CPU {
+  int index;  // 0 is the BSP.
+  uint32_t apic_id;
+  // Taken from SRAT. SRAT::kUnknownProximityDomain if not listed.
+  uint32_t proximity_domain;
+  LocalAPIC local_apic;
+  GDT gdt;
+  uint64_t last_switch_fs;  // NowFs() at the last switch.
+  volatile bool is_online;
+  // Incremented each time the TLB is flushed by kTLBShootdownVector.
+  uint64_t num_of_tlb_shootdowns;
+};
+
+// Values for ap_boot.S. The layout should be kept in sync with it.
+packed_struct APBootParams {
+  uint16_t gdtr_limit;
+  uint32_t gdtr_base;
+  uint16_t padding;
+  uint64_t gdt[4];
+  uint64_t cr3;
+  uint64_t cr4;
+  uint64_t cr0;
+  uint64_t efer;
+  uint64_t stack_pointer;
+  uint64_t entry_point;
+};
+static_assert(sizeof(APBootParams) == 88);
+
+// @smp.cc
+CPU& GetCPU(int index);
+CPU& GetCurrentCPU();
+int GetCurrentCPUIndex();
+int GetNumOfCPUs();
+// Used to allocate pages near to the current processor.
+uint32_t GetProximityDomainOfCurrentCPU();
+// Should be called after the LocalAPIC of the BSP is initialized.
+void InitBootProcessor();
+// cpu can be the current processor.
+void SendRescheduleIPI(int cpu);
+// Flushes the TLBs of all online processors and returns after all of them
+// have done it. Should be called with interrupts enabled, so that the
+// caller serves shootdowns from other processors while waiting.
+void FlushTLBOfAllCPUs();
+void TLBShootdownHandler(uint64_t intcode, InterruptInfo* info);
+// Starts processors listed in MADT. Each of them runs its idle process and
+// schedules processes registered to it.
+void StartApplicationProcessors();
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "generic.h"
+
+// Lock for data shared between processors. Interrupts on the processor are
+// disabled while the lock is held, so it can also be taken in interrupt
+// handlers. Not recursive.
+class SpinLock {
+ public:
+  constexpr SpinLock() : locked_(0), saved_rflags_(0) {}
+  void Lock() {
+    const uint64_t rflags = SaveFlagsAndDisableInterrupts();
+    while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+      while (__atomic_load_n(&locked_, __ATOMIC_RELAXED))
+        asm volatile("pause");
+    }
+    saved_rflags_ = rflags;
+  }
+  // Returns true if the lock is taken. Useful to take a lock out of the
+  // lock order without risking a deadlock.
+  bool TryLock() {
+    const uint64_t rflags = SaveFlagsAndDisableInterrupts();
+    if (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+      RestoreFlags(rflags);
+      return false;
+    }
+    saved_rflags_ = rflags;
+    return true;
+  }
+  void Unlock() {
+    const uint64_t rflags = saved_rflags_;
+    __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+    RestoreFlags(rflags);
+  }
+  bool IsLocked() const { return __atomic_load_n(&locked_, __ATOMIC_RELAXED); }
+
+ private:
+  static constexpr uint64_t kRFlagsInterruptEnable = (1ULL << 9);
+  static uint64_t SaveFlagsAndDisableInterrupts() {
+#ifdef LIUMOS_TEST
+    return 0;
+#else
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    return rflags;
+#endif
+  }
+  static void RestoreFlags([[maybe_unused]] uint64_t rflags) {
+#ifndef LIUMOS_TEST
+    if (rflags & kRFlagsInterruptEnable)
+      asm volatile("sti" : : : "memory");
+#endif
+  }
+
+  uint32_t locked_;
+  uint64_t saved_rflags_;
+};
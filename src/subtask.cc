@@ -3,11 +3,12 @@
 #include "kernel.h"
 #include "liumos.h"
 #include "sheet.h"
+#include "timer.h"
 
 class PolygonCube {
  public:
   PolygonCube() {
-    sheet_ = new Sheet();
+    sheet_ = new (AllocKernelObject<Sheet>()) Sheet();
     sheet_->Init(buf_, width, height, width,
                  liumos->screen_sheet->GetXSize() - width - 64, 64);
     sheet_->SetParent(liumos->vram_sheet);
@@ -198,7 +199,7 @@ void CellularAutomaton() {
     }
     liumos->screen_sheet->Flush(liumos->screen_sheet->GetXSize() - canvas_xsize,
                                 0, canvas_xsize, canvas_ysize);
-    HPET::GetInstance().BusyWait(200);
+    SleepMilliSecond(200);
   }
 }
 
@@ -207,6 +208,6 @@ void SubTask() {
   kprintf("pcube size: 0x%X\n", sizeof(pcube));
   for (;;) {
     pcube.Draw();
-    HPET::GetInstance().BusyWait(10);
+    SleepMilliSecond(10);
   }
 }
@@ -1,20 +1,40 @@
 #include <stdio.h>
+#include <time.h>
 
+#include "clock_source.h"
 #include "liumos.h"
-
-#include "virtio_net.h"
+#include "nic.h"
+#include "poll.h"
+#include "tcp.h"
+#include "timer.h"
 
 #include "kernel.h"
 
 constexpr uint64_t kSyscallIndex_sys_read = 0;
 constexpr uint64_t kSyscallIndex_sys_write = 1;
 constexpr uint64_t kSyscallIndex_sys_close = 3;
+constexpr uint64_t kSyscallIndex_sys_poll = 7;
+constexpr uint64_t kSyscallIndex_sys_mmap = 9;
+constexpr uint64_t kSyscallIndex_sys_nanosleep = 35;
 constexpr uint64_t kSyscallIndex_sys_socket = 41;
+constexpr uint64_t kSyscallIndex_sys_connect = 42;
+constexpr uint64_t kSyscallIndex_sys_accept = 43;
 constexpr uint64_t kSyscallIndex_sys_sendto = 44;
 constexpr uint64_t kSyscallIndex_sys_recvfrom = 45;
 constexpr uint64_t kSyscallIndex_sys_bind = 49;
+constexpr uint64_t kSyscallIndex_sys_listen = 50;
+constexpr uint64_t kSyscallIndex_sys_setsockopt = 54;
 constexpr uint64_t kSyscallIndex_sys_exit = 60;
+constexpr uint64_t kSyscallIndex_sys_fcntl = 72;
 constexpr uint64_t kSyscallIndex_arch_prctl = 158;
+constexpr uint64_t kSyscallIndex_sys_epoll_create = 213;
+constexpr uint64_t kSyscallIndex_sys_clock_gettime = 228;
+constexpr uint64_t kSyscallIndex_sys_clock_nanosleep = 230;
+constexpr uint64_t kSyscallIndex_sys_epoll_wait = 232;
+constexpr uint64_t kSyscallIndex_sys_epoll_ctl = 233;
+constexpr uint64_t kSyscallIndex_sys_epoll_create1 = 291;
+constexpr uint64_t kSyscallIndex_sys_recvmmsg = 299;
+constexpr uint64_t kSyscallIndex_sys_sendmmsg = 307;
 // constexpr uint64_t kArchSetGS = 0x1001;
 constexpr uint64_t kArchSetFS = 0x1002;
 // constexpr uint64_t kArchGetFS = 0x1003;
@@ -22,10 +42,25 @@ constexpr uint64_t kArchSetFS = 0x1002;
 
 // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/asm-generic/errno-base.h#L6
 enum ErrorNumber {
+  kNoEntry = -2,
   kBadFileDescriptor = -9,
+  kTryAgain = -11,
+  kBusy = -16,
+  kExists = -17,
   kInvalid = -22,
+  kMessageTooLong = -90,
+  kNoBufferSpace = -105,
+  kTimedOut = -110,
+  kInProgress = -115,
 };
 
+// struct timespec of the libc has the same layout as the one of Linux.
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/time.h#L26
+constexpr int kClockRealtime = 0;
+constexpr int kClockMonotonic = 1;
+constexpr int kTimerAbsTime = 1;
+
 // c.f.
 // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/in.h#L232
 // sockaddr_in means sockaddr for InterNet protocol(IP)
@@ -38,6 +73,70 @@ struct sockaddr_in {
   // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/in.h#L231
 };
 typedef uint32_t socklen_t;
+constexpr uint16_t kAddressFamilyIPv4 = 2;
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/tcp.h#L95
+constexpr int kLevelTCP = 6;
+constexpr int kOptionTCPNoDelay = 1;
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/asm-generic/socket.h#L9
+constexpr int kLevelSocket = 1;
+constexpr int kOptionReceiveTimeout = 20;
+constexpr int kOptionSendTimeout = 21;
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/if_packet.h#L45
+// Linux allows these only for AF_PACKET sockets, and liumOS for raw ICMP
+// sockets. The layout of the rings is also liumOS's own (@packet_ring.h).
+constexpr int kLevelPacket = 263;
+constexpr int kOptionPacketRXRing = 5;
+constexpr int kOptionPacketTXRing = 13;
+struct PacketRingRequest {
+  uint32_t frame_size;
+  uint32_t num_of_frames;
+};
+// Each ring is on physically contiguous pages, so they are kept small.
+constexpr size_t kMaxPacketRingByteSize = 4 * 1024 * 1024;
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/linux/socket.h#L290
+constexpr int kMessageTruncated = 0x20;
+constexpr int kMessageDontWait = 0x40;
+constexpr int kMessageWaitForOne = 0x10000;
+
+// struct timeval of Linux, which is used for the timeouts of sockets.
+struct TimeVal {
+  int64_t tv_sec;
+  int64_t tv_usec;
+};
+
+// struct iovec, struct msghdr and struct mmsghdr of Linux.
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/linux/socket.h#L48
+struct IOVec {
+  void* base;
+  size_t len;
+};
+struct MessageHeader {
+  sockaddr_in* name;
+  socklen_t name_len;
+  IOVec* iov;
+  size_t iov_len;
+  void* control;  // Ancillary data is not supported.
+  size_t control_len;
+  int flags;
+};
+static_assert(sizeof(MessageHeader) == 56);
+struct MultiMessageHeader {
+  MessageHeader hdr;
+  uint32_t len;
+};
+static_assert(sizeof(MultiMessageHeader) == 64);
+// UIO_MAXIOV of Linux, which also limits the number of messages.
+constexpr size_t kMaxIOVecLen = 1024;
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/asm-generic/mman-common.h#L9
+constexpr int kProtRead = 0x1;
+constexpr int kProtWrite = 0x2;
+constexpr int kMapShared = 0x01;
 
 extern "C" uint64_t GetCurrentKernelStack(void) {
   ExecutionContext& ctx =
@@ -47,126 +146,186 @@ extern "C" uint64_t GetCurrentKernelStack(void) {
   return ctx.GetKernelRSP();
 }
 
-static bool IsICMPPacket(void* frame_data, size_t frame_size) {
-  using EtherFrame = Network::EtherFrame;
-  using IPv4Packet = Network::IPv4Packet;
-  if (frame_size < sizeof(IPv4Packet)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(EtherFrame::kTypeIPv4)) {
-    return false;
+// Returns a new file descriptor of the current process which refers to a
+// new socket, or -1 on failure.
+static int OpenSocket(Network::Socket::Type type) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  Network& network = Network::GetInstance();
+  Network::Socket* socket = network.CreateSocket(proc.GetID(), type);
+  if (!socket)
+    return -1;
+  const int fd = proc.GetFileDescriptorTable().Alloc(
+      FileDescriptorTable::Type::kSocket, socket);
+  if (fd < 0)
+    network.CloseSocket(*socket);
+  return fd;
+}
+
+// Returns nullptr if fd of the current process is not a socket.
+static Network::Socket* GetSocket(int fd) {
+  return reinterpret_cast<Network::Socket*>(
+      liumos->scheduler->GetCurrentProcess().GetFileDescriptorTable().Get(
+          fd, FileDescriptorTable::Type::kSocket));
+}
+
+// Returns a new file descriptor of the current process which refers to
+// socket, or -1 on failure. socket is closed on failure.
+static int OpenTCPSocket(TCP::Socket& socket) {
+  const int fd =
+      liumos->scheduler->GetCurrentProcess().GetFileDescriptorTable().Alloc(
+          FileDescriptorTable::Type::kTCPSocket, &socket);
+  if (fd < 0)
+    TCP::GetInstance().Close(socket);
+  return fd;
+}
+
+// Returns nullptr if fd of the current process is not a TCP socket.
+static TCP::Socket* GetTCPSocket(int fd) {
+  return reinterpret_cast<TCP::Socket*>(
+      liumos->scheduler->GetCurrentProcess().GetFileDescriptorTable().Get(
+          fd, FileDescriptorTable::Type::kTCPSocket));
+}
+
+// Returns the deadline of an operation on fd which waits for timeout_ns at
+// most, or forever if timeout_ns is 0. Operations on non-blocking
+// descriptors and ones with MSG_DONTWAIT in flags do not wait at all.
+static uint64_t GetDeadline(int fd, int flags, uint64_t timeout_ns) {
+  const int status_flags = liumos->scheduler->GetCurrentProcess()
+                               .GetFileDescriptorTable()
+                               .GetStatusFlags(fd);
+  const uint64_t now = NowNs();
+  if ((flags & kMessageDontWait) ||
+      (status_flags >= 0 &&
+       (status_flags & FileDescriptorTable::kStatusFlagNonBlock)))
+    return now;
+  if (!timeout_ns || timeout_ns >= kNoDeadline - now)
+    return kNoDeadline;
+  return now + timeout_ns;
+}
+
+// Converts a result of TCP::Send() or TCP::Receive() to the one of syscalls.
+static ssize_t ToSyscallResult(TCP::Socket& socket, ssize_t result) {
+  if (result == TCP::kErrorWouldBlock)
+    return ErrorNumber::kTryAgain;
+  if (result < 0 && TCP::GetInstance().HasTimedOut(socket))
+    return ErrorNumber::kTimedOut;
+  return result;
+}
+
+// Ports in sockaddr_in are in the network byte order.
+static uint16_t SwapBytes16(uint16_t v) {
+  return static_cast<uint16_t>(((v >> 8) & 0xFF) | (v << 8));
+}
+
+static void FillSockAddr(struct sockaddr_in* addr,
+                         Network::IPv4Addr ip_addr,
+                         uint16_t port) {
+  addr->sin_family = kAddressFamilyIPv4;
+  addr->sin_port = SwapBytes16(port);
+  addr->sin_addr = ip_addr;
+}
+
+static size_t GetIOVecSize(const IOVec* iov, size_t iov_len) {
+  size_t size = 0;
+  for (size_t i = 0; i < iov_len; i++)
+    size += iov[i].len;
+  return size;
+}
+
+// Copies size bytes of src to the buffers of iov in order, as many as they
+// can hold. Returns the copied size.
+static size_t ScatterToIOVec(const IOVec* iov,
+                             size_t iov_len,
+                             const uint8_t* src,
+                             size_t size) {
+  size_t copied = 0;
+  for (size_t i = 0; i < iov_len && copied < size; i++) {
+    const size_t copy_size = std::min(iov[i].len, size - copied);
+    memcpy(iov[i].base, src + copied, copy_size);
+    copied += copy_size;
   }
-  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame_data);
-  if (p.protocol != IPv4Packet::Protocol::kICMP) {
-    return false;
+  return copied;
+}
+
+// Copies size bytes from the buffers of iov in order to dst.
+static void GatherFromIOVec(uint8_t* dst,
+                            const IOVec* iov,
+                            size_t iov_len,
+                            size_t size) {
+  size_t copied = 0;
+  for (size_t i = 0; i < iov_len && copied < size; i++) {
+    const size_t copy_size = std::min(iov[i].len, size - copied);
+    memcpy(dst + copied, iov[i].base, copy_size);
+    copied += copy_size;
   }
-  return true;
 }
 
-static bool IsUDPPacketToPort(void* frame_data,
-                              size_t frame_size,
-                              uint16_t port) {
-  using EtherFrame = Network::EtherFrame;
-  using IPv4Packet = Network::IPv4Packet;
+// Copies the payload of packet which socket received to iov, and fills addr
+// with the source of it if addr is not nullptr. Returns the size of the
+// payload, which is larger than the copied size if iov is too small.
+static size_t CopyDatagram(const Network::Socket& socket,
+                           PacketBuffer& packet,
+                           const IOVec* iov,
+                           size_t iov_len,
+                           struct sockaddr_in* addr) {
   using IPv4UDPPacket = Network::IPv4UDPPacket;
-  if (frame_size < sizeof(IPv4UDPPacket)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(EtherFrame::kTypeIPv4)) {
-    return false;
-  }
-  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame_data);
-  if (p.protocol != IPv4Packet::Protocol::kUDP) {
-    return false;
-  }
-  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(frame_data);
-  if (udp.GetDestinationPort() != port) {
-    return false;
-  }
-  return true;
+  using Socket = Network::Socket;
+  // Packets of ICMP datagram sockets are passed from the ICMP header, and
+  // the ones of raw sockets from the IP header.
+  size_t header_size = sizeof(IPv4UDPPacket);
+  if (socket.type == Socket::Type::kICMPDatagram)
+    header_size = sizeof(Network::IPv4Packet);
+  if (socket.type == Socket::Type::kICMPRaw)
+    header_size = sizeof(Network::EtherFrame);
+  const size_t payload_size = packet.GetSize() - header_size;
+  ScatterToIOVec(iov, iov_len, packet.GetData() + header_size, payload_size);
+  if (!addr || socket.type == Socket::Type::kICMPRaw)
+    return payload_size;
+  const Network::IPv4Packet& ip =
+      *reinterpret_cast<const Network::IPv4Packet*>(packet.GetData());
+  uint16_t port = 0;
+  if (socket.type == Socket::Type::kUDP)
+    port = reinterpret_cast<IPv4UDPPacket*>(packet.GetData())->GetSourcePort();
+  FillSockAddr(addr, ip.src_ip, port);
+  return payload_size;
 }
 
 static ssize_t sys_recvfrom(int sockfd,
                             void* buf,
                             size_t buf_size,
-                            int64_t,
+                            int flags,
                             struct sockaddr_in* recv_addr,
                             socklen_t*) {
   /* returns -1 on failure */
-  using IPv4Packet = Network::IPv4Packet;
-  using IPv4UDPPacket = Network::IPv4UDPPacket;
-  using ICMPPacket = Network::ICMPPacket;
-  using EtherFrame = Network::EtherFrame;
   using Socket = Network::Socket;
-  Network& network = Network::GetInstance();
-  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
-    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
-    return -1;
-  }
-  Socket::Type socket_type = (*sock_holder).type;
-  if (socket_type == Socket::Type::kICMPDatagram) {
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsICMPPacket(packet.data, packet.size)) {
-          continue;
-        }
-        ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(packet.data);
-        size_t icmp_data_size = packet.size - sizeof(IPv4Packet);
-        size_t copy_size = std::min(icmp_data_size, buf_size);
-        memcpy(buf, &icmp.type, copy_size);
-        recv_addr->sin_addr = icmp.ip.src_ip;
-        return icmp_data_size;
-      }
-      Sleep();
-    }
-    return -1;
-  }
-  if (socket_type == Socket::Type::kICMPRaw) {
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsICMPPacket(packet.data, packet.size)) {
-          continue;
-        }
-        size_t ip_data_size = packet.size - sizeof(EtherFrame);
-        size_t copy_size = std::min(ip_data_size, buf_size);
-        memcpy(buf, &packet.data[sizeof(EtherFrame)], copy_size);
-        return ip_data_size;
-      }
-      Sleep();
+  if (TCP::Socket* tcp_socket = GetTCPSocket(sockfd)) {
+    const ssize_t size = TCP::GetInstance().Receive(
+        *tcp_socket, buf, buf_size,
+        GetDeadline(sockfd, flags, tcp_socket->GetRXTimeoutNs()));
+    if (size >= 0 && recv_addr) {
+      FillSockAddr(recv_addr, tcp_socket->GetRemoteAddr(),
+                   tcp_socket->GetRemotePort());
     }
-    return -1;
+    return ToSyscallResult(*tcp_socket, size);
   }
-  if (socket_type == Socket::Type::kUDP) {
-    uint16_t port = (*sock_holder).listen_port;
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsUDPPacketToPort(packet.data, packet.size, port)) {
-          continue;
-        }
-        size_t udp_data_size = packet.size - sizeof(IPv4UDPPacket);
-        size_t copy_size = std::min(udp_data_size, buf_size);
-        memcpy(buf, &packet.data[sizeof(IPv4UDPPacket)], copy_size);
-        IPv4UDPPacket* udp_packet =
-            reinterpret_cast<IPv4UDPPacket*>(packet.data);
-        recv_addr->sin_addr = udp_packet->ip.src_ip;
-        recv_addr->sin_port =
-            *reinterpret_cast<uint16_t*>(&udp_packet->src_port);
-        return udp_data_size;
-      }
-      Sleep();
-    }
+  Socket* socket = GetSocket(sockfd);
+  if (!socket) {
+    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
-  kprintf("%s: socket_type = %d is not a supported yet\n", __func__,
-          socket_type);
-  return -1;
+  // Packets go to the RX ring instead if it is mapped.
+  if (socket->rx_ring.IsEnabled())
+    return ErrorNumber::kInvalid;
+  // Packets in the queue of the socket are already demultiplexed by
+  // Network::DeliverPacket().
+  PacketBuffer* packet = socket->WaitAndPopPacket(
+      GetDeadline(sockfd, flags, socket->rx_timeout_ns));
+  if (!packet)
+    return ErrorNumber::kTryAgain;
+  const IOVec iov = {buf, buf_size};
+  const size_t size = CopyDatagram(*socket, *packet, &iov, 1, recv_addr);
+  packet->Unref();
+  return size;
 }
 
 static int sys_socket(int domain, int type, int protocol) {
@@ -174,34 +333,46 @@ static int sys_socket(int domain, int type, int protocol) {
   constexpr int kDomainIPv4 = 2;
   constexpr int kTypeDatagram = 2; /* UDP under kDomainIPv4 */
   constexpr int kTypeRawSocket = 3;
+  constexpr int kTypeStream = 1; /* TCP under kDomainIPv4 */
   constexpr int kProtocolICMP = 1;
-  Network& network = Network::GetInstance();
-  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  const int sockfd = 3; /* Always assign 3 for now */
+  constexpr int kProtocolTCP = 6;
   if (domain == kDomainIPv4) {
+    if (type == kTypeStream && (protocol == 0 || protocol == kProtocolTCP)) {
+      TCP::Socket* socket = TCP::GetInstance().CreateSocket(
+          liumos->scheduler->GetCurrentProcess().GetID());
+      const int sockfd = socket ? OpenTCPSocket(*socket) : -1;
+      if (sockfd < 0) {
+        kprintf("kernel: %s: failed to register socket.\n", __func__);
+        return -1 /* Return -1 on error */;
+      }
+      kprintf("kernel: %s: socket (fd=%d) created (IPv4, STREAM, %d)(TCP)\n",
+              __func__, sockfd, protocol);
+      return sockfd;
+    }
     if (type == kTypeDatagram && protocol == kProtocolICMP) {
-      if (network.RegisterSocket(pid, sockfd,
-                                 Network::Socket::Type::kICMPDatagram)) {
+      const int sockfd = OpenSocket(Network::Socket::Type::kICMPDatagram);
+      if (sockfd < 0) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
       kprintf("kernel: %s: socket (fd=%d) created (IPv4, DGRAM, ICMP)\n",
               __func__, sockfd);
-      return sockfd /* Always returns 3 for now */;
+      return sockfd;
     }
     if (type == kTypeRawSocket && protocol == kProtocolICMP) {
-      if (network.RegisterSocket(pid, sockfd,
-                                 Network::Socket::Type::kICMPRaw)) {
+      const int sockfd = OpenSocket(Network::Socket::Type::kICMPRaw);
+      if (sockfd < 0) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
       kprintf("kernel: %s: socket (fd=%d) created (IPv4, Raw, ICMPRaw)\n",
               __func__, sockfd);
-      return sockfd /* Always returns 3 for now */;
+      return sockfd;
     }
     if (type == kTypeDatagram && (protocol == 0 || protocol == 17)) {
       /* UDP */
-      if (network.RegisterSocket(pid, sockfd, Network::Socket::Type::kUDP)) {
+      const int sockfd = OpenSocket(Network::Socket::Type::kUDP);
+      if (sockfd < 0) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
@@ -217,16 +388,21 @@ static int sys_socket(int domain, int type, int protocol) {
 
 static int sys_bind(int sockfd, sockaddr_in* addr, socklen_t addrlen) {
   /* returns -1 on failure */
-  Network& network = Network::GetInstance();
-  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
+  if (TCP::Socket* tcp_socket = GetTCPSocket(sockfd)) {
+    if (TCP::GetInstance().Bind(*tcp_socket, SwapBytes16(addr->sin_port))) {
+      kprintf("%s: port %u is in use\n", __func__,
+              SwapBytes16(addr->sin_port));
+      return -1;
+    }
+    return 0;
+  }
+  Network::Socket* socket = GetSocket(sockfd);
+  if (!socket) {
     kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
-  if (network.BindToPort(
-          pid, sockfd,
-          ((addr->sin_port >> 8) & 0xFF) | (addr->sin_port << 8))) {
+  if (Network::GetInstance().BindToPort(*socket,
+                                       SwapBytes16(addr->sin_port))) {
     kprintf("%s: BindToPort failed\n", __func__, sockfd);
     return -1;
   }
@@ -234,7 +410,215 @@ static int sys_bind(int sockfd, sockaddr_in* addr, socklen_t addrlen) {
   return 0;
 }
 
+static int sys_listen(int sockfd, int backlog) {
+  TCP::Socket* socket = GetTCPSocket(sockfd);
+  if (!socket) {
+    kprintf("%s: fd %d is not a TCP socket\n", __func__, sockfd);
+    return -1;
+  }
+  return TCP::GetInstance().Listen(*socket, backlog) ? -1 : 0;
+}
+
+static int sys_accept(int sockfd,
+                      struct sockaddr_in* addr,
+                      socklen_t* addrlen) {
+  TCP::Socket* listener = GetTCPSocket(sockfd);
+  if (!listener) {
+    kprintf("%s: fd %d is not a TCP socket\n", __func__, sockfd);
+    return -1;
+  }
+  bool would_block;
+  TCP::Socket* socket = TCP::GetInstance().Accept(
+      *listener, GetDeadline(sockfd, 0, listener->GetRXTimeoutNs()),
+      would_block);
+  if (!socket)
+    return would_block ? ErrorNumber::kTryAgain : -1;
+  const int fd = OpenTCPSocket(*socket);
+  if (fd < 0)
+    return -1;
+  if (addr && addrlen && *addrlen >= sizeof(sockaddr_in)) {
+    FillSockAddr(addr, socket->GetRemoteAddr(), socket->GetRemotePort());
+    *addrlen = sizeof(sockaddr_in);
+  }
+  return fd;
+}
+
+static std::optional<uint64_t> TimeValToNs(const TimeVal* tv) {
+  if (!tv || tv->tv_sec < 0 || tv->tv_usec < 0 || tv->tv_usec >= 1'000'000)
+    return std::nullopt;
+  // Saturates instead of overflowing. Such a timeout never expires anyway.
+  constexpr uint64_t kMaxSec = ~0ULL / 1'000'000'000 - 1;
+  if (static_cast<uint64_t>(tv->tv_sec) > kMaxSec)
+    return kMaxSec * 1'000'000'000;
+  return tv->tv_sec * 1'000'000'000 + tv->tv_usec * 1'000;
+}
+
+static int sys_setsockopt(int sockfd,
+                          int level,
+                          int optname,
+                          const void* optval,
+                          socklen_t optlen) {
+  TCP::Socket* socket = GetTCPSocket(sockfd);
+  if (socket && level == kLevelTCP && optname == kOptionTCPNoDelay &&
+      optval && optlen >= sizeof(int)) {
+    TCP::GetInstance().SetNoDelay(*socket,
+                                  *reinterpret_cast<const int*>(optval));
+    return 0;
+  }
+  if (level == kLevelSocket &&
+      (optname == kOptionReceiveTimeout || optname == kOptionSendTimeout)) {
+    const std::optional<uint64_t> timeout_ns =
+        optlen >= sizeof(TimeVal)
+            ? TimeValToNs(reinterpret_cast<const TimeVal*>(optval))
+            : std::nullopt;
+    if (!timeout_ns)
+      return ErrorNumber::kInvalid;
+    const bool is_rx = optname == kOptionReceiveTimeout;
+    if (socket) {
+      if (is_rx)
+        socket->SetRXTimeoutNs(*timeout_ns);
+      else
+        socket->SetTXTimeoutNs(*timeout_ns);
+      return 0;
+    }
+    if (Network::Socket* datagram_socket = GetSocket(sockfd)) {
+      if (is_rx)
+        datagram_socket->rx_timeout_ns = *timeout_ns;
+      return 0;
+    }
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  if (level == kLevelPacket && (optname == kOptionPacketRXRing ||
+                                optname == kOptionPacketTXRing)) {
+    Network::Socket* datagram_socket = GetSocket(sockfd);
+    if (!datagram_socket)
+      return ErrorNumber::kBadFileDescriptor;
+    if (datagram_socket->type != Network::Socket::Type::kICMPRaw ||
+        !optval || optlen < sizeof(PacketRingRequest))
+      return ErrorNumber::kInvalid;
+    // The rings can not be resized after they are mapped.
+    if (datagram_socket->ring_memory)
+      return ErrorNumber::kBusy;
+    const PacketRingRequest& req =
+        *reinterpret_cast<const PacketRingRequest*>(optval);
+    if (PacketRing::IsInvalidLayout(req.frame_size, req.num_of_frames) ||
+        PacketRing::GetByteSize(req.frame_size, req.num_of_frames) >
+            kMaxPacketRingByteSize)
+      return ErrorNumber::kInvalid;
+    Network::Socket::RingLayout& layout = optname == kOptionPacketRXRing
+                                              ? datagram_socket->rx_ring_layout
+                                              : datagram_socket->tx_ring_layout;
+    layout = {req.frame_size, req.num_of_frames};
+    return 0;
+  }
+  kprintf("%s: setsockopt(%d, %d, %d) is not supported yet\n", __func__,
+          sockfd, level, optname);
+  return -1;
+}
+
+// Returns the size of a ring of layout in the mapping, which is rounded up
+// to pages, or 0 if the ring is not requested.
+static size_t GetPacketRingMapSize(const Network::Socket::RingLayout& layout) {
+  if (!layout.num_of_frames)
+    return 0;
+  return ByteSizeToPageSize(PacketRing::GetByteSize(
+             layout.frame_size, layout.num_of_frames))
+         << kPageSizeExponent;
+}
+
+// Only the packet rings of a socket can be mapped. They are in one range,
+// the RX ring followed by the TX ring as Linux does, and the kernel chooses
+// the address of it. Returns the address.
+static int64_t sys_mmap(void* /*addr*/,
+                        size_t length,
+                        int prot,
+                        int flags,
+                        int fd,
+                        int64_t offset) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  Network::Socket* socket = GetSocket(fd);
+  if (!socket) {
+    kprintf("%s: fd %d is not a socket\n", __func__, fd);
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  const size_t rx_size = GetPacketRingMapSize(socket->rx_ring_layout);
+  const size_t byte_size =
+      rx_size + GetPacketRingMapSize(socket->tx_ring_layout);
+  if (!byte_size || length != byte_size || offset ||
+      prot != (kProtRead | kProtWrite) || !(flags & kMapShared) ||
+      !proc.CanMapUserPages())
+    return ErrorNumber::kInvalid;
+  if (socket->ring_memory)
+    return ErrorNumber::kBusy;
+  uint8_t* memory = AllocKernelMemory<uint8_t*>(byte_size);
+  const Network::Socket::RingLayout& rx = socket->rx_ring_layout;
+  const Network::Socket::RingLayout& tx = socket->tx_ring_layout;
+  if (tx.num_of_frames)
+    socket->tx_ring.Init(memory + rx_size, tx.frame_size, tx.num_of_frames);
+  socket->ring_memory = memory;
+  socket->ring_byte_size = byte_size;
+  socket->ring_vaddr = proc.MapUserPages(
+      reinterpret_cast<uint64_t>(memory) - GetKernelStraightMappingBase(),
+      byte_size);
+  if (rx.num_of_frames) {
+    socket->lock.Lock();
+    socket->rx_ring.Init(memory, rx.frame_size, rx.num_of_frames);
+    socket->lock.Unlock();
+    // No packets are queued from now on. The ones queued before are dropped
+    // since recvfrom(2) does not work with the ring.
+    while (PacketBuffer* pbuf = socket->PopPacket())
+      pbuf->Unref();
+  }
+  return static_cast<int64_t>(socket->ring_vaddr);
+}
+
+void CloseFileDescriptor(Process& proc, int fd) {
+  FileDescriptorTable& fd_table = proc.GetFileDescriptorTable();
+  // Event polls refer to descriptors by their numbers.
+  for (int i = fd_table.FindNextOpen(0); i >= 0;
+       i = fd_table.FindNextOpen(i + 1)) {
+    if (void* object = fd_table.Get(i, FileDescriptorTable::Type::kEventPoll))
+      reinterpret_cast<EventPoll*>(object)->RemoveFD(fd);
+  }
+  FileDescriptorTable::Entry entry = fd_table.Free(fd);
+  if (entry.type == FileDescriptorTable::Type::kSocket) {
+    Network::Socket& socket =
+        *reinterpret_cast<Network::Socket*>(entry.object);
+    if (socket.ring_vaddr)
+      proc.UnmapUserPages(socket.ring_vaddr, socket.ring_byte_size);
+    Network::GetInstance().CloseSocket(socket);
+  }
+  if (entry.type == FileDescriptorTable::Type::kTCPSocket)
+    TCP::GetInstance().Close(*reinterpret_cast<TCP::Socket*>(entry.object));
+  if (entry.type == FileDescriptorTable::Type::kEventPoll)
+    reinterpret_cast<EventPoll*>(entry.object)->Destroy();
+}
+
+void CloseAllFileDescriptors(Process& proc) {
+  FileDescriptorTable& fd_table = proc.GetFileDescriptorTable();
+  for (int fd = fd_table.FindNextOpen(0); fd >= 0;
+       fd = fd_table.FindNextOpen(fd + 1)) {
+    CloseFileDescriptor(proc, fd);
+  }
+}
+
+static int sys_close(int fd) {
+  if (0 <= fd && fd < FileDescriptorTable::kNumOfReservedFileDescriptors)
+    return 0;
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  if (proc.GetFileDescriptorTable().FindNextOpen(fd) != fd)
+    return ErrorNumber::kBadFileDescriptor;
+  CloseFileDescriptor(proc, fd);
+  return 0;
+}
+
 static ssize_t sys_read(int fd, void* buf, size_t count) {
+  if (TCP::Socket* socket = GetTCPSocket(fd)) {
+    return ToSyscallResult(
+        *socket, TCP::GetInstance().Receive(
+                     *socket, buf, count,
+                     GetDeadline(fd, 0, socket->GetRXTimeoutNs())));
+  }
   if (fd != 0) {
     kprintf("%s: fd %d is not supported yet: only stdin is supported now.\n",
             __func__, fd);
@@ -252,134 +636,613 @@ static ssize_t sys_read(int fd, void* buf, size_t count) {
   return 1;
 }
 
-static std::optional<Network::EtherAddr> ResolveIPv4WithTimeout(
-    Network::IPv4Addr dst_ip_addr,
-    uint64_t timeout_ms) {
+static ssize_t sys_write(int fd, const void* buf, size_t count) {
+  if (TCP::Socket* socket = GetTCPSocket(fd)) {
+    return ToSyscallResult(
+        *socket,
+        TCP::GetInstance().Send(*socket, buf, count,
+                                GetDeadline(fd, 0, socket->GetTXTimeoutNs())));
+  }
+  if (fd != 1) {
+    kprintf("%s: fd = %d is not supported yet\n", __func__, fd);
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  if ((count >> 63)) {
+    kprintf("%s: fd = %llu is too big. May be negative?\n", __func__, count);
+    return ErrorNumber::kInvalid;
+  }
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+  for (size_t i = 0; i < count; i++) {
+    PutChar(p[i]);
+  }
+  return count;
+}
+
+static int sys_fcntl(int fd, int cmd, uint64_t arg) {
+  constexpr int kCommandGetStatusFlags = 3;  // F_GETFL
+  constexpr int kCommandSetStatusFlags = 4;  // F_SETFL
+  constexpr int kAccessModeReadWrite = 2;    // O_RDWR
+  if (cmd != kCommandGetStatusFlags && cmd != kCommandSetStatusFlags)
+    return ErrorNumber::kInvalid;
+  // The console is always blocking.
+  if (0 <= fd && fd < FileDescriptorTable::kNumOfReservedFileDescriptors) {
+    if (cmd == kCommandGetStatusFlags)
+      return kAccessModeReadWrite;
+    return (arg & FileDescriptorTable::kStatusFlagNonBlock)
+               ? ErrorNumber::kInvalid
+               : 0;
+  }
+  FileDescriptorTable& fd_table =
+      liumos->scheduler->GetCurrentProcess().GetFileDescriptorTable();
+  if (cmd == kCommandGetStatusFlags) {
+    const int flags = fd_table.GetStatusFlags(fd);
+    return flags < 0 ? ErrorNumber::kBadFileDescriptor
+                     : flags | kAccessModeReadWrite;
+  }
+  // Only O_NONBLOCK can be changed. The others are ignored, as Linux does
+  // for the access mode.
+  return fd_table.SetStatusFlags(
+             fd, static_cast<int>(arg) &
+                     FileDescriptorTable::kStatusFlagNonBlock)
+             ? ErrorNumber::kBadFileDescriptor
+             : 0;
+}
+
+// Returns the deadline of a timeout in milliseconds. Negative timeouts never
+// expire.
+static uint64_t TimeoutMsToDeadline(int timeout_ms) {
+  if (timeout_ms < 0)
+    return kNoDeadline;
+  return NowNs() + static_cast<uint64_t>(timeout_ms) * 1'000'000;
+}
+
+static int sys_poll(PollFD* fds, uint64_t nfds, int timeout_ms) {
+  if (nfds > FileDescriptorTable::kMaxNumOfFileDescriptors)
+    return ErrorNumber::kInvalid;
+  return Poll(liumos->scheduler->GetCurrentProcess(), fds,
+              static_cast<int>(nfds), TimeoutMsToDeadline(timeout_ms));
+}
+
+static int sys_epoll_create1(int flags) {
+  constexpr int kEpollCloseOnExec = 0x80000;
+  if (flags & ~kEpollCloseOnExec)
+    return ErrorNumber::kInvalid;
+  EventPoll* epoll = EventPoll::Create();
+  if (!epoll)
+    return -1;
+  const int fd =
+      liumos->scheduler->GetCurrentProcess().GetFileDescriptorTable().Alloc(
+          FileDescriptorTable::Type::kEventPoll, epoll);
+  if (fd < 0)
+    epoll->Destroy();
+  return fd;
+}
+
+static int sys_epoll_create(int size) {
+  // size is only a hint, but should be positive.
+  if (size <= 0)
+    return ErrorNumber::kInvalid;
+  return sys_epoll_create1(0);
+}
+
+static int sys_epoll_ctl(int epfd,
+                         int op,
+                         int fd,
+                         const EventPoll::Event* event) {
+  constexpr int kEpollCtlAdd = 1;
+  constexpr int kEpollCtlDel = 2;
+  constexpr int kEpollCtlMod = 3;
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  FileDescriptorTable& fd_table = proc.GetFileDescriptorTable();
+  EventPoll* epoll = reinterpret_cast<EventPoll*>(
+      fd_table.Get(epfd, FileDescriptorTable::Type::kEventPoll));
+  if (!epoll || (GetPollEvents(proc, fd) & kPollNVal))
+    return ErrorNumber::kBadFileDescriptor;
+  if (fd_table.Get(fd, FileDescriptorTable::Type::kEventPoll))
+    return ErrorNumber::kInvalid;
+  if (op == kEpollCtlAdd && event)
+    return epoll->AddFD(proc, fd, *event) ? ErrorNumber::kExists : 0;
+  if (op == kEpollCtlMod && event)
+    return epoll->ModifyFD(fd, *event) ? ErrorNumber::kNoEntry : 0;
+  if (op == kEpollCtlDel)
+    return epoll->RemoveFD(fd) ? ErrorNumber::kNoEntry : 0;
+  return ErrorNumber::kInvalid;
+}
+
+static int sys_epoll_wait(int epfd,
+                          EventPoll::Event* events,
+                          int max_events,
+                          int timeout_ms) {
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  EventPoll* epoll = reinterpret_cast<EventPoll*>(
+      proc.GetFileDescriptorTable().Get(epfd,
+                                        FileDescriptorTable::Type::kEventPoll));
+  if (!epoll)
+    return ErrorNumber::kBadFileDescriptor;
+  if (max_events <= 0)
+    return ErrorNumber::kInvalid;
+  return epoll->Wait(proc, events, max_events,
+                     TimeoutMsToDeadline(timeout_ms));
+}
+
+static std::optional<uint64_t> TimespecToNs(const struct timespec* ts) {
+  if (!ts || ts->tv_sec < 0 || ts->tv_nsec < 0 ||
+      ts->tv_nsec >= 1'000'000'000)
+    return std::nullopt;
+  // Saturates instead of overflowing. Such a sleep never ends anyway.
+  constexpr uint64_t kMaxSec = ~0ULL / 1'000'000'000 - 1;
+  if (static_cast<uint64_t>(ts->tv_sec) > kMaxSec)
+    return kMaxSec * 1'000'000'000;
+  return ts->tv_sec * 1'000'000'000 + ts->tv_nsec;
+}
+
+// Also saturates, so that a very long sleep does not wrap around to a
+// deadline in the past.
+static uint64_t DurationNsToDeadline(uint64_t ns) {
+  const uint64_t now = NowNs();
+  return ns > kNoDeadline - now ? kNoDeadline : now + ns;
+}
+
+static void ClearRemainingTime(struct timespec* rem) {
+  // Sleeps are never interrupted since signals are not supported.
+  if (!rem)
+    return;
+  rem->tv_sec = 0;
+  rem->tv_nsec = 0;
+}
+
+static int64_t sys_nanosleep(const struct timespec* req,
+                             struct timespec* rem) {
+  const std::optional<uint64_t> ns = TimespecToNs(req);
+  if (!ns)
+    return ErrorNumber::kInvalid;
+  SleepUntilNs(DurationNsToDeadline(*ns));
+  ClearRemainingTime(rem);
+  return 0;
+}
+
+static int64_t sys_clock_gettime(int clock_id, struct timespec* tp) {
+  // CLOCK_REALTIME counts from boot as sys_clock_nanosleep() does.
+  if ((clock_id != kClockRealtime && clock_id != kClockMonotonic) || !tp)
+    return ErrorNumber::kInvalid;
+  const uint64_t now = NowNs();
+  tp->tv_sec = static_cast<time_t>(now / 1'000'000'000);
+  tp->tv_nsec = static_cast<long>(now % 1'000'000'000);
+  return 0;
+}
+
+static int64_t sys_clock_nanosleep(int clock_id,
+                                   int flags,
+                                   const struct timespec* req,
+                                   struct timespec* rem) {
+  // There is no wall clock yet, so CLOCK_REALTIME counts from boot as
+  // CLOCK_MONOTONIC does.
+  if (clock_id != kClockRealtime && clock_id != kClockMonotonic)
+    return ErrorNumber::kInvalid;
+  if (flags & ~kTimerAbsTime)
+    return ErrorNumber::kInvalid;
+  const std::optional<uint64_t> ns = TimespecToNs(req);
+  if (!ns)
+    return ErrorNumber::kInvalid;
+  if (flags & kTimerAbsTime) {
+    SleepUntilNs(*ns);
+    return 0;
+  }
+  SleepUntilNs(DurationNsToDeadline(*ns));
+  ClearRemainingTime(rem);
+  return 0;
+}
+
+struct NextHop {
+  Network::IPv4Addr addr;
+  std::optional<Network::EtherAddr> eth_addr;  // nullopt if not resolved.
+};
+
+// Returns the next hop to dst_ip_addr without waiting for ARP resolution.
+static NextHop ResolveNextHop(Network::IPv4Addr dst_ip_addr) {
   Network& network = Network::GetInstance();
-  uint64_t time_passed_ms = 0;
-  constexpr uint64_t kWaitTimePerTryMs = 200;
-  Network::IPv4Addr nexthop_ip_addr;
-  if (dst_ip_addr.IsInSameSubnet(network.GetIPv4DefaultGateway(),
-                                 network.GetIPv4NetMask())) {
-    kprintf("kernel: dst is in the same subnet.\n");
-    nexthop_ip_addr = dst_ip_addr;
-  } else {
-    kprintf("kernel: dst is in a different subnet.\n");
-    nexthop_ip_addr = network.GetIPv4DefaultGateway();
-  }
-  while (time_passed_ms < timeout_ms) {
-    auto eth_container = network.ResolveIPv4(nexthop_ip_addr);
-    if (eth_container.has_value()) {
-      kprintf("kernel: ARP entry found!\n");
-      return eth_container;
+  const Network::IPv4Addr next_hop = network.GetNextHop(dst_ip_addr);
+  return {next_hop, network.ResolveIPv4(next_hop)};
+}
+
+// Sends a frame of frame_size bytes to next_hop. build(frame) fills the
+// frame except the destination of the Ethernet header and returns the
+// offloads for it. Returns true on failure.
+template <class TBuilder>
+static bool SendIPv4Frame(const NextHop& next_hop,
+                          size_t frame_size,
+                          TBuilder build) {
+  Network& network = Network::GetInstance();
+  NIC& nic = network.GetNIC();
+  if (next_hop.eth_addr.has_value()) {
+    uint8_t* frame = nic.GetNextTXPacketBuf(frame_size);
+    const Network::TXOffload offload = build(frame);
+    reinterpret_cast<Network::EtherFrame*>(frame)->dst = *next_hop.eth_addr;
+    nic.SetTXOffload(offload);
+    nic.SendPacket();
+    return false;
+  }
+  // Sent when the next hop replies.
+  Network::PendingFrame* frame = Network::AllocPendingFrame(frame_size);
+  if (!frame)
+    return true;
+  frame->offload = build(frame->GetData());
+  network.SendFrameAfterARPResolution(next_hop.addr, *frame);
+  return false;
+}
+
+// Runs func() in a TX batch of nic. The batch ends on the TX queue where it
+// began, since the process may move to another processor in func().
+template <class TFunc>
+static void WithTXBatch(NIC& nic, TFunc func) {
+  const int batch = nic.BeginTXBatch();
+  func();
+  nic.EndTXBatch(batch);
+}
+
+// Returns the size of the largest UDP datagram which nic can send, as one
+// frame or fragmented by the device.
+static size_t GetMaxUDPDataSize(NIC& nic) {
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  constexpr size_t kMaxIPv4PacketSize = 0xFFFF;
+  size_t max_frame_size = sizeof(Network::EtherFrame) + kMaxIPv4PacketSize;
+  if (!nic.CanOffloadTXChecksum() || !nic.CanOffloadUDPFragmentation()) {
+    max_frame_size =
+        sizeof(Network::EtherFrame) + Network::EtherFrame::kMTU;
+  }
+  max_frame_size = std::min(max_frame_size, nic.GetMaxTXPacketSize());
+  return max_frame_size - sizeof(IPv4UDPPacket);
+}
+
+// Fills frame with an ICMP message of len bytes from buf to dst_ip_addr.
+// Returns the offloads for it.
+static Network::TXOffload BuildICMPFrame(uint8_t* frame,
+                                         Network::IPv4Addr dst_ip_addr,
+                                         const void* buf,
+                                         size_t len) {
+  using IPv4Packet = Network::IPv4Packet;
+  NIC& nic = Network::GetInstance().GetNIC();
+  IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(frame);
+  // ip.eth
+  ip.eth.src = nic.GetSelfEtherAddr();
+  ip.eth.SetEthType(Network::EtherFrame::kTypeIPv4);
+  // ip
+  ip.version_and_ihl =
+      0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
+  ip.dscp_and_ecn = 0;
+  ip.SetTotalLength(static_cast<uint16_t>(
+      sizeof(IPv4Packet) - sizeof(Network::EtherFrame) + len));
+  ip.ident = 0;
+  ip.flags = 0;
+  ip.ttl = 0xFF;
+  ip.protocol = IPv4Packet::Protocol::kICMP;
+  ip.src_ip = nic.GetSelfIPv4Addr();
+  ip.dst_ip = dst_ip_addr;
+  ip.CalcAndSetChecksum();
+  // icmp
+  memcpy(frame + sizeof(IPv4Packet), buf, len);
+  return Network::TXOffload{};
+}
+
+// Sends the ICMP messages in the TX ring of socket. Messages which do not
+// fit in a frame are dropped. Returns the number of sent bytes.
+static ssize_t SendPacketRingFrames(Network::Socket& socket) {
+  constexpr size_t kMaxMessageSize = Network::EtherFrame::kMTU -
+                                     sizeof(Network::IPv4Packet) +
+                                     sizeof(Network::EtherFrame);
+  NIC& nic = Network::GetInstance().GetNIC();
+  // Consecutive messages to the same destination share the next hop, which
+  // is resolved only once.
+  std::optional<Network::IPv4Addr> dst_ip_addr;
+  NextHop next_hop;
+  ssize_t sent_size = 0;
+  uint32_t size;
+  uint32_t addr;
+  WithTXBatch(nic, [&] {
+    while (const uint8_t* data = socket.tx_ring.Front(size, addr)) {
+      Network::IPv4Addr dst;
+      memcpy(dst.addr, &addr, sizeof(dst.addr));
+      if (size <= kMaxMessageSize) {
+        if (!dst_ip_addr.has_value() || !(*dst_ip_addr == dst)) {
+          dst_ip_addr = dst;
+          next_hop = ResolveNextHop(dst);
+        }
+        auto build = [&](uint8_t* frame) {
+          return BuildICMPFrame(frame, dst, data, size);
+        };
+        // Kept in the ring to be sent on the next kick.
+        if (SendIPv4Frame(next_hop, sizeof(Network::IPv4Packet) + size,
+                          build))
+          return;
+        sent_size += size;
+      }
+      socket.tx_ring.Pop();
     }
-    SendARPRequest(nexthop_ip_addr);
-    kprintf("kernel: ARP request sent to %d.%d.%d.%d...\n",
-            nexthop_ip_addr.addr[0], nexthop_ip_addr.addr[1],
-            nexthop_ip_addr.addr[2], nexthop_ip_addr.addr[3]);
-    Sleep();
-    HPET::GetInstance().BusyWait(kWaitTimePerTryMs);
-    time_passed_ms += kWaitTimePerTryMs;
+  });
+  return sent_size;
+}
+
+// Fills frame with a UDP datagram from socket to dst_addr which has len
+// bytes of data gathered from iov. Returns the offloads for it.
+static Network::TXOffload BuildUDPFrame(uint8_t* frame,
+                                        const Network::Socket& socket,
+                                        const struct sockaddr_in& dst_addr,
+                                        const IOVec* iov,
+                                        size_t iov_len,
+                                        size_t len) {
+  using IPv4Packet = Network::IPv4Packet;
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  NIC& nic = Network::GetInstance().GetNIC();
+  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(frame);
+  Network::TXOffload offload = {};
+  // ip.eth
+  udp.ip.eth.src = nic.GetSelfEtherAddr();
+  udp.ip.eth.SetEthType(Network::EtherFrame::kTypeIPv4);
+  // ip
+  udp.ip.version_and_ihl =
+      0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
+  udp.ip.dscp_and_ecn = 0;
+  udp.ip.SetDataLength(sizeof(IPv4UDPPacket) + len - sizeof(IPv4Packet));
+  udp.ip.ident = 0;
+  udp.ip.flags = 0;
+  udp.ip.ttl = 0xFF;
+  udp.ip.protocol = Network::IPv4Packet::Protocol::kUDP;
+  udp.ip.src_ip = nic.GetSelfIPv4Addr();
+  udp.ip.dst_ip = dst_addr.sin_addr;
+  udp.ip.CalcAndSetChecksum();
+  // udp
+  GatherFromIOVec(frame + sizeof(IPv4UDPPacket) /*right after the UDP header*/,
+                  iov, iov_len, len);
+  udp.SetSourcePort(socket.listen_port);
+  *reinterpret_cast<uint16_t*>(&udp.dst_port) = dst_addr.sin_port;
+  udp.SetDataSize(len);
+  if (!nic.CanOffloadTXChecksum()) {
+    udp.csum = Network::CalcUDPChecksum(
+        &udp, offsetof(IPv4UDPPacket, src_port), sizeof(IPv4UDPPacket) + len,
+        udp.ip.src_ip, udp.ip.dst_ip, udp.length);
+    return offload;
+  }
+  udp.csum = Network::CalcPseudoHeaderChecksum(
+      udp.ip.src_ip, udp.ip.dst_ip, Network::IPv4Packet::Protocol::kUDP,
+      static_cast<uint16_t>(udp.length[0] << 8 | udp.length[1]));
+  offload.csum_start = offsetof(IPv4UDPPacket, src_port);
+  offload.csum_offset =
+      offsetof(IPv4UDPPacket, csum) - offsetof(IPv4UDPPacket, src_port);
+  // The device fragments datagrams larger than the MTU.
+  constexpr size_t kIPHeaderSize =
+      sizeof(IPv4Packet) - sizeof(Network::EtherFrame);
+  if (sizeof(IPv4UDPPacket) + len - sizeof(Network::EtherFrame) >
+          Network::EtherFrame::kMTU &&
+      nic.CanOffloadUDPFragmentation()) {
+    offload.gso_type = NIC::kGSOTypeUDP;
+    offload.header_size = sizeof(IPv4UDPPacket);
+    offload.segment_size = Network::EtherFrame::kMTU - kIPHeaderSize;
+  }
+  return offload;
+}
+
+static int sys_connect(int sockfd,
+                       const struct sockaddr_in* addr,
+                       socklen_t /*addrlen*/) {
+  constexpr uint64_t kARPTimeoutNs = 1'000'000'000;
+  TCP::Socket* socket = GetTCPSocket(sockfd);
+  if (!socket) {
+    kprintf("%s: fd %d is not a TCP socket\n", __func__, sockfd);
+    return -1;
+  }
+  // The next hop is resolved once here and used for the whole connection.
+  Network& network = Network::GetInstance();
+  if (!network.HasNIC()) {
+    kprintf("%s: no NIC is available\n", __func__);
+    return -1;
   }
-  kprintf("kernel: ARP resolution failed. (timeout)\n");
-  return std::nullopt;
+  const uint64_t deadline_ns =
+      GetDeadline(sockfd, 0, socket->GetTXTimeoutNs());
+  const uint64_t now = NowNs();
+  const bool is_arp_limited_by_deadline =
+      deadline_ns < now + kARPTimeoutNs;
+  std::optional<Network::EtherAddr> eth_addr = network.WaitForARPResolution(
+      network.GetNextHop(addr->sin_addr),
+      is_arp_limited_by_deadline ? deadline_ns - std::min(deadline_ns, now)
+                                 : kARPTimeoutNs);
+  if (!eth_addr.has_value()) {
+    // The request has been sent, so a later try may succeed.
+    if (is_arp_limited_by_deadline)
+      return ErrorNumber::kTryAgain;
+    kprintf("%s: ARP resolution failed.\n", __func__);
+    return -1;
+  }
+  const TCP::ConnectResult result =
+      TCP::GetInstance().Connect(*socket, addr->sin_addr,
+                                 SwapBytes16(addr->sin_port), *eth_addr,
+                                 deadline_ns);
+  if (result == TCP::ConnectResult::kConnected)
+    return 0;
+  if (result == TCP::ConnectResult::kInProgress)
+    return ErrorNumber::kInProgress;
+  return TCP::GetInstance().HasTimedOut(*socket) ? ErrorNumber::kTimedOut : -1;
 }
 
 static ssize_t sys_sendto(int sockfd,
                           const void* buf,
                           size_t len,
-                          int /*flags*/,
+                          int flags,
                           const struct sockaddr_in* dest_addr,
                           socklen_t /*addrlen*/) {
-  using Net = Virtio::Net;
-  using IPv4Packet = Virtio::Net::IPv4Packet;
+  using IPv4Packet = Network::IPv4Packet;
   using IPv4Addr = Network::IPv4Addr;
-  using EtherAddr = Network::EtherAddr;
   using Socket = Network::Socket;
 
-  Net& virtio_net = Net::GetInstance();
-  Network& network = Network::GetInstance();
-  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
+  // Connected sockets ignore dest_addr, as Linux does.
+  if (TCP::Socket* tcp_socket = GetTCPSocket(sockfd)) {
+    return ToSyscallResult(
+        *tcp_socket,
+        TCP::GetInstance().Send(
+            *tcp_socket, buf, len,
+            GetDeadline(sockfd, flags, tcp_socket->GetTXTimeoutNs())));
+  }
+  Socket* socket = GetSocket(sockfd);
+  if (!socket) {
     kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
-  Socket::Type socket_type = (*sock_holder).type;
-
-  IPv4Addr target_ip_addr = dest_addr->sin_addr;
-  std::optional<EtherAddr> target_eth_addr_holder =
-      ResolveIPv4WithTimeout(target_ip_addr, 1000);
-  if (!target_eth_addr_holder.has_value()) {
-    kprintf("%s: ARP resolution failed.\n", __func__);
+  Socket::Type socket_type = socket->type;
+  if (!Network::GetInstance().HasNIC()) {
+    kprintf("%s: no NIC is available\n", __func__);
     return -1;
   }
+  NIC& nic = Network::GetInstance().GetNIC();
+
+  // send(2) with no data kicks the TX ring, as on Linux.
+  if (!buf && socket->tx_ring.IsEnabled())
+    return SendPacketRingFrames(*socket);
+
+  IPv4Addr target_ip_addr = dest_addr->sin_addr;
   if (socket_type == Network::Socket::Type::kICMPRaw ||
       socket_type == Network::Socket::Type::kICMPDatagram) {
-    using ICMPPacket = Virtio::Net::ICMPPacket;
-    ICMPPacket& icmp =
-        *virtio_net.GetNextTXPacketBuf<ICMPPacket*>(sizeof(IPv4Packet) + len);
-    // ip.eth
-    icmp.ip.eth.dst = *target_eth_addr_holder;
-    icmp.ip.eth.src = virtio_net.GetSelfEtherAddr();
-    icmp.ip.eth.SetEthType(Net::EtherFrame::kTypeIPv4);
-    // ip
-    icmp.ip.version_and_ihl =
-        0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
-    icmp.ip.dscp_and_ecn = 0;
-    icmp.ip.SetDataLength(sizeof(ICMPPacket) - sizeof(IPv4Packet));
-    icmp.ip.ident = 0;
-    icmp.ip.flags = 0;
-    icmp.ip.ttl = 0xFF;
-    icmp.ip.protocol = Net::IPv4Packet::Protocol::kICMP;
-    icmp.ip.src_ip = virtio_net.GetSelfIPv4Addr();
-    icmp.ip.dst_ip = target_ip_addr;
-    icmp.ip.CalcAndSetChecksum();
-    // icmp
-    memcpy(&icmp.type /*first member of ICMP*/, buf, len);
-    // send
-    virtio_net.SendPacket();
+    auto build = [&](uint8_t* frame) {
+      return BuildICMPFrame(frame, target_ip_addr, buf, len);
+    };
+    if (SendIPv4Frame(ResolveNextHop(target_ip_addr), sizeof(IPv4Packet) + len,
+                      build))
+      return -1;
     return len;
   }
   if (socket_type == Network::Socket::Type::kUDP) {
     len = (len + 1) & ~1;  // make size even
-    using IPv4UDPPacket = Virtio::Net::IPv4UDPPacket;
-    IPv4UDPPacket& udp = *virtio_net.GetNextTXPacketBuf<IPv4UDPPacket*>(
-        sizeof(IPv4UDPPacket) + len);
-    // ip.eth
-    udp.ip.eth.dst = *target_eth_addr_holder;
-    udp.ip.eth.src = virtio_net.GetSelfEtherAddr();
-    udp.ip.eth.SetEthType(Net::EtherFrame::kTypeIPv4);
-    // ip
-    udp.ip.version_and_ihl =
-        0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
-    udp.ip.dscp_and_ecn = 0;
-    udp.ip.SetDataLength(sizeof(IPv4UDPPacket) + len - sizeof(IPv4Packet));
-    udp.ip.ident = 0;
-    udp.ip.flags = 0;
-    udp.ip.ttl = 0xFF;
-    udp.ip.protocol = Net::IPv4Packet::Protocol::kUDP;
-    udp.ip.src_ip = virtio_net.GetSelfIPv4Addr();
-    udp.ip.dst_ip = target_ip_addr;
-    udp.ip.CalcAndSetChecksum();
-    // udp
-    memcpy(reinterpret_cast<uint8_t*>(&udp) +
-               sizeof(IPv4UDPPacket) /*right after the UDP header*/,
-           buf, len);
-    udp.SetSourcePort((*sock_holder).listen_port);
-    *reinterpret_cast<uint16_t*>(&udp.dst_port) = dest_addr->sin_port;
-    udp.SetDataSize(len);
-    udp.csum = Network::CalcUDPChecksum(
-        &udp, offsetof(IPv4UDPPacket, src_port), sizeof(IPv4UDPPacket) + len,
-        udp.ip.src_ip, udp.ip.dst_ip, udp.length);
-    // send
-    virtio_net.SendPacket();
+    const IOVec iov = {const_cast<void*>(buf), len};
+    auto build = [&](uint8_t* frame) {
+      return BuildUDPFrame(frame, *socket, *dest_addr, &iov, 1, len);
+    };
+    if (SendIPv4Frame(ResolveNextHop(target_ip_addr),
+                      sizeof(Network::IPv4UDPPacket) + len, build))
+      return -1;
     return len;
   }
   kprintf("%s: socket_type = %d is not supported\n", __func__, socket_type);
   return -1;
 }
 
+// Sends datagrams of msgvec. Returns the number of sent ones. Stops at the
+// first datagram which is invalid or cannot be sent, and fails if it is the
+// first one.
+static int sys_sendmmsg(int sockfd,
+                        MultiMessageHeader* msgvec,
+                        unsigned int vlen,
+                        int /*flags*/) {
+  Network::Socket* socket = GetSocket(sockfd);
+  if (!socket)
+    return ErrorNumber::kBadFileDescriptor;
+  // Datagrams are sent without blocking, so flags do not matter.
+  if (socket->type != Network::Socket::Type::kUDP || !msgvec)
+    return ErrorNumber::kInvalid;
+  Network& network = Network::GetInstance();
+  if (!network.HasNIC())
+    return -1;
+  NIC& nic = network.GetNIC();
+  vlen = std::min<unsigned int>(vlen, kMaxIOVecLen);
+  // Consecutive datagrams to the same destination share the next hop, which
+  // is resolved only once.
+  std::optional<Network::IPv4Addr> dst_ip_addr;
+  NextHop next_hop;
+  const size_t max_len = GetMaxUDPDataSize(nic);
+  unsigned int n = 0;
+  int error = 0;
+  WithTXBatch(nic, [&] {
+    for (; n < vlen; n++) {
+      MessageHeader& hdr = msgvec[n].hdr;
+      if (!hdr.name || hdr.name_len < sizeof(sockaddr_in) ||
+          hdr.iov_len > kMaxIOVecLen) {
+        error = ErrorNumber::kInvalid;
+        return;
+      }
+      const struct sockaddr_in& dst_addr = *hdr.name;
+      const size_t len = GetIOVecSize(hdr.iov, hdr.iov_len);
+      if (len > max_len) {
+        error = ErrorNumber::kMessageTooLong;
+        return;
+      }
+      if (!dst_ip_addr.has_value() || !(*dst_ip_addr == dst_addr.sin_addr)) {
+        dst_ip_addr = dst_addr.sin_addr;
+        next_hop = ResolveNextHop(dst_addr.sin_addr);
+      }
+      auto build = [&](uint8_t* frame) {
+        return BuildUDPFrame(frame, *socket, dst_addr, hdr.iov, hdr.iov_len,
+                             len);
+      };
+      // No memory is left to keep the frame until ARP is resolved.
+      if (SendIPv4Frame(next_hop, sizeof(Network::IPv4UDPPacket) + len,
+                        build)) {
+        error = ErrorNumber::kNoBufferSpace;
+        return;
+      }
+      msgvec[n].len = static_cast<uint32_t>(len);
+    }
+  });
+  return n ? static_cast<int>(n) : error;
+}
+
+// Receives datagrams into msgvec until vlen of them arrive or the timeout
+// expires. Waits only for the first one with MSG_WAITFORONE. Returns the
+// number of received ones.
+static int sys_recvmmsg(int sockfd,
+                        MultiMessageHeader* msgvec,
+                        unsigned int vlen,
+                        int flags,
+                        const struct timespec* timeout) {
+  constexpr int kBatchSize = 64;
+  Network::Socket* socket = GetSocket(sockfd);
+  if (!socket)
+    return ErrorNumber::kBadFileDescriptor;
+  // Packets go to the RX ring instead if it is mapped.
+  if (!msgvec || socket->rx_ring.IsEnabled())
+    return ErrorNumber::kInvalid;
+  uint64_t deadline_ns = GetDeadline(sockfd, flags, socket->rx_timeout_ns);
+  if (timeout) {
+    const std::optional<uint64_t> timeout_ns = TimespecToNs(timeout);
+    if (!timeout_ns)
+      return ErrorNumber::kInvalid;
+    const uint64_t now = NowNs();
+    if (*timeout_ns < deadline_ns - std::min(deadline_ns, now))
+      deadline_ns = now + *timeout_ns;
+  }
+  vlen = std::min<unsigned int>(vlen, kMaxIOVecLen);
+  PacketBuffer* packets[kBatchSize];
+  unsigned int n = 0;
+  while (n < vlen) {
+    // Takes the queued packets at once, and waits only if there is none.
+    int num_of_packets = socket->PopPackets(
+        packets, static_cast<int>(std::min<unsigned int>(vlen - n,
+                                                         kBatchSize)));
+    if (!num_of_packets) {
+      packets[0] = socket->WaitAndPopPacket(deadline_ns);
+      if (!packets[0])
+        break;
+      num_of_packets = 1;
+    }
+    for (int i = 0; i < num_of_packets; i++) {
+      MessageHeader& hdr = msgvec[n].hdr;
+      const size_t iov_len = std::min(hdr.iov_len, kMaxIOVecLen);
+      const size_t buf_size = GetIOVecSize(hdr.iov, iov_len);
+      struct sockaddr_in* addr =
+          hdr.name && hdr.name_len >= sizeof(sockaddr_in) ? hdr.name
+                                                          : nullptr;
+      const size_t size =
+          CopyDatagram(*socket, *packets[i], hdr.iov, iov_len, addr);
+      packets[i]->Unref();
+      if (addr)
+        hdr.name_len = sizeof(sockaddr_in);
+      hdr.control_len = 0;
+      hdr.flags = size > buf_size ? kMessageTruncated : 0;
+      msgvec[n].len = static_cast<uint32_t>(std::min(size, buf_size));
+      n++;
+    }
+    if (flags & kMessageWaitForOne)
+      deadline_ns = NowNs();
+  }
+  return n ? static_cast<int>(n) : ErrorNumber::kTryAgain;
+}
+
 __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
   // This function will be called under exceptions are masked
   // with Kernel Stack
@@ -390,26 +1253,46 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
     return;
   }
   if (idx == kSyscallIndex_sys_write) {
-    const uint64_t fildes = args[1];
-    const uint8_t* buf = reinterpret_cast<uint8_t*>(args[2]);
-    uint64_t nbyte = args[3];
-    if (fildes != 1) {
-      kprintf("%s: fd = %d is not supported yet\n", __func__, fildes);
-      args[0] = ErrorNumber::kBadFileDescriptor;
-      return;
-    }
-    if ((nbyte >> 63)) {
-      kprintf("%s: fd = %llu is too big. May be negative?\n", __func__, nbyte);
-      args[0] = ErrorNumber::kInvalid;
-      return;
-    }
-    while (nbyte--) {
-      PutChar(*(buf++));
-    }
+    args[0] = sys_write(static_cast<int>(args[1]),
+                        reinterpret_cast<const void*>(args[2]), args[3]);
     return;
   }
   if (idx == kSyscallIndex_sys_close) {
-    args[0] = 0;
+    args[0] = sys_close(static_cast<int>(args[1]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_fcntl) {
+    args[0] = sys_fcntl(static_cast<int>(args[1]), static_cast<int>(args[2]),
+                        args[3]);
+    return;
+  }
+  if (idx == kSyscallIndex_sys_poll) {
+    args[0] = sys_poll(reinterpret_cast<PollFD*>(args[1]), args[2],
+                       static_cast<int>(args[3]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_mmap) {
+    args[0] = sys_mmap(reinterpret_cast<void*>(args[1]), args[2],
+                       static_cast<int>(args[3]), static_cast<int>(args[4]),
+                       static_cast<int>(args[5]),
+                       static_cast<int64_t>(args[6]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_nanosleep) {
+    args[0] = sys_nanosleep(reinterpret_cast<const struct timespec*>(args[1]),
+                            reinterpret_cast<struct timespec*>(args[2]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_clock_gettime) {
+    args[0] = sys_clock_gettime(static_cast<int>(args[1]),
+                                reinterpret_cast<struct timespec*>(args[2]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_clock_nanosleep) {
+    args[0] = sys_clock_nanosleep(
+        static_cast<int>(args[1]), static_cast<int>(args[2]),
+        reinterpret_cast<const struct timespec*>(args[3]),
+        reinterpret_cast<struct timespec*>(args[4]));
     return;
   }
   if (idx == kSyscallIndex_sys_exit) {
@@ -447,6 +1330,21 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
                    static_cast<socklen_t>(args[6]));
     return;
   }
+  if (idx == kSyscallIndex_sys_sendmmsg) {
+    args[0] = sys_sendmmsg(static_cast<int>(args[1]),
+                           reinterpret_cast<MultiMessageHeader*>(args[2]),
+                           static_cast<unsigned int>(args[3]),
+                           static_cast<int>(args[4]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_recvmmsg) {
+    args[0] = sys_recvmmsg(static_cast<int>(args[1]),
+                           reinterpret_cast<MultiMessageHeader*>(args[2]),
+                           static_cast<unsigned int>(args[3]),
+                           static_cast<int>(args[4]),
+                           reinterpret_cast<const struct timespec*>(args[5]));
+    return;
+  }
   if (idx == kSyscallIndex_sys_recvfrom) {
     args[0] = sys_recvfrom(
         static_cast<int>(args[1]), reinterpret_cast<void*>(args[2]), args[3],
@@ -460,6 +1358,51 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
                        static_cast<socklen_t>(args[3]));
     return;
   }
+  if (idx == kSyscallIndex_sys_listen) {
+    args[0] = sys_listen(static_cast<int>(args[1]), static_cast<int>(args[2]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_accept) {
+    args[0] = sys_accept(static_cast<int>(args[1]),
+                         reinterpret_cast<struct sockaddr_in*>(args[2]),
+                         reinterpret_cast<socklen_t*>(args[3]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_connect) {
+    args[0] = sys_connect(static_cast<int>(args[1]),
+                          reinterpret_cast<const struct sockaddr_in*>(args[2]),
+                          static_cast<socklen_t>(args[3]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_setsockopt) {
+    args[0] = sys_setsockopt(
+        static_cast<int>(args[1]), static_cast<int>(args[2]),
+        static_cast<int>(args[3]), reinterpret_cast<const void*>(args[4]),
+        static_cast<socklen_t>(args[5]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_create) {
+    args[0] = sys_epoll_create(static_cast<int>(args[1]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_create1) {
+    args[0] = sys_epoll_create1(static_cast<int>(args[1]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_ctl) {
+    args[0] = sys_epoll_ctl(
+        static_cast<int>(args[1]), static_cast<int>(args[2]),
+        static_cast<int>(args[3]),
+        reinterpret_cast<const EventPoll::Event*>(args[4]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_wait) {
+    args[0] = sys_epoll_wait(static_cast<int>(args[1]),
+                             reinterpret_cast<EventPoll::Event*>(args[2]),
+                             static_cast<int>(args[3]),
+                             static_cast<int>(args[4]));
+    return;
+  }
   char s[64];
   snprintf(s, sizeof(s), "Unhandled syscall. rax = %lu\n", idx);
   PutString(s);
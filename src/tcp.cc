@@ -0,0 +1,1185 @@
+#include "tcp.h"
+#include "clock_source.h"
+#include "kernel.h"
+#include "liumos.h"
+#include "nic.h"
+#include "timer.h"
+
+using IPv4TCPPacket = Network::IPv4TCPPacket;
+
+TCP* TCP::tcp_;
+
+// Comparison of sequence numbers modulo 2^32 (RFC 793 3.3)
+static bool SeqLT(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+static bool SeqLE(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) <= 0;
+}
+
+TCP::Socket::Socket(uint64_t pid)
+    : pid_(pid),
+      state_(State::kClosed),
+      ref_count_(0),
+      is_closed_by_user_(false),
+      owns_port_(false),
+      is_reset_(false),
+      is_timed_out_(false),
+      no_delay_(false),
+      rx_timeout_ns_(0),
+      tx_timeout_ns_(0),
+      local_port_(0),
+      remote_port_(0),
+      remote_addr_{},
+      remote_eth_addr_{},
+      iss_(0),
+      snd_una_(0),
+      snd_nxt_(0),
+      snd_max_(0),
+      snd_wnd_(0),
+      snd_wl1_(0),
+      snd_wl2_(0),
+      snd_mss_(kDefaultMSS),
+      fin_queued_(false),
+      fin_seq_(0),
+      num_of_dup_acks_(0),
+      rcv_nxt_(0),
+      rcv_wnd_advertised_(0),
+      fin_received_(false),
+      num_of_unacked_segments_(0),
+      srtt_ns_(0),
+      rttvar_ns_(0),
+      rto_ns_(kInitialRTONs),
+      is_measuring_rtt_(false),
+      rtt_seq_(0),
+      rtt_start_ns_(0),
+      num_of_retransmits_(0),
+      is_rtx_timer_armed_(false),
+      rtx_deadline_ns_(0),
+      is_delayed_ack_timer_armed_(false),
+      listener_(nullptr),
+      next_child_(nullptr),
+      children_(nullptr),
+      num_of_children_(0),
+      backlog_(0),
+      next_to_wake_(nullptr),
+      is_wake_pending_(false),
+      num_of_segments_sent_(0),
+      num_of_segments_received_(0),
+      num_of_retransmitted_segments_(0) {
+  rtx_timer_.Init(HandleRTXTimer, this);
+  delayed_ack_timer_.Init(HandleDelayedACKTimer, this);
+}
+
+TCP& TCP::GetInstance() {
+  if (!tcp_) {
+    tcp_ = liumos->kernel_heap_allocator->Alloc<TCP>();
+    bzero(tcp_, sizeof(TCP));
+    new (tcp_) TCP();
+  }
+  assert(tcp_);
+  return *tcp_;
+}
+
+uint32_t TCP::GetMaxFrameDataSize(uint32_t mss) {
+  NIC& nic = Network::GetInstance().GetNIC();
+  if (!nic.CanOffloadTCPSegmentation())
+    return mss;
+  const uint32_t max_size = static_cast<uint32_t>(nic.GetMaxTXPacketSize() -
+                                                  sizeof(IPv4TCPPacket));
+  return std::max(mss, max_size - max_size % mss);
+}
+
+bool TCP::IsFINSent(const Socket& socket) {
+  return socket.fin_queued_ && SeqLT(socket.fin_seq_, socket.snd_nxt_);
+}
+
+uint32_t TCP::GetSentDataSize(const Socket& socket) {
+  return socket.snd_nxt_ - socket.snd_una_ - (IsFINSent(socket) ? 1 : 0);
+}
+
+uint32_t TCP::GenerateISS(const Socket& socket) {
+  // A clock ticking every 4 us as RFC 793 suggests, offset by a hash of the
+  // connection so that it is not shared between connections (RFC 6528).
+  const uint64_t hash = ConnectionKeyOf(socket) * 0x9E3779B97F4A7C15ULL;
+  return static_cast<uint32_t>(NowNs() / 4000 + (hash >> 32));
+}
+
+TCP::Socket* TCP::AllocSocketLocked(uint64_t pid) {
+  Socket* socket = new (AllocKernelObject<Socket>()) Socket(pid);
+  socket->tx_buf_.Init(
+      reinterpret_cast<uint8_t*>(AllocKernelObjectMemory(kBufferSize)),
+      kBufferSize);
+  socket->rx_buf_.Init(
+      reinterpret_cast<uint8_t*>(AllocKernelObjectMemory(kBufferSize)),
+      kBufferSize);
+  sockets_.push_back(socket);
+  return socket;
+}
+
+void TCP::UnrefLocked(Socket& socket) {
+  assert(socket.ref_count_ > 0);
+  if (--socket.ref_count_)
+    return;
+  assert(socket.state_ == State::kClosed);
+  assert(!socket.owns_port_);
+  for (auto it = sockets_.begin(); it != sockets_.end(); it++) {
+    if (*it == &socket) {
+      sockets_.erase(it);
+      break;
+    }
+  }
+  FreeKernelObjectMemory(socket.tx_buf_.GetBuffer());
+  FreeKernelObjectMemory(socket.rx_buf_.GetBuffer());
+  socket.~Socket();
+  FreeKernelObjectMemory(&socket);
+}
+
+void TCP::RequestWakeLocked(Socket& socket) {
+  if (socket.is_wake_pending_)
+    return;
+  socket.is_wake_pending_ = true;
+  RefLocked(socket);
+  socket.next_to_wake_ = wake_list_;
+  wake_list_ = &socket;
+}
+
+void TCP::UnlockAndWake() {
+  // The waiters evaluate their conditions with lock_ held, so they are woken
+  // up after lock_ is released. The pending flags are cleared before that,
+  // so that changes made while waking up request another wakeup.
+  constexpr int kMaxNumOfSocketsPerBatch = 16;
+  for (;;) {
+    Socket* batch[kMaxNumOfSocketsPerBatch];
+    int num_of_sockets = 0;
+    while (wake_list_ && num_of_sockets < kMaxNumOfSocketsPerBatch) {
+      Socket* socket = wake_list_;
+      wake_list_ = socket->next_to_wake_;
+      socket->is_wake_pending_ = false;
+      batch[num_of_sockets++] = socket;
+    }
+    lock_.Unlock();
+    if (!num_of_sockets)
+      return;
+    for (int i = 0; i < num_of_sockets; i++) {
+      batch[i]->wait_queue_.WakeAll();
+      batch[i]->poll_notifier_.Notify();
+    }
+    lock_.Lock();
+    for (int i = 0; i < num_of_sockets; i++)
+      UnrefLocked(*batch[i]);
+  }
+}
+
+bool TCP::AllocPortLocked(Socket& socket, uint16_t port) {
+  if (!port) {
+    constexpr int kNumOfPorts =
+        Network::kEphemeralPortLast - Network::kEphemeralPortFirst + 1;
+    for (int i = 0; i < kNumOfPorts; i++) {
+      const uint16_t candidate = next_ephemeral_port_;
+      next_ephemeral_port_ = candidate == Network::kEphemeralPortLast
+                                 ? Network::kEphemeralPortFirst
+                                 : candidate + 1;
+      if (!sockets_by_port_.count(candidate)) {
+        port = candidate;
+        break;
+      }
+    }
+    if (!port)
+      return true;
+  } else if (sockets_by_port_.count(port)) {
+    return true;
+  }
+  sockets_by_port_.insert({port, &socket});
+  socket.local_port_ = port;
+  socket.owns_port_ = true;
+  return false;
+}
+
+void TCP::InsertConnectionLocked(Socket& socket) {
+  connections_.insert({ConnectionKeyOf(socket), &socket});
+  RefLocked(socket);
+}
+
+void TCP::CloseConnectionLocked(Socket& socket) {
+  while (socket.children_) {
+    Socket& child = *socket.children_;
+    SendSegmentLocked(child, child.snd_nxt_,
+                      IPv4TCPPacket::kFlagRST | IPv4TCPPacket::kFlagACK, 0, 0);
+    CloseConnectionLocked(child);
+  }
+  if (socket.listener_)
+    UnlinkChildLocked(socket);
+  if (socket.owns_port_) {
+    sockets_by_port_.erase(socket.local_port_);
+    socket.owns_port_ = false;
+  }
+  socket.state_ = State::kClosed;
+  socket.rtx_deadline_ns_ = 0;
+  RequestWakeLocked(socket);
+  auto it = connections_.find(ConnectionKeyOf(socket));
+  if (it != connections_.end() && it->second == &socket) {
+    connections_.erase(it);
+    UnrefLocked(socket);
+  }
+}
+
+void TCP::ResetConnectionLocked(Socket& socket) {
+  socket.is_reset_ = true;
+  CloseConnectionLocked(socket);
+}
+
+void TCP::UnlinkChildLocked(Socket& child) {
+  Socket& listener = *child.listener_;
+  for (Socket** p = &listener.children_; *p; p = &(*p)->next_child_) {
+    if (*p == &child) {
+      *p = child.next_child_;
+      break;
+    }
+  }
+  listener.num_of_children_--;
+  child.listener_ = nullptr;
+  child.next_child_ = nullptr;
+}
+
+void TCP::ArmRTXTimerLocked(Socket& socket, uint64_t deadline_ns) {
+  socket.rtx_deadline_ns_ = deadline_ns;
+  if (!deadline_ns || socket.is_rtx_timer_armed_)
+    return;
+  socket.is_rtx_timer_armed_ = true;
+  RefLocked(socket);
+  AddTimer(socket.rtx_timer_, deadline_ns);
+}
+
+void TCP::ArmDelayedACKTimerLocked(Socket& socket) {
+  if (socket.is_delayed_ack_timer_armed_)
+    return;
+  socket.is_delayed_ack_timer_armed_ = true;
+  RefLocked(socket);
+  AddTimer(socket.delayed_ack_timer_, NowNs() + kDelayedACKNs);
+}
+
+void TCP::HandleRTXTimer(Timer& timer) {
+  TCP& tcp = GetInstance();
+  Socket& socket = *reinterpret_cast<Socket*>(timer.GetData());
+  tcp.lock_.Lock();
+  socket.is_rtx_timer_armed_ = false;
+  const uint64_t deadline_ns = socket.rtx_deadline_ns_;
+  if (deadline_ns && socket.state_ != State::kClosed) {
+    if (NowNs() < deadline_ns) {
+      tcp.ArmRTXTimerLocked(socket, deadline_ns);
+    } else if (socket.state_ == State::kTimeWait ||
+               socket.state_ == State::kFinWait2) {
+      tcp.CloseConnectionLocked(socket);
+    } else {
+      tcp.RetransmitLocked(socket);
+    }
+  }
+  tcp.UnrefLocked(socket);
+  tcp.UnlockAndWake();
+}
+
+void TCP::HandleDelayedACKTimer(Timer& timer) {
+  TCP& tcp = GetInstance();
+  Socket& socket = *reinterpret_cast<Socket*>(timer.GetData());
+  tcp.lock_.Lock();
+  socket.is_delayed_ack_timer_armed_ = false;
+  if (socket.num_of_unacked_segments_ && IsSynchronized(socket.state_))
+    tcp.SendACKLocked(socket);
+  tcp.UnrefLocked(socket);
+  tcp.UnlockAndWake();
+}
+
+void TCP::EnterTimeWaitLocked(Socket& socket) {
+  socket.state_ = State::kTimeWait;
+  ArmRTXTimerLocked(socket, NowNs() + kTimeWaitNs);
+}
+
+uint16_t TCP::GetWindowToAdvertiseLocked(Socket& socket) {
+  // The right edge of the window never moves back since rx_buf_ shrinks only
+  // by the data which advances rcv_nxt_.
+  const uint32_t window = std::min<uint32_t>(socket.rx_buf_.GetFreeSize(),
+                                             0xFFFF);
+  socket.rcv_wnd_advertised_ = window;
+  return static_cast<uint16_t>(window);
+}
+
+void TCP::TransmitLocked(const SegmentInfo& info,
+                         const ByteRingBuffer* data,
+                         uint32_t data_offset,
+                         uint32_t data_size) {
+  NIC& nic = Network::GetInstance().GetNIC();
+  const uint32_t options_size = info.mss ? 4 : 0;
+  const uint32_t tcp_size = static_cast<uint32_t>(
+      sizeof(IPv4TCPPacket) - sizeof(Network::IPv4Packet) + options_size +
+      data_size);
+  IPv4TCPPacket& tcp = *nic.GetNextTXPacketBuf<IPv4TCPPacket*>(
+      sizeof(IPv4TCPPacket) + options_size + data_size);
+  // ip.eth
+  tcp.ip.eth.dst = info.dst_eth_addr;
+  tcp.ip.eth.src = nic.GetSelfEtherAddr();
+  tcp.ip.eth.SetEthType(Network::EtherFrame::kTypeIPv4);
+  // ip
+  tcp.ip.version_and_ihl =
+      0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
+  tcp.ip.dscp_and_ecn = 0;
+  tcp.ip.SetTotalLength(sizeof(Network::IPv4Packet) -
+                        sizeof(Network::EtherFrame) + tcp_size);
+  tcp.ip.ident = next_ip_ident_++;
+  tcp.ip.flags = 0x0040;  // Don't fragment
+  tcp.ip.ttl = 0xFF;
+  tcp.ip.protocol = Network::IPv4Packet::Protocol::kTCP;
+  tcp.ip.src_ip = nic.GetSelfIPv4Addr();
+  tcp.ip.dst_ip = info.dst_addr;
+  tcp.ip.CalcAndSetChecksum();
+  // tcp
+  tcp.SetSourcePort(info.src_port);
+  tcp.SetDestinationPort(info.dst_port);
+  tcp.SetSeq(info.seq);
+  tcp.SetAck(info.ack);
+  tcp.SetHeaderSize(sizeof(IPv4TCPPacket) - sizeof(Network::IPv4Packet) +
+                    options_size);
+  tcp.flags = info.flags;
+  tcp.SetWindow(info.window);
+  tcp.csum.Clear();
+  tcp.urgent_pointer[0] = 0;
+  tcp.urgent_pointer[1] = 0;
+  uint8_t* options = tcp.GetOptions();
+  if (info.mss) {
+    options[0] = IPv4TCPPacket::kOptionMSS;
+    options[1] = 4;
+    options[2] = info.mss >> 8;
+    options[3] = info.mss & 0xFF;
+  }
+  if (data_size)
+    data->Peek(data_offset, options + options_size, data_size);
+  if (nic.CanOffloadTXChecksum()) {
+    tcp.csum = Network::CalcPseudoHeaderChecksum(
+        tcp.ip.src_ip, tcp.ip.dst_ip, Network::IPv4Packet::Protocol::kTCP,
+        static_cast<uint16_t>(tcp_size));
+    nic.SetTXChecksumOffload(
+        offsetof(IPv4TCPPacket, src_port),
+        offsetof(IPv4TCPPacket, csum) - offsetof(IPv4TCPPacket, src_port));
+    if (info.segment_size) {
+      nic.SetTXSegmentationOffload(NIC::kGSOTypeTCPv4,
+                                   sizeof(IPv4TCPPacket) + options_size,
+                                   info.segment_size);
+    }
+  } else {
+    assert(!info.segment_size);
+    tcp.csum = Network::CalcTCPChecksum(
+        &tcp, offsetof(IPv4TCPPacket, src_port),
+        offsetof(IPv4TCPPacket, src_port) + tcp_size, tcp.ip.src_ip,
+        tcp.ip.dst_ip);
+  }
+  nic.SendPacket();
+}
+
+void TCP::SendSegmentLocked(Socket& socket,
+                            uint32_t seq,
+                            uint8_t flags,
+                            uint32_t data_offset,
+                            uint32_t data_size) {
+  SegmentInfo info;
+  info.dst_eth_addr = socket.remote_eth_addr_;
+  info.dst_addr = socket.remote_addr_;
+  info.src_port = socket.local_port_;
+  info.dst_port = socket.remote_port_;
+  info.seq = seq;
+  info.ack = (flags & IPv4TCPPacket::kFlagACK) ? socket.rcv_nxt_ : 0;
+  info.flags = flags;
+  info.window = GetWindowToAdvertiseLocked(socket);
+  info.mss = (flags & IPv4TCPPacket::kFlagSYN) ? kMaxMSS : 0;
+  info.segment_size = data_size > socket.snd_mss_ ? socket.snd_mss_ : 0;
+  TransmitLocked(info, &socket.tx_buf_, data_offset, data_size);
+  socket.num_of_segments_sent_++;
+  if (flags & IPv4TCPPacket::kFlagACK)
+    socket.num_of_unacked_segments_ = 0;
+}
+
+void TCP::SendACKLocked(Socket& socket) {
+  SendSegmentLocked(socket, socket.snd_nxt_, IPv4TCPPacket::kFlagACK, 0, 0);
+}
+
+void TCP::SendWindowUpdateLocked(Socket& socket) {
+  // Avoids the silly window syndrome (RFC 1122 4.2.3.3): the window is
+  // announced again only when it opened by a full segment or half the
+  // buffer.
+  if (!IsSynchronized(socket.state_) || socket.fin_received_)
+    return;
+  const uint32_t advertised = socket.rcv_wnd_advertised_;
+  const uint32_t window = socket.rx_buf_.GetFreeSize();
+  if ((advertised < kMaxMSS && window >= kMaxMSS) ||
+      window - advertised >= kBufferSize / 2)
+    SendACKLocked(socket);
+}
+
+void TCP::OutputLocked(Socket& socket) {
+  const State state = socket.state_;
+  if (state != State::kEstablished && state != State::kCloseWait &&
+      state != State::kFinWait1 && state != State::kClosing &&
+      state != State::kLastAck)
+    return;
+  while (!IsFINSent(socket)) {
+    const uint32_t in_flight = socket.snd_nxt_ - socket.snd_una_;
+    const uint32_t unsent = socket.tx_buf_.GetSize() - in_flight;
+    const uint32_t usable =
+        socket.snd_wnd_ > in_flight ? socket.snd_wnd_ - in_flight : 0;
+    const uint32_t mss = socket.snd_mss_;
+    uint32_t size =
+        std::min(std::min(unsent, usable), GetMaxFrameDataSize(mss));
+    if (!size)
+      break;
+    // Only the last segment of the data can be smaller than an MSS.
+    if (size > mss && size != unsent)
+      size -= size % mss;
+    // Nagle's algorithm: a small segment waits until all data in flight is
+    // acknowledged, unless it is the last one before FIN.
+    if (size < mss && in_flight && !socket.no_delay_ &&
+        !socket.fin_queued_)
+      break;
+    uint8_t flags = IPv4TCPPacket::kFlagACK;
+    if (size == unsent)
+      flags |= IPv4TCPPacket::kFlagPSH;
+    SendSegmentLocked(socket, socket.snd_nxt_, flags, in_flight, size);
+    if (!socket.is_measuring_rtt_ && socket.snd_nxt_ == socket.snd_max_) {
+      socket.is_measuring_rtt_ = true;
+      socket.rtt_seq_ = socket.snd_nxt_;
+      socket.rtt_start_ns_ = NowNs();
+    }
+    socket.snd_nxt_ += size;
+    if (SeqLT(socket.snd_max_, socket.snd_nxt_))
+      socket.snd_max_ = socket.snd_nxt_;
+  }
+  if (socket.fin_queued_ && socket.snd_nxt_ == socket.fin_seq_) {
+    SendSegmentLocked(socket, socket.snd_nxt_,
+                      IPv4TCPPacket::kFlagFIN | IPv4TCPPacket::kFlagACK, 0, 0);
+    socket.snd_nxt_++;
+    if (SeqLT(socket.snd_max_, socket.snd_nxt_))
+      socket.snd_max_ = socket.snd_nxt_;
+  }
+  // The timer also probes a zero window when nothing is in flight.
+  const bool needs_timer =
+      socket.snd_una_ != socket.snd_max_ ||
+      (!socket.snd_wnd_ && GetSentDataSize(socket) < socket.tx_buf_.GetSize());
+  if (needs_timer && !socket.rtx_deadline_ns_)
+    ArmRTXTimerLocked(socket, NowNs() + socket.rto_ns_);
+}
+
+void TCP::RetransmitLocked(Socket& socket) {
+  const uint64_t now = NowNs();
+  socket.rtx_deadline_ns_ = 0;
+  if (socket.state_ == State::kSynSent ||
+      socket.state_ == State::kSynReceived) {
+    if (++socket.num_of_retransmits_ > kMaxRetransmits) {
+      socket.is_timed_out_ = true;
+      ResetConnectionLocked(socket);
+      return;
+    }
+    socket.rto_ns_ = std::min(socket.rto_ns_ * 2, kMaxRTONs);
+    socket.is_measuring_rtt_ = false;
+    socket.num_of_retransmitted_segments_++;
+    const uint8_t flags =
+        socket.state_ == State::kSynSent
+            ? IPv4TCPPacket::kFlagSYN
+            : IPv4TCPPacket::kFlagSYN | IPv4TCPPacket::kFlagACK;
+    SendSegmentLocked(socket, socket.iss_, flags, 0, 0);
+    ArmRTXTimerLocked(socket, now + socket.rto_ns_);
+    return;
+  }
+  if (!socket.snd_wnd_ && socket.tx_buf_.GetSize()) {
+    // Persist timer: probes the zero window with one byte. The connection is
+    // kept however long the peer keeps its window closed.
+    socket.rto_ns_ = std::min(socket.rto_ns_ * 2, kMaxRTONs);
+    SendSegmentLocked(socket, socket.snd_una_, IPv4TCPPacket::kFlagACK, 0, 1);
+    if (socket.snd_nxt_ == socket.snd_una_)
+      socket.snd_nxt_++;
+    if (SeqLT(socket.snd_max_, socket.snd_nxt_))
+      socket.snd_max_ = socket.snd_nxt_;
+    ArmRTXTimerLocked(socket, now + socket.rto_ns_);
+    return;
+  }
+  if (socket.snd_una_ == socket.snd_max_)
+    return;
+  if (++socket.num_of_retransmits_ > kMaxRetransmits) {
+    SendSegmentLocked(socket, socket.snd_nxt_,
+                      IPv4TCPPacket::kFlagRST | IPv4TCPPacket::kFlagACK, 0, 0);
+    socket.is_timed_out_ = true;
+    ResetConnectionLocked(socket);
+    return;
+  }
+  socket.rto_ns_ = std::min(socket.rto_ns_ * 2, kMaxRTONs);
+  // Karn's algorithm: retransmitted segments are not sampled.
+  socket.is_measuring_rtt_ = false;
+  socket.num_of_retransmitted_segments_++;
+  socket.snd_nxt_ = socket.snd_una_;
+  OutputLocked(socket);
+}
+
+void TCP::UpdateRTTLocked(Socket& socket, uint32_t ack) {
+  if (!socket.is_measuring_rtt_ || !SeqLT(socket.rtt_seq_, ack))
+    return;
+  socket.is_measuring_rtt_ = false;
+  const uint64_t rtt_ns = NowNs() - socket.rtt_start_ns_;
+  if (!socket.srtt_ns_) {
+    socket.srtt_ns_ = rtt_ns;
+    socket.rttvar_ns_ = rtt_ns / 2;
+  } else {
+    const uint64_t diff = socket.srtt_ns_ > rtt_ns ? socket.srtt_ns_ - rtt_ns
+                                                    : rtt_ns - socket.srtt_ns_;
+    socket.rttvar_ns_ = (socket.rttvar_ns_ * 3 + diff) / 4;
+    socket.srtt_ns_ = (socket.srtt_ns_ * 7 + rtt_ns) / 8;
+  }
+  const uint64_t rto_ns = socket.srtt_ns_ + socket.rttvar_ns_ * 4;
+  socket.rto_ns_ = std::min(std::max(rto_ns, kMinRTONs), kMaxRTONs);
+}
+
+void TCP::HandleACKLocked(Socket& socket,
+                          IPv4TCPPacket& tcp,
+                          uint32_t payload_size) {
+  const uint32_t seq = tcp.GetSeq();
+  const uint32_t ack = tcp.GetAck();
+  const uint16_t window = tcp.GetWindow();
+  if (SeqLT(socket.snd_una_, ack)) {
+    UpdateRTTLocked(socket, ack);
+    const uint32_t acked_data_size =
+        std::min(ack - socket.snd_una_, socket.tx_buf_.GetSize());
+    socket.tx_buf_.Discard(acked_data_size);
+    socket.snd_una_ = ack;
+    // Data sent before going back for retransmission may be acknowledged.
+    if (SeqLT(socket.snd_nxt_, ack))
+      socket.snd_nxt_ = ack;
+    socket.num_of_retransmits_ = 0;
+    socket.num_of_dup_acks_ = 0;
+    ArmRTXTimerLocked(socket, socket.snd_una_ != socket.snd_max_
+                                  ? NowNs() + socket.rto_ns_
+                                  : 0);
+    RequestWakeLocked(socket);
+  } else if (ack == socket.snd_una_ && !payload_size &&
+             window == socket.snd_wnd_ &&
+             socket.snd_una_ != socket.snd_max_) {
+    // Fast retransmit (RFC 5681 3.2) without congestion control.
+    if (++socket.num_of_dup_acks_ == 3) {
+      socket.is_measuring_rtt_ = false;
+      socket.num_of_retransmitted_segments_++;
+      socket.snd_nxt_ = socket.snd_una_;
+    }
+  }
+  if (SeqLT(socket.snd_wl1_, seq) ||
+      (socket.snd_wl1_ == seq && SeqLE(socket.snd_wl2_, ack))) {
+    socket.snd_wnd_ = window;
+    socket.snd_wl1_ = seq;
+    socket.snd_wl2_ = ack;
+  }
+}
+
+void TCP::HandleListenLocked(Socket& listener,
+                             IPv4TCPPacket& tcp,
+                             uint16_t peer_mss) {
+  const uint8_t flags = tcp.flags;
+  if (flags & IPv4TCPPacket::kFlagRST)
+    return;
+  if (flags & IPv4TCPPacket::kFlagACK) {
+    SendResetForSegmentLocked(tcp, 0);
+    return;
+  }
+  if (!(flags & IPv4TCPPacket::kFlagSYN))
+    return;
+  if (listener.num_of_children_ >= listener.backlog_) {
+    // The peer sends SYN again later.
+    num_of_segments_dropped_++;
+    return;
+  }
+  Socket& child = *AllocSocketLocked(listener.pid_);
+  child.local_port_ = listener.local_port_;
+  child.remote_port_ = tcp.GetSourcePort();
+  child.remote_addr_ = tcp.ip.src_ip;
+  child.remote_eth_addr_ = tcp.ip.eth.src;
+  child.no_delay_ = listener.no_delay_;
+  child.rcv_nxt_ = tcp.GetSeq() + 1;
+  child.iss_ = GenerateISS(child);
+  child.snd_una_ = child.iss_;
+  child.snd_nxt_ = child.iss_ + 1;
+  child.snd_max_ = child.snd_nxt_;
+  child.snd_wnd_ = tcp.GetWindow();
+  child.snd_wl1_ = tcp.GetSeq();
+  child.snd_mss_ = peer_mss;
+  child.state_ = State::kSynReceived;
+  child.num_of_segments_received_++;
+  // Appended so that connections are accepted in the order of arrival.
+  Socket** tail = &listener.children_;
+  while (*tail)
+    tail = &(*tail)->next_child_;
+  *tail = &child;
+  child.listener_ = &listener;
+  listener.num_of_children_++;
+  InsertConnectionLocked(child);
+  SendSegmentLocked(child, child.iss_,
+                    IPv4TCPPacket::kFlagSYN | IPv4TCPPacket::kFlagACK, 0, 0);
+  ArmRTXTimerLocked(child, NowNs() + child.rto_ns_);
+}
+
+void TCP::HandleSynSentLocked(Socket& socket,
+                              IPv4TCPPacket& tcp,
+                              uint16_t peer_mss) {
+  const uint8_t flags = tcp.flags;
+  const uint32_t ack = tcp.GetAck();
+  if ((flags & IPv4TCPPacket::kFlagACK) && ack != socket.iss_ + 1) {
+    if (!(flags & IPv4TCPPacket::kFlagRST))
+      SendResetForSegmentLocked(tcp, 0);
+    return;
+  }
+  if (flags & IPv4TCPPacket::kFlagRST) {
+    // Connection refused
+    if (flags & IPv4TCPPacket::kFlagACK)
+      ResetConnectionLocked(socket);
+    return;
+  }
+  if (!(flags & IPv4TCPPacket::kFlagSYN))
+    return;
+  socket.rcv_nxt_ = tcp.GetSeq() + 1;
+  socket.snd_mss_ = peer_mss;
+  socket.snd_wnd_ = tcp.GetWindow();
+  socket.snd_wl1_ = tcp.GetSeq();
+  socket.snd_wl2_ = ack;
+  if (!(flags & IPv4TCPPacket::kFlagACK)) {
+    // Simultaneous open
+    socket.state_ = State::kSynReceived;
+    SendSegmentLocked(socket, socket.iss_,
+                      IPv4TCPPacket::kFlagSYN | IPv4TCPPacket::kFlagACK, 0, 0);
+    return;
+  }
+  UpdateRTTLocked(socket, ack);
+  socket.snd_una_ = ack;
+  socket.state_ = State::kEstablished;
+  socket.num_of_retransmits_ = 0;
+  socket.rtx_deadline_ns_ = 0;
+  SendACKLocked(socket);
+  RequestWakeLocked(socket);
+}
+
+void TCP::HandleSynchronizedLocked(Socket& socket,
+                                   IPv4TCPPacket& tcp,
+                                   uint8_t* payload,
+                                   uint32_t payload_size) {
+  const uint8_t flags = tcp.flags;
+  const uint32_t seq = tcp.GetSeq();
+  // 1. Is the segment in the receive window? (RFC 793 p69)
+  const uint32_t segment_size =
+      payload_size + ((flags & IPv4TCPPacket::kFlagSYN) ? 1 : 0) +
+      ((flags & IPv4TCPPacket::kFlagFIN) ? 1 : 0);
+  const uint32_t window = socket.rx_buf_.GetFreeSize();
+  const uint32_t window_end = socket.rcv_nxt_ + window;
+  const uint32_t last = seq + segment_size - 1;
+  bool is_acceptable;
+  if (!segment_size) {
+    is_acceptable = window ? SeqLE(socket.rcv_nxt_, seq) &&
+                                 SeqLT(seq, window_end)
+                           : seq == socket.rcv_nxt_;
+  } else {
+    is_acceptable =
+        window &&
+        ((SeqLE(socket.rcv_nxt_, seq) && SeqLT(seq, window_end)) ||
+         (SeqLE(socket.rcv_nxt_, last) && SeqLT(last, window_end)));
+  }
+  if (!is_acceptable) {
+    if (flags & IPv4TCPPacket::kFlagRST)
+      return;
+    // Includes FIN sent again in TIME-WAIT since our ACK was lost.
+    SendACKLocked(socket);
+    if (socket.state_ == State::kTimeWait &&
+        (flags & IPv4TCPPacket::kFlagFIN))
+      EnterTimeWaitLocked(socket);
+    return;
+  }
+  // 2. RST. Only the exact one resets the connection (RFC 5961 3.2).
+  if (flags & IPv4TCPPacket::kFlagRST) {
+    if (seq == socket.rcv_nxt_)
+      ResetConnectionLocked(socket);
+    else
+      SendACKLocked(socket);
+    return;
+  }
+  // 4. SYN in the window (RFC 5961 4.2)
+  if (flags & IPv4TCPPacket::kFlagSYN) {
+    SendACKLocked(socket);
+    return;
+  }
+  // 5. ACK
+  if (!(flags & IPv4TCPPacket::kFlagACK))
+    return;
+  const uint32_t ack = tcp.GetAck();
+  if (socket.state_ == State::kSynReceived) {
+    if (!SeqLT(socket.snd_una_, ack) || SeqLT(socket.snd_max_, ack)) {
+      SendResetForSegmentLocked(tcp, payload_size);
+      return;
+    }
+    socket.snd_una_ = socket.iss_ + 1;
+    socket.state_ = State::kEstablished;
+    socket.num_of_retransmits_ = 0;
+    socket.rtx_deadline_ns_ = 0;
+    socket.snd_wnd_ = tcp.GetWindow();
+    socket.snd_wl1_ = seq;
+    socket.snd_wl2_ = ack;
+    if (socket.listener_)
+      RequestWakeLocked(*socket.listener_);
+    RequestWakeLocked(socket);
+  }
+  if (SeqLT(socket.snd_max_, ack)) {
+    // Acknowledges data which is not sent yet.
+    SendACKLocked(socket);
+    return;
+  }
+  HandleACKLocked(socket, tcp, payload_size);
+  const bool is_fin_acked =
+      socket.fin_queued_ && SeqLT(socket.fin_seq_, socket.snd_una_);
+  if (is_fin_acked) {
+    if (socket.state_ == State::kFinWait1) {
+      socket.state_ = State::kFinWait2;
+      if (socket.is_closed_by_user_)
+        ArmRTXTimerLocked(socket, NowNs() + kFinWait2TimeoutNs);
+    } else if (socket.state_ == State::kClosing) {
+      EnterTimeWaitLocked(socket);
+    } else if (socket.state_ == State::kLastAck) {
+      CloseConnectionLocked(socket);
+      return;
+    }
+  }
+  // 7. Data. Segments after a hole are dropped, and the duplicate ACK for
+  // them makes the peer send the hole again.
+  const State state = socket.state_;
+  const bool can_receive = state == State::kEstablished ||
+                           state == State::kFinWait1 ||
+                           state == State::kFinWait2;
+  bool should_ack_now = false;
+  if (payload_size && can_receive) {
+    if (SeqLT(socket.rcv_nxt_, seq)) {
+      should_ack_now = true;
+    } else {
+      const uint32_t offset = socket.rcv_nxt_ - seq;
+      if (offset < payload_size) {
+        const uint32_t size =
+            socket.rx_buf_.Write(payload + offset, payload_size - offset);
+        socket.rcv_nxt_ += size;
+        socket.num_of_unacked_segments_++;
+        if (size < payload_size - offset)
+          should_ack_now = true;
+        RequestWakeLocked(socket);
+      } else {
+        should_ack_now = true;
+      }
+    }
+  }
+  // 8. FIN, which is processed only after all data before it.
+  if ((flags & IPv4TCPPacket::kFlagFIN) && can_receive &&
+      seq + payload_size == socket.rcv_nxt_) {
+    socket.rcv_nxt_++;
+    socket.fin_received_ = true;
+    should_ack_now = true;
+    RequestWakeLocked(socket);
+    if (state == State::kEstablished) {
+      socket.state_ = State::kCloseWait;
+    } else if (state == State::kFinWait1) {
+      if (is_fin_acked)
+        EnterTimeWaitLocked(socket);
+      else
+        socket.state_ = State::kClosing;
+    } else {
+      EnterTimeWaitLocked(socket);
+    }
+  }
+  // Delayed ACK (RFC 1122 4.2.3.2): every second segment is acknowledged
+  // at once.
+  if (should_ack_now || socket.num_of_unacked_segments_ >= 2)
+    SendACKLocked(socket);
+  else if (socket.num_of_unacked_segments_)
+    ArmDelayedACKTimerLocked(socket);
+  OutputLocked(socket);
+}
+
+void TCP::SendResetForSegmentLocked(IPv4TCPPacket& tcp,
+                                    uint32_t payload_size) {
+  SegmentInfo info;
+  info.dst_eth_addr = tcp.ip.eth.src;
+  info.dst_addr = tcp.ip.src_ip;
+  info.src_port = tcp.GetDestinationPort();
+  info.dst_port = tcp.GetSourcePort();
+  info.window = 0;
+  info.mss = 0;
+  info.segment_size = 0;
+  if (tcp.flags & IPv4TCPPacket::kFlagACK) {
+    info.seq = tcp.GetAck();
+    info.ack = 0;
+    info.flags = IPv4TCPPacket::kFlagRST;
+  } else {
+    info.seq = 0;
+    info.ack = tcp.GetSeq() + payload_size +
+               ((tcp.flags & IPv4TCPPacket::kFlagSYN) ? 1 : 0) +
+               ((tcp.flags & IPv4TCPPacket::kFlagFIN) ? 1 : 0);
+    info.flags = IPv4TCPPacket::kFlagRST | IPv4TCPPacket::kFlagACK;
+  }
+  TransmitLocked(info, nullptr, 0, 0);
+  num_of_resets_sent_++;
+}
+
+void TCP::HandleSegment(PacketBuffer& pbuf) {
+  using EtherFrame = Network::EtherFrame;
+  using IPv4Packet = Network::IPv4Packet;
+  constexpr size_t kIPHeaderSize = sizeof(IPv4Packet) - sizeof(EtherFrame);
+  constexpr size_t kTCPHeaderOffset = offsetof(IPv4TCPPacket, src_port);
+  if (pbuf.GetSize() < sizeof(IPv4TCPPacket))
+    return;
+  IPv4TCPPacket& tcp = *reinterpret_cast<IPv4TCPPacket*>(pbuf.GetData());
+  // IP options and fragments are not supported.
+  if (tcp.ip.version_and_ihl != 0x45)
+    return;
+  const size_t ip_size = tcp.ip.GetTotalLength();
+  const size_t header_size = tcp.GetHeaderSize();
+  if (sizeof(EtherFrame) + ip_size > pbuf.GetSize() ||
+      ip_size < kIPHeaderSize + header_size ||
+      header_size < sizeof(IPv4TCPPacket) - kTCPHeaderOffset)
+    return;
+  if (!tcp.ip.dst_ip.IsEqualTo(
+          Network::GetInstance().GetNIC().GetSelfIPv4Addr()))
+    return;
+  const size_t tcp_size = ip_size - kIPHeaderSize;
+  if (!pbuf.IsChecksumValid()) {
+    Network::InternetChecksum csum = Network::CalcTCPChecksum(
+        &tcp, kTCPHeaderOffset, kTCPHeaderOffset + tcp_size, tcp.ip.src_ip,
+        tcp.ip.dst_ip);
+    if (!csum.IsEqualTo({0, 0}))
+      return;
+  }
+  uint8_t* payload =
+      reinterpret_cast<uint8_t*>(&tcp) + kTCPHeaderOffset + header_size;
+  const uint32_t payload_size = static_cast<uint32_t>(tcp_size - header_size);
+  uint16_t peer_mss = kDefaultMSS;
+  if (tcp.flags & IPv4TCPPacket::kFlagSYN) {
+    const uint8_t* options = tcp.GetOptions();
+    const uint8_t* options_end = payload;
+    while (options < options_end && *options != IPv4TCPPacket::kOptionEnd) {
+      if (*options == IPv4TCPPacket::kOptionNop) {
+        options++;
+        continue;
+      }
+      if (options + 2 > options_end || options[1] < 2 ||
+          options + options[1] > options_end)
+        break;
+      if (options[0] == IPv4TCPPacket::kOptionMSS && options[1] == 4)
+        peer_mss = static_cast<uint16_t>(options[2]) << 8 | options[3];
+      options += options[1];
+    }
+    peer_mss = std::min(std::max<uint16_t>(peer_mss, 64), kMaxMSS);
+  }
+
+  lock_.Lock();
+  auto it = connections_.find(ConnectionKey(
+      tcp.GetDestinationPort(), tcp.ip.src_ip, tcp.GetSourcePort()));
+  if (it != connections_.end()) {
+    Socket& socket = *it->second;
+    socket.num_of_segments_received_++;
+    if (socket.state_ == State::kSynSent)
+      HandleSynSentLocked(socket, tcp, peer_mss);
+    else
+      HandleSynchronizedLocked(socket, tcp, payload, payload_size);
+  } else {
+    auto listener_it = sockets_by_port_.find(tcp.GetDestinationPort());
+    if (listener_it != sockets_by_port_.end() &&
+        listener_it->second->state_ == State::kListen) {
+      HandleListenLocked(*listener_it->second, tcp, peer_mss);
+    } else {
+      num_of_segments_dropped_++;
+      if (!(tcp.flags & IPv4TCPPacket::kFlagRST))
+        SendResetForSegmentLocked(tcp, payload_size);
+    }
+  }
+  UnlockAndWake();
+}
+
+TCP::Socket* TCP::CreateSocket(uint64_t pid) {
+  lock_.Lock();
+  Socket* socket = AllocSocketLocked(pid);
+  RefLocked(*socket);
+  UnlockAndWake();
+  return socket;
+}
+
+bool TCP::Bind(Socket& socket, uint16_t port) {
+  lock_.Lock();
+  const bool failed = socket.owns_port_ || socket.state_ != State::kClosed ||
+                      AllocPortLocked(socket, port);
+  UnlockAndWake();
+  return failed;
+}
+
+bool TCP::Listen(Socket& socket, int backlog) {
+  lock_.Lock();
+  bool failed = socket.state_ != State::kClosed || socket.is_reset_ ||
+                (!socket.owns_port_ && AllocPortLocked(socket, 0));
+  if (!failed) {
+    socket.state_ = State::kListen;
+    socket.backlog_ = std::min(std::max(backlog, 1), kMaxBacklog);
+  }
+  UnlockAndWake();
+  return failed;
+}
+
+bool TCP::CanAcceptLocked(Socket& listener) {
+  if (listener.state_ != State::kListen)
+    return true;
+  for (Socket* child = listener.children_; child; child = child->next_child_) {
+    if (child->state_ != State::kSynReceived)
+      return true;
+  }
+  return false;
+}
+
+TCP::Socket* TCP::Accept(Socket& listener,
+                        uint64_t deadline_ns,
+                        bool& would_block) {
+  would_block = false;
+  for (;;) {
+    lock_.Lock();
+    if (listener.state_ != State::kListen) {
+      UnlockAndWake();
+      return nullptr;
+    }
+    for (Socket* child = listener.children_; child;
+         child = child->next_child_) {
+      if (child->state_ == State::kSynReceived)
+        continue;
+      UnlinkChildLocked(*child);
+      RefLocked(*child);
+      UnlockAndWake();
+      // Inherits the options of the listener, as Linux does.
+      child->rx_timeout_ns_ = listener.rx_timeout_ns_;
+      child->tx_timeout_ns_ = listener.tx_timeout_ns_;
+      return child;
+    }
+    UnlockAndWake();
+    auto can_accept = [this, &listener] {
+      lock_.Lock();
+      const bool can_accept = CanAcceptLocked(listener);
+      lock_.Unlock();
+      return can_accept;
+    };
+    if (!WaitUntilOrDeadline(listener.wait_queue_, deadline_ns, can_accept)) {
+      would_block = true;
+      return nullptr;
+    }
+  }
+}
+
+TCP::ConnectResult TCP::Connect(Socket& socket,
+                                Network::IPv4Addr remote_addr,
+                                uint16_t remote_port,
+                                Network::EtherAddr remote_eth_addr,
+                                uint64_t deadline_ns) {
+  lock_.Lock();
+  const bool is_started = socket.state_ != State::kClosed &&
+                          socket.state_ != State::kListen &&
+                          socket.remote_addr_ == remote_addr &&
+                          socket.remote_port_ == remote_port;
+  if (!is_started) {
+    if (socket.state_ != State::kClosed || socket.is_reset_ ||
+        (!socket.owns_port_ && AllocPortLocked(socket, 0)) ||
+        connections_.count(
+            ConnectionKey(socket.local_port_, remote_addr, remote_port))) {
+      UnlockAndWake();
+      return ConnectResult::kFailed;
+    }
+    socket.remote_addr_ = remote_addr;
+    socket.remote_port_ = remote_port;
+    socket.remote_eth_addr_ = remote_eth_addr;
+    socket.iss_ = GenerateISS(socket);
+    socket.snd_una_ = socket.iss_;
+    socket.snd_nxt_ = socket.iss_ + 1;
+    socket.snd_max_ = socket.snd_nxt_;
+    socket.state_ = State::kSynSent;
+    InsertConnectionLocked(socket);
+    SendSegmentLocked(socket, socket.iss_, IPv4TCPPacket::kFlagSYN, 0, 0);
+    socket.is_measuring_rtt_ = true;
+    socket.rtt_seq_ = socket.iss_;
+    socket.rtt_start_ns_ = NowNs();
+    ArmRTXTimerLocked(socket, NowNs() + socket.rto_ns_);
+  }
+  UnlockAndWake();
+  auto is_done = [this, &socket] {
+    lock_.Lock();
+    const bool is_done = socket.state_ != State::kSynSent &&
+                         socket.state_ != State::kSynReceived;
+    lock_.Unlock();
+    return is_done;
+  };
+  if (!is_done() &&
+      !WaitUntilOrDeadline(socket.wait_queue_, deadline_ns, is_done))
+    return ConnectResult::kInProgress;
+  lock_.Lock();
+  const bool failed = socket.state_ != State::kEstablished &&
+                      socket.state_ != State::kCloseWait;
+  UnlockAndWake();
+  return failed ? ConnectResult::kFailed : ConnectResult::kConnected;
+}
+
+ssize_t TCP::Send(Socket& socket,
+                  const void* buf,
+                  size_t size,
+                  uint64_t deadline_ns) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+  size_t sent = 0;
+  for (;;) {
+    lock_.Lock();
+    if (socket.is_reset_ || socket.fin_queued_ ||
+        (socket.state_ != State::kEstablished &&
+         socket.state_ != State::kCloseWait)) {
+      UnlockAndWake();
+      return sent ? sent : -1;
+    }
+    sent += socket.tx_buf_.Write(
+        p + sent, static_cast<uint32_t>(std::min<size_t>(size - sent,
+                                                         kBufferSize)));
+    OutputLocked(socket);
+    UnlockAndWake();
+    if (sent == size)
+      return sent;
+    auto can_send = [this, &socket] {
+      lock_.Lock();
+      const bool can_send = socket.tx_buf_.GetFreeSize() ||
+                            (socket.state_ != State::kEstablished &&
+                             socket.state_ != State::kCloseWait);
+      lock_.Unlock();
+      return can_send;
+    };
+    if (!WaitUntilOrDeadline(socket.wait_queue_, deadline_ns, can_send))
+      return sent ? sent : kErrorWouldBlock;
+  }
+}
+
+ssize_t TCP::Receive(Socket& socket,
+                     void* buf,
+                     size_t size,
+                     uint64_t deadline_ns) {
+  for (;;) {
+    lock_.Lock();
+    if (socket.rx_buf_.GetSize()) {
+      const uint32_t read_size = socket.rx_buf_.Read(
+          buf, static_cast<uint32_t>(std::min<size_t>(size, kBufferSize)));
+      SendWindowUpdateLocked(socket);
+      UnlockAndWake();
+      return read_size;
+    }
+    const State state = socket.state_;
+    if (socket.is_reset_ || (!socket.fin_received_ &&
+                             state != State::kEstablished &&
+                             state != State::kFinWait1 &&
+                             state != State::kFinWait2)) {
+      UnlockAndWake();
+      return -1;
+    }
+    if (socket.fin_received_) {
+      UnlockAndWake();
+      return 0;
+    }
+    UnlockAndWake();
+    auto is_ready = [this, &socket] {
+      lock_.Lock();
+      const bool is_ready = socket.rx_buf_.GetSize() || socket.is_reset_ ||
+                            socket.fin_received_ ||
+                            socket.state_ == State::kClosed;
+      lock_.Unlock();
+      return is_ready;
+    };
+    if (!WaitUntilOrDeadline(socket.wait_queue_, deadline_ns, is_ready))
+      return kErrorWouldBlock;
+  }
+}
+
+bool TCP::HasTimedOut(Socket& socket) {
+  lock_.Lock();
+  const bool has_timed_out = socket.is_timed_out_;
+  lock_.Unlock();
+  return has_timed_out;
+}
+
+void TCP::SetNoDelay(Socket& socket, bool no_delay) {
+  lock_.Lock();
+  socket.no_delay_ = no_delay;
+  if (no_delay)
+    OutputLocked(socket);
+  UnlockAndWake();
+}
+
+uint16_t TCP::GetPollEvents(Socket& socket) {
+  lock_.Lock();
+  uint16_t events = 0;
+  const State state = socket.state_;
+  if (state == State::kListen) {
+    if (CanAcceptLocked(socket))
+      events |= kPollIn;
+    lock_.Unlock();
+    return events;
+  }
+  // Same conditions as the ones which Receive() and Send() wait for.
+  if (socket.rx_buf_.GetSize() || socket.is_reset_ || socket.fin_received_ ||
+      state == State::kClosed)
+    events |= kPollIn;
+  if (!socket.is_reset_ && !socket.fin_queued_ &&
+      (state == State::kEstablished || state == State::kCloseWait) &&
+      socket.tx_buf_.GetFreeSize())
+    events |= kPollOut;
+  if (socket.is_reset_)
+    events |= kPollErr;
+  if (socket.is_reset_ || state == State::kClosed ||
+      (socket.fin_received_ && socket.fin_queued_))
+    events |= kPollHup;
+  lock_.Unlock();
+  return events;
+}
+
+void TCP::Close(Socket& socket) {
+  lock_.Lock();
+  socket.is_closed_by_user_ = true;
+  switch (socket.state_) {
+    case State::kEstablished:
+    case State::kCloseWait:
+      socket.state_ = socket.state_ == State::kEstablished ? State::kFinWait1
+                                                           : State::kLastAck;
+      socket.fin_queued_ = true;
+      socket.fin_seq_ = socket.snd_una_ + socket.tx_buf_.GetSize();
+      OutputLocked(socket);
+      break;
+    case State::kClosed:
+    case State::kListen:
+    case State::kSynSent:
+    case State::kSynReceived:
+      CloseConnectionLocked(socket);
+      break;
+    default:
+      break;
+  }
+  UnrefLocked(socket);
+  UnlockAndWake();
+}
+
+void TCP::PrintSockets() {
+  static const char* kStateNames[] = {
+      "CLOSED",     "LISTEN",     "SYN-SENT",   "SYN-RECEIVED",
+      "ESTABLISHED", "FIN-WAIT-1", "FIN-WAIT-2", "CLOSE-WAIT",
+      "CLOSING",    "LAST-ACK",   "TIME-WAIT"};
+  lock_.Lock();
+  for (auto it : sockets_) {
+    const Network::IPv4Addr& addr = it->remote_addr_;
+    kprintf(
+        "pid %lu tcp port %u -> %u.%u.%u.%u:%u %s: tx %u, rx %u, sent %lu, "
+        "received %lu, retransmitted %lu, rto %lu ms\n",
+        it->pid_, it->local_port_, addr.addr[0], addr.addr[1], addr.addr[2],
+        addr.addr[3], it->remote_port_,
+        kStateNames[static_cast<int>(it->state_)], it->tx_buf_.GetSize(),
+        it->rx_buf_.GetSize(), it->num_of_segments_sent_,
+        it->num_of_segments_received_, it->num_of_retransmitted_segments_,
+        it->rto_ns_ / 1'000'000);
+  }
+  kprintf("tcp segments dropped: %lu, resets sent: %lu\n",
+          num_of_segments_dropped_, num_of_resets_sent_);
+  lock_.Unlock();
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "generic.h"
+#include "network.h"
+#include "packet_buffer.h"
+#include "poll.h"
+#include "ring_buffer.h"
+#include "slab_allocator.h"
+#include "spin_lock.h"
+#include "timer.h"
+#include "timer_wheel.h"
+#include "wait_queue.h"
+
+// TCP (RFC 793) with the retransmission timer of RFC 6298, delayed ACKs
+// (RFC 1122) and Nagle's algorithm (RFC 896).
+// Received segments are processed in the network bottom half
+// (NetworkManager @network.cc), and timers in the timer interrupt handler.
+// Out-of-order segments are dropped, and lost data is sent again go-back-N
+// from the oldest unacknowledged byte. The amount of data in flight is
+// limited only by the window of the peer; there is no congestion control.
+class TCP {
+ public:
+  enum class State {
+    kClosed,
+    kListen,
+    kSynSent,
+    kSynReceived,
+    kEstablished,
+    kFinWait1,
+    kFinWait2,
+    kCloseWait,
+    kClosing,
+    kLastAck,
+    kTimeWait,
+  };
+  static constexpr uint32_t kBufferSize = 16 * 1024;
+  // Assumed when the peer does not tell its MSS (RFC 1122 4.2.2.6).
+  static constexpr uint16_t kDefaultMSS = 536;
+  // For Ethernet without IP and TCP options.
+  static constexpr uint16_t kMaxMSS = 1460;
+  static constexpr int kMaxBacklog = 16;
+  static constexpr uint64_t kInitialRTONs = 1'000'000'000;
+  static constexpr uint64_t kMinRTONs = 200'000'000;
+  static constexpr uint64_t kMaxRTONs = 60'000'000'000;
+  static constexpr int kMaxRetransmits = 8;
+  static constexpr uint64_t kDelayedACKNs = 40'000'000;
+  // Much shorter than 2 MSL of RFC 793 so that ports can be reused soon.
+  static constexpr uint64_t kTimeWaitNs = 2'000'000'000;
+  // Closed sockets waiting for FIN of the peer in FIN-WAIT-2 are dropped
+  // after this.
+  static constexpr uint64_t kFinWait2TimeoutNs = 60'000'000'000;
+  // Returned by Send() and Receive() when nothing could be done until the
+  // deadline.
+  static constexpr ssize_t kErrorWouldBlock = -2;
+  enum class ConnectResult {
+    kConnected,
+    kInProgress,  // Not established until the deadline.
+    kFailed,
+  };
+
+  // Transmission control block. Protected by the lock of TCP.
+  class Socket {
+   public:
+    Network::IPv4Addr GetRemoteAddr() const { return remote_addr_; }
+    uint16_t GetRemotePort() const { return remote_port_; }
+    PollNotifier& GetPollNotifier() { return poll_notifier_; }
+    // SO_RCVTIMEO and SO_SNDTIMEO. 0 waits forever. Only the owner process
+    // touches them, so they are not protected by the lock of TCP.
+    uint64_t GetRXTimeoutNs() const { return rx_timeout_ns_; }
+    void SetRXTimeoutNs(uint64_t ns) { rx_timeout_ns_ = ns; }
+    uint64_t GetTXTimeoutNs() const { return tx_timeout_ns_; }
+    void SetTXTimeoutNs(uint64_t ns) { tx_timeout_ns_ = ns; }
+    friend class TCP;
+
+   private:
+    Socket(uint64_t pid);
+
+    uint64_t pid_;  // Only for debugging.
+    State state_;
+    // Dropped when it reaches zero. Held by the file descriptor, the
+    // connection table, armed timers and pending wakeups.
+    int ref_count_;
+    bool is_closed_by_user_;
+    bool owns_port_;  // Accepted sockets share the port of the listener.
+    bool is_reset_;   // The connection was reset or timed out.
+    bool is_timed_out_;  // Retransmissions were not acknowledged.
+    bool no_delay_;   // Disables Nagle's algorithm.
+    uint64_t rx_timeout_ns_;
+    uint64_t tx_timeout_ns_;
+    uint16_t local_port_;
+    uint16_t remote_port_;
+    Network::IPv4Addr remote_addr_;
+    Network::EtherAddr remote_eth_addr_;  // Next hop.
+    // Send sequence variables (RFC 793 3.2)
+    uint32_t iss_;
+    uint32_t snd_una_;
+    uint32_t snd_nxt_;
+    uint32_t snd_max_;  // snd_nxt_ goes back to snd_una_ on retransmission.
+    uint32_t snd_wnd_;
+    uint32_t snd_wl1_;
+    uint32_t snd_wl2_;
+    uint16_t snd_mss_;
+    bool fin_queued_;  // Closed by the user. FIN follows the data.
+    uint32_t fin_seq_;  // Valid if fin_queued_.
+    int num_of_dup_acks_;
+    // Receive sequence variables
+    uint32_t rcv_nxt_;
+    uint32_t rcv_wnd_advertised_;
+    bool fin_received_;
+    int num_of_unacked_segments_;
+    // Round trip time (RFC 6298)
+    uint64_t srtt_ns_;
+    uint64_t rttvar_ns_;
+    uint64_t rto_ns_;
+    bool is_measuring_rtt_;
+    uint32_t rtt_seq_;
+    uint64_t rtt_start_ns_;
+    int num_of_retransmits_;
+    // Retransmission, persist and TIME-WAIT timer. Fires lazily: it is not
+    // cancelled, and re-armed on expiry if the deadline was moved later.
+    Timer rtx_timer_;
+    bool is_rtx_timer_armed_;
+    uint64_t rtx_deadline_ns_;  // 0 if not needed.
+    Timer delayed_ack_timer_;
+    bool is_delayed_ack_timer_armed_;
+    // tx_buf_ holds data from snd_una_, rx_buf_ data not read by the user.
+    ByteRingBuffer tx_buf_;
+    ByteRingBuffer rx_buf_;
+    // Listening sockets have connections not accepted yet as children.
+    Socket* listener_;
+    Socket* next_child_;
+    Socket* children_;
+    int num_of_children_;
+    int backlog_;
+    Socket* next_to_wake_;
+    bool is_wake_pending_;
+    // Readers, writers and waiters for connection state changes.
+    WaitQueue wait_queue_;
+    // Notified on the same occasions as wait_queue_.
+    PollNotifier poll_notifier_;
+    // Statistics
+    uint64_t num_of_segments_sent_;
+    uint64_t num_of_segments_received_;
+    uint64_t num_of_retransmitted_segments_;
+  };
+
+  static TCP& GetInstance();
+  // Returns nullptr on failure. The caller owns the returned socket until
+  // it passes the socket to Close().
+  Socket* CreateSocket(uint64_t pid);
+  // port 0 allocates an ephemeral port. Returns true on failure.
+  bool Bind(Socket& socket, uint16_t port);
+  // Returns true on failure.
+  bool Listen(Socket& socket, int backlog);
+  // Blocking operations below wait until deadline_ns at most (@timer.h).
+  // Blocks until a connection is established. Returns nullptr on failure,
+  // with would_block set if none was established until deadline_ns.
+  Socket* Accept(Socket& listener, uint64_t deadline_ns, bool& would_block);
+  // Blocks until the connection is established. remote_eth_addr is the
+  // address of the next hop to remote_addr. Calling this again for the same
+  // peer waits for the connection started before.
+  ConnectResult Connect(Socket& socket,
+                        Network::IPv4Addr remote_addr,
+                        uint16_t remote_port,
+                        Network::EtherAddr remote_eth_addr,
+                        uint64_t deadline_ns);
+  // Blocks until all data is queued. Returns the size of queued data, -1 if
+  // the connection is not established, or kErrorWouldBlock if the buffer
+  // was full until deadline_ns.
+  ssize_t Send(Socket& socket,
+               const void* buf,
+               size_t size,
+               uint64_t deadline_ns);
+  // Blocks until some data is received. Returns 0 at the end of the stream,
+  // -1 if the connection is not established or reset, and kErrorWouldBlock
+  // if nothing was received until deadline_ns.
+  ssize_t Receive(Socket& socket, void* buf, size_t size, uint64_t deadline_ns);
+  // Returns true if the connection was dropped since the peer did not
+  // acknowledge retransmissions.
+  bool HasTimedOut(Socket& socket);
+  void SetNoDelay(Socket& socket, bool no_delay);
+  // Returns the events of poll(2) which socket has.
+  uint16_t GetPollEvents(Socket& socket);
+  // Releases the socket. The connection is closed in the background.
+  void Close(Socket& socket);
+  // Called for each received IPv4 packet of TCP.
+  void HandleSegment(PacketBuffer& pbuf);
+  void PrintSockets();
+
+ private:
+  static TCP* tcp_;
+
+  struct SegmentInfo {
+    Network::EtherAddr dst_eth_addr;
+    Network::IPv4Addr dst_addr;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+    uint16_t window;
+    uint16_t mss;  // Sent as an option if not 0.
+    // The data is split into segments of this size by the device if not 0.
+    uint16_t segment_size;
+  };
+
+  // Key of a connection in connections_.
+  static uint64_t ConnectionKey(uint16_t local_port,
+                                Network::IPv4Addr remote_addr,
+                                uint16_t remote_port) {
+    return static_cast<uint64_t>(
+               *reinterpret_cast<const uint32_t*>(remote_addr.addr))
+               << 32 |
+           static_cast<uint64_t>(remote_port) << 16 | local_port;
+  }
+  static uint64_t ConnectionKeyOf(const Socket& socket) {
+    return ConnectionKey(socket.local_port_, socket.remote_addr_,
+                         socket.remote_port_);
+  }
+  static void HandleRTXTimer(Timer& timer);
+  static void HandleDelayedACKTimer(Timer& timer);
+  static bool IsSynchronized(State state) {
+    return state != State::kClosed && state != State::kListen &&
+           state != State::kSynSent && state != State::kSynReceived;
+  }
+  // Larger than mss only if the device splits frames into segments.
+  static uint32_t GetMaxFrameDataSize(uint32_t mss);
+  static bool IsFINSent(const Socket& socket);
+  // The size of data sent from snd_una_, excluding FIN.
+  static uint32_t GetSentDataSize(const Socket& socket);
+  static uint32_t GenerateISS(const Socket& socket);
+
+  Socket* AllocSocketLocked(uint64_t pid);
+  void RefLocked(Socket& socket) { socket.ref_count_++; }
+  void UnrefLocked(Socket& socket);
+  // Wakes up the waiters of socket in UnlockAndWake().
+  void RequestWakeLocked(Socket& socket);
+  void UnlockAndWake();
+  bool AllocPortLocked(Socket& socket, uint16_t port);
+  void InsertConnectionLocked(Socket& socket);
+  // Moves socket to kClosed and drops it from the tables.
+  void CloseConnectionLocked(Socket& socket);
+  void ResetConnectionLocked(Socket& socket);
+  void UnlinkChildLocked(Socket& child);
+  void ArmRTXTimerLocked(Socket& socket, uint64_t deadline_ns);
+  void ArmDelayedACKTimerLocked(Socket& socket);
+  void EnterTimeWaitLocked(Socket& socket);
+  uint16_t GetWindowToAdvertiseLocked(Socket& socket);
+  // data is copied from offset bytes after the head of tx_buf_ if data_size
+  // is not 0.
+  void TransmitLocked(const SegmentInfo& info,
+                      const ByteRingBuffer* data,
+                      uint32_t data_offset,
+                      uint32_t data_size);
+  void SendSegmentLocked(Socket& socket,
+                         uint32_t seq,
+                         uint8_t flags,
+                         uint32_t data_offset,
+                         uint32_t data_size);
+  void SendACKLocked(Socket& socket);
+  void SendWindowUpdateLocked(Socket& socket);
+  // Sends queued data and FIN as far as the window and Nagle's algorithm
+  // allow.
+  void OutputLocked(Socket& socket);
+  void RetransmitLocked(Socket& socket);
+  void UpdateRTTLocked(Socket& socket, uint32_t ack);
+  void HandleACKLocked(Socket& socket,
+                       Network::IPv4TCPPacket& tcp,
+                       uint32_t payload_size);
+  void HandleListenLocked(Socket& listener,
+                          Network::IPv4TCPPacket& tcp,
+                          uint16_t peer_mss);
+  void HandleSynSentLocked(Socket& socket,
+                           Network::IPv4TCPPacket& tcp,
+                           uint16_t peer_mss);
+  void HandleSynchronizedLocked(Socket& socket,
+                                Network::IPv4TCPPacket& tcp,
+                                uint8_t* payload,
+                                uint32_t payload_size);
+  void SendResetForSegmentLocked(Network::IPv4TCPPacket& tcp,
+                                 uint32_t payload_size);
+  bool CanAcceptLocked(Socket& listener);
+
+  using ConnectionMap = std::unordered_map<
+      uint64_t,
+      Socket*,
+      std::hash<uint64_t>,
+      std::equal_to<uint64_t>,
+      KernelObjectSTLAllocator<std::pair<const uint64_t, Socket*>>>;
+  using PortMap = std::unordered_map<
+      uint16_t,
+      Socket*,
+      std::hash<uint16_t>,
+      std::equal_to<uint16_t>,
+      KernelObjectSTLAllocator<std::pair<const uint16_t, Socket*>>>;
+
+  ConnectionMap connections_;
+  // Sockets which own their local port, including listeners.
+  PortMap sockets_by_port_;
+  std::vector<Socket*, KernelObjectSTLAllocator<Socket*>> sockets_;
+  Socket* wake_list_;
+  uint16_t next_ephemeral_port_;
+  uint16_t next_ip_ident_;
+  uint64_t num_of_segments_dropped_;
+  uint64_t num_of_resets_sent_;
+  SpinLock lock_;
+
+  TCP()
+      : wake_list_(nullptr),
+        next_ephemeral_port_(Network::kEphemeralPortFirst),
+        next_ip_ident_(0),
+        num_of_segments_dropped_(0),
+        num_of_resets_sent_(0){};
+};
@@ -0,0 +1,163 @@
+#include "timer.h"
+
+#include "clock_source.h"
+#include "liumos.h"
+#include "scheduler.h"
+
+constexpr uint64_t kDefaultTimeSliceMs = 100;
+// Upper bound of an interval programmed at once. Longer deadlines are
+// reached by programming the timer again when it fires.
+constexpr uint64_t kMaxTimerIntervalNs = 1'000'000'000;
+
+struct TimerState {
+  TimerWheel wheel;
+  uint64_t time_slice_end = 0;
+  uint64_t armed_deadline = kNoDeadline;
+  uint64_t num_of_timer_interrupts = 0;
+  uint64_t num_of_reschedule_interrupts = 0;
+};
+
+static TimerState timer_states_[kMaxNumOfCPUs];
+static uint64_t lapic_timer_count_per_ms_;
+
+static void CalibrateLocalAPICTimer(LocalAPIC& lapic) {
+  // All local APIC timers are driven by the same bus clock, so measuring on
+  // the BSP is enough. Interrupts are not enabled yet, so spin.
+  constexpr uint64_t kMeasurementMs = 10;
+  constexpr uint32_t kInitialCount = 0xFFFF'FFFF;
+  lapic.StartTimer(kInitialCount, kTimerVector, false);
+  const uint64_t end = NowNs() + kMeasurementMs * 1'000'000;
+  while (NowNs() < end) {
+    asm volatile("pause");
+  }
+  const uint32_t elapsed = kInitialCount - lapic.ReadTimerCurrentCount();
+  lapic.StopTimer();
+  lapic_timer_count_per_ms_ = elapsed / kMeasurementMs;
+  PutStringAndHex("LocalAPIC timer count per ms", lapic_timer_count_per_ms_);
+}
+
+void InitTimer() {
+  SetTimeSliceMicroSecond(kDefaultTimeSliceMs * 1000);
+  CalibrateLocalAPICTimer(GetCPU(0).local_apic);
+}
+
+void HandleTimerInterrupt() {
+  TimerState& ts = timer_states_[GetCurrentCPUIndex()];
+  ts.num_of_timer_interrupts++;
+  ts.armed_deadline = kNoDeadline;
+  ts.wheel.Advance(NowNs());
+}
+
+void HandleRescheduleInterrupt() {
+  timer_states_[GetCurrentCPUIndex()].num_of_reschedule_interrupts++;
+}
+
+static uint32_t NsToLocalAPICTimerCount(uint64_t ns) {
+  if (ns > kMaxTimerIntervalNs)
+    ns = kMaxTimerIntervalNs;
+  const uint64_t lapic_count = ns * lapic_timer_count_per_ms_ / 1'000'000;
+  // 0 stops the timer.
+  if (lapic_count == 0)
+    return 1;
+  if (lapic_count > 0xFFFF'FFFFULL)
+    return 0xFFFF'FFFF;
+  return static_cast<uint32_t>(lapic_count);
+}
+
+static void ArmTimer(int cpu, uint64_t now) {
+  TimerState& ts = timer_states_[cpu];
+  uint64_t deadline = ts.wheel.GetNextExpiryNs();
+  if (liumos->scheduler->HasReadyProcess(cpu) && ts.time_slice_end < deadline)
+    deadline = ts.time_slice_end;
+  if (deadline == ts.armed_deadline)
+    return;
+  ts.armed_deadline = deadline;
+  LocalAPIC& lapic = GetCPU(cpu).local_apic;
+  if (deadline == kNoDeadline) {
+    lapic.StopTimer();
+    return;
+  }
+  lapic.StartTimer(
+      NsToLocalAPICTimerCount(deadline > now ? deadline - now : 0),
+      kTimerVector, false);
+}
+
+void ProgramNextTimerInterrupt(bool is_switched) {
+  const int cpu = GetCurrentCPUIndex();
+  TimerState& ts = timer_states_[cpu];
+  const uint64_t now = NowNs();
+  if (is_switched || now >= ts.time_slice_end)
+    ts.time_slice_end = now + liumos->time_slice_ns;
+  ArmTimer(cpu, now);
+}
+
+void AddTimer(Timer& timer, uint64_t deadline_ns) {
+  // Interrupts are disabled to keep the caller on this processor until the
+  // timer is armed.
+  const uint64_t rflags = ReadRFLAGS();
+  ClearIntFlag();
+  const int cpu = GetCurrentCPUIndex();
+  const uint64_t now = NowNs();
+  timer_states_[cpu].wheel.Add(timer, deadline_ns, now);
+  ArmTimer(cpu, now);
+  if (rflags & kRFlagsInterruptEnable)
+    StoreIntFlag();
+}
+
+bool CancelTimer(Timer& timer) {
+  // A timer stays on the wheel which it was added to last time.
+  TimerWheel* wheel = timer.GetWheel();
+  return wheel ? wheel->Remove(timer) : false;
+}
+
+static void WakeSleepingProcess(Timer& timer) {
+  reinterpret_cast<WaitQueue*>(timer.GetData())->WakeAll();
+}
+
+void SleepUntilNs(uint64_t deadline_ns) {
+  if (NowNs() >= deadline_ns)
+    return;
+  Process& proc = liumos->scheduler->GetCurrentProcess();
+  Timer& timer = proc.GetSleepTimer();
+  WaitQueue& wait_queue = proc.GetSleepWaitQueue();
+  timer.Init(WakeSleepingProcess, &wait_queue);
+  AddTimer(timer, deadline_ns);
+  wait_queue.WaitUntil([deadline_ns] { return NowNs() >= deadline_ns; });
+  // The timer has fired unless the process was woken up by someone else.
+  CancelTimer(timer);
+}
+
+void SleepMicroSecond(uint64_t microsec) {
+  SleepUntilNs(NowNs() + microsec * 1000);
+}
+
+void SleepMilliSecond(uint64_t ms) {
+  SleepMicroSecond(ms * 1000);
+}
+
+void SetTimeSliceMicroSecond(uint64_t microsec) {
+  liumos->time_slice_ns = microsec * 1000;
+}
+
+void PrintTimerStatistics() {
+  uint64_t timer_counts[kMaxNumOfCPUs];
+  uint64_t reschedule_counts[kMaxNumOfCPUs];
+  const int num_of_cpus = GetNumOfCPUs();
+  for (int i = 0; i < num_of_cpus; i++) {
+    timer_counts[i] = timer_states_[i].num_of_timer_interrupts;
+    reschedule_counts[i] = timer_states_[i].num_of_reschedule_interrupts;
+  }
+  SleepMilliSecond(1000);
+  PutString("cpu, timer interrupts/s, reschedule IPIs/s, pending timers\n");
+  for (int i = 0; i < num_of_cpus; i++) {
+    PutDecimal64(i);
+    PutString(", ");
+    PutDecimal64(timer_states_[i].num_of_timer_interrupts - timer_counts[i]);
+    PutString(", ");
+    PutDecimal64(timer_states_[i].num_of_reschedule_interrupts -
+                 reschedule_counts[i]);
+    PutString(", ");
+    PutDecimal64(timer_states_[i].wheel.GetNumOfTimers());
+    PutString("\n");
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "clock_source.h"
+#include "generic.h"
+#include "timer_wheel.h"
+#include "wait_queue.h"
+
+// Tickless timer.
+// Each processor arms a one-shot local APIC timer for its nearest deadline:
+// the end of the time slice of the running process when other processes are
+// waiting for the processor, or the earliest expiry in its TimerWheel.
+// Processors without any deadline just halt until the next interrupt.
+// Deadlines are in NowNs() (@clock_source.h).
+
+constexpr uint8_t kTimerVector = 0x20;
+// A deadline which never comes.
+constexpr uint64_t kNoDeadline = ~0ULL;
+
+// @timer.cc
+// Should be called on the BSP after the clock source and its local APIC are
+// initialized.
+void InitTimer();
+// Called from the timer interrupt handler.
+void HandleTimerInterrupt();
+// Called from the reschedule IPI handler. Only for statistics.
+void HandleRescheduleInterrupt();
+// Arms the timer of the current processor for its next deadline. Should be
+// called with interrupts disabled after the scheduler chose the process to
+// run. is_switched should be true if a new process has been switched to.
+void ProgramNextTimerInterrupt(bool is_switched);
+// Adds timer to the wheel of the current processor. Its callback is called on
+// that processor even if the caller moves to another one.
+void AddTimer(Timer& timer, uint64_t deadline_ns);
+// Returns true if timer was pending. The callback of timer is not running
+// after this returns.
+bool CancelTimer(Timer& timer);
+// Blocks the current process until NowNs() reaches deadline_ns.
+void SleepUntilNs(uint64_t deadline_ns);
+void SleepMicroSecond(uint64_t microsec);
+void SleepMilliSecond(uint64_t ms);
+void SetTimeSliceMicroSecond(uint64_t microsec);
+// Measures and prints the number of interrupts per second on each processor.
+void PrintTimerStatistics();
+
+// Blocks the current process until condition() returns true as
+// WaitQueue::WaitUntil() does, or until NowNs() reaches deadline_ns.
+// Returns false if the deadline has passed, without waiting if it had
+// passed already, so the caller should check the condition before this.
+template <class TCondition>
+bool WaitUntilOrDeadline(WaitQueue& wait_queue,
+                         uint64_t deadline_ns,
+                         TCondition condition) {
+  if (deadline_ns == kNoDeadline) {
+    wait_queue.WaitUntil(condition);
+    return true;
+  }
+  if (NowNs() >= deadline_ns)
+    return false;
+  struct Expiry {
+    WaitQueue* wait_queue;
+    bool has_expired;
+  } expiry = {&wait_queue, false};
+  Timer timer;
+  timer.Init(
+      [](Timer& fired_timer) {
+        Expiry& expiry = *reinterpret_cast<Expiry*>(fired_timer.GetData());
+        __atomic_store_n(&expiry.has_expired, true, __ATOMIC_RELEASE);
+        expiry.wait_queue->WakeAll();
+      },
+      &expiry);
+  AddTimer(timer, deadline_ns);
+  bool is_met = false;
+  wait_queue.WaitUntil([&] {
+    is_met = condition();
+    return is_met || __atomic_load_n(&expiry.has_expired, __ATOMIC_ACQUIRE);
+  });
+  CancelTimer(timer);
+  return is_met;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include "generic.h"
+#include "spin_lock.h"
+
+class TimerWheel;
+
+// One-shot timer which calls its callback after its deadline.
+// The callback is called from the timer interrupt handler of the processor
+// which the timer was added on, without any lock held. It should not block.
+class Timer {
+ public:
+  using Callback = void (*)(Timer& timer);
+  constexpr Timer()
+      : callback_(nullptr),
+        data_(nullptr),
+        deadline_ns_(0),
+        expiry_tick_(0),
+        wheel_(nullptr),
+        prev_(nullptr),
+        next_(nullptr),
+        level_(0),
+        slot_(0),
+        is_pending_(false) {}
+  void Init(Callback callback, void* data) {
+    assert(!is_pending_);
+    callback_ = callback;
+    data_ = data;
+  }
+  void* GetData() const { return data_; }
+  uint64_t GetDeadlineNs() const { return deadline_ns_; }
+  // The wheel which this timer was added to last time.
+  TimerWheel* GetWheel() const { return wheel_; }
+  friend class TimerWheel;
+
+ private:
+  Callback callback_;
+  void* data_;
+  uint64_t deadline_ns_;
+  uint64_t expiry_tick_;
+  TimerWheel* wheel_;
+  Timer* prev_;
+  Timer* next_;
+  int level_;
+  int slot_;
+  bool is_pending_;
+};
+
+// Hierarchical timing wheel.
+// Each level has kNumOfSlots slots. A slot of level 0 holds timers which
+// expire in a tick, and a slot of level n covers a whole rotation of level
+// n - 1. A timer is put in the lowest level which can hold its expiry, and
+// moved down ("cascaded") when the lower level comes around to it, so adding
+// and removing a timer take constant time regardless of the number of
+// timers. Deadlines are rounded up to ticks.
+class TimerWheel {
+ public:
+  static constexpr int kTickShift = 14;  // 16.384 us
+  static constexpr uint64_t kTickNs = 1ULL << kTickShift;
+  static constexpr int kBitsPerLevel = 6;
+  static constexpr int kNumOfSlots = 1 << kBitsPerLevel;
+  static constexpr int kNumOfLevels = 5;
+  // Timers expiring after this are kept in the top level until they come
+  // closer. About 4.9 hours.
+  static constexpr uint64_t kMaxTicks = 1ULL
+                                        << (kBitsPerLevel * kNumOfLevels);
+  static constexpr uint64_t kNoExpiry = ~0ULL;
+
+  constexpr TimerWheel()
+      : current_tick_(0),
+        num_of_timers_(0),
+        running_timer_(nullptr),
+        bitmaps_{},
+        slots_{} {}
+  // now_ns is used to catch up with the current time if the wheel is empty.
+  void Add(Timer& timer, uint64_t deadline_ns, uint64_t now_ns) {
+    lock_.Lock();
+    assert(!timer.is_pending_);
+    assert(timer.callback_);
+    const uint64_t now_tick = now_ns >> kTickShift;
+    if (!num_of_timers_ && current_tick_ < now_tick)
+      current_tick_ = now_tick;
+    // Rounded up without overflowing, since kNoDeadline (@timer.h) is also
+    // accepted.
+    uint64_t expiry_tick =
+        (deadline_ns >> kTickShift) + ((deadline_ns & (kTickNs - 1)) != 0);
+    if (expiry_tick < current_tick_)
+      expiry_tick = current_tick_;
+    timer.deadline_ns_ = deadline_ns;
+    timer.expiry_tick_ = expiry_tick;
+    timer.wheel_ = this;
+    timer.is_pending_ = true;
+    Insert(timer);
+    num_of_timers_++;
+    lock_.Unlock();
+  }
+  // Returns true if the timer was pending. After this returns, the callback
+  // of the timer is not running. Should not be called from the callback of
+  // the timer itself.
+  bool Remove(Timer& timer) {
+    lock_.Lock();
+    const bool was_pending = timer.is_pending_;
+    if (was_pending) {
+      assert(timer.wheel_ == this);
+      Unlink(timer);
+      timer.is_pending_ = false;
+      num_of_timers_--;
+    }
+    while (running_timer_ == &timer) {
+      lock_.Unlock();
+      while (__atomic_load_n(&running_timer_, __ATOMIC_ACQUIRE) == &timer) {
+#ifndef LIUMOS_TEST
+        asm volatile("pause");
+#endif
+      }
+      lock_.Lock();
+    }
+    lock_.Unlock();
+    return was_pending;
+  }
+  // Calls the callbacks of the timers expired at now_ns in the order of
+  // their expiry ticks.
+  void Advance(uint64_t now_ns) {
+    const uint64_t now_tick = now_ns >> kTickShift;
+    lock_.Lock();
+    while (current_tick_ <= now_tick) {
+      Timer* timer = slots_[0][current_tick_ & (kNumOfSlots - 1)];
+      if (timer) {
+        Unlink(*timer);
+        timer->is_pending_ = false;
+        num_of_timers_--;
+        __atomic_store_n(&running_timer_, timer, __ATOMIC_RELEASE);
+        lock_.Unlock();
+        timer->callback_(*timer);
+        lock_.Lock();
+        __atomic_store_n(&running_timer_, nullptr, __ATOMIC_RELEASE);
+        continue;
+      }
+      if (!num_of_timers_) {
+        current_tick_ = now_tick + 1;
+        break;
+      }
+      // Skips rotations of empty levels at once.
+      uint64_t step = 1;
+      for (int level = 0; level < kNumOfLevels - 1 && !bitmaps_[level];
+           level++) {
+        step <<= kBitsPerLevel;
+      }
+      uint64_t next_tick = (current_tick_ + step) & ~(step - 1);
+      // Ticks after now_tick should not be passed since timers expiring
+      // before them can be added later.
+      if (next_tick > now_tick + 1)
+        next_tick = now_tick + 1;
+      current_tick_ = next_tick;
+      Cascade();
+    }
+    lock_.Unlock();
+  }
+  // Returns the start of the earliest tick which may have an expired timer,
+  // or kNoExpiry if there is no timer.
+  uint64_t GetNextExpiryNs() {
+    lock_.Lock();
+    uint64_t next_tick = kNoExpiry;
+    for (int level = 0; level < kNumOfLevels; level++) {
+      if (!bitmaps_[level])
+        continue;
+      const int shift = kBitsPerLevel * level;
+      const uint64_t current_slot = current_tick_ >> shift;
+      const int index = current_slot & (kNumOfSlots - 1);
+      uint64_t rotated = bitmaps_[level];
+      if (index)
+        rotated = (rotated >> index) | (rotated << (kNumOfSlots - index));
+      // Timers in the current slot of upper levels expire after a rotation.
+      uint64_t distance = __builtin_ctzll(rotated);
+      if (level && !distance) {
+        rotated &= ~1ULL;
+        distance = rotated ? __builtin_ctzll(rotated) : kNumOfSlots;
+      }
+      const uint64_t tick = (current_slot + distance) << shift;
+      if (tick < next_tick)
+        next_tick = tick;
+    }
+    lock_.Unlock();
+    return next_tick == kNoExpiry ? kNoExpiry : next_tick << kTickShift;
+  }
+  uint64_t GetNumOfTimers() const { return num_of_timers_; }
+
+ private:
+  void Insert(Timer& timer) {
+    const uint64_t delta = timer.expiry_tick_ - current_tick_;
+    uint64_t tick = timer.expiry_tick_;
+    if (delta >= kMaxTicks)
+      tick = current_tick_ + kMaxTicks - 1;
+    int level = 0;
+    while (level < kNumOfLevels - 1 &&
+           tick - current_tick_ >= (1ULL << (kBitsPerLevel * (level + 1)))) {
+      level++;
+    }
+    const int slot = (tick >> (kBitsPerLevel * level)) & (kNumOfSlots - 1);
+    timer.level_ = level;
+    timer.slot_ = slot;
+    timer.prev_ = nullptr;
+    timer.next_ = slots_[level][slot];
+    if (timer.next_)
+      timer.next_->prev_ = &timer;
+    slots_[level][slot] = &timer;
+    bitmaps_[level] |= 1ULL << slot;
+  }
+  void Unlink(Timer& timer) {
+    if (timer.prev_)
+      timer.prev_->next_ = timer.next_;
+    else
+      slots_[timer.level_][timer.slot_] = timer.next_;
+    if (timer.next_)
+      timer.next_->prev_ = timer.prev_;
+    if (!slots_[timer.level_][timer.slot_])
+      bitmaps_[timer.level_] &= ~(1ULL << timer.slot_);
+    timer.prev_ = nullptr;
+    timer.next_ = nullptr;
+  }
+  // Moves timers in slots of upper levels which begin at current_tick_ down.
+  void Cascade() {
+    for (int level = kNumOfLevels - 1; level > 0; level--) {
+      const int shift = kBitsPerLevel * level;
+      if (current_tick_ & ((1ULL << shift) - 1))
+        continue;
+      const int slot = (current_tick_ >> shift) & (kNumOfSlots - 1);
+      Timer* timer = slots_[level][slot];
+      slots_[level][slot] = nullptr;
+      bitmaps_[level] &= ~(1ULL << slot);
+      while (timer) {
+        Timer* next = timer->next_;
+        Insert(*timer);
+        timer = next;
+      }
+    }
+  }
+
+  SpinLock lock_;
+  uint64_t current_tick_;  // Ticks before this are already processed.
+  uint64_t num_of_timers_;
+  Timer* running_timer_;
+  uint64_t bitmaps_[kNumOfLevels];  // Bit n is set if slot n is not empty.
+  Timer* slots_[kNumOfLevels][kNumOfSlots];
+};
@@ -0,0 +1,124 @@
+#include "timer_wheel.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+struct FiredRecord {
+  uint64_t fired_at_ns;
+  int num_of_fired;
+};
+
+static uint64_t now_ns_;
+
+static void RecordFire(Timer& timer) {
+  FiredRecord& record = *reinterpret_cast<FiredRecord*>(timer.GetData());
+  // Timers should never fire before their deadlines.
+  assert(timer.GetDeadlineNs() <= now_ns_);
+  record.fired_at_ns = now_ns_;
+  record.num_of_fired++;
+}
+
+static void AdvanceTo(TimerWheel& wheel, uint64_t ns) {
+  // Advances as an interrupt-driven caller does: jumps to the next expiry.
+  while (now_ns_ < ns) {
+    uint64_t next = wheel.GetNextExpiryNs();
+    if (next < now_ns_)
+      next = now_ns_;
+    now_ns_ = next < ns ? next : ns;
+    wheel.Advance(now_ns_);
+  }
+}
+
+static void TestFireInOrder() {
+  constexpr int kNumOfTimers = 6;
+  // Deadlines spread over all levels, including one beyond the range.
+  const uint64_t deadlines[kNumOfTimers] = {
+      50'000,         3'000'000,          2'000'000'000,
+      70'000'000'000, 20'000'000'000'000, 100,
+  };
+  TimerWheel wheel;
+  Timer timers[kNumOfTimers];
+  FiredRecord records[kNumOfTimers] = {};
+  now_ns_ = 1'000'000;
+  for (int i = 0; i < kNumOfTimers; i++) {
+    timers[i].Init(RecordFire, &records[i]);
+    wheel.Add(timers[i], now_ns_ + deadlines[i], now_ns_);
+  }
+  assert(wheel.GetNumOfTimers() == kNumOfTimers);
+  AdvanceTo(wheel, now_ns_ + 30'000'000'000'000);
+  assert(wheel.GetNumOfTimers() == 0);
+  assert(wheel.GetNextExpiryNs() == TimerWheel::kNoExpiry);
+  for (int i = 0; i < kNumOfTimers; i++) {
+    assert(records[i].num_of_fired == 1);
+    // Jumping to the next expiry should fire timers within a tick.
+    const uint64_t deadline = 1'000'000 + deadlines[i];
+    assert(records[i].fired_at_ns < deadline + TimerWheel::kTickNs);
+  }
+}
+
+static void TestRemove() {
+  TimerWheel wheel;
+  Timer timer1;
+  Timer timer2;
+  FiredRecord record1 = {};
+  FiredRecord record2 = {};
+  now_ns_ = 0;
+  timer1.Init(RecordFire, &record1);
+  timer2.Init(RecordFire, &record2);
+  wheel.Add(timer1, 10'000'000, now_ns_);
+  wheel.Add(timer2, 20'000'000, now_ns_);
+  assert(wheel.GetNextExpiryNs() <= 10'000'000);
+  assert(wheel.Remove(timer1));
+  assert(!wheel.Remove(timer1));
+  assert(wheel.GetNextExpiryNs() > 10'000'000);
+  assert(wheel.GetNextExpiryNs() <= 20'000'000);
+  AdvanceTo(wheel, 30'000'000);
+  assert(record1.num_of_fired == 0);
+  assert(record2.num_of_fired == 1);
+  assert(!wheel.Remove(timer2));
+
+  // A removed timer can be added again.
+  wheel.Add(timer1, 40'000'000, now_ns_);
+  AdvanceTo(wheel, 50'000'000);
+  assert(record1.num_of_fired == 1);
+}
+
+static void TestExpiredDeadline() {
+  TimerWheel wheel;
+  Timer timer;
+  FiredRecord record = {};
+  now_ns_ = 5'000'000'000;
+  wheel.Advance(now_ns_);
+  timer.Init(RecordFire, &record);
+  wheel.Add(timer, now_ns_ - 1'000'000, now_ns_);
+  now_ns_ += TimerWheel::kTickNs;
+  wheel.Advance(now_ns_);
+  assert(record.num_of_fired == 1);
+}
+
+static void TestFarDeadline() {
+  TimerWheel wheel;
+  Timer timer;
+  FiredRecord record = {};
+  now_ns_ = 1'000'000;
+  timer.Init(RecordFire, &record);
+  // Rounding up the last deadline should not wrap around to the past.
+  wheel.Add(timer, ~0ULL, now_ns_);
+  AdvanceTo(wheel, now_ns_ + 30'000'000'000'000);
+  assert(record.num_of_fired == 0);
+  assert(wheel.Remove(timer));
+}
+
+int main() {
+  TestFireInOrder();
+  TestRemove();
+  TestExpiredDeadline();
+  TestFarDeadline();
+  puts("PASS");
+  return 0;
+}
+
+#endif
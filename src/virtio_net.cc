@@ -1,6 +1,8 @@
 #include "virtio_net.h"
 
+#include "clock_source.h"
 #include "kernel.h"
+#include "timer.h"
 
 namespace Virtio {
 
@@ -43,12 +45,31 @@ void Net::WriteConfigReg32(int ofs, uint32_t data) {
   WriteIOPort32(config_io_addr_base_ + ofs, data);
 }
 
+// 4.1.4.8 Legacy Interfaces: A Note on PCI Device Layout
+constexpr static int kConfigRegOffsetQueueSize = 12;
+constexpr static int kConfigRegOffsetQueueSelect = 14;
+constexpr static int kConfigRegOffsetQueueNotify = 16;
+constexpr static int kConfigRegOffsetISRStatus = 19;
+constexpr static int kConfigRegOffsetQueueMSIXVector = 22;
+constexpr static int kDeviceConfigOffset = 20;
+constexpr static int kDeviceConfigOffsetWithMSIX = 24;
+constexpr static uint16_t kNoMSIXVector = 0xFFFF;
+// 5.1.4 Device configuration layout
+constexpr static int kDeviceConfigOffsetMaxVirtqueuePairs = 8;
+// 2.4.5 The Virtqueue Descriptor Table
+constexpr static uint16_t kDescriptorFlagNext = 1;
+constexpr static uint16_t kDescriptorFlagWrite = 2;
+constexpr static uint8_t kISRStatusBitQueue = 1;
+
 uint8_t Net::ReadDeviceStatus() {
   return ReadConfigReg8(18);
 }
 void Net::WriteDeviceStatus(uint8_t data) {
   WriteConfigReg8(18, data);
 }
+uint32_t Net::GetDeviceFeatures() {
+  return ReadConfigReg32(0);
+}
 void Net::SetFeatures(uint32_t f) {
   WriteConfigReg32(4, f);
 }
@@ -61,9 +82,6 @@ constexpr static uint8_t kDeviceStatusFeaturesOK = 8;
 // constexpr static uint8_t kDeviceStatusDeviceNeedsReset = 64;
 // constexpr static uint8_t kDeviceStatusFailed = 128;
 
-constexpr static uint32_t kFeaturesMAC = (1 << 5);
-constexpr static uint32_t kFeaturesStatus = (1 << 16);
-
 static uint64_t CalcSizeOfVirtqueue(int queue_size) {
   // First part: Descriptor Table + Available Ring
   // Second part: Used Ring
@@ -112,6 +130,13 @@ uint16_t Net::Virtqueue::GetUsedRingIndex() {
   return pidx;
 }
 
+uint16_t Net::Virtqueue::GetUsedRingFlags() {
+  volatile uint16_t& pflags = *reinterpret_cast<volatile uint16_t*>(
+      base_ + CeilToPageAlignment(sizeof(Descriptor) * queue_size_ +
+                                  sizeof(uint16_t) * (2 * queue_size_)));
+  return pflags;
+}
+
 Net::Virtqueue::UsedRingEntry& Net::Virtqueue::GetUsedRingEntry(int idx) {
   assert(0 <= idx && idx < queue_size_);
   UsedRingEntry* used_ring = reinterpret_cast<UsedRingEntry*>(
@@ -122,264 +147,302 @@ Net::Virtqueue::UsedRingEntry& Net::Virtqueue::GetUsedRingEntry(int idx) {
   return used_ring[idx];
 }
 
-void PrintARPPacket(Net::ARPPacket& arp) {
-  switch (arp.GetOperation()) {
-    case Net::ARPPacket::Operation::kRequest:
-      PutString("Who has ");
-      arp.target_proto_addr.Print();
-      PutString("? Tell ");
-      arp.sender_proto_addr.Print();
-      PutString(" at ");
-      arp.sender_eth_addr.Print();
-      PutChar('\n');
-      return;
-    case Net::ARPPacket::Operation::kReply:
-      arp.sender_proto_addr.Print();
-      PutString(" is at ");
-      arp.sender_eth_addr.Print();
-      PutChar('\n');
-      return;
-    default:
-      break;
+void Net::ReleaseRXBuffer(PacketBuffer& pbuf) {
+  Net& net = Net::GetInstance();
+  const int idx = static_cast<int>(&pbuf - &net.rx_pbufs_[0][0]);
+  net.PostRXBuffer(idx / Virtqueue::kMaxQueueSize,
+                   static_cast<uint16_t>(idx % Virtqueue::kMaxQueueSize));
+}
+
+void Net::PostRXBuffer(int queue, uint16_t desc_idx) {
+  RXQueue& rxq = rx_queues_[queue];
+  rxq.lock.Lock();
+  __atomic_sub_fetch(&rxq.num_of_held, 1, __ATOMIC_RELAXED);
+  rxq.vq.SetAvailableRingEntry(rxq.avail_idx % rxq.size, desc_idx);
+  rxq.avail_idx++;
+  rxq.vq.SetAvailableRingIndex(rxq.avail_idx);
+  // The device stops receiving when it runs out of buffers, and resumes
+  // when notified. Notifies only when it is about to run out.
+  asm volatile("mfence" ::: "memory");
+  const uint16_t num_of_posted =
+      static_cast<uint16_t>(rxq.avail_idx - rxq.vq.GetUsedRingIndex());
+  if (num_of_posted <= kRXKickThreshold &&
+      !(rxq.vq.GetUsedRingFlags() & Virtqueue::kUsedRingFlagNoNotify)) {
+    WriteConfigReg16(kConfigRegOffsetQueueNotify, rxq.index);
+    rxq.num_of_kicks++;
   }
-  PutString("Recieved ARP with invalid Operation\n");
+  rxq.lock.Unlock();
 }
 
-using InternetChecksum = Net::InternetChecksum;
-using EtherFrame = Net::EtherFrame;
-using ARPPacket = Net::ARPPacket;
-using IPv4Packet = Net::IPv4Packet;
-using ICMPPacket = Net::ICMPPacket;
-using IPv4UDPPacket = Net::IPv4UDPPacket;
+bool Net::HasUsedRXDescriptor(RXQueue& rxq) {
+  return rxq.vq.GetUsedRingIndex() != rxq.used_cursor;
+}
 
-static bool ARPPacketHandler(uint8_t* frame_data, size_t frame_size) {
-  if (frame_size < sizeof(ARPPacket)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(Net::EtherFrame::kTypeARP)) {
-    return false;
-  }
-  ARPPacket& arp = *reinterpret_cast<ARPPacket*>(frame_data);
+void Net::IntHandler(uint64_t, InterruptInfo*) {
   Net& net = Net::GetInstance();
-  if (arp.GetOperation() == ARPPacket::Operation::kReply) {
-    Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
-                                                 arp.sender_eth_addr);
-    return true;
-  }
-  if (arp.GetOperation() != ARPPacket::Operation::kRequest) {
-    return false;
-  }
-  if (!arp.target_proto_addr.IsEqualTo(net.GetSelfIPv4Addr())) {
-    // This is ARP Request, but not a request to me
-    return true;
+  // Reading the ISR status deasserts the INTx line. MSI-X does not use it.
+  if (net.interrupt_mode_ == InterruptMode::kINTx &&
+      !(net.ReadConfigReg8(kConfigRegOffsetISRStatus) & kISRStatusBitQueue)) {
+    GetCurrentCPU().local_apic.SendEndOfInterrupt();
+    return;
   }
-  // Reply to ARP
-  ARPPacket& reply = *net.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
-  reply.SetupReply(arp.sender_proto_addr, net.GetSelfIPv4Addr(),
-                   arp.sender_eth_addr, net.GetSelfEtherAddr());
-  net.SendPacket();
-  return true;
+  // Each processor receives interrupts only of its own RX queue.
+  const int queue = GetCurrentCPUIndex();
+  assert(queue < net.num_of_queue_pairs_);
+  RXQueue& rxq = net.rx_queues_[queue];
+  rxq.num_of_interrupts++;
+  // Packets arriving until the bottom half drains the queue are handled
+  // without further interrupts.
+  rxq.vq.SetAvailableRingFlags(Virtqueue::kAvailableRingFlagNoInterrupt);
+  GetCurrentCPU().local_apic.SendEndOfInterrupt();
+  rxq.wait_queue.WakeAll();
 }
 
-static void SendICMPEchoReply(const ICMPPacket& req, size_t req_frame_size) {
-  if (req_frame_size < sizeof(ICMPPacket)) {
+void Net::WaitForRXQueue(int queue) {
+  assert(0 <= queue && queue < kMaxNumOfQueuePairs);
+  if (initialized_ && interrupt_mode_ == InterruptMode::kNone &&
+      queue < num_of_queue_pairs_) {
+    SleepMilliSecond(kRXPollIntervalMs);
     return;
   }
-  PutStringAndHex("req_frame_size", req_frame_size);
-  Net& net = Net::GetInstance();
-  // Reply to ARP
-  ICMPPacket& reply = *net.GetNextTXPacketBuf<ICMPPacket*>(req_frame_size);
-  memcpy(&reply, &req, req_frame_size);
-  // Setup ICMP
-  reply.type = ICMPPacket::Type::kEchoReply;
-  reply.csum.Clear();
-  reply.csum = Network::InternetChecksum::Calc(
-      &reply, offsetof(ICMPPacket, type), req_frame_size);
-  // Setup IP
-  reply.ip.dst_ip = req.ip.src_ip;
-  reply.ip.src_ip = req.ip.dst_ip;
-  reply.ip.csum.Clear();
-  reply.ip.csum = Network::InternetChecksum::Calc(
-      &reply, offsetof(IPv4Packet, version_and_ihl), req_frame_size);
-  // Setup Eth
-  reply.ip.eth.dst = req.ip.eth.src;
-  reply.ip.eth.src = net.GetSelfEtherAddr();
-  // Send
-  net.SendPacket();
-  PutString("Reply sent!: ");
-
-  // UDP
-  const char* s = "Hello! This is liumOS. Are you there?\n";
-  uint16_t dst_port = 11111;
-  uint16_t packet_size =
-      static_cast<uint16_t>((sizeof(IPv4UDPPacket) + strlen(s) + 1) & ~1);
-  IPv4UDPPacket& p = *net.GetNextTXPacketBuf<IPv4UDPPacket*>(packet_size);
-  char* data = reinterpret_cast<char*>(reinterpret_cast<uint8_t*>(&p) +
-                                       sizeof(IPv4UDPPacket));
-  memcpy(&p, &req, packet_size);
-  memcpy(data, s, strlen(s));
-  // Setup UDP
-  p.SetDestinationPort(dst_port);
-  p.SetSourcePort(12345);
-  p.SetDataSize(strlen(s));
-  p.csum.Clear();
-  p.csum = Network::CalcUDPChecksum(&p, offsetof(IPv4UDPPacket, src_port),
-                                    packet_size, req.ip.dst_ip, req.ip.src_ip,
-                                    p.length);
-  // Setup IP
-  p.ip.protocol = IPv4Packet::Protocol::kUDP;
-  p.ip.SetDataLength(packet_size - sizeof(IPv4Packet));
-  p.ip.dst_ip = req.ip.src_ip;
-  p.ip.src_ip = req.ip.dst_ip;
-  p.ip.csum.Clear();
-  p.ip.csum = Network::InternetChecksum::Calc(
-      &p, offsetof(IPv4Packet, version_and_ihl), sizeof(IPv4Packet));
-  // Setup Eth
-  p.ip.eth.dst = req.ip.eth.src;
-  p.ip.eth.src = net.GetSelfEtherAddr();
-  // Send
-  net.SendPacket();
-}
-
-static bool ICMPPacketHandler(IPv4Packet& p, size_t frame_size) {
-  if (p.protocol != IPv4Packet::Protocol::kICMP) {
-    return false;
-  }
-  if (frame_size < sizeof(ICMPPacket)) {
-    return false;
-  }
-  ICMPPacket& icmp = *reinterpret_cast<Net::ICMPPacket*>(&p);
-  if (icmp.type == ICMPPacket::Type::kEchoRequest) {
-    SendICMPEchoReply(icmp, frame_size);
-  }
-  return true;
+  RXQueue& rxq = rx_queues_[queue];
+  rxq.wait_queue.WaitUntil([this, queue, &rxq] {
+    // Init() wakes this up when the device is ready.
+    if (!initialized_ || queue >= num_of_queue_pairs_)
+      return false;
+    if (HasUsedRXDescriptor(rxq))
+      return true;
+    rxq.vq.SetAvailableRingFlags(0);
+    // Packets written before the device sees the flag do not raise an
+    // interrupt, so check again after enabling it.
+    asm volatile("mfence" ::: "memory");
+    if (!HasUsedRXDescriptor(rxq))
+      return false;
+    rxq.vq.SetAvailableRingFlags(Virtqueue::kAvailableRingFlagNoInterrupt);
+    return true;
+  });
 }
 
-static bool UDPPacketHandler(IPv4Packet& p, size_t frame_size) {
-  using IPv4Addr = Network::IPv4Addr;
-  using IPv4NetMask = Network::IPv4NetMask;
-  if (p.protocol != IPv4Packet::Protocol::kUDP) {
-    return false;
-  }
-  if (frame_size < sizeof(IPv4UDPPacket)) {
-    return false;
-  }
-  Net::IPv4UDPPacket& udp = *reinterpret_cast<Net::IPv4UDPPacket*>(&p);
-  if (udp.GetDestinationPort() != 68) {
-    // Not a DHCP packet
-    return false;
+int Net::PollRXQueue(int queue) {
+  assert(0 <= queue && queue < num_of_queue_pairs_);
+  RXQueue& rxq = rx_queues_[queue];
+  const uint16_t used_idx = rxq.vq.GetUsedRingIndex();
+  if (used_idx == rxq.used_cursor) {
+    return 0;
   }
-  Net::DHCPPacket& dhcp = *reinterpret_cast<Net::DHCPPacket*>(&p);
-  Net& net = Net::GetInstance();
-  Network& network = Network::GetInstance();
-  if (dhcp.op != 2 || !dhcp.chaddr.IsEqualTo(net.GetSelfEtherAddr())) {
-    return false;
-  }
-  dhcp.yiaddr.Print();
-  kprintf(" is assigned by DHCP\n");
-  net.SetSelfIPv4Addr(dhcp.yiaddr);
-  // https://tools.ietf.org/html/rfc2131
-  // 3. The Client-Server Protocol
-  if (dhcp.cookie[0] != 99 || dhcp.cookie[1] != 130 || dhcp.cookie[2] != 83 ||
-      dhcp.cookie[3] != 99) {
-    kprintf("Unexpected DHCP Option cookie\n");
-    return true;
-  }
-  uint8_t* buf = reinterpret_cast<uint8_t*>(&dhcp);
-  size_t i = sizeof(Net::DHCPPacket);
-  while (i < frame_size) {
-    uint8_t option = buf[i];
-    uint8_t option_data_len = buf[i + 1];
-    if (option_data_len == 0) {
-      break;
-    }
-    if (option == 3) {
-      // Router
-      assert(option_data_len == 4);
-      IPv4Addr router_ip = *reinterpret_cast<IPv4Addr*>(&buf[i + 2]);
-      router_ip.Print();
-      kprintf(" is router\n");
-      network.SetIPv4DefaultGateway(router_ip);
+  int num_of_packets = 0;
+  // Replies to the received packets are notified to the device at once.
+  const int tx_batch = BeginTXBatch();
+  for (; rxq.used_cursor != used_idx; rxq.used_cursor++) {
+    Virtqueue::UsedRingEntry& used =
+        rxq.vq.GetUsedRingEntry(rxq.used_cursor % rxq.size);
+    const uint16_t desc_idx = static_cast<uint16_t>(used.id);
+    const uint32_t len = used.len;
+    PacketBuffer& pbuf = rx_pbufs_[queue][desc_idx];
+    pbuf.Init(rxq.vq.GetDescriptorBuf(desc_idx) + sizeof(PacketBufHeader),
+              len > sizeof(PacketBufHeader) ? len - sizeof(PacketBufHeader)
+                                            : 0,
+              ReleaseRXBuffer);
+    // Sockets may keep frames in their queues while half of the ring is
+    // left for the device. Frames beyond that are copied by them.
+    pbuf.SetCanBeKept(__atomic_add_fetch(&rxq.num_of_held, 1,
+                                         __ATOMIC_RELAXED) <= rxq.size / 2);
+    // 5.1.6.4.1 With VIRTIO_NET_F_GUEST_CSUM, the checksum was validated by
+    // the device, or was never computed since the frame did not leave the
+    // host.
+    const PacketBufHeader& hdr =
+        *rxq.vq.GetDescriptorBuf<PacketBufHeader*>(desc_idx);
+    if (hdr.flags & (PacketBufHeader::kFlagNeedsChecksum |
+                     PacketBufHeader::kFlagDataValid)) {
+      pbuf.SetChecksumValid(true);
+      rxq.num_of_csum_validated++;
     }
-    if (option == 1) {
-      // Subnet Mask
-      assert(option_data_len == 4);
-      IPv4NetMask netmask = *reinterpret_cast<IPv4NetMask*>(&buf[i + 2]);
-      netmask.Print();
-      kprintf(" is netmask\n");
-      network.SetIPv4NetMask(netmask);
-    }
-    i += 2 + option_data_len;
+    if (pbuf.GetSize())
+      Network::GetInstance().HandleReceivedFrame(pbuf);
+    // The descriptor is posted again when nobody holds the frame.
+    pbuf.Unref();
+    num_of_packets++;
   }
-  return true;
+  EndTXBatch(tx_batch);
+  rxq.num_of_polls++;
+  rxq.num_of_packets += num_of_packets;
+  if (static_cast<uint64_t>(num_of_packets) > rxq.max_batch)
+    rxq.max_batch = num_of_packets;
+  // Socket readers are woken up once per batch.
+  Network::GetInstance().NotifyRXPackets();
+  return num_of_packets;
 }
 
-static bool IPv4PacketHandler(uint8_t* frame_data, size_t frame_size) {
-  using EtherFrame = Net::EtherFrame;
-  using IPv4Packet = Net::IPv4Packet;
-  if (frame_size < sizeof(IPv4Packet)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<Net::EtherFrame*>(frame_data);
-  if (!eth.HasEthType(Net::EtherFrame::kTypeIPv4)) {
-    return false;
-  }
-  IPv4Packet& p = *reinterpret_cast<Net::IPv4Packet*>(frame_data);
-  if (ICMPPacketHandler(p, frame_size)) {
-    return true;
+void Net::PrintStatistics() {
+  if (!initialized_) {
+    PutString("Virtio::Net is not initialized\n");
+    return;
   }
-  if (UDPPacketHandler(p, frame_size)) {
-    return true;
+  const char* mode = "polling";
+  if (interrupt_mode_ == InterruptMode::kMSIX)
+    mode = "MSI-X";
+  if (interrupt_mode_ == InterruptMode::kINTx)
+    mode = "INTx";
+  kprintf("interrupt mode: %s\n", mode);
+  kprintf("queue pairs: %d\n", num_of_queue_pairs_);
+  kprintf("offload: tx csum %s, tso %s, ufo %s, rx csum %s\n",
+          CanOffloadTXChecksum() ? "on" : "off",
+          CanOffloadTCPSegmentation() ? "on" : "off",
+          CanOffloadUDPFragmentation() ? "on" : "off",
+          (features_ & kFeatureGuestCSUM) ? "on" : "off");
+  for (int i = 0; i < num_of_queue_pairs_; i++) {
+    const RXQueue& rxq = rx_queues_[i];
+    const TXQueue& txq = tx_queues_[i];
+    kprintf("queue %d:\n", i);
+    kprintf("  rx interrupts: %lu\n", rxq.num_of_interrupts);
+    kprintf("  rx polls: %lu\n", rxq.num_of_polls);
+    kprintf("  rx packets: %lu (max %lu per poll)\n", rxq.num_of_packets,
+            rxq.max_batch);
+    kprintf("  rx kicks: %lu\n", rxq.num_of_kicks);
+    kprintf("  rx descriptors held: %u\n", rxq.num_of_held);
+    kprintf("  tx packets: %lu, kicks: %lu, ring full: %lu\n",
+            txq.num_of_packets, txq.num_of_kicks, txq.num_of_ring_full);
+    kprintf("  tx csum offloaded: %lu, tx gso packets: %lu, "
+            "rx csum validated: %lu\n",
+            txq.num_of_csum_offloaded, txq.num_of_gso_packets,
+            rxq.num_of_csum_validated);
+    if (rxq.num_of_interrupts) {
+      const uint64_t ppi_x100 =
+          rxq.num_of_packets * 100 / rxq.num_of_interrupts;
+      kprintf("  rx packets per interrupt: %lu.%02lu\n", ppi_x100 / 100,
+              ppi_x100 % 100);
+    }
   }
-  return true;
 }
 
-void Net::ProcessPacket(uint8_t* buf, size_t buf_size) {
-  size_t frame_size = buf_size - sizeof(Net::PacketBufHeader);
-  uint8_t* frame_data = buf + sizeof(Net::PacketBufHeader);
-  ARPPacketHandler(frame_data, frame_size) ||
-      IPv4PacketHandler(frame_data, frame_size);
-  Network::GetInstance().PushToRXBuffer(frame_data, 0, frame_size);
+void Net::ReclaimTXDescriptorsLocked(TXQueue& txq) {
+  const uint16_t used_idx = txq.vq.GetUsedRingIndex();
+  for (; txq.used_cursor != used_idx; txq.used_cursor++) {
+    const int idx = txq.used_cursor % txq.size;
+    txq.free_descs[txq.num_of_free_descs++] =
+        static_cast<uint16_t>(txq.vq.GetUsedRingEntry(idx).id);
+  }
 }
 
-void Net::PollRXQueue() {
-  auto& rxq = vq_[kIndexOfRXVirtqueue];
-  auto& rxq_cursor_ = vq_cursor_[kIndexOfRXVirtqueue];
-  if (rxq.GetUsedRingIndex() == rxq_cursor_) {
+void Net::KickTXQueueLocked(TXQueue& txq) {
+  if (!txq.num_of_unkicked)
     return;
-  }
-  while (rxq.GetUsedRingIndex() != rxq_cursor_) {
-    int idx = rxq_cursor_ % vq_size_[kIndexOfRXVirtqueue];
-    Net::ProcessPacket(rxq.GetDescriptorBuf(idx),
-                       rxq.GetUsedRingEntry(idx).len);
-    rxq.GetUsedRingEntry(idx).len = 0;
-    rxq_cursor_++;
-  }
-  rxq.SetAvailableRingIndex(rxq_cursor_ - 1);
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfRXVirtqueue);
+  txq.num_of_unkicked = 0;
+  // 2.4.7.2 The available index should be visible before reading the flag.
+  asm volatile("mfence" ::: "memory");
+  if (txq.vq.GetUsedRingFlags() & Virtqueue::kUsedRingFlagNoNotify)
+    return;
+  WriteConfigReg16(kConfigRegOffsetQueueNotify, txq.index);
+  txq.num_of_kicks++;
 }
 
-void Net::SendPacket() {
-  const int idx =
-      vq_cursor_[kIndexOfTXVirtqueue] % vq_size_[kIndexOfTXVirtqueue];
-  auto& txq = vq_[kIndexOfTXVirtqueue];
-  uint8_t* data = txq.GetDescriptorBuf(idx);
-  uint32_t data_size = txq.GetDescriptorSize(idx);
-  if (debug_mode_enabled_) {
-    kprintbuf("SendPacket data", data, sizeof(PacketBufHeader), data_size);
+uint8_t* Net::ReserveTXPacketBuf(size_t size) {
+  if (!initialized_) {
+    Panic("Virtio::Net not initialized yet");
+  }
+  uint32_t buf_size = static_cast<uint32_t>(sizeof(PacketBufHeader) + size);
+  assert(buf_size <= tx_buf_size_);
+  TXQueue* txqp;
+  while (true) {
+    txqp = &GetTXQueueOfCurrentCPU();
+    txqp->lock.Lock();
+    // Interrupts are disabled while the lock is held, so the processor does
+    // not change until SendPacket(). The caller may have moved to another
+    // processor before the lock was taken, though.
+    if (txqp != &GetTXQueueOfCurrentCPU()) {
+      txqp->lock.Unlock();
+      continue;
+    }
+    ReclaimTXDescriptorsLocked(*txqp);
+    if (txqp->num_of_free_descs)
+      break;
+    // The ring is full. Makes sure the device knows all packets in it and
+    // waits for some of them to be sent.
+    txqp->num_of_ring_full++;
+    KickTXQueueLocked(*txqp);
+    txqp->lock.Unlock();
+    asm volatile("pause");
   }
-  PacketBufHeader& hdr = *txq.GetDescriptorBuf<PacketBufHeader*>(idx);
+  TXQueue& txq = *txqp;
+  const int idx = txq.free_descs[--txq.num_of_free_descs];
+  txq.reserved_desc = idx;
+  txq.vq.SetDescriptor(idx, txq.vq.GetDescriptorBuf(idx), buf_size, 0, 0);
+  PacketBufHeader& hdr = *txq.vq.GetDescriptorBuf<PacketBufHeader*>(idx);
   hdr.flags = 0;
   hdr.gso_type = PacketBufHeader::kGSOTypeNone;
   hdr.header_length = 0x00;
   hdr.gso_size = 0;
   hdr.csum_start = 0;
   hdr.csum_offset = 0;
-  txq.SetAvailableRingEntry(idx, idx);
-  vq_cursor_[kIndexOfTXVirtqueue]++;
-  txq.SetAvailableRingIndex(idx + 1);
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfTXVirtqueue);
+  return txq.vq.GetDescriptorBuf(idx) + sizeof(PacketBufHeader);
+}
+
+void Net::SetTXChecksumOffload(size_t csum_start, size_t csum_offset) {
+  TXQueue& txq = GetTXQueueOfCurrentCPU();
+  assert(txq.lock.IsLocked());
+  assert(CanOffloadTXChecksum());
+  PacketBufHeader& hdr =
+      *txq.vq.GetDescriptorBuf<PacketBufHeader*>(txq.reserved_desc);
+  hdr.flags |= PacketBufHeader::kFlagNeedsChecksum;
+  hdr.csum_start = static_cast<uint16_t>(csum_start);
+  hdr.csum_offset = static_cast<uint16_t>(csum_offset);
+  txq.num_of_csum_offloaded++;
+}
+
+void Net::SetTXSegmentationOffload(uint8_t gso_type,
+                                   size_t header_size,
+                                   size_t segment_size) {
+  TXQueue& txq = GetTXQueueOfCurrentCPU();
+  assert(txq.lock.IsLocked());
+  assert(gso_type != PacketBufHeader::kGSOTypeTCPv4 ||
+         CanOffloadTCPSegmentation());
+  assert(gso_type != PacketBufHeader::kGSOTypeUDP ||
+         CanOffloadUDPFragmentation());
+  PacketBufHeader& hdr =
+      *txq.vq.GetDescriptorBuf<PacketBufHeader*>(txq.reserved_desc);
+  hdr.gso_type = gso_type;
+  hdr.header_length = static_cast<uint16_t>(header_size);
+  hdr.gso_size = static_cast<uint16_t>(segment_size);
+  txq.num_of_gso_packets++;
+}
+
+void Net::SendPacket() {
+  TXQueue& txq = GetTXQueueOfCurrentCPU();
+  assert(txq.lock.IsLocked());
+  const int idx = txq.reserved_desc;
+  uint8_t* data = txq.vq.GetDescriptorBuf(idx);
+  uint32_t data_size = txq.vq.GetDescriptorSize(idx);
+  if (debug_mode_enabled_) {
+    kprintbuf("SendPacket data", data, sizeof(PacketBufHeader), data_size);
+  }
+  txq.vq.SetAvailableRingEntry(txq.avail_idx % txq.size,
+                               static_cast<uint16_t>(idx));
+  txq.avail_idx++;
+  txq.vq.SetAvailableRingIndex(txq.avail_idx);
+  txq.num_of_packets++;
+  txq.num_of_unkicked++;
+  if (!txq.batch_depth || txq.num_of_unkicked >= kTXKickBatchSize)
+    KickTXQueueLocked(txq);
+  txq.lock.Unlock();
+}
+
+int Net::BeginTXBatch() {
+  const int queue = GetTXQueueIndexOfCurrentCPU();
+  TXQueue& txq = tx_queues_[queue];
+  txq.lock.Lock();
+  txq.batch_depth++;
+  txq.lock.Unlock();
+  return queue;
+}
+
+void Net::EndTXBatch(int batch) {
+  assert(0 <= batch && batch < num_of_queue_pairs_);
+  TXQueue& txq = tx_queues_[batch];
+  txq.lock.Lock();
+  assert(txq.batch_depth > 0);
+  if (--txq.batch_depth == 0)
+    KickTXQueueLocked(txq);
+  txq.lock.Unlock();
 }
 
 Net& Net::GetInstance() {
@@ -392,6 +455,140 @@ Net& Net::GetInstance() {
   return *net_;
 }
 
+void Net::SetupInterrupt() {
+  interrupt_mode_ = InterruptMode::kNone;
+  device_config_ofs_ = kDeviceConfigOffset;
+  IDT::GetInstance().SetIntHandler(kInterruptVector, IntHandler);
+  // The RX queue of the BSP uses the MSI-X entry 0. The entries of the other
+  // queues are set up after the number of queues is known.
+  const uint32_t apic_id = liumos->bsp_local_apic->GetID();
+  if (PCI::EnableMSIX(dev_, 0, apic_id, kInterruptVector)) {
+    interrupt_mode_ = InterruptMode::kMSIX;
+    device_config_ofs_ = kDeviceConfigOffsetWithMSIX;
+    PutString("Virtio::Net: using MSI-X\n");
+    return;
+  }
+  constexpr uint32_t kPCIRegOffsetInterruptLine = 0x3C;
+  constexpr uint32_t kPCIRegOffsetInterruptPin = 0x3D;
+  const uint8_t irq =
+      PCI::ReadConfigRegister8(dev_, kPCIRegOffsetInterruptLine);
+  const uint8_t pin =
+      PCI::ReadConfigRegister8(dev_, kPCIRegOffsetInterruptPin);
+  if (!pin || irq >= 24) {
+    PutString("Virtio::Net: no interrupt available. Polling RX queue.\n");
+    return;
+  }
+  SetLevelTriggeredInterruptRedirection(apic_id, irq, kInterruptVector);
+  PCI::EnableINTx(dev_);
+  interrupt_mode_ = InterruptMode::kINTx;
+  PutStringAndHex("Virtio::Net: using INTx. IRQ", irq);
+}
+
+int Net::SetupQueueInterrupts(int num_of_queue_pairs) {
+  // INTx and polling are handled only by the BSP.
+  if (interrupt_mode_ != InterruptMode::kMSIX)
+    return 1;
+  for (int i = 1; i < num_of_queue_pairs; i++) {
+    if (!PCI::EnableMSIX(dev_, i, GetCPU(i).apic_id, kInterruptVector))
+      return i;
+  }
+  return num_of_queue_pairs;
+}
+
+uint16_t Net::SetupVirtqueue(Virtqueue& vq,
+                             uint16_t index,
+                             uint16_t msix_vector) {
+  // 4.1.5.1.3 Virtqueue Configuration
+  WriteConfigReg16(kConfigRegOffsetQueueSelect, index);
+  uint16_t queue_size = ReadConfigReg16(kConfigRegOffsetQueueSize);
+  if (!queue_size)
+    return 0;
+  PutStringAndHex("Queue Select(RW)   ",
+                  ReadConfigReg16(kConfigRegOffsetQueueSelect));
+  PutStringAndHex("Queue Size(R)      ", queue_size);
+  vq.Alloc(queue_size);
+  PutStringAndHex("Queue Addr(phys)   ", vq.GetPhysAddr());
+  uint64_t vq_pfn = vq.GetPhysAddr() >> kPageSizeExponent;
+  assert(vq_pfn == (vq_pfn & 0xFFFF'FFFF));
+  WriteConfigReg32(8, static_cast<uint32_t>(vq_pfn));
+  PutStringAndHex("Queue Addr(RW)     ", ReadConfigReg32(8));
+  if (interrupt_mode_ != InterruptMode::kMSIX)
+    return queue_size;
+  WriteConfigReg16(kConfigRegOffsetQueueMSIXVector, msix_vector);
+  if (ReadConfigReg16(kConfigRegOffsetQueueMSIXVector) != msix_vector) {
+    PutString("Virtio::Net: failed to set MSI-X vector. Polling RX queue.\n");
+    interrupt_mode_ = InterruptMode::kNone;
+  }
+  return queue_size;
+}
+
+void Net::SetupRXQueue(int queue) {
+  RXQueue& rxq = rx_queues_[queue];
+  for (int i = 0; i < rxq.size; i++) {
+    rxq.vq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(kPageSize),
+                         kPageSize, kDescriptorFlagWrite, 0);
+    rxq.vq.SetAvailableRingEntry(i, static_cast<uint16_t>(i));
+    rxq.vq.SetAvailableRingIndex(i + 1);
+  }
+  rxq.used_cursor = 0;
+  rxq.avail_idx = rxq.size;
+  WriteConfigReg16(kConfigRegOffsetQueueNotify, rxq.index);
+}
+
+void Net::SetupTXQueue(int queue) {
+  TXQueue& txq = tx_queues_[queue];
+  txq.avail_idx = 0;
+  txq.used_cursor = 0;
+  txq.num_of_free_descs = 0;
+  for (int i = 0; i < txq.size; i++) {
+    txq.vq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(tx_buf_size_),
+                         tx_buf_size_, 0 /* device read only */, 0);
+    txq.free_descs[txq.num_of_free_descs++] = static_cast<uint16_t>(i);
+  }
+  // Sent descriptors are reclaimed when new ones are needed, so TX
+  // completion does not need interrupts.
+  txq.vq.SetAvailableRingFlags(Virtqueue::kAvailableRingFlagNoInterrupt);
+}
+
+bool Net::SetNumOfQueuePairs(uint16_t num_of_queue_pairs) {
+  // 5.1.6.5.5 Automatic receive steering in multiqueue mode
+  // The header, the data and the ack are in separate descriptors, as
+  // legacy devices require.
+  packed_struct Command {
+    uint8_t class_;
+    uint8_t command;
+    uint16_t virtqueue_pairs;
+    uint8_t ack;
+  };
+  Command& cmd = *AllocMemoryForMappedIO<Command*>(kPageSize);
+  cmd.class_ = kCtrlClassMQ;
+  cmd.command = kCtrlCommandMQVQPairsSet;
+  cmd.virtqueue_pairs = num_of_queue_pairs;
+  cmd.ack = 0xFF;  // Overwritten by the device.
+  ctrl_vq_.SetDescriptor(0, &cmd.class_, 2, kDescriptorFlagNext, 1);
+  ctrl_vq_.SetDescriptor(1, &cmd.virtqueue_pairs, sizeof(uint16_t),
+                         kDescriptorFlagNext, 2);
+  ctrl_vq_.SetDescriptor(2, &cmd.ack, 1, kDescriptorFlagWrite, 0);
+  ctrl_vq_.SetAvailableRingFlags(Virtqueue::kAvailableRingFlagNoInterrupt);
+  ctrl_vq_.SetAvailableRingEntry(0, 0);
+  const uint16_t used_idx = ctrl_vq_.GetUsedRingIndex();
+  ctrl_vq_.SetAvailableRingIndex(1);
+  asm volatile("mfence" ::: "memory");
+  WriteConfigReg16(kConfigRegOffsetQueueNotify, ctrl_vq_index_);
+  const uint64_t deadline_ns = NowNs() + kCtrlTimeoutMs * 1'000'000;
+  while (ctrl_vq_.GetUsedRingIndex() == used_idx) {
+    if (NowNs() > deadline_ns) {
+      // cmd is leaked since the device may still write to it.
+      PutString("Virtio::Net: control command timed out\n");
+      return true;
+    }
+    asm volatile("pause");
+  }
+  const bool failed = cmd.ack != kCtrlAckOK;
+  FreeMemoryForMappedIO(&cmd, kPageSize);
+  return failed;
+}
+
 void Net::Init() {
   PutString("Virtio::Net::Init()\n");
   if (auto dev = FindVirtioNet()) {
@@ -403,6 +600,7 @@ void Net::Init() {
   PCI::BARForIO bar = PCI::GetBARForIO(dev_);
   config_io_addr_base_ = bar.base;
   PutStringAndHex("bar.base", bar.base);
+  SetupInterrupt();
 
   // PCI: 6.7. Capabilities List
   // 4.1.4 Virtio Structure PCI Capabilities
@@ -431,57 +629,99 @@ void Net::Init() {
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusDriver);
   // 5.1.4.2 Driver Requirements: Device configuration layout
   // A driver SHOULD negotiate VIRTIO_NET_F_MAC if the device offers it
-  SetFeatures(kFeaturesStatus | kFeaturesMAC);
+  // 5.1.3.1 Feature bit requirements: TSO and UFO require CSUM, and MQ
+  // requires CTRL_VQ.
+  // GUEST_TSO4 and GUEST_UFO are not negotiated since RX buffers are a page.
+  const uint32_t device_features = GetDeviceFeatures();
+  uint32_t features = kFeatureStatus | kFeatureMAC;
+  features |= device_features & (kFeatureCSUM | kFeatureGuestCSUM);
+  if (features & kFeatureCSUM)
+    features |= device_features & (kFeatureHostTSO4 | kFeatureHostUFO);
+  // Queues other than the first pair are useless without their own
+  // interrupts.
+  if ((device_features & kFeatureMQ) && (device_features & kFeatureCtrlVQ) &&
+      interrupt_mode_ == InterruptMode::kMSIX && GetNumOfCPUs() > 1)
+    features |= kFeatureMQ | kFeatureCtrlVQ;
+  features_ = features;
+  PutStringAndHex("Device features", device_features);
+  PutStringAndHex("Driver features", features_);
+  SetFeatures(features_);
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusFeaturesOK);
 
   // 5.1.5 Device Initialization
-  // 4.1.5.1.3 Virtqueue Configuration
-  for (int i = 0; i < kNumOfVirtqueues; i++) {
-    WriteConfigReg16(14 /* queue_select */, i);
-    uint16_t queue_size = ReadConfigReg16(12);
-    if (!queue_size)
+  // Queue pair i consists of the virtqueues 2i (RX) and 2i+1 (TX), and the
+  // control virtqueue follows the last pair which the device has.
+  int max_num_of_queue_pairs = 1;
+  if (features_ & kFeatureMQ) {
+    max_num_of_queue_pairs = ReadConfigReg16(
+        device_config_ofs_ + kDeviceConfigOffsetMaxVirtqueuePairs);
+    ctrl_vq_index_ = static_cast<uint16_t>(2 * max_num_of_queue_pairs);
+  }
+  int num_of_queue_pairs = max_num_of_queue_pairs;
+  if (num_of_queue_pairs > GetNumOfCPUs())
+    num_of_queue_pairs = GetNumOfCPUs();
+  if (num_of_queue_pairs > kMaxNumOfQueuePairs)
+    num_of_queue_pairs = kMaxNumOfQueuePairs;
+  num_of_queue_pairs = SetupQueueInterrupts(num_of_queue_pairs);
+  for (int i = 0; i < num_of_queue_pairs; i++) {
+    RXQueue& rxq = rx_queues_[i];
+    TXQueue& txq = tx_queues_[i];
+    rxq.index = static_cast<uint16_t>(2 * i);
+    txq.index = static_cast<uint16_t>(2 * i + 1);
+    // Only RX queues raise interrupts.
+    rxq.size = SetupVirtqueue(rxq.vq, rxq.index, static_cast<uint16_t>(i));
+    txq.size = SetupVirtqueue(txq.vq, txq.index, kNoMSIXVector);
+    if (!rxq.size || !txq.size) {
+      num_of_queue_pairs = i;
       break;
-    PutStringAndHex("Queue Select(RW)   ", ReadConfigReg16(14));
-    PutStringAndHex("Queue Size(R)      ", queue_size);
-    vq_[i].Alloc(queue_size);
-    vq_size_[i] = queue_size;
-    vq_cursor_[i] = 0;
-    PutStringAndHex("Queue Addr(phys)   ", vq_[i].GetPhysAddr());
-    uint64_t vq_pfn = vq_[i].GetPhysAddr() >> kPageSizeExponent;
-    assert(vq_pfn == (vq_pfn & 0xFFFF'FFFF));
-    WriteConfigReg32(8, static_cast<uint32_t>(vq_pfn));
-    PutStringAndHex("Queue Addr(RW)     ", ReadConfigReg32(8));
+    }
+  }
+  if (!num_of_queue_pairs) {
+    PutString("Virtio::Net: no queues available\n");
+    return;
+  }
+  if (interrupt_mode_ != InterruptMode::kMSIX && num_of_queue_pairs > 1) {
+    // Setting up an MSI-X vector failed. Polling only the first pair.
+    num_of_queue_pairs = 1;
+  }
+  if ((features_ & kFeatureMQ) &&
+      !SetupVirtqueue(ctrl_vq_, ctrl_vq_index_, kNoMSIXVector)) {
+    PutString("Virtio::Net: no control queue. Using one queue pair.\n");
+    num_of_queue_pairs = 1;
+    features_ &= ~kFeatureMQ;
   }
 
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusDriverOK);
 
-  initialized_ = true;
-
   PutString("MAC Addr: ");
   for (int i = 0; i < 6; i++) {
-    mac_addr_.mac[i] = ReadConfigReg8(0x14 + i);
+    mac_addr_.mac[i] = ReadConfigReg8(device_config_ofs_ + i);
   }
   mac_addr_.Print();
   PutChar('\n');
 
-  // Populate RX Buffer
-  auto& rxq = vq_[kIndexOfRXVirtqueue];
-  vq_cursor_[kIndexOfRXVirtqueue] = 0;
-  for (int i = 0; i < vq_size_[kIndexOfRXVirtqueue]; i++) {
-    rxq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(kPageSize), kPageSize,
-                      2 /* device write only */, 0);
-    rxq.SetAvailableRingEntry(i, i);
-    rxq.SetAvailableRingIndex(i + 1);
+  // The device uses only the first pair until told otherwise.
+  if ((features_ & kFeatureMQ) && num_of_queue_pairs > 1 &&
+      SetNumOfQueuePairs(static_cast<uint16_t>(num_of_queue_pairs))) {
+    PutString("Virtio::Net: failed to enable multiqueue\n");
+    num_of_queue_pairs = 1;
   }
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfRXVirtqueue);
-
-  // Populate TX Buffer
-  auto& txq = vq_[kIndexOfTXVirtqueue];
-  vq_cursor_[kIndexOfTXVirtqueue] = 0;
-  for (int i = 0; i < vq_size_[kIndexOfTXVirtqueue]; i++) {
-    txq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(kPageSize), kPageSize,
-                      0 /* device read only */, 0);
+  num_of_queue_pairs_ = num_of_queue_pairs;
+  PutStringAndHex("Virtio::Net: queue pairs", num_of_queue_pairs_);
+
+  // Frames larger than the MTU are only sent with segmentation offload.
+  tx_buf_size_ = (features_ & (kFeatureHostTSO4 | kFeatureHostUFO))
+                     ? kTXBufferSizeForGSO
+                     : static_cast<uint32_t>(kPageSize);
+  for (int i = 0; i < num_of_queue_pairs_; i++) {
+    SetupRXQueue(i);
+    SetupTXQueue(i);
   }
-  SendDHCPRequest();
+  initialized_ = true;
+  // NetworkManager may be waiting for the initialization.
+  for (int i = 0; i < kMaxNumOfQueuePairs; i++)
+    rx_queues_[i].wait_queue.WakeAll();
+  if (Network::GetInstance().AttachNIC(*this))
+    PutString("Virtio::Net: another NIC is used\n");
 }
 }  // namespace Virtio
@@ -2,12 +2,25 @@
 
 #include <optional>
 
+#include "asm.h"
 #include "generic.h"
 #include "network.h"
+#include "nic.h"
+#include "packet_buffer.h"
 #include "pci.h"
+#include "smp.h"
+#include "spin_lock.h"
+#include "wait_queue.h"
 
 namespace Virtio {
-class Net {
+// With VIRTIO_NET_F_MQ, each processor has its own pair of RX and TX queues.
+// The RX queue of a processor raises interrupts only on the processor, and
+// is drained by the bottom half pinned to it (NetworkManager @network.cc).
+// Packets are sent from the TX queue of the sending processor, so no lock
+// is shared between processors on the data path. The device spreads flows
+// over the RX queues; a tap backend delivers a flow to the queue which sent
+// it most recently.
+class Net : public NIC {
  public:
   struct PacketBufHeader {
     // virtio: 5.1.6 Device Operation
@@ -19,8 +32,21 @@ class Net {
     uint16_t csum_offset;
     //
     static constexpr uint8_t kFlagNeedsChecksum = 1;
-    static constexpr uint8_t kGSOTypeNone = 0;
+    static constexpr uint8_t kFlagDataValid = 2;
+    static constexpr uint8_t kGSOTypeNone = NIC::kGSOTypeNone;
+    static constexpr uint8_t kGSOTypeTCPv4 = NIC::kGSOTypeTCPv4;
+    static constexpr uint8_t kGSOTypeUDP = NIC::kGSOTypeUDP;
   };
+  // 5.1.3 Feature bits
+  static constexpr uint32_t kFeatureCSUM = 1 << 0;
+  static constexpr uint32_t kFeatureGuestCSUM = 1 << 1;
+  static constexpr uint32_t kFeatureMAC = 1 << 5;
+  static constexpr uint32_t kFeatureHostTSO4 = 1 << 11;
+  static constexpr uint32_t kFeatureHostUFO = 1 << 14;
+  static constexpr uint32_t kFeatureStatus = 1 << 16;
+  static constexpr uint32_t kFeatureCtrlVQ = 1 << 17;
+  static constexpr uint32_t kFeatureMQ = 1 << 22;
+  static constexpr int kMaxNumOfQueuePairs = kMaxNumOfCPUs;
   using InternetChecksum = Network::InternetChecksum;
   using EtherFrame = Network::EtherFrame;
   using IPv4Packet = Network::IPv4Packet;
@@ -31,6 +57,7 @@ class Net {
 
   class Virtqueue {
    public:
+    static constexpr int kMaxQueueSize = 0x100;
     packed_struct Descriptor {
       volatile uint64_t addr;
       volatile uint32_t len;
@@ -70,63 +97,166 @@ class Net {
           base_ + sizeof(Descriptor) * queue_size_ + sizeof(uint16_t));
       pidx = idx;
     }
+    // 2.4.7 Virtqueue Interrupt Suppression
+    static constexpr uint16_t kAvailableRingFlagNoInterrupt = 1;
+    void SetAvailableRingFlags(uint16_t flags) {
+      volatile uint16_t& pflags = *reinterpret_cast<volatile uint16_t*>(
+          base_ + sizeof(Descriptor) * queue_size_);
+      pflags = flags;
+    }
     uint16_t GetUsedRingIndex();
+    static constexpr uint16_t kUsedRingFlagNoNotify = 1;
+    uint16_t GetUsedRingFlags();
     UsedRingEntry& GetUsedRingEntry(int idx);
 
    private:
-    static constexpr int kMaxQueueSize = 0x100;
     int queue_size_;
     uint8_t* base_;
     void* buf_[kMaxQueueSize];
   };
 
-  void PollRXQueue();
+  // Attaches the device to Network if found.
   void Init();
 
-  template <typename T = uint8_t*>
-  T GetNextTXPacketBuf(size_t size) {
-    if (!initialized_) {
-      Panic("Virtio::Net not initialized yet");
-    }
-    uint32_t buf_size = static_cast<uint32_t>(sizeof(PacketBufHeader) + size);
-    assert(buf_size < kPageSize);
-    auto& txq = vq_[kIndexOfTXVirtqueue];
-    const int idx =
-        vq_cursor_[kIndexOfTXVirtqueue] % vq_size_[kIndexOfTXVirtqueue];
-    txq.SetDescriptor(idx, txq.GetDescriptorBuf(idx), buf_size, 0, 0);
-    return reinterpret_cast<T>(txq.GetDescriptorBuf(idx) +
-                               sizeof(PacketBufHeader));
+  // NIC
+  // Waits forever if the device does not use queue.
+  void WaitForRXQueue(int queue) override;
+  int PollRXQueue(int queue) override;
+  int GetNumOfRXQueues() const override { return num_of_queue_pairs_; }
+  void PrintStatistics() override;
+  // Offloads negotiated with the device in Init().
+  bool CanOffloadTXChecksum() const override {
+    return features_ & kFeatureCSUM;
+  }
+  bool CanOffloadTCPSegmentation() const override {
+    return features_ & kFeatureHostTSO4;
+  }
+  bool CanOffloadUDPFragmentation() const override {
+    return features_ & kFeatureHostUFO;
   }
-  const Network::IPv4Addr GetSelfIPv4Addr() { return self_ip_; }
-  void SetSelfIPv4Addr(Network::IPv4Addr addr) {
-    self_ip_ = addr;
-    if (self_ip_.IsEqualTo(Network::kWildcardIPv4Addr))
-      return;
-    Network::GetInstance().RegisterARPResolution(self_ip_, mac_addr_);
+  size_t GetMaxTXPacketSize() const override {
+    return tx_buf_size_ - sizeof(PacketBufHeader);
   }
-  const Network::EtherAddr GetSelfEtherAddr() { return {mac_addr_}; }
-  void SendPacket();
+  void SetTXChecksumOffload(size_t csum_start, size_t csum_offset) override;
+  void SetTXSegmentationOffload(uint8_t gso_type,
+                                size_t header_size,
+                                size_t segment_size) override;
+  void SendPacket() override;
+  // Packets in a batch are notified to the device at once, or every
+  // kTXKickBatchSize packets.
+  int BeginTXBatch() override;
+  void EndTXBatch(int batch) override;
 
   static Net& GetInstance();
 
  private:
-  static constexpr int kNumOfVirtqueues = 3;
+  enum class InterruptMode {
+    kNone,  // RX queue is polled periodically.
+    kMSIX,
+    kINTx,
+  };
+  // Shared by the RX queues. The RX queue of processor i uses the MSI-X
+  // entry i, which is delivered to the processor.
+  static constexpr uint8_t kInterruptVector = 0x23;
+  static constexpr uint64_t kRXPollIntervalMs = 10;
+  static constexpr int kTXKickBatchSize = 32;
+  static constexpr int kRXKickThreshold = 8;
+  // Large enough for 11 TCP segments of 1460 bytes with TSO.
+  static constexpr uint32_t kTXBufferSizeForGSO = 4 * kPageSize;
+
+  // 5.1.6.5 Control Virtqueue
+  static constexpr uint8_t kCtrlClassMQ = 4;
+  static constexpr uint8_t kCtrlCommandMQVQPairsSet = 0;
+  static constexpr uint8_t kCtrlAckOK = 0;
+  static constexpr uint64_t kCtrlTimeoutMs = 1000;
 
-  static constexpr int kIndexOfRXVirtqueue = 0;
-  static constexpr int kIndexOfTXVirtqueue = 1;
+  struct RXQueue {
+    Virtqueue vq;
+    uint16_t index;  // Index of the virtqueue in the device.
+    uint16_t size;
+    uint16_t used_cursor;
+    // Protects the available ring, which is refilled from any processor
+    // releasing a PacketBuffer.
+    SpinLock lock;
+    uint16_t avail_idx;
+    // Descriptors whose frames are referenced by the upper layer.
+    uint16_t num_of_held;
+    WaitQueue wait_queue;
+    // Interrupt coalescing statistics.
+    uint64_t num_of_interrupts;
+    uint64_t num_of_polls;
+    uint64_t num_of_packets;
+    uint64_t max_batch;
+    uint64_t num_of_kicks;
+    uint64_t num_of_csum_validated;
+  };
+  struct TXQueue {
+    Virtqueue vq;
+    uint16_t index;
+    uint16_t size;
+    uint16_t avail_idx;
+    // Protects the members below and the virtqueue.
+    SpinLock lock;
+    // Descriptors not owned by the device.
+    uint16_t free_descs[Virtqueue::kMaxQueueSize];
+    int num_of_free_descs;
+    int reserved_desc;  // Taken by GetNextTXPacketBuf().
+    uint16_t used_cursor;
+    int batch_depth;
+    int num_of_unkicked;
+    uint64_t num_of_packets;
+    uint64_t num_of_kicks;
+    uint64_t num_of_ring_full;
+    // Offload statistics
+    uint64_t num_of_csum_offloaded;
+    uint64_t num_of_gso_packets;
+  };
 
   static Net* net_;
   bool initialized_;
   PCI::DeviceLocation dev_;
-  Network::EtherAddr mac_addr_;
+  uint32_t features_;
   uint16_t config_io_addr_base_;
-  Virtqueue vq_[kNumOfVirtqueues];
-  uint16_t vq_size_[kNumOfVirtqueues];
-  uint16_t vq_cursor_[kNumOfVirtqueues];
-  Network::IPv4Addr self_ip_;
+  int num_of_queue_pairs_;
+  RXQueue rx_queues_[kMaxNumOfQueuePairs];
+  TXQueue tx_queues_[kMaxNumOfQueuePairs];
+  Virtqueue ctrl_vq_;
+  uint16_t ctrl_vq_index_;
   bool debug_mode_enabled_;
+  InterruptMode interrupt_mode_;
+  // Offset of the device-specific config, which moves when MSI-X is enabled.
+  int device_config_ofs_;
+  // Received frames are passed to the upper layer without copying. The
+  // descriptor of a frame is given back to the device when it is released.
+  // Up to half of each RX queue can be kept by sockets (@PollRXQueue).
+  PacketBuffer rx_pbufs_[kMaxNumOfQueuePairs][Virtqueue::kMaxQueueSize];
+  uint32_t tx_buf_size_;
 
-  void ProcessPacket(uint8_t* buf, size_t buf_size);
+  static void IntHandler(uint64_t intcode, InterruptInfo* info);
+  void SetupInterrupt();
+  // Returns the number of queue pairs which have an interrupt, up to
+  // num_of_queue_pairs.
+  int SetupQueueInterrupts(int num_of_queue_pairs);
+  // Returns the size of the queue, or 0 if the device does not have it.
+  uint16_t SetupVirtqueue(Virtqueue& vq, uint16_t index, uint16_t msix_vector);
+  void SetupRXQueue(int queue);
+  void SetupTXQueue(int queue);
+  // Returns true on failure.
+  bool SetNumOfQueuePairs(uint16_t num_of_queue_pairs);
+  bool HasUsedRXDescriptor(RXQueue& rxq);
+  int GetTXQueueIndexOfCurrentCPU() {
+    return GetCurrentCPUIndex() % num_of_queue_pairs_;
+  }
+  TXQueue& GetTXQueueOfCurrentCPU() {
+    return tx_queues_[GetTXQueueIndexOfCurrentCPU()];
+  }
+  // Takes a free TX descriptor from the TX queue of the current processor.
+  // The TX queue is locked until SendPacket() is called.
+  uint8_t* ReserveTXPacketBuf(size_t size) override;
+  void ReclaimTXDescriptorsLocked(TXQueue& txq);
+  void KickTXQueueLocked(TXQueue& txq);
+  static void ReleaseRXBuffer(PacketBuffer& pbuf);
+  void PostRXBuffer(int queue, uint16_t desc_idx);
 
   uint8_t ReadConfigReg8(int ofs);
   uint16_t ReadConfigReg16(int ofs);
@@ -138,6 +268,7 @@ class Net {
 
   uint8_t ReadDeviceStatus();
   void WriteDeviceStatus(uint8_t);
+  uint32_t GetDeviceFeatures();
   void SetFeatures(uint32_t);
 };
 };  // namespace Virtio
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "generic.h"
+
+// Allocates address ranges from [base, base + size). Freed ranges are kept
+// sorted by their bases with adjacent ones merged, and are reused first-fit
+// before the untouched area after them. Not thread-safe.
+class VirtualRangeAllocator {
+ public:
+  static constexpr int kMaxNumOfFreeRanges = 64;
+  struct Range {
+    uint64_t base;
+    uint64_t size;
+  };
+
+  constexpr VirtualRangeAllocator(uint64_t base, uint64_t size)
+      : end_(base + size),
+        next_base_(base),
+        free_ranges_{},
+        num_of_free_ranges_(0) {}
+  // Returns 0 if there is no room for byte_size bytes.
+  uint64_t Alloc(uint64_t byte_size) {
+    for (int i = 0; i < num_of_free_ranges_; i++) {
+      Range& r = free_ranges_[i];
+      if (r.size < byte_size)
+        continue;
+      const uint64_t vaddr = r.base;
+      r.base += byte_size;
+      r.size -= byte_size;
+      if (!r.size)
+        RemoveFreeRange(i);
+      return vaddr;
+    }
+    if (byte_size > end_ - next_base_)
+      return 0;
+    const uint64_t vaddr = next_base_;
+    next_base_ += byte_size;
+    return vaddr;
+  }
+  // vaddr and byte_size should be the same as the ones for Alloc(). The range
+  // is leaked if the free list is full and it cannot be merged.
+  void Free(uint64_t vaddr, uint64_t byte_size) {
+    int i = 0;
+    while (i < num_of_free_ranges_ && free_ranges_[i].base < vaddr)
+      i++;
+    if (i > 0 &&
+        free_ranges_[i - 1].base + free_ranges_[i - 1].size == vaddr) {
+      i--;
+      free_ranges_[i].size += byte_size;
+    } else if (i < num_of_free_ranges_ &&
+               vaddr + byte_size == free_ranges_[i].base) {
+      free_ranges_[i].base = vaddr;
+      free_ranges_[i].size += byte_size;
+    } else {
+      if (num_of_free_ranges_ >= kMaxNumOfFreeRanges)
+        return;
+      for (int k = num_of_free_ranges_; k > i; k--)
+        free_ranges_[k] = free_ranges_[k - 1];
+      free_ranges_[i] = {vaddr, byte_size};
+      num_of_free_ranges_++;
+    }
+    Range& r = free_ranges_[i];
+    if (i + 1 < num_of_free_ranges_ &&
+        r.base + r.size == free_ranges_[i + 1].base) {
+      r.size += free_ranges_[i + 1].size;
+      RemoveFreeRange(i + 1);
+    }
+    // The last free range goes back to the untouched area.
+    if (i + 1 == num_of_free_ranges_ && r.base + r.size == next_base_) {
+      next_base_ = r.base;
+      RemoveFreeRange(i);
+    }
+  }
+  int GetNumOfFreeRanges() const { return num_of_free_ranges_; }
+  const Range& GetFreeRange(int i) const {
+    assert(0 <= i && i < num_of_free_ranges_);
+    return free_ranges_[i];
+  }
+  uint64_t GetNextBase() const { return next_base_; }
+
+ private:
+  void RemoveFreeRange(int i) {
+    for (int k = i; k + 1 < num_of_free_ranges_; k++)
+      free_ranges_[k] = free_ranges_[k + 1];
+    num_of_free_ranges_--;
+  }
+
+  uint64_t end_;
+  uint64_t next_base_;  // Start of the untouched area.
+  Range free_ranges_[kMaxNumOfFreeRanges];
+  int num_of_free_ranges_;
+};
@@ -0,0 +1,92 @@
+#include "virtual_range_allocator.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+constexpr uint64_t kBase = 0x1000'0000;
+constexpr uint64_t kSize = 0x10'0000;
+constexpr uint64_t kPage = 0x1000;
+
+static void TestAllocFromUntouchedArea() {
+  VirtualRangeAllocator ranges(kBase, kSize);
+  assert(ranges.Alloc(kPage) == kBase);
+  assert(ranges.Alloc(kPage * 2) == kBase + kPage);
+  assert(ranges.GetNextBase() == kBase + kPage * 3);
+  assert(ranges.Alloc(kSize) == 0);
+  assert(ranges.Alloc(kSize - kPage * 3) == kBase + kPage * 3);
+  assert(ranges.Alloc(kPage) == 0);
+}
+
+static void TestFirstFit() {
+  VirtualRangeAllocator ranges(kBase, kSize);
+  uint64_t addrs[6];
+  for (int i = 0; i < 6; i++)
+    addrs[i] = ranges.Alloc(kPage * 2);
+  // Leaves holes of 2 pages at addrs[1] and addrs[3].
+  ranges.Free(addrs[1], kPage * 2);
+  ranges.Free(addrs[3], kPage * 2);
+  assert(ranges.GetNumOfFreeRanges() == 2);
+  // Too large for the holes.
+  assert(ranges.Alloc(kPage * 3) == addrs[5] + kPage * 2);
+  // The first hole is split.
+  assert(ranges.Alloc(kPage) == addrs[1]);
+  assert(ranges.GetFreeRange(0).base == addrs[1] + kPage);
+  assert(ranges.GetFreeRange(0).size == kPage);
+  assert(ranges.Alloc(kPage * 2) == addrs[3]);
+  assert(ranges.GetNumOfFreeRanges() == 1);
+  assert(ranges.Alloc(kPage) == addrs[1] + kPage);
+  assert(ranges.GetNumOfFreeRanges() == 0);
+}
+
+static void TestMerge() {
+  VirtualRangeAllocator ranges(kBase, kSize);
+  uint64_t addrs[5];
+  for (int i = 0; i < 5; i++)
+    addrs[i] = ranges.Alloc(kPage);
+  // Merged with the previous range.
+  ranges.Free(addrs[0], kPage);
+  ranges.Free(addrs[1], kPage);
+  assert(ranges.GetNumOfFreeRanges() == 1);
+  assert(ranges.GetFreeRange(0).base == addrs[0]);
+  assert(ranges.GetFreeRange(0).size == kPage * 2);
+  // Merged with the next range.
+  ranges.Free(addrs[3], kPage);
+  ranges.Free(addrs[2], kPage);
+  assert(ranges.GetNumOfFreeRanges() == 1);
+  assert(ranges.GetFreeRange(0).size == kPage * 4);
+  // The last one merges everything back into the untouched area.
+  ranges.Free(addrs[4], kPage);
+  assert(ranges.GetNumOfFreeRanges() == 0);
+  assert(ranges.GetNextBase() == kBase);
+}
+
+static void TestFullFreeList() {
+  VirtualRangeAllocator ranges(kBase, kSize);
+  constexpr int kNumOfAllocs = VirtualRangeAllocator::kMaxNumOfFreeRanges * 2;
+  uint64_t addrs[kNumOfAllocs + 1];
+  for (int i = 0; i <= kNumOfAllocs; i++)
+    addrs[i] = ranges.Alloc(kPage);
+  for (int i = 0; i < kNumOfAllocs; i += 2)
+    ranges.Free(addrs[i], kPage);
+  assert(ranges.GetNumOfFreeRanges() ==
+         VirtualRangeAllocator::kMaxNumOfFreeRanges);
+  // Ranges adjacent to a free one can still be merged.
+  ranges.Free(addrs[1], kPage);
+  assert(ranges.GetNumOfFreeRanges() ==
+         VirtualRangeAllocator::kMaxNumOfFreeRanges - 1);
+  assert(ranges.GetFreeRange(0).size == kPage * 3);
+}
+
+int main() {
+  TestAllocFromUntouchedArea();
+  TestFirstFit();
+  TestMerge();
+  TestFullFreeList();
+  puts("PASS");
+  return 0;
+}
+
+#endif
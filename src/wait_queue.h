@@ -0,0 +1,53 @@
+#pragma once
+
+#include "spin_lock.h"
+
+class Process;
+
+// Intrusive FIFO of processes. A process can be linked to at most one queue
+// at a time (a ready queue of the scheduler or a WaitQueue).
+// Callers should hold the lock which protects the queue.
+class ProcessQueue {
+ public:
+  constexpr ProcessQueue() : head_(nullptr), tail_(nullptr) {}
+  bool IsEmpty() const { return !head_; }
+  Process* GetTail() const { return tail_; }
+  // @process.cc
+  void Push(Process& proc);
+  Process* Pop();
+  void Remove(Process& proc);
+
+ private:
+  Process* head_;
+  Process* tail_;
+};
+
+// Processes blocked until some event happens. Blocked processes are not
+// scheduled until they are woken up by Wake*().
+class WaitQueue {
+ public:
+  // Blocks the current process until condition() returns true.
+  // condition() is evaluated with the lock of this queue held, so a wakeup
+  // after changing the state is never missed. Wakers should not hold locks
+  // taken in condition() when calling Wake*().
+  template <class TCondition>
+  void WaitUntil(TCondition condition) {
+    lock_.Lock();
+    while (!condition()) {
+      BlockCurrentProcessAndUnlock();
+      lock_.Lock();
+    }
+    lock_.Unlock();
+  }
+  // @scheduler.cc
+  void WakeOne();
+  void WakeAll();
+
+ private:
+  friend class Scheduler;
+  // @scheduler.cc
+  void BlockCurrentProcessAndUnlock();
+
+  SpinLock lock_;
+  ProcessQueue queue_;
+};
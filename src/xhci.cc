@@ -85,7 +85,8 @@ void Controller::InitPrimaryInterrupter() {
   // before setting the Run/Stop (RS) flag in the USBCMD register to 1.
 
   class EventRing& primary_event_ring =
-      *new EventRing(kNumOfTRBForEventRing, rt_regs_->irs[0]);
+      *new (AllocKernelObject<EventRing>())
+          EventRing(kNumOfTRBForEventRing, rt_regs_->irs[0]);
   primary_event_ring_ = &primary_event_ring;
 };
 